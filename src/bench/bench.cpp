@@ -0,0 +1,552 @@
+// Serving benchmark: replays a JSONL workload, or synthesizes one, against Synexis::addTask and reports
+// throughput, latency percentiles, slot utilization and KV usage.
+//
+//   synexis-bench -m model.gguf --requests 200 --arrival poisson --rate 4 --prompt-len 128:1024 --output-len 64:256
+//   synexis-bench -m model.gguf --workload prompts.jsonl --concurrency 8 --json result.json
+//
+// Workload lines are JSON objects with a "prompt" string (or the field named by --prompt-field) or a "messages"
+// array of {"role", "content"}, and optionally "max_tokens" and "arrival", in seconds from the start.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+#include <synexis/Synexis.h>
+
+#include "stats.h"
+
+using json = nlohmann::ordered_json;
+using Clock = std::chrono::steady_clock;
+
+#define METRICS_SAMPLE_INTERVAL_MS 20
+
+enum ArrivalMode {
+    ARRIVAL_CLOSED,
+    ARRIVAL_POISSON,
+    ARRIVAL_BURST,
+    ARRIVAL_REPLAY,
+};
+
+struct Range {
+    int min = 0;
+    int max = 0;
+};
+
+struct BenchOptions {
+    std::string model;
+    std::string projector;
+    int slots = 8;
+    int ctx = 16 * 1024;
+    int batch = 1024;
+    int threads = 4;
+    int gpuLayers = 0;
+
+    std::string workload;
+    std::string promptField = "prompt";
+    int requests = 100;
+    int warmup = 2;
+    ArrivalMode arrival = ARRIVAL_CLOSED;
+    bool arrivalSet = false;
+    int concurrency = 0;
+    double rate = 1.0;
+    int burstSize = 8;
+    Range promptLength = {256, 256};
+    Range outputLength = {128, 128};
+    uint32_t seed = 42;
+
+    std::string jsonPath;
+};
+
+struct WorkItem {
+    std::string prompt;
+    std::vector<ChatMessage> messages;
+    int maxTokens = 128;
+    // Seconds from the start, negative when the arrival mode decides
+    double arrival = -1.0;
+};
+
+// Written by the engine thread of the request, read once its future is ready
+struct RequestRecord {
+    Clock::time_point submitted;
+    Clock::time_point firstToken;
+    Clock::time_point lastToken;
+    int tokens = 0;
+    bool failed = false;
+    CompletionResult result;
+};
+
+static void printUsage(const char *program) {
+    std::printf(
+        "usage: %s -m MODEL [options]\n"
+        "\n"
+        "engine:\n"
+        "  -m, --model PATH          GGUF model\n"
+        "  --mmproj PATH             multimodal projector\n"
+        "  --slots N                 parallel slots (8)\n"
+        "  --ctx N                   context size (16384)\n"
+        "  --batch N                 batch size (1024)\n"
+        "  --threads N               threads (4)\n"
+        "  --gpu-layers N            layers offloaded to the GPU (0)\n"
+        "\n"
+        "workload:\n"
+        "  --workload PATH           JSONL file to replay instead of synthetic prompts\n"
+        "  --prompt-field NAME       workload field holding the prompt (prompt)\n"
+        "  --requests N              requests to run, at most the workload size (100)\n"
+        "  --warmup N                requests run before measuring (2)\n"
+        "  --prompt-len MIN[:MAX]    synthetic prompt length in words, uniform (256)\n"
+        "  --output-len MIN[:MAX]    maximum generated tokens, uniform (128); generation may end earlier\n"
+        "  --seed N                  random seed (42)\n"
+        "\n"
+        "arrivals:\n"
+        "  --arrival MODE            closed, poisson, burst or replay (closed, replay when the workload has "
+        "arrival times)\n"
+        "  --concurrency N           closed loop: requests in flight (number of slots)\n"
+        "  --rate R                  poisson and burst: requests per second (1)\n"
+        "  --burst-size N            burst: requests arriving together (8)\n"
+        "\n"
+        "output:\n"
+        "  --json PATH               also write the results as JSON, - for stdout\n",
+        program);
+}
+
+static Range parseRange(const std::string &value) {
+    Range range;
+    const size_t colon = value.find(':');
+    range.min = std::stoi(value.substr(0, colon));
+    range.max = colon == std::string::npos ? range.min : std::stoi(value.substr(colon + 1));
+    if (range.min <= 0 || range.max < range.min) {
+        throw std::invalid_argument("invalid range " + value);
+    }
+    return range;
+}
+
+static ArrivalMode parseArrival(const std::string &value) {
+    if (value == "closed") return ARRIVAL_CLOSED;
+    if (value == "poisson") return ARRIVAL_POISSON;
+    if (value == "burst") return ARRIVAL_BURST;
+    if (value == "replay") return ARRIVAL_REPLAY;
+    throw std::invalid_argument("unknown arrival mode " + value);
+}
+
+static const char *arrivalName(ArrivalMode mode) {
+    switch (mode) {
+        case ARRIVAL_POISSON: return "poisson";
+        case ARRIVAL_BURST: return "burst";
+        case ARRIVAL_REPLAY: return "replay";
+        default: return "closed";
+    }
+}
+
+static BenchOptions parseOptions(int argc, char **argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            std::exit(0);
+        } else if (arg == "-m" || arg == "--model") options.model = value();
+        else if (arg == "--mmproj") options.projector = value();
+        else if (arg == "--slots") options.slots = std::stoi(value());
+        else if (arg == "--ctx") options.ctx = std::stoi(value());
+        else if (arg == "--batch") options.batch = std::stoi(value());
+        else if (arg == "--threads") options.threads = std::stoi(value());
+        else if (arg == "--gpu-layers") options.gpuLayers = std::stoi(value());
+        else if (arg == "--workload") options.workload = value();
+        else if (arg == "--prompt-field") options.promptField = value();
+        else if (arg == "--requests") options.requests = std::stoi(value());
+        else if (arg == "--warmup") options.warmup = std::stoi(value());
+        else if (arg == "--prompt-len") options.promptLength = parseRange(value());
+        else if (arg == "--output-len") options.outputLength = parseRange(value());
+        else if (arg == "--seed") options.seed = static_cast<uint32_t>(std::stoul(value()));
+        else if (arg == "--arrival") {
+            options.arrival = parseArrival(value());
+            options.arrivalSet = true;
+        } else if (arg == "--concurrency") options.concurrency = std::stoi(value());
+        else if (arg == "--rate") options.rate = std::stod(value());
+        else if (arg == "--burst-size") options.burstSize = std::stoi(value());
+        else if (arg == "--json") options.jsonPath = value();
+        else {
+            throw std::invalid_argument("unknown argument " + arg);
+        }
+    }
+    if (options.model.empty()) {
+        throw std::invalid_argument("a model is required (-m)");
+    }
+    if (options.concurrency <= 0) {
+        options.concurrency = options.slots;
+    }
+    if (options.rate <= 0.0 || options.burstSize <= 0) {
+        throw std::invalid_argument("--rate and --burst-size must be positive");
+    }
+    return options;
+}
+
+static std::vector<WorkItem> loadWorkload(const BenchOptions &options) {
+    std::ifstream file(options.workload);
+    if (!file) {
+        throw std::runtime_error("cannot open " + options.workload);
+    }
+    std::vector<WorkItem> items;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        const json entry = json::parse(line);
+        WorkItem item;
+        if (entry.contains("messages")) {
+            for (const auto &message: entry["messages"]) {
+                item.messages.push_back({message.value("role", "user"), message.value("content", "")});
+            }
+        } else if (entry.contains(options.promptField) && entry[options.promptField].is_string()) {
+            item.prompt = entry[options.promptField].get<std::string>();
+        } else {
+            throw std::runtime_error("workload line without \"" + options.promptField + "\" or \"messages\"");
+        }
+        item.maxTokens = entry.value("max_tokens", options.outputLength.max);
+        item.arrival = entry.value("arrival", -1.0);
+        items.push_back(std::move(item));
+    }
+    return items;
+}
+
+// Prompts made of common words, roughly one token each
+static std::vector<WorkItem> synthesizeWorkload(const BenchOptions &options, std::mt19937 &rng) {
+    static const char *words[] = {
+        "the", "model", "answer", "question", "system", "data", "time", "people", "world", "number",
+        "water", "story", "light", "house", "small", "large", "river", "city", "music", "paper",
+    };
+    const size_t n_words = sizeof(words) / sizeof(words[0]);
+    std::uniform_int_distribution<int> promptLength(options.promptLength.min, options.promptLength.max);
+    std::uniform_int_distribution<int> outputLength(options.outputLength.min, options.outputLength.max);
+    std::uniform_int_distribution<size_t> word(0, n_words - 1);
+
+    std::vector<WorkItem> items(options.requests);
+    for (auto &item: items) {
+        const int length = promptLength(rng);
+        item.prompt.reserve(length * 7);
+        for (int i = 0; i < length; ++i) {
+            if (i > 0) {
+                item.prompt += ' ';
+            }
+            item.prompt += words[word(rng)];
+        }
+        item.maxTokens = outputLength(rng);
+    }
+    return items;
+}
+
+// Seconds from the start at which every request is submitted, empty in closed loop
+static std::vector<double> arrivalTimes(const BenchOptions &options, const std::vector<WorkItem> &items,
+                                        std::mt19937 &rng) {
+    std::vector<double> times(items.size(), 0.0);
+    switch (options.arrival) {
+        case ARRIVAL_CLOSED:
+            return {};
+        case ARRIVAL_POISSON: {
+            std::exponential_distribution<double> gap(options.rate);
+            double t = 0.0;
+            for (auto &time: times) {
+                time = t;
+                t += gap(rng);
+            }
+            break;
+        }
+        case ARRIVAL_BURST:
+            for (size_t i = 0; i < times.size(); ++i) {
+                times[i] = static_cast<double>(i / options.burstSize) * options.burstSize / options.rate;
+            }
+            break;
+        case ARRIVAL_REPLAY:
+            for (size_t i = 0; i < times.size(); ++i) {
+                times[i] = std::max(0.0, items[i].arrival);
+            }
+            break;
+    }
+    return times;
+}
+
+static TaskParams makeTask(const WorkItem &item, RequestRecord &record, const std::function<void()> &onFinished) {
+    TaskParams params;
+    if (item.messages.empty()) {
+        params.prompt = item.prompt;
+    } else {
+        params.messages = item.messages;
+    }
+    params.maximumTokens = item.maxTokens;
+    // Streamed for the token timestamps, the text itself is not needed
+    params.stream = true;
+    params.emitText = false;
+    params.on_token_id = [&record](int32_t) {
+        const auto now = Clock::now();
+        if (record.tokens == 0) {
+            record.firstToken = now;
+        }
+        record.lastToken = now;
+        record.tokens++;
+    };
+    params.on_done = [onFinished](const std::string &) { onFinished(); };
+    params.on_error = [onFinished](const std::string &) { onFinished(); };
+    return params;
+}
+
+// Submits every item, in closed loop or at its arrival time, and waits for all of them
+static std::vector<RequestRecord> runWorkload(Synexis &engine, const std::vector<WorkItem> &items,
+                                             const std::vector<double> &arrivals, int concurrency) {
+    std::vector<RequestRecord> records(items.size());
+    std::vector<std::future<CompletionResult> > futures;
+    futures.reserve(items.size());
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    int inFlight = 0;
+    auto onFinished = [&] {
+        {
+            std::lock_guard lock(mutex);
+            inFlight--;
+        }
+        cv.notify_one();
+    };
+
+    const auto start = Clock::now();
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (arrivals.empty()) {
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [&] { return inFlight < concurrency; });
+        } else {
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(
+                                              std::chrono::duration<double>(arrivals[i])));
+        }
+        {
+            std::lock_guard lock(mutex);
+            inFlight++;
+        }
+        records[i].submitted = Clock::now();
+        futures.push_back(engine.addTask(makeTask(items[i], records[i], onFinished)));
+    }
+
+    for (size_t i = 0; i < futures.size(); ++i) {
+        try {
+            records[i].result = futures[i].get();
+        } catch (const std::exception &) {
+            records[i].failed = true;
+        }
+    }
+    return records;
+}
+
+static json statsJson(const SampleStats &stats) {
+    return {
+        {"count", stats.count}, {"mean", stats.mean}, {"min", stats.min}, {"max", stats.max},
+        {"p50", stats.p50}, {"p90", stats.p90}, {"p99", stats.p99},
+    };
+}
+
+static void printStats(const char *name, const SampleStats &stats, const char *unit) {
+    std::printf("  %-22s p50 %9.2f  p90 %9.2f  p99 %9.2f  mean %9.2f %s\n", name, stats.p50, stats.p90, stats.p99,
+                stats.mean, unit);
+}
+
+int main(int argc, char **argv) {
+    BenchOptions options;
+    try {
+        options = parseOptions(argc, argv);
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "error: %s\n\n", e.what());
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::mt19937 rng(options.seed);
+    std::vector<WorkItem> items;
+    try {
+        if (options.workload.empty()) {
+            items = synthesizeWorkload(options, rng);
+        } else {
+            items = loadWorkload(options);
+            if (static_cast<int>(items.size()) > options.requests) {
+                items.resize(options.requests);
+            }
+            if (!options.arrivalSet && !items.empty() && items.front().arrival >= 0.0) {
+                options.arrival = ARRIVAL_REPLAY;
+            }
+        }
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+    if (items.empty()) {
+        std::fprintf(stderr, "error: empty workload\n");
+        return 1;
+    }
+    const std::vector<double> arrivals = arrivalTimes(options, items, rng);
+
+    SynexisArguments args(options.model);
+    args.modelProjectorPath = options.projector;
+    args.n_slots = options.slots;
+    args.n_ctx = options.ctx;
+    args.n_batch = options.batch;
+    args.numberOfThreads = options.threads;
+    args.numberOfGpuLayers = options.gpuLayers;
+    Synexis engine(args);
+    engine.run();
+
+    if (options.warmup > 0) {
+        std::vector<WorkItem> warmup(items.begin(), items.begin() + std::min<size_t>(options.warmup, items.size()));
+        for (auto &item: warmup) {
+            item.maxTokens = std::min(item.maxTokens, 8);
+        }
+        runWorkload(engine, warmup, {}, options.slots);
+    }
+
+    // Slot occupancy and KV cells, sampled from the engine metrics while the workload runs
+    std::atomic<bool> sampling{true};
+    std::vector<double> busySlots;
+    std::vector<double> kvCells;
+    std::thread sampler([&] {
+        while (sampling.load()) {
+            const MetricsSnapshot snapshot = engine.metrics();
+            int busy = 0;
+            int64_t cells = 0;
+            for (int32_t slotCells: snapshot.slotKvCells) {
+                busy += slotCells > 0;
+                cells += slotCells;
+            }
+            busySlots.push_back(busy);
+            kvCells.push_back(static_cast<double>(cells));
+            std::this_thread::sleep_for(std::chrono::milliseconds(METRICS_SAMPLE_INTERVAL_MS));
+        }
+    });
+
+    const MetricsSnapshot before = engine.metrics();
+    const auto start = Clock::now();
+    std::vector<RequestRecord> records = runWorkload(engine, items, arrivals, options.concurrency);
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    sampling.store(false);
+    sampler.join();
+    const MetricsSnapshot after = engine.metrics();
+    engine.stop();
+
+    std::vector<double> ttft, tpot, latency;
+    int failed = 0;
+    int64_t promptTokens = 0;
+    int64_t outputTokens = 0;
+    using Ms = std::chrono::duration<double, std::milli>;
+    for (const auto &record: records) {
+        if (record.failed) {
+            failed++;
+            continue;
+        }
+        promptTokens += record.result.promptTokens;
+        outputTokens += record.tokens;
+        if (record.tokens == 0) {
+            continue;
+        }
+        ttft.push_back(Ms(record.firstToken - record.submitted).count());
+        latency.push_back(Ms(record.lastToken - record.submitted).count());
+        if (record.tokens > 1) {
+            tpot.push_back(Ms(record.lastToken - record.firstToken).count() / (record.tokens - 1));
+        }
+    }
+    const SampleStats ttftStats = summarize(ttft);
+    const SampleStats tpotStats = summarize(tpot);
+    const SampleStats latencyStats = summarize(latency);
+    const SampleStats busyStats = summarize(busySlots);
+    const SampleStats kvStats = summarize(kvCells);
+    const int completed = static_cast<int>(records.size()) - failed;
+    const uint64_t steps = after.decodeSteps - before.decodeSteps;
+
+    std::printf("\n%d requests (%d failed) in %.2f s, %s arrivals", static_cast<int>(records.size()), failed, elapsed,
+                arrivalName(options.arrival));
+    if (options.arrival == ARRIVAL_CLOSED) {
+        std::printf(", concurrency %d", options.concurrency);
+    }
+    std::printf("\n\nthroughput\n");
+    std::printf("  %-22s %9.2f req/s\n", "requests", completed / elapsed);
+    std::printf("  %-22s %9.1f tok/s\n", "output tokens", outputTokens / elapsed);
+    std::printf("  %-22s %9.1f tok/s\n", "total tokens", (promptTokens + outputTokens) / elapsed);
+    std::printf("\nlatency\n");
+    printStats("time to first token", ttftStats, "ms");
+    printStats("time per output token", tpotStats, "ms");
+    printStats("end to end", latencyStats, "ms");
+    std::printf("\nengine\n");
+    std::printf("  %-22s %9.1f %% mean, %d slots\n", "slot utilization", 100.0 * busyStats.mean / options.slots,
+                options.slots);
+    std::printf("  %-22s %9.1f %% mean, %.1f %% peak of %d cells\n", "KV usage", 100.0 * kvStats.mean / options.ctx,
+                100.0 * kvStats.max / options.ctx, options.ctx);
+    std::printf("  %-22s %9llu\n", "decode steps", static_cast<unsigned long long>(steps));
+    std::printf("  %-22s %9llu\n", "decode retries",
+                static_cast<unsigned long long>(after.decodeRetries - before.decodeRetries));
+    std::printf("  %-22s %9llu\n", "context shifts",
+                static_cast<unsigned long long>(after.contextShifts - before.contextShifts));
+
+    if (!options.jsonPath.empty()) {
+        json result = {
+            {
+                "config", {
+                    {"model", options.model},
+                    {"slots", options.slots},
+                    {"ctx", options.ctx},
+                    {"batch", options.batch},
+                    {"threads", options.threads},
+                    {"workload", options.workload.empty() ? "synthetic" : options.workload},
+                    {"arrival", arrivalName(options.arrival)},
+                    {"concurrency", options.concurrency},
+                    {"rate", options.rate},
+                    {"seed", options.seed},
+                }
+            },
+            {"requests", records.size()},
+            {"failed", failed},
+            {"duration_s", elapsed},
+            {
+                "throughput", {
+                    {"requests_per_s", completed / elapsed},
+                    {"output_tokens_per_s", outputTokens / elapsed},
+                    {"total_tokens_per_s", (promptTokens + outputTokens) / elapsed},
+                }
+            },
+            {"prompt_tokens", promptTokens},
+            {"output_tokens", outputTokens},
+            {"ttft_ms", statsJson(ttftStats)},
+            {"tpot_ms", statsJson(tpotStats)},
+            {"latency_ms", statsJson(latencyStats)},
+            {"slot_utilization", busyStats.mean / options.slots},
+            {"kv_usage", {{"mean", kvStats.mean / options.ctx}, {"peak", kvStats.max / options.ctx}}},
+            {"decode_steps", steps},
+            {"decode_retries", after.decodeRetries - before.decodeRetries},
+            {"context_shifts", after.contextShifts - before.contextShifts},
+        };
+        const std::string text = result.dump(2);
+        if (options.jsonPath == "-") {
+            std::cout << text << std::endl;
+        } else {
+            std::ofstream file(options.jsonPath);
+            file << text << std::endl;
+            if (!file) {
+                std::fprintf(stderr, "error: cannot write %s\n", options.jsonPath.c_str());
+                return 1;
+            }
+        }
+    }
+    return failed == 0 ? 0 : 2;
+}
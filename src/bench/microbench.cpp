@@ -0,0 +1,510 @@
+// Microbenchmarks of the per-token hot path: candidate building and the sampler chain, logit bias, logprobs,
+// the token history ring, batch building, stop string checks, detokenization and the streaming byte ring.
+//
+//   synexis-microbench                                   synthetic logits, vocab sizes 32k to 256k
+//   synexis-microbench --vocab 32000,152064 --filter sample --json result.json
+//   synexis-microbench -m model.gguf                     also detokenization and stop checks on a real vocab
+//
+// Every benchmark runs on data generated from --seed, is calibrated to last --min-time seconds per repetition and
+// reports the median and fastest of --repetitions runs, in nanoseconds per operation.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "llama.h"
+#include "batch_helper.h"
+#include "SynexisSlot.h"
+#include "sampler/LogitBias.h"
+#include "sampler/Logprobs.h"
+#include "sampler/RingBuffer.h"
+#include "sampler/Sampler.h"
+#include "utils.h"
+#include "../python-wrapper/ByteRing.h"
+
+#include "stats.h"
+
+using json = nlohmann::ordered_json;
+using Clock = std::chrono::steady_clock;
+
+// Rows cycled through by the logits benchmarks, so consecutive operations do not hit a row left in cache
+#define LOGIT_ROWS 4
+#define LOGIT_BIAS_ENTRIES 256
+#define BANNED_TOKENS 32
+#define TOP_LOGPROBS 5
+#define HISTORY_SIZE 256
+#define BATCH_TOKENS 512
+#define STOP_STRINGS 4
+#define STREAM_PIECE_BYTES 6
+
+struct MicrobenchOptions {
+    std::string model;
+    std::vector<int32_t> vocabSizes = {32000, 65536, 131072, 262144};
+    std::string filter;
+    double minTime = 0.1;
+    int repetitions = 5;
+    uint32_t seed = 42;
+    std::string jsonPath;
+};
+
+struct MicrobenchResult {
+    std::string name;
+    // Vocab size, or another size the benchmark is parameterized on, 0 when there is none
+    int64_t size = 0;
+    uint64_t iterations = 0;
+    SampleStats nsPerOp;
+};
+
+// Results of the measured operations are folded into it so the compiler cannot drop them. Only the main thread
+// calls consume().
+static volatile uint64_t sink = 0;
+
+static void consume(uint64_t value) {
+    sink = sink + value;
+}
+
+static void printUsage(const char *program) {
+    std::printf(
+        "usage: %s [options]\n"
+        "\n"
+        "  -m, --model PATH          GGUF model, adds detokenization and stop checks on its vocab\n"
+        "  --vocab N[,N...]          synthetic vocab sizes (32000,65536,131072,262144)\n"
+        "  --filter TEXT             only run benchmarks whose name contains TEXT\n"
+        "  --min-time S              seconds per repetition (0.1)\n"
+        "  --repetitions N           repetitions, the median is reported (5)\n"
+        "  --seed N                  random seed of the synthetic data (42)\n"
+        "  --json PATH               also write the results as JSON, - for stdout\n",
+        program);
+}
+
+static std::vector<int32_t> parseSizes(const std::string &value) {
+    std::vector<int32_t> sizes;
+    size_t start = 0;
+    while (start <= value.size()) {
+        const size_t comma = value.find(',', start);
+        const std::string item = value.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        const int32_t size = std::stoi(item);
+        if (size <= 0) {
+            throw std::invalid_argument("invalid vocab size " + item);
+        }
+        sizes.push_back(size);
+        if (comma == std::string::npos) {
+            break;
+        }
+        start = comma + 1;
+    }
+    return sizes;
+}
+
+static MicrobenchOptions parseOptions(int argc, char **argv) {
+    MicrobenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            std::exit(0);
+        } else if (arg == "-m" || arg == "--model") options.model = value();
+        else if (arg == "--vocab") options.vocabSizes = parseSizes(value());
+        else if (arg == "--filter") options.filter = value();
+        else if (arg == "--min-time") options.minTime = std::stod(value());
+        else if (arg == "--repetitions") options.repetitions = std::stoi(value());
+        else if (arg == "--seed") options.seed = static_cast<uint32_t>(std::stoul(value()));
+        else if (arg == "--json") options.jsonPath = value();
+        else {
+            throw std::invalid_argument("unknown argument " + arg);
+        }
+    }
+    if (options.minTime <= 0.0 || options.repetitions <= 0) {
+        throw std::invalid_argument("--min-time and --repetitions must be positive");
+    }
+    return options;
+}
+
+class Microbench {
+public:
+    // The table goes to `table`, stderr when the JSON is written to stdout
+    Microbench(const MicrobenchOptions &options, FILE *table): options(options), table(table) {
+    }
+
+    void printHeader() const {
+        std::fprintf(table, "%-28s %10s %14s %14s %12s\n", "benchmark", "size", "median ns/op", "min ns/op",
+                     "iterations");
+    }
+
+    // `op` runs the measured operation `n` times. The iteration count is doubled until one call lasts a tenth of
+    // --min-time, then scaled so every repetition lasts about --min-time.
+    void run(const std::string &name, int64_t size, const std::function<void(uint64_t n)> &op) {
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos) {
+            return;
+        }
+        uint64_t n = 1;
+        double elapsed = 0.0;
+        while (true) {
+            elapsed = time(op, n);
+            if (elapsed >= options.minTime / 10 || n >= (1ull << 40)) {
+                break;
+            }
+            n *= 2;
+        }
+        n = std::max<uint64_t>(1, static_cast<uint64_t>(n * options.minTime / std::max(elapsed, 1e-9)));
+
+        std::vector<double> samples;
+        samples.reserve(options.repetitions);
+        for (int r = 0; r < options.repetitions; ++r) {
+            samples.push_back(time(op, n) * 1e9 / n);
+        }
+
+        MicrobenchResult result;
+        result.name = name;
+        result.size = size;
+        result.iterations = n;
+        result.nsPerOp = summarize(std::move(samples));
+        std::fprintf(table, "%-28s %10lld %14.1f %14.1f %12llu\n", name.c_str(), static_cast<long long>(size),
+                     result.nsPerOp.p50, result.nsPerOp.min, static_cast<unsigned long long>(n));
+        std::fflush(table);
+        results.push_back(std::move(result));
+    }
+
+    json toJson() const {
+        json out;
+        out["seed"] = options.seed;
+        out["min_time"] = options.minTime;
+        out["repetitions"] = options.repetitions;
+        out["benchmarks"] = json::array();
+        for (const auto &result: results) {
+            out["benchmarks"].push_back({
+                {"name", result.name},
+                {"size", result.size},
+                {"iterations", result.iterations},
+                {"ns_per_op_median", result.nsPerOp.p50},
+                {"ns_per_op_min", result.nsPerOp.min},
+                {"ns_per_op_max", result.nsPerOp.max},
+                {"ns_per_op_mean", result.nsPerOp.mean},
+            });
+        }
+        return out;
+    }
+
+private:
+    static double time(const std::function<void(uint64_t n)> &op, uint64_t n) {
+        const auto start = Clock::now();
+        op(n);
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    const MicrobenchOptions &options;
+    FILE *table;
+    std::vector<MicrobenchResult> results;
+};
+
+// Logits roughly shaped like a language model's: most of the vocabulary far below a few dozen plausible tokens
+static std::vector<std::vector<float> > syntheticLogits(int32_t n_vocab, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> noise(0.0f, 2.0f);
+    std::uniform_int_distribution<int32_t> token(0, n_vocab - 1);
+    std::vector<std::vector<float> > rows(LOGIT_ROWS, std::vector<float>(n_vocab));
+    for (auto &row: rows) {
+        for (float &logit: row) {
+            logit = noise(rng) - 4.0f;
+        }
+        for (int i = 0; i < 32; ++i) {
+            row[token(rng)] += 12.0f + noise(rng);
+        }
+    }
+    return rows;
+}
+
+// Keeps every 4th token of the vocabulary, like a grammar state that rules out most of it
+static TokenMask syntheticMask(int32_t n_vocab) {
+    TokenMask mask;
+    mask.bits.assign((n_vocab + 63) / 64, 0);
+    for (int32_t token = 0; token < n_vocab; token += 4) {
+        mask.bits[token >> 6] |= 1ull << (token & 63);
+        ++mask.n_allowed;
+    }
+    return mask;
+}
+
+static void logitsBenchmarks(Microbench &bench, int32_t n_vocab, uint32_t seed) {
+    const auto rows = syntheticLogits(n_vocab, seed);
+    std::vector<llama_token_data> candidates;
+
+    bench.run("fill_candidates", n_vocab, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            consume(SynexisSampler::fillCandidates(rows[i % LOGIT_ROWS].data(), n_vocab, nullptr, candidates));
+        }
+    });
+
+    const TokenMask mask = syntheticMask(n_vocab);
+    bench.run("fill_candidates_masked", n_vocab, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            consume(SynexisSampler::fillCandidates(rows[i % LOGIT_ROWS].data(), n_vocab, &mask, candidates));
+        }
+    });
+
+    // What SynexisSampler::sample does per token without grammar: build the candidates, run the chain, accept
+    SamplingParams params;
+    params.seed = seed;
+    params.penalty_repeat = 1.1f;
+    // DRY and infill need a model vocab, the synthetic logits have none
+    params.samplers.erase(std::remove_if(params.samplers.begin(), params.samplers.end(), [](SamplerType type) {
+        return type == SAMPLER_TYPE_DRY || type == SAMPLER_TYPE_INFILL;
+    }), params.samplers.end());
+    llama_sampler *chain = SynexisSampler::buildChain(params, nullptr, 0);
+    bench.run("sample_default_chain", n_vocab, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            const size_t size = SynexisSampler::fillCandidates(rows[i % LOGIT_ROWS].data(), n_vocab, nullptr,
+                                                               candidates);
+            llama_token_data_array array = {candidates.data(), size, -1, false};
+            llama_sampler_apply(chain, &array);
+            const llama_token token = array.data[array.selected].id;
+            llama_sampler_accept(chain, token);
+            consume(token);
+        }
+    });
+    llama_sampler_free(chain);
+
+    llama_sampler *greedy = llama_sampler_init_greedy();
+    bench.run("sample_greedy", n_vocab, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            const size_t size = SynexisSampler::fillCandidates(rows[i % LOGIT_ROWS].data(), n_vocab, nullptr,
+                                                               candidates);
+            llama_token_data_array array = {candidates.data(), size, -1, false};
+            llama_sampler_apply(greedy, &array);
+            consume(array.data[array.selected].id);
+        }
+    });
+    llama_sampler_free(greedy);
+
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int32_t> token(0, n_vocab - 1);
+    std::map<int32_t, float> biases;
+    while (biases.size() < LOGIT_BIAS_ENTRIES) {
+        biases[token(rng)] = 0.5f;
+    }
+    std::vector<int32_t> banned(BANNED_TOKENS);
+    for (auto &id: banned) {
+        id = token(rng);
+    }
+    const auto table = LogitBiasTable::get(biases, banned, n_vocab);
+    std::vector<llama_token_data> biased;
+    SynexisSampler::fillCandidates(rows[0].data(), n_vocab, nullptr, biased);
+    bench.run("logit_bias_apply", n_vocab, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            table->apply(biased.data(), biased.size(), n_vocab);
+        }
+        consume(static_cast<uint64_t>(biased[0].logit));
+    });
+
+    TokenLogprob top[TOP_LOGPROBS];
+    bench.run("logprobs_top5", n_vocab, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            const float *row = rows[i % LOGIT_ROWS].data();
+            const float max_logit = logits_top_k(row, n_vocab, TOP_LOGPROBS, top);
+            const float log_norm = logits_logsumexp(row, n_vocab, max_logit);
+            consume(static_cast<uint64_t>(top[0].token) + static_cast<uint64_t>(log_norm));
+        }
+    });
+}
+
+static void helperBenchmarks(Microbench &bench, uint32_t seed) {
+    RingBuffer<int32_t> history(HISTORY_SIZE);
+    bench.run("ring_buffer_push", HISTORY_SIZE, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            history.push_back(static_cast<int32_t>(i));
+        }
+        consume(history.back());
+    });
+
+    // Penalties and DRY scan the last tokens as one contiguous range
+    bench.run("ring_buffer_scan_last64", HISTORY_SIZE, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            history.push_back(static_cast<int32_t>(i));
+            int64_t sum = 0;
+            for (const int32_t token: history.last(64)) {
+                sum += token;
+            }
+            consume(static_cast<uint64_t>(sum));
+        }
+    });
+
+    // One generation step of BATCH_TOKENS slots, timed per added token
+    llama_batch batch = llama_batch_init(BATCH_TOKENS, 0, 1);
+    const std::vector<llama_seq_id> seq = {0};
+    bench.run("batch_add", BATCH_TOKENS, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            if (batch.n_tokens == BATCH_TOKENS) {
+                clear_batch(batch);
+            }
+            batch_add(batch, static_cast<llama_token>(i), static_cast<int32_t>(i), seq, true);
+        }
+        consume(batch.n_tokens);
+    });
+    llama_batch_free(batch);
+
+    // Generated text as the streaming path sees it: short pieces, some of them splitting a code point
+    std::mt19937 rng(seed);
+    std::vector<std::string> pieces;
+    const char *samples[] = {" the", " model", "\xC3\xA9t", "\xE2\x82", "\xAC", " \xF0\x9F\x98", "\x80", "ing"};
+    for (int i = 0; i < 1024; ++i) {
+        pieces.emplace_back(samples[rng() % (sizeof(samples) / sizeof(samples[0]))]);
+    }
+
+    Utf8Stream utf8;
+    std::string text;
+    bench.run("utf8_stream_feed", 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            text.clear();
+            utf8.feed(pieces[i & 1023], text);
+            consume(text.size());
+        }
+    });
+
+    // StreamIterator's transport: the worker writes each piece, the Python thread drains everything available
+    ByteRing ring(64 * 1024);
+    std::string drained;
+    bench.run("stream_ring_write_read", 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            const std::string &piece = pieces[i & 1023];
+            ring.write(piece.data(), piece.size());
+            drained.clear();
+            consume(ring.read(drained));
+        }
+    });
+
+    bench.run("stream_ring_spsc", 0, [&](uint64_t n) {
+        ByteRing shared(64 * 1024);
+        std::thread producer([&] {
+            const char piece[STREAM_PIECE_BYTES] = {'t', 'o', 'k', 'e', 'n', ' '};
+            for (uint64_t i = 0; i < n; ++i) {
+                while (!shared.write(piece, sizeof(piece))) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+        const uint64_t total = n * STREAM_PIECE_BYTES;
+        uint64_t received = 0;
+        std::string out;
+        while (received < total) {
+            out.clear();
+            const size_t read = shared.read(out);
+            if (read == 0) {
+                std::this_thread::yield();
+            }
+            received += read;
+        }
+        producer.join();
+        consume(received);
+    });
+}
+
+static void vocabBenchmarks(Microbench &bench, const std::string &path, uint32_t seed) {
+    llama_model_params params = llama_model_default_params();
+    params.vocab_only = true;
+    llama_model *model = llama_model_load_from_file(path.c_str(), params);
+    if (!model) {
+        throw std::runtime_error("failed to load the vocab of " + path);
+    }
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int32_t> token(0, n_vocab - 1);
+    std::vector<llama_token> ids(4096);
+    for (auto &id: ids) {
+        id = token(rng);
+    }
+
+    std::string piece;
+    bench.run("token_to_piece", n_vocab, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            consume(token_to_piece(vocab, ids[i & 4095], false, piece));
+        }
+    });
+
+    std::vector<std::string> pieces(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        token_to_piece(vocab, ids[i], false, pieces[i]);
+    }
+
+    // The end-of-generation, length and stop string checks run on every generated token
+    SynexisSlot slot;
+    slot.request = std::make_unique<Request>();
+    slot.request->params.stopTokens = {"</s>", "\n\nUser:", "<|im_end|>", "###"};
+    slot.n_decoded = 0;
+    bench.run("process_token_stop_check", STOP_STRINGS, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            consume(slot.processToken(vocab, ids[i & 4095], pieces[i & 4095]));
+        }
+    });
+
+    llama_model_free(model);
+}
+
+int main(int argc, char **argv) {
+    MicrobenchOptions options;
+    try {
+        options = parseOptions(argc, argv);
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    llama_log_set([](ggml_log_level, const char *, void *) {
+    }, nullptr);
+    llama_backend_init();
+
+    Microbench bench(options, options.jsonPath == "-" ? stderr : stdout);
+    bench.printHeader();
+    try {
+        for (const int32_t n_vocab: options.vocabSizes) {
+            logitsBenchmarks(bench, n_vocab, options.seed);
+        }
+        helperBenchmarks(bench, options.seed);
+        if (!options.model.empty()) {
+            vocabBenchmarks(bench, options.model, options.seed);
+        }
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        llama_backend_free();
+        return 1;
+    }
+
+    if (!options.jsonPath.empty()) {
+        const std::string dumped = bench.toJson().dump(2);
+        if (options.jsonPath == "-") {
+            std::cout << dumped << std::endl;
+        } else {
+            std::ofstream file(options.jsonPath);
+            file << dumped << std::endl;
+            if (!file) {
+                std::fprintf(stderr, "error: could not write %s\n", options.jsonPath.c_str());
+                llama_backend_free();
+                return 1;
+            }
+        }
+    }
+    llama_backend_free();
+    return 0;
+}
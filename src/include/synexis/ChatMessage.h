@@ -0,0 +1,8 @@
+#pragma once
+#include <string>
+
+struct ChatMessage {
+    std::string role;
+    // Plain text, media goes in as Synexis::mediaMarker()
+    std::string content;
+};
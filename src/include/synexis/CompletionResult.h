@@ -0,0 +1,43 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum FinishReason {
+    // End of generation token or stop string
+    FINISH_REASON_STOP,
+    // maximumTokens reached
+    FINISH_REASON_LENGTH,
+    // TaskParams::cancelled was set before generation ended
+    FINISH_REASON_CANCELLED,
+};
+
+// Outcome of one completion task, moved out of the slot into the future when generation ends
+struct CompletionResult {
+    // Empty for streaming tasks, the text went to on_token
+    std::string text;
+
+    // Prompt positions, media included, split between the ones evaluated for this task and the ones whose KV
+    // cells were already there
+    int32_t promptTokens = 0;
+    int32_t promptTokensComputed = 0;
+    int32_t promptTokensCached = 0;
+    int32_t completionTokens = 0;
+    FinishReason finishReason = FINISH_REASON_STOP;
+
+    // Seconds spent waiting for a slot and the worker, evaluating the prompt, and generating after the first token
+    double queueTime = 0.0;
+    double prefillTime = 0.0;
+    double decodeTime = 0.0;
+
+    // Seconds from enqueueing to every generated token, only with SamplingParams::timing_per_token
+    std::vector<double> tokenTimes;
+
+    const char *finishReasonName() const {
+        switch (finishReason) {
+            case FINISH_REASON_LENGTH: return "length";
+            case FINISH_REASON_CANCELLED: return "cancelled";
+            default: return "stop";
+        }
+    }
+};
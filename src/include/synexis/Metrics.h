@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Distribution of one metric. `counts[i]` holds the observations at most `bounds[i]`, not cumulative; the last
+// count has no bound and holds everything above the last one.
+struct HistogramSnapshot {
+    std::vector<double> bounds;
+    std::vector<uint64_t> counts;
+    uint64_t count = 0;
+    double sum = 0.0;
+
+    // Estimated from the buckets, 0 <= q <= 1
+    double quantile(double q) const;
+};
+
+// Point-in-time copy of the engine counters. Durations are in seconds.
+struct MetricsSnapshot {
+    uint64_t requestsAdmitted = 0;
+    uint64_t requestsCompleted = 0;
+    uint64_t requestsFailed = 0;
+    uint64_t requestsCancelled = 0;
+    uint64_t promptTokens = 0;
+    uint64_t generatedTokens = 0;
+    uint64_t decodeSteps = 0;
+    uint64_t decodeRetries = 0;
+    uint64_t contextShifts = 0;
+    // Requests waiting for a slot
+    uint64_t queueDepth = 0;
+
+    // Enqueued to first generated token
+    HistogramSnapshot timeToFirstToken;
+    // Between two generated tokens of a request
+    HistogramSnapshot interTokenLatency;
+    // Enqueued to assigned to a slot
+    HistogramSnapshot queueWait;
+    // Per decode step
+    HistogramSnapshot prefillTokens;
+    HistogramSnapshot decodeTokens;
+    // Tokens of the step over n_batch
+    HistogramSnapshot batchFill;
+
+    // KV cells held by each slot's sequence
+    std::vector<int32_t> slotKvCells;
+
+    // Prometheus text exposition format, every metric prefixed with `synexis_`
+    std::string toPrometheus() const;
+};
@@ -0,0 +1,13 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Log-likelihood of one continuation given the shared prompt
+struct ScoreResult {
+    // Sum of token_logprobs
+    double logprob = 0.0;
+    std::vector<int32_t> tokens;
+    std::vector<float> token_logprobs;
+    // True when every continuation token was the most likely one
+    bool greedy = true;
+};
@@ -1,7 +1,12 @@
 #pragma once
 #include <future>
 #include <string>
+#include <vector>
 
+#include "ChatMessage.h"
+#include "CompletionResult.h"
+#include "Metrics.h"
+#include "ScoreResult.h"
 #include "SynexisArguments.h"
 #include "TaskParams.h"
 class SynexisImpl;
@@ -14,17 +19,52 @@ public:
 
     ~Synexis();
 
-    std::future<std::string> addTask(const std::string &prompt, const TaskParams &sampling_params);
+    std::future<CompletionResult> addTask(const std::string &prompt, const TaskParams &sampling_params);
+
+    // Takes the prompt and media from `params`, pass it with std::move to avoid copying them
+    std::future<CompletionResult> addTask(TaskParams params);
+
+    // Skips tokenization, `tokens` are decoded as they are. The prompt and messages of `params` are ignored.
+    std::future<CompletionResult> addTask(std::vector<int32_t> tokens, TaskParams params);
+
+    // Queues every task in one go, the futures are in the same order as `params`
+    std::vector<std::future<CompletionResult>> addTasks(std::vector<TaskParams> params);
 
     std::string get_result(int task_id);
 
+    // Prefills the prompt once and returns the log-likelihood of every continuation after it
+    std::future<std::vector<ScoreResult>> score(const std::string &prompt, const std::vector<std::string> &continuations);
+
 
     void run() const;
 
+    // Tasks still queued, or added afterwards, fail with on_error and their future; the ones in a slot fail once the
+    // engine threads are done
     void stop() const;
 
+    // Counters and latency histograms since the engine was created, cheap enough to poll
+    [[nodiscard]] MetricsSnapshot metrics() const;
+
+    // Recorded scheduler spans in the Chrome trace-event format, empty unless SynexisArguments::traceCapacity is set
+    [[nodiscard]] std::string traceJson() const;
+
+    bool dumpTrace(const std::string &path) const;
+
+    // As passed in SynexisArguments
+    [[nodiscard]] std::string modelPath() const;
+
     [[nodiscard]] std::string getTemplate() const;
 
+    // True when applyChatTemplate() can render the model's chat template, detected once at load
+    [[nodiscard]] bool hasNativeChatTemplate() const;
+
+    // Renders the messages with the model's chat template, throws when it is not supported natively
+    [[nodiscard]] std::string applyChatTemplate(const std::vector<ChatMessage> &messages,
+                                                bool addGenerationPrompt = true) const;
+
+    // Placeholder marking where a media item goes in the prompt
+    static std::string mediaMarker();
+
     std::string getToken(std::string str) const;
 
     std::vector<std::vector<float>> getEmbedding(const std::string &str);
@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <vector>
 
 struct SynexisArguments {
     std::string modelPath;
@@ -8,6 +9,8 @@ struct SynexisArguments {
     int numberOfGpuLayers = 999;
     int numberOfThreads = 4;
     bool use_mmap = true;
+    // CPUs the engine threads and the compute thread pool run on, empty leaves the placement to the OS. Linux only.
+    std::vector<int> cpus;
 
     int n_ctx = 16 * 1024;
     int n_batch = 1024;
@@ -16,8 +19,16 @@ struct SynexisArguments {
 
     int n_slots = 8;
 
+    // Threads encoding images and audio in parallel, each one holds its own copy of the projector
+    int mediaEncoders = 1;
+
     bool embedding = false;
 
+    // Scheduler spans kept per thread for Synexis::traceJson(), 0 disables tracing
+    size_t traceCapacity = 0;
+    // When set, the trace is also written there on shutdown
+    std::string tracePath;
+
     explicit SynexisArguments(std::string modelPath): modelPath(std::move(modelPath)) {
     }
 };
@@ -0,0 +1,61 @@
+#pragma once
+#include <future>
+#include <string>
+#include <vector>
+
+#include "ChatMessage.h"
+#include "CompletionResult.h"
+#include "Metrics.h"
+#include "TaskParams.h"
+class SynexisClientImpl;
+
+// Submits tasks to an engine in another process, served by SynexisIpcServer. Mirrors the task API of Synexis:
+// futures, callbacks and cancel flags behave the same, callbacks run on the client's receiving thread.
+//
+// Streamed pieces are written by the engine thread straight into memory shared with this process, no socket round
+// trip per token. At most `channels` tasks are in flight at once, addTask() waits for one to finish beyond that.
+// Linux only.
+class SynexisClient {
+public:
+    // Connects and waits for the engine's handshake, throws std::runtime_error when it fails.
+    // Every channel holds up to `ringBytes` of streamed data the client has not read yet, a power of two.
+    explicit SynexisClient(const std::string &socketPath, int channels = 1024, int ringBytes = 16 * 1024);
+
+    ~SynexisClient();
+
+    SynexisClient(const SynexisClient &) = delete;
+
+    SynexisClient &operator=(const SynexisClient &) = delete;
+
+    std::future<CompletionResult> addTask(const std::string &prompt, const TaskParams &sampling_params);
+
+    // Media are copied once into shared memory the engine maps
+    std::future<CompletionResult> addTask(TaskParams params);
+
+    std::future<CompletionResult> addTask(std::vector<int32_t> tokens, TaskParams params);
+
+    std::vector<std::future<CompletionResult>> addTasks(std::vector<TaskParams> params);
+
+    [[nodiscard]] MetricsSnapshot metrics() const;
+
+    // Model file the engine loaded
+    [[nodiscard]] std::string modelPath() const;
+
+    [[nodiscard]] std::string getTemplate() const;
+
+    [[nodiscard]] bool hasNativeChatTemplate() const;
+
+    [[nodiscard]] std::string applyChatTemplate(const std::vector<ChatMessage> &messages,
+                                                bool addGenerationPrompt = true) const;
+
+    static std::string mediaMarker();
+
+    // "BOS" or "EOS"
+    std::string getToken(std::string str) const;
+
+    // False once the engine went away, every later task fails
+    [[nodiscard]] bool connected() const;
+
+private:
+    SynexisClientImpl *impl;
+};
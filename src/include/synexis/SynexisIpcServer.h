@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+
+class Synexis;
+class SynexisIpcServerImpl;
+
+// Serves an engine to SynexisClient instances in other processes over a Unix domain socket, so every worker process
+// shares one copy of the model, its slots and its KV cache. Linux only.
+class SynexisIpcServer {
+public:
+    // `engine` must outlive the server. An existing socket file at `socketPath` is replaced.
+    SynexisIpcServer(Synexis &engine, std::string socketPath);
+
+    ~SynexisIpcServer();
+
+    SynexisIpcServer(const SynexisIpcServer &) = delete;
+
+    SynexisIpcServer &operator=(const SynexisIpcServer &) = delete;
+
+    // Binds the socket and starts the thread accepting clients, throws std::runtime_error when the socket cannot be
+    // set up
+    void run();
+
+    // Disconnects every client, cancelling their tasks, and removes the socket file
+    void stop();
+
+private:
+    SynexisIpcServerImpl *impl;
+};
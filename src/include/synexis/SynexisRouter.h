@@ -0,0 +1,77 @@
+#pragma once
+#include <future>
+#include <string>
+#include <vector>
+
+#include "ChatMessage.h"
+#include "CompletionResult.h"
+#include "Metrics.h"
+#include "ScoreResult.h"
+#include "SynexisArguments.h"
+#include "TaskParams.h"
+class SynexisRouterImpl;
+
+// Runs several engine replicas, each one with its own context, slots and compute threads pinned to the CPUs of one
+// NUMA node, and spreads the tasks over them. On a multi-socket host a single engine keeps pulling its weights and
+// KV cache across the interconnect; replicas keep every step on node-local cores and memory instead.
+//
+// A task goes to the replica that last served the same prefix (system prompt and first message, or the start of
+// the prompt) as long as it has a free slot, so its tokenization cache and KV prefix stay useful, otherwise to the
+// replica with the fewest tasks in flight. Mirrors the task API of Synexis.
+class SynexisRouter {
+public:
+    // Every replica gets `args` with its own CPUs: `n_slots`, `n_ctx` and `numberOfThreads` are per replica, the
+    // threads capped at the replica's CPU count. `replicas` 0 starts one per NUMA node, more than the nodes split
+    // their CPUs. With `localWeights` each replica reads its own copy of the weights into memory of its node,
+    // otherwise every replica maps the same file and shares its pages. Replicas load in parallel.
+    explicit SynexisRouter(SynexisArguments args, int replicas = 0, bool localWeights = false);
+
+    ~SynexisRouter();
+
+    SynexisRouter(const SynexisRouter &) = delete;
+
+    SynexisRouter &operator=(const SynexisRouter &) = delete;
+
+    std::future<CompletionResult> addTask(const std::string &prompt, const TaskParams &sampling_params);
+
+    std::future<CompletionResult> addTask(TaskParams params);
+
+    std::future<CompletionResult> addTask(std::vector<int32_t> tokens, TaskParams params);
+
+    std::vector<std::future<CompletionResult>> addTasks(std::vector<TaskParams> params);
+
+    // Runs on the least loaded replica
+    std::future<std::vector<ScoreResult>> score(const std::string &prompt, const std::vector<std::string> &continuations);
+
+    void run() const;
+
+    void stop() const;
+
+    // Counters and histograms of every replica added up, the slots of all replicas one after the other
+    [[nodiscard]] MetricsSnapshot metrics() const;
+
+    [[nodiscard]] MetricsSnapshot replicaMetrics(size_t replica) const;
+
+    [[nodiscard]] size_t replicas() const;
+
+    // CPUs the replica runs on, empty when it is not pinned
+    [[nodiscard]] std::vector<int> replicaCpus(size_t replica) const;
+
+    [[nodiscard]] std::string modelPath() const;
+
+    [[nodiscard]] std::string getTemplate() const;
+
+    [[nodiscard]] bool hasNativeChatTemplate() const;
+
+    [[nodiscard]] std::string applyChatTemplate(const std::vector<ChatMessage> &messages,
+                                                bool addGenerationPrompt = true) const;
+
+    static std::string mediaMarker();
+
+    std::string getToken(std::string str) const;
+
+    std::vector<std::vector<float>> getEmbedding(const std::string &str);
+
+private:
+    SynexisRouterImpl *impl;
+};
@@ -1,14 +1,35 @@
 #pragma once
+#include "ChatMessage.h"
+#include "CompletionResult.h"
 #include "sampler/StructParams.h"
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <string_view>
 
 struct MediaDataView {
     const uint8_t *data = nullptr;
     size_t size = 0;
+    // Keeps `data` alive for as long as the request needs it, empty when the caller guarantees it
+    std::shared_ptr<const void> owner;
+};
+
+struct TokenLogprob {
+    int32_t token;
+    float logprob;
+};
+
+// Log-probabilities of one generated token: the chosen token and the `n_probs` most likely alternatives
+struct TokenProbs {
+    TokenLogprob chosen;
+    std::vector<TokenLogprob> top;
 };
 
 struct TaskParams {
     std::string prompt;
+    // Borrowed prompt text used instead of `prompt` when `promptOwner` is set, see setPrompt()
+    std::string_view promptRef;
+    std::shared_ptr<const void> promptOwner;
     SamplingParams samplerParams = SamplingParams(); // default value
     bool stream = false;
 
@@ -16,8 +37,23 @@ struct TaskParams {
 
     std::vector<MediaDataView> media;
 
+    // When set, the engine renders the prompt with the model's chat template and reuses the tokens of the
+    // conversation prefixes it saw before; `prompt` is ignored
+    std::vector<ChatMessage> messages;
+    bool addGenerationPrompt = true;
+
+    // Pre-tokenized prompt, used instead of `prompt` and `messages` when set
+    std::vector<int32_t> tokens;
+
+    // Streaming only. When false on_token is never called and tokens are not detokenized unless stop strings need it
+    bool emitText = true;
+
     std::vector<std::string> stopTokens;
 
+    // Setting it to true stops the task: a queued task is never admitted, a running one gives its slot back before
+    // the next batch. The future then holds what was generated so far with FINISH_REASON_CANCELLED.
+    std::shared_ptr<std::atomic<bool> > cancelled;
+
     TaskParams() = default;
 
     TaskParams(std::string prompt, SamplingParams samplerParams = SamplingParams(), int maximumTokens = -1,
@@ -27,12 +63,42 @@ struct TaskParams {
                                                      stopTokens(std::move(stopTokens)) {
     }
 
+    // Uses `text` without copying it. It must be null-terminated and stays alive as long as `owner` does.
+    void setPrompt(std::string_view text, std::shared_ptr<const void> owner) {
+        prompt.clear();
+        promptRef = text;
+        promptOwner = std::move(owner);
+    }
+
+    std::string_view promptView() const {
+        return promptOwner ? promptRef : std::string_view(prompt);
+    }
+
+    // The caller keeps `viewData` alive until the task is done
     void addMedia(const std::string_view &viewData) {
         MediaDataView mediaData = {reinterpret_cast<const uint8_t *>(viewData.data()), viewData.size()};
         media.emplace_back(mediaData);
     }
 
+    // Shares the ownership of `data` with the task instead of copying it
+    void addMedia(const uint8_t *data, size_t size, std::shared_ptr<const void> owner) {
+        media.push_back({data, size, std::move(owner)});
+    }
+
+    // Maps the file read-only, the mapping lives as long as the task
+    void addMediaFile(const std::string &path);
+
+    // Streaming only. Receives complete UTF-8 code points: the bytes of a token that ends inside a code point are
+    // held back and delivered with the next token, so one call may carry several tokens' text and some tokens none
     std::function<void(const std::string &)> on_token = nullptr;
+    // Streaming only. Called once per generated token, before its text is passed to on_token; the reference points
+    // to a per-slot buffer that is reused for the next token
+    std::function<void(const TokenProbs &)> on_probs = nullptr;
+    // Streaming only. Called with the id of every generated token
+    std::function<void(int32_t)> on_token_id = nullptr;
     std::function<void(const std::string &)> on_done = nullptr;
     std::function<void(const std::string &)> on_error = nullptr;
+    // Called on an engine thread with the result right before the future receives it, so a caller can answer from
+    // there instead of waiting on the future. Exactly one of on_result and on_error is called per task.
+    std::function<void(const CompletionResult &)> on_result = nullptr;
 };
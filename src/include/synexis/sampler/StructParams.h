@@ -1,4 +1,5 @@
 #pragma once
+#include <map>
 #include <set>
 #include <string>
 #include <vector>
@@ -47,6 +48,10 @@ struct SamplingParams {
     float mirostat_tau = 5.00f;
     float mirostat_eta = 0.10f;
 
+    // Logit bias parameters
+    std::map<int32_t, float> logit_bias;
+    std::vector<int32_t> banned_tokens;
+
     // Flags
     bool ignore_eos = false;
     bool no_perf = false;
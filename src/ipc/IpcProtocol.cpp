@@ -0,0 +1,445 @@
+#include "IpcProtocol.h"
+
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    void copyIn(char *ring, uint32_t ringBytes, uint64_t position, const void *data, size_t size) {
+        const size_t offset = position & (ringBytes - 1);
+        const size_t first = std::min(size, ringBytes - offset);
+        std::memcpy(ring + offset, data, first);
+        std::memcpy(ring, static_cast<const char *>(data) + first, size - first);
+    }
+
+    void writeHistogram(WireWriter &writer, const HistogramSnapshot &histogram) {
+        writer.putVector(histogram.bounds);
+        writer.putVector(histogram.counts);
+        writer.put(histogram.count);
+        writer.put(histogram.sum);
+    }
+
+    HistogramSnapshot readHistogram(WireReader &reader) {
+        HistogramSnapshot histogram;
+        histogram.bounds = reader.getVector<double>();
+        histogram.counts = reader.getVector<uint64_t>();
+        histogram.count = reader.get<uint64_t>();
+        histogram.sum = reader.get<double>();
+        return histogram;
+    }
+}
+
+bool ipcRingWrite(IpcChannel &channel, char *ring, uint32_t ringBytes, IpcRecordKind kind, const void *data,
+                  uint32_t size) {
+    const uint64_t head = channel.head.load(std::memory_order_relaxed);
+    const uint64_t tail = channel.tail.load(std::memory_order_acquire);
+    const uint64_t total = sizeof(IpcRecordHeader) + static_cast<uint64_t>(size);
+    // The client owns the tail, a value past the head is treated as a full ring
+    if (tail > head || ringBytes - (head - tail) < total) {
+        return false;
+    }
+    const IpcRecordHeader header = {kind, size};
+    copyIn(ring, ringBytes, head, &header, sizeof(header));
+    copyIn(ring, ringBytes, head + sizeof(header), data, size);
+    channel.head.store(head + total, std::memory_order_release);
+    return true;
+}
+
+void ipcRingRead(IpcChannel &channel, const char *ring, uint32_t ringBytes, std::string &out) {
+    const uint64_t tail = channel.tail.load(std::memory_order_relaxed);
+    const uint64_t head = channel.head.load(std::memory_order_acquire);
+    const uint64_t n = std::min<uint64_t>(head - tail, ringBytes);
+    if (n == 0) {
+        return;
+    }
+    const size_t offset = tail & (ringBytes - 1);
+    const size_t first = std::min<size_t>(n, ringBytes - offset);
+    out.append(ring + offset, first);
+    out.append(ring, n - first);
+    channel.tail.store(tail + n, std::memory_order_release);
+}
+
+int ipcMemfd(const char *name, const void *data, size_t size) {
+    const int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+    const char *bytes = static_cast<const char *>(data);
+    size_t written = 0;
+    while (written < size) {
+        const ssize_t n = ::write(fd, bytes + written, size - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ::close(fd);
+            return -1;
+        }
+        written += static_cast<size_t>(n);
+    }
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool ipcSealedSize(int fd) {
+    const int seals = fcntl(fd, F_GET_SEALS);
+    return seals >= 0 && (seals & F_SEAL_SHRINK);
+}
+
+void ipcCloseFds(std::vector<int> &fds) {
+    for (int fd: fds) {
+        ::close(fd);
+    }
+    fds.clear();
+}
+
+bool ipcSend(int fd, IpcMessageType type, uint64_t id, const std::string &payload, const std::vector<int> &fds) {
+    IpcMessageHeader header = {type, 0, id};
+    std::vector<int> attached = fds;
+    int spilled = -1;
+    std::string_view inlined = payload;
+    if (payload.size() > IPC_INLINE_BYTES) {
+        spilled = ipcMemfd("synexis-ipc-payload", payload.data(), payload.size());
+        if (spilled < 0) {
+            return false;
+        }
+        header.flags |= IPC_FLAG_SPILLED;
+        attached.push_back(spilled);
+        inlined = std::string_view();
+    }
+    if (attached.size() > IPC_MAX_FDS) {
+        if (spilled >= 0) {
+            ::close(spilled);
+        }
+        return false;
+    }
+
+    iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = const_cast<char *>(inlined.data());
+    iov[1].iov_len = inlined.size();
+    msghdr message{};
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * IPC_MAX_FDS)];
+    if (!attached.empty()) {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * attached.size());
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * attached.size());
+        std::memcpy(CMSG_DATA(cmsg), attached.data(), sizeof(int) * attached.size());
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    const int error = errno;
+    // The receiver holds its own copy of the descriptor
+    if (spilled >= 0) {
+        ::close(spilled);
+    }
+    // Left for the caller, EAGAIN on a non-blocking socket that is full
+    errno = error;
+    return n == static_cast<ssize_t>(sizeof(header) + inlined.size());
+}
+
+bool ipcReceive(int fd, IpcMessage &message, bool wait) {
+    static thread_local std::vector<char> buffer(sizeof(IpcMessageHeader) + IPC_INLINE_BYTES);
+    iovec iov;
+    iov.iov_base = buffer.data();
+    iov.iov_len = buffer.size();
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * IPC_MAX_FDS)];
+    msghdr header{};
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &header, MSG_CMSG_CLOEXEC | (wait ? 0 : MSG_DONTWAIT));
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        if (n == 0) {
+            errno = 0;
+        }
+        return false;
+    }
+
+    message.fds.clear();
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const size_t first = message.fds.size();
+            message.fds.resize(first + count);
+            std::memcpy(message.fds.data() + first, CMSG_DATA(cmsg), count * sizeof(int));
+        }
+    }
+    errno = 0;
+    if ((header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || n < static_cast<ssize_t>(sizeof(IpcMessageHeader))) {
+        ipcCloseFds(message.fds);
+        return false;
+    }
+
+    IpcMessageHeader head;
+    std::memcpy(&head, buffer.data(), sizeof(head));
+    message.type = head.type;
+    message.id = head.id;
+    message.payload.assign(buffer.data() + sizeof(head), n - sizeof(head));
+    if (head.flags & IPC_FLAG_SPILLED) {
+        if (message.fds.empty()) {
+            return false;
+        }
+        const int spilled = message.fds.back();
+        message.fds.pop_back();
+        struct stat info{};
+        bool ok = fstat(spilled, &info) == 0 && info.st_size <= IPC_MAX_PAYLOAD_BYTES;
+        if (ok) {
+            message.payload.resize(info.st_size);
+            size_t done = 0;
+            while (ok && done < message.payload.size()) {
+                const ssize_t read = pread(spilled, message.payload.data() + done, message.payload.size() - done,
+                                           static_cast<off_t>(done));
+                if (read < 0 && errno == EINTR) {
+                    continue;
+                }
+                ok = read > 0;
+                done += ok ? static_cast<size_t>(read) : 0;
+            }
+        }
+        ::close(spilled);
+        if (!ok) {
+            ipcCloseFds(message.fds);
+            return false;
+        }
+    }
+    return true;
+}
+
+void ipcWriteTask(WireWriter &writer, const TaskParams &params) {
+    uint32_t flags = 0;
+    if (params.on_token) {
+        flags |= IPC_TASK_ON_TOKEN;
+    }
+    if (params.on_token_id) {
+        flags |= IPC_TASK_ON_TOKEN_ID;
+    }
+    if (params.on_probs) {
+        flags |= IPC_TASK_ON_PROBS;
+    }
+    writer.put(flags);
+
+    writer.putString(params.promptView());
+    writer.put<uint8_t>(params.stream);
+    writer.put<int32_t>(params.maximumTokens);
+    writer.put<uint64_t>(params.messages.size());
+    for (const auto &message: params.messages) {
+        writer.putString(message.role);
+        writer.putString(message.content);
+    }
+    writer.put<uint8_t>(params.addGenerationPrompt);
+    writer.putVector(params.tokens);
+    writer.put<uint8_t>(params.emitText);
+    writer.putStrings(params.stopTokens);
+
+    const SamplingParams &s = params.samplerParams;
+    writer.put(s.seed);
+    writer.put(s.n_prev);
+    writer.put(s.n_probs);
+    writer.put(s.min_keep);
+    writer.put(s.top_k);
+    writer.put(s.top_p);
+    writer.put(s.min_p);
+    writer.put(s.xtc_probability);
+    writer.put(s.xtc_threshold);
+    writer.put(s.typ_p);
+    writer.put(s.temp);
+    writer.put(s.dynatemp_range);
+    writer.put(s.dynatemp_exponent);
+    writer.put(s.penalty_last_n);
+    writer.put(s.penalty_repeat);
+    writer.put(s.penalty_freq);
+    writer.put(s.penalty_present);
+    writer.put(s.dry_multiplier);
+    writer.put(s.dry_base);
+    writer.put(s.dry_allowed_length);
+    writer.put(s.dry_penalty_last_n);
+    writer.putStrings(s.dry_sequence_breakers);
+    writer.put(s.mirostat);
+    writer.put(s.top_n_sigma);
+    writer.put(s.mirostat_tau);
+    writer.put(s.mirostat_eta);
+    writer.put<uint64_t>(s.logit_bias.size());
+    for (const auto &[token, bias]: s.logit_bias) {
+        writer.put(token);
+        writer.put(bias);
+    }
+    writer.putVector(s.banned_tokens);
+    writer.put<uint8_t>(s.ignore_eos);
+    writer.put<uint8_t>(s.no_perf);
+    writer.put<uint8_t>(s.timing_per_token);
+    writer.putVector(s.samplers);
+    writer.putString(s.grammar);
+    writer.put<uint8_t>(s.grammar_lazy);
+    writer.put<uint64_t>(s.grammar_triggers.size());
+    for (const auto &trigger: s.grammar_triggers) {
+        writer.put(trigger.type);
+        writer.putString(trigger.value);
+        writer.put(trigger.token);
+    }
+    writer.putVector(std::vector<int32_t>(s.preserved_tokens.begin(), s.preserved_tokens.end()));
+}
+
+uint32_t ipcReadTask(WireReader &reader, TaskParams &params) {
+    const uint32_t flags = reader.get<uint32_t>();
+
+    params.prompt = reader.getString();
+    params.stream = reader.get<uint8_t>() != 0;
+    params.maximumTokens = reader.get<int32_t>();
+    const uint64_t messages = reader.get<uint64_t>();
+    for (uint64_t i = 0; i < messages; ++i) {
+        ChatMessage message;
+        message.role = reader.getString();
+        message.content = reader.getString();
+        params.messages.push_back(std::move(message));
+    }
+    params.addGenerationPrompt = reader.get<uint8_t>() != 0;
+    params.tokens = reader.getVector<int32_t>();
+    params.emitText = reader.get<uint8_t>() != 0;
+    params.stopTokens = reader.getStrings();
+
+    SamplingParams &s = params.samplerParams;
+    s.seed = reader.get<uint32_t>();
+    s.n_prev = reader.get<int32_t>();
+    s.n_probs = reader.get<int32_t>();
+    s.min_keep = reader.get<int32_t>();
+    s.top_k = reader.get<int32_t>();
+    s.top_p = reader.get<float>();
+    s.min_p = reader.get<float>();
+    s.xtc_probability = reader.get<float>();
+    s.xtc_threshold = reader.get<float>();
+    s.typ_p = reader.get<float>();
+    s.temp = reader.get<float>();
+    s.dynatemp_range = reader.get<float>();
+    s.dynatemp_exponent = reader.get<float>();
+    s.penalty_last_n = reader.get<int32_t>();
+    s.penalty_repeat = reader.get<float>();
+    s.penalty_freq = reader.get<float>();
+    s.penalty_present = reader.get<float>();
+    s.dry_multiplier = reader.get<float>();
+    s.dry_base = reader.get<float>();
+    s.dry_allowed_length = reader.get<int32_t>();
+    s.dry_penalty_last_n = reader.get<int32_t>();
+    s.dry_sequence_breakers = reader.getStrings();
+    s.mirostat = reader.get<int32_t>();
+    s.top_n_sigma = reader.get<float>();
+    s.mirostat_tau = reader.get<float>();
+    s.mirostat_eta = reader.get<float>();
+    const uint64_t biases = reader.get<uint64_t>();
+    for (uint64_t i = 0; i < biases; ++i) {
+        const int32_t token = reader.get<int32_t>();
+        s.logit_bias[token] = reader.get<float>();
+    }
+    s.banned_tokens = reader.getVector<int32_t>();
+    s.ignore_eos = reader.get<uint8_t>() != 0;
+    s.no_perf = reader.get<uint8_t>() != 0;
+    s.timing_per_token = reader.get<uint8_t>() != 0;
+    s.samplers = reader.getVector<SamplerType>();
+    s.grammar = reader.getString();
+    s.grammar_lazy = reader.get<uint8_t>() != 0;
+    const uint64_t triggers = reader.get<uint64_t>();
+    s.grammar_triggers.clear();
+    for (uint64_t i = 0; i < triggers; ++i) {
+        GrammarTrigger trigger;
+        trigger.type = reader.get<GrammarTriggerType>();
+        trigger.value = reader.getString();
+        trigger.token = reader.get<int32_t>();
+        s.grammar_triggers.push_back(std::move(trigger));
+    }
+    const std::vector<int32_t> preserved = reader.getVector<int32_t>();
+    s.preserved_tokens = std::set<int32_t>(preserved.begin(), preserved.end());
+    return flags;
+}
+
+void ipcWriteResult(WireWriter &writer, const CompletionResult &result) {
+    writer.putString(result.text);
+    writer.put(result.promptTokens);
+    writer.put(result.promptTokensComputed);
+    writer.put(result.promptTokensCached);
+    writer.put(result.completionTokens);
+    writer.put(result.finishReason);
+    writer.put(result.queueTime);
+    writer.put(result.prefillTime);
+    writer.put(result.decodeTime);
+    writer.putVector(result.tokenTimes);
+}
+
+CompletionResult ipcReadResult(WireReader &reader) {
+    CompletionResult result;
+    result.text = reader.getString();
+    result.promptTokens = reader.get<int32_t>();
+    result.promptTokensComputed = reader.get<int32_t>();
+    result.promptTokensCached = reader.get<int32_t>();
+    result.completionTokens = reader.get<int32_t>();
+    result.finishReason = reader.get<FinishReason>();
+    result.queueTime = reader.get<double>();
+    result.prefillTime = reader.get<double>();
+    result.decodeTime = reader.get<double>();
+    result.tokenTimes = reader.getVector<double>();
+    return result;
+}
+
+void ipcWriteMetrics(WireWriter &writer, const MetricsSnapshot &metrics) {
+    writer.put(metrics.requestsAdmitted);
+    writer.put(metrics.requestsCompleted);
+    writer.put(metrics.requestsFailed);
+    writer.put(metrics.requestsCancelled);
+    writer.put(metrics.promptTokens);
+    writer.put(metrics.generatedTokens);
+    writer.put(metrics.decodeSteps);
+    writer.put(metrics.decodeRetries);
+    writer.put(metrics.contextShifts);
+    writer.put(metrics.queueDepth);
+    writeHistogram(writer, metrics.timeToFirstToken);
+    writeHistogram(writer, metrics.interTokenLatency);
+    writeHistogram(writer, metrics.queueWait);
+    writeHistogram(writer, metrics.prefillTokens);
+    writeHistogram(writer, metrics.decodeTokens);
+    writeHistogram(writer, metrics.batchFill);
+    writer.putVector(metrics.slotKvCells);
+}
+
+MetricsSnapshot ipcReadMetrics(WireReader &reader) {
+    MetricsSnapshot metrics;
+    metrics.requestsAdmitted = reader.get<uint64_t>();
+    metrics.requestsCompleted = reader.get<uint64_t>();
+    metrics.requestsFailed = reader.get<uint64_t>();
+    metrics.requestsCancelled = reader.get<uint64_t>();
+    metrics.promptTokens = reader.get<uint64_t>();
+    metrics.generatedTokens = reader.get<uint64_t>();
+    metrics.decodeSteps = reader.get<uint64_t>();
+    metrics.decodeRetries = reader.get<uint64_t>();
+    metrics.contextShifts = reader.get<uint64_t>();
+    metrics.queueDepth = reader.get<uint64_t>();
+    metrics.timeToFirstToken = readHistogram(reader);
+    metrics.interTokenLatency = readHistogram(reader);
+    metrics.queueWait = readHistogram(reader);
+    metrics.prefillTokens = readHistogram(reader);
+    metrics.decodeTokens = readHistogram(reader);
+    metrics.batchFill = readHistogram(reader);
+    metrics.slotKvCells = reader.getVector<int32_t>();
+    return metrics;
+}
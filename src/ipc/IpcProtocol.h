@@ -0,0 +1,243 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <synexis/CompletionResult.h>
+#include <synexis/Metrics.h>
+#include <synexis/TaskParams.h>
+
+// Wire format between SynexisClient and SynexisIpcServer, both ends are built from the same sources.
+//
+// Control messages travel over a SOCK_SEQPACKET Unix socket, one message per packet, file descriptors attached with
+// SCM_RIGHTS. Streamed tokens do not: at connect time the client hands over a memfd holding one single-producer
+// single-consumer ring per in-flight request, the engine thread writes records into it and signals the client's
+// eventfd once per drain.
+
+#define IPC_VERSION 2
+#define IPC_MAGIC 0x53594E58u
+// Larger payloads are spilled into a memfd sent along the message
+#define IPC_INLINE_BYTES (32 * 1024)
+#define IPC_MAX_PAYLOAD_BYTES (512 * 1024 * 1024)
+#define IPC_MAX_FDS 64
+#define IPC_DEFAULT_CHANNELS 1024
+#define IPC_DEFAULT_RING_BYTES (16 * 1024)
+
+enum IpcMessageType : uint32_t {
+    // Client: fds are the ring memfd and the eventfd, payload is IpcHello
+    IPC_HELLO = 1,
+    // Server: model path, chat template and special tokens
+    IPC_WELCOME,
+    // Client: payload is the channel index and the TaskParams, fds are the media
+    IPC_SUBMIT,
+    // Server: records that did not fit in the request's ring, to be read after whatever the ring holds
+    IPC_STREAM_OVERFLOW,
+    // Server: CompletionResult and the text passed to on_done
+    IPC_RESULT,
+    // Server: the message passed to on_error
+    IPC_ERROR,
+    // Client: answered with IPC_REPLY under the same id
+    IPC_METRICS,
+    IPC_APPLY_TEMPLATE,
+    IPC_REPLY,
+};
+
+enum IpcMessageFlags : uint32_t {
+    // The payload is the content of the last fd
+    IPC_FLAG_SPILLED = 1,
+};
+
+struct IpcMessageHeader {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t id;
+};
+
+struct IpcMessage {
+    uint32_t type = 0;
+    uint64_t id = 0;
+    std::string payload;
+    // Owned by the receiver
+    std::vector<int> fds;
+};
+
+struct IpcHello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t channels;
+    uint32_t ringBytes;
+};
+
+// One request's stream. The engine advances `head`, the client `tail`; both only grow and are masked into the ring.
+struct IpcChannel {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    // Set by the server after writing, cleared by the client before reading: one eventfd signal per drain
+    alignas(64) std::atomic<bool> notified;
+    // The task's TaskParams::cancelled on the engine side
+    std::atomic<bool> cancelled;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<bool>::is_always_lock_free,
+              "shared memory atomics must be lock-free");
+
+enum IpcRecordKind : uint32_t {
+    IPC_RECORD_TEXT = 1,
+    IPC_RECORD_TOKEN_ID,
+    // TokenProbs: the chosen token, then the alternatives
+    IPC_RECORD_PROBS,
+};
+
+struct IpcRecordHeader {
+    uint32_t kind;
+    uint32_t size;
+};
+
+// Layout of the client's memfd: the channel headers, then every channel's ring
+inline size_t ipcMappingSize(uint32_t channels, uint32_t ringBytes) {
+    return static_cast<size_t>(channels) * (sizeof(IpcChannel) + ringBytes);
+}
+
+inline IpcChannel *ipcChannel(void *mapping, uint32_t index) {
+    return static_cast<IpcChannel *>(mapping) + index;
+}
+
+inline char *ipcRing(void *mapping, uint32_t channels, uint32_t ringBytes, uint32_t index) {
+    return static_cast<char *>(mapping) + channels * sizeof(IpcChannel) + static_cast<size_t>(index) * ringBytes;
+}
+
+// Producer side. Writes the whole record or nothing. `ringBytes` is a power of two.
+bool ipcRingWrite(IpcChannel &channel, char *ring, uint32_t ringBytes, IpcRecordKind kind, const void *data,
+                  uint32_t size);
+
+// Consumer side. Appends every readable byte, whole records, to `out`.
+void ipcRingRead(IpcChannel &channel, const char *ring, uint32_t ringBytes, std::string &out);
+
+// Sends one message, the caller serializes sends on `fd`. False when the peer is gone, or with errno EAGAIN when
+// `fd` is non-blocking and full.
+bool ipcSend(int fd, IpcMessageType type, uint64_t id, const std::string &payload, const std::vector<int> &fds = {});
+
+// Receives one message, spilled payloads included. Returns false on EOF or a broken message, and with `wait` unset
+// also when nothing is pending (errno is then EAGAIN).
+bool ipcReceive(int fd, IpcMessage &message, bool wait);
+
+// A memfd holding `data`, sealed read-only, -1 on failure
+int ipcMemfd(const char *name, const void *data, size_t size);
+
+// True when `fd` is a memfd that cannot shrink anymore. The engine only maps those: a client truncating a file the
+// engine has mapped would make it take SIGBUS.
+bool ipcSealedSize(int fd);
+
+void ipcCloseFds(std::vector<int> &fds);
+
+// Appends plain values to a payload. Both ends share the architecture, values are copied as they are in memory.
+class WireWriter {
+public:
+    template<typename T>
+    void put(const T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    void putString(std::string_view value) {
+        put<uint64_t>(value.size());
+        out.append(value.data(), value.size());
+    }
+
+    template<typename T>
+    void putVector(const std::vector<T> &values) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        put<uint64_t>(values.size());
+        out.append(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
+    }
+
+    void putStrings(const std::vector<std::string> &values) {
+        put<uint64_t>(values.size());
+        for (const auto &value: values) {
+            putString(value);
+        }
+    }
+
+    std::string out;
+};
+
+// Reads what WireWriter wrote, throws std::runtime_error on a truncated payload
+class WireReader {
+public:
+    explicit WireReader(std::string_view data): data(data) {
+    }
+
+    template<typename T>
+    T get() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    std::string getString() {
+        const uint64_t size = get<uint64_t>();
+        return std::string(take(size), size);
+    }
+
+    template<typename T>
+    std::vector<T> getVector() {
+        const uint64_t size = get<uint64_t>();
+        if (size > data.size() / sizeof(T)) {
+            throw std::runtime_error("truncated IPC message");
+        }
+        std::vector<T> values(size);
+        if (size > 0) {
+            std::memcpy(values.data(), take(size * sizeof(T)), size * sizeof(T));
+        }
+        return values;
+    }
+
+    std::vector<std::string> getStrings() {
+        const uint64_t size = get<uint64_t>();
+        std::vector<std::string> values;
+        for (uint64_t i = 0; i < size; ++i) {
+            values.push_back(getString());
+        }
+        return values;
+    }
+
+private:
+    const char *take(uint64_t size) {
+        if (size > data.size()) {
+            throw std::runtime_error("truncated IPC message");
+        }
+        const char *start = data.data();
+        data.remove_prefix(size);
+        return start;
+    }
+
+    std::string_view data;
+};
+
+// Which callbacks the client set, the server only installs those
+enum IpcTaskFlags : uint32_t {
+    IPC_TASK_ON_TOKEN = 1,
+    IPC_TASK_ON_TOKEN_ID = 2,
+    IPC_TASK_ON_PROBS = 4,
+};
+
+// Everything of TaskParams but the media, which travel as fds, and the callbacks
+void ipcWriteTask(WireWriter &writer, const TaskParams &params);
+
+// Returns the IpcTaskFlags written with the task
+uint32_t ipcReadTask(WireReader &reader, TaskParams &params);
+
+void ipcWriteResult(WireWriter &writer, const CompletionResult &result);
+
+CompletionResult ipcReadResult(WireReader &reader);
+
+void ipcWriteMetrics(WireWriter &writer, const MetricsSnapshot &metrics);
+
+MetricsSnapshot ipcReadMetrics(WireReader &reader);
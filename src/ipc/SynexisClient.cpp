@@ -0,0 +1,603 @@
+#include <synexis/SynexisClient.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <synexis/Synexis.h>
+
+#include "IpcProtocol.h"
+
+// How often the receiving thread copies the callers' cancel flags into shared memory while tasks have one
+#define IPC_CANCEL_POLL_MS 20
+
+namespace {
+    // Client side of one submitted task, removed by the receiving thread once its result or error arrived
+    struct ClientTask {
+        uint32_t channel = 0;
+        std::function<void(const std::string &)> on_token;
+        std::function<void(const TokenProbs &)> on_probs;
+        std::function<void(int32_t)> on_token_id;
+        std::function<void(const std::string &)> on_done;
+        std::function<void(const std::string &)> on_error;
+        std::function<void(const CompletionResult &)> on_result;
+        std::shared_ptr<std::atomic<bool> > cancelled;
+        std::promise<CompletionResult> promise;
+        // Reused for every drain
+        std::string records;
+        TokenProbs probs;
+    };
+
+    std::runtime_error disconnected() {
+        return std::runtime_error("the engine closed the connection");
+    }
+}
+
+class SynexisClientImpl {
+public:
+    SynexisClientImpl(const std::string &socketPath, int channels, int ringBytes) {
+        if (channels <= 0 || ringBytes < 256 || (ringBytes & (ringBytes - 1)) != 0) {
+            throw std::invalid_argument("channels must be positive and ringBytes a power of two of at least 256");
+        }
+        this->channels = channels;
+        this->ringBytes = ringBytes;
+
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+            throw std::invalid_argument("invalid socket path " + socketPath);
+        }
+        std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+            const std::string error = std::strerror(errno);
+            release();
+            throw std::runtime_error("cannot connect to " + socketPath + ": " + error);
+        }
+
+        mappingSize = ipcMappingSize(this->channels, this->ringBytes);
+        const int memfd = memfd_create("synexis-ipc-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        // The engine maps the rings too, it only accepts a file whose size is fixed
+        if (memfd < 0 || ftruncate(memfd, static_cast<off_t>(mappingSize)) != 0 ||
+            fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ||
+            (mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+            mapping = nullptr;
+            if (memfd >= 0) {
+                ::close(memfd);
+            }
+            release();
+            throw std::runtime_error("cannot allocate the shared stream rings");
+        }
+        for (uint32_t i = 0; i < this->channels; ++i) {
+            new(ipcChannel(mapping, i)) IpcChannel{};
+        }
+        eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        const IpcHello hello = {IPC_MAGIC, IPC_VERSION, this->channels, this->ringBytes};
+        const bool sent = eventFd >= 0 && stopFd >= 0 &&
+                          ipcSend(fd, IPC_HELLO, 0, std::string(reinterpret_cast<const char *>(&hello), sizeof(hello)),
+                                  {memfd, eventFd});
+        ::close(memfd);
+        IpcMessage welcome;
+        if (!sent || !ipcReceive(fd, welcome, true) || welcome.type != IPC_WELCOME) {
+            release();
+            throw std::runtime_error("the engine at " + socketPath + " refused the connection");
+        }
+        ipcCloseFds(welcome.fds);
+        try {
+            WireReader reader(welcome.payload);
+            modelPath = reader.getString();
+            chatTemplate = reader.getString();
+            nativeChatTemplate = reader.get<uint8_t>() != 0;
+            bosToken = reader.getString();
+            eosToken = reader.getString();
+        } catch (const std::exception &) {
+            release();
+            throw;
+        }
+
+        freeChannels.reserve(this->channels);
+        for (uint32_t i = this->channels; i > 0; --i) {
+            freeChannels.push_back(i - 1);
+        }
+        connected = true;
+        receiver = std::thread(&SynexisClientImpl::receiveLoop, this);
+    }
+
+    ~SynexisClientImpl() {
+        const uint64_t one = 1;
+        [[maybe_unused]] const ssize_t written = ::write(stopFd, &one, sizeof(one));
+        if (receiver.joinable()) {
+            receiver.join();
+        }
+        {
+            std::lock_guard lock(sendMutex);
+            connected = false;
+        }
+        channelsCv.notify_all();
+        // Cancels every task still running in the engine
+        shutdown(fd, SHUT_RDWR);
+        fail(std::runtime_error("the client was closed"));
+        release();
+    }
+
+    std::future<CompletionResult> addTask(TaskParams &&params) {
+        if (params.media.size() > IPC_MAX_FDS) {
+            throw std::invalid_argument("at most " + std::to_string(IPC_MAX_FDS) + " media per task");
+        }
+        const uint32_t channel = acquireChannel();
+
+        IpcChannel *shared = ipcChannel(mapping, channel);
+        shared->head.store(0, std::memory_order_relaxed);
+        shared->tail.store(0, std::memory_order_relaxed);
+        shared->notified.store(false, std::memory_order_relaxed);
+        shared->cancelled.store(params.cancelled && params.cancelled->load());
+
+        WireWriter writer;
+        writer.put(channel);
+        ipcWriteTask(writer, params);
+        std::vector<int> media;
+        for (const auto &item: params.media) {
+            const int memfd = ipcMemfd("synexis-ipc-media", item.data, item.size);
+            if (memfd < 0) {
+                ipcCloseFds(media);
+                releaseChannel(channel);
+                throw std::runtime_error("cannot copy the media into shared memory");
+            }
+            media.push_back(memfd);
+        }
+
+        auto task = std::make_unique<ClientTask>();
+        task->channel = channel;
+        task->on_token = std::move(params.on_token);
+        task->on_probs = std::move(params.on_probs);
+        task->on_token_id = std::move(params.on_token_id);
+        task->on_done = std::move(params.on_done);
+        task->on_error = std::move(params.on_error);
+        task->on_result = std::move(params.on_result);
+        task->cancelled = std::move(params.cancelled);
+        std::future<CompletionResult> future = task->promise.get_future();
+
+        const uint64_t id = nextId++;
+        const bool cancellable = task->cancelled != nullptr;
+        // Registered first, the result may arrive before the send returns
+        {
+            std::lock_guard lock(tasksMutex);
+            if (task->cancelled) {
+                cancelFlags++;
+            }
+            tasks.emplace(id, std::move(task));
+        }
+        const bool sent = send(IPC_SUBMIT, id, writer.out, media);
+        ipcCloseFds(media);
+        if (!sent) {
+            std::unique_ptr<ClientTask> failed = take(id);
+            if (failed) {
+                releaseChannel(channel);
+            }
+            throw disconnected();
+        }
+        if (cancellable) {
+            // Wakes the receiving thread up so it starts polling the flag
+            const uint64_t one = 1;
+            [[maybe_unused]] const ssize_t written = ::write(eventFd, &one, sizeof(one));
+        }
+        return future;
+    }
+
+    std::string call(IpcMessageType type, const std::string &payload) const {
+        const uint64_t id = nextId++;
+        std::future<std::string> reply; {
+            std::lock_guard lock(tasksMutex);
+            reply = calls[id].get_future();
+        }
+        if (!send(type, id, payload, {})) {
+            std::lock_guard lock(tasksMutex);
+            calls.erase(id);
+            throw disconnected();
+        }
+        return reply.get();
+    }
+
+    bool send(IpcMessageType type, uint64_t id, const std::string &payload, const std::vector<int> &fds) const {
+        std::lock_guard lock(sendMutex);
+        return connected && ipcSend(fd, type, id, payload, fds);
+    }
+
+    std::string modelPath;
+    std::string chatTemplate;
+    bool nativeChatTemplate = false;
+    std::string bosToken;
+    std::string eosToken;
+    std::atomic<bool> connected{false};
+
+private:
+    uint32_t acquireChannel() {
+        std::unique_lock lock(channelsMutex);
+        channelsCv.wait(lock, [this] { return !freeChannels.empty() || !connected; });
+        if (!connected) {
+            throw disconnected();
+        }
+        const uint32_t channel = freeChannels.back();
+        freeChannels.pop_back();
+        return channel;
+    }
+
+    void releaseChannel(uint32_t channel) {
+        {
+            std::lock_guard lock(channelsMutex);
+            freeChannels.push_back(channel);
+        }
+        channelsCv.notify_one();
+    }
+
+    std::unique_ptr<ClientTask> take(uint64_t id) {
+        std::lock_guard lock(tasksMutex);
+        const auto it = tasks.find(id);
+        if (it == tasks.end()) {
+            return nullptr;
+        }
+        std::unique_ptr<ClientTask> task = std::move(it->second);
+        tasks.erase(it);
+        if (task->cancelled) {
+            cancelFlags--;
+        }
+        return task;
+    }
+
+    ClientTask *find(uint64_t id) {
+        std::lock_guard lock(tasksMutex);
+        const auto it = tasks.find(id);
+        return it == tasks.end() ? nullptr : it->second.get();
+    }
+
+    void receiveLoop() {
+        pollfd fds[3] = {{fd, POLLIN, 0}, {eventFd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+        while (true) {
+            int timeout; {
+                std::lock_guard lock(tasksMutex);
+                timeout = cancelFlags > 0 ? IPC_CANCEL_POLL_MS : -1;
+            }
+            const int n = poll(fds, 3, timeout);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (fds[2].revents) {
+                return;
+            }
+            if (fds[1].revents & POLLIN) {
+                uint64_t count;
+                [[maybe_unused]] const ssize_t read = ::read(eventFd, &count, sizeof(count));
+                drainAll();
+            }
+            if (fds[0].revents && !receiveMessages()) {
+                break;
+            }
+            forwardCancelFlags();
+        }
+        // The engine is gone
+        {
+            std::lock_guard lock(sendMutex);
+            connected = false;
+        }
+        channelsCv.notify_all();
+        fail(disconnected());
+    }
+
+    // Receiving thread. False once the socket is closed.
+    bool receiveMessages() {
+        while (true) {
+            IpcMessage message;
+            if (!ipcReceive(fd, message, false)) {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            ipcCloseFds(message.fds);
+            handle(message);
+        }
+    }
+
+    void handle(const IpcMessage &message) {
+        switch (message.type) {
+            case IPC_STREAM_OVERFLOW: {
+                ClientTask *task = find(message.id);
+                if (task) {
+                    drain(*task);
+                    deliver(*task, message.payload);
+                }
+                break;
+            }
+            case IPC_RESULT: {
+                std::unique_ptr<ClientTask> task = take(message.id);
+                if (!task) {
+                    break;
+                }
+                drain(*task);
+                releaseChannel(task->channel);
+                try {
+                    WireReader reader(message.payload);
+                    CompletionResult result = ipcReadResult(reader);
+                    const std::string doneText = reader.getString();
+                    if (task->on_done) {
+                        task->on_done(doneText);
+                    }
+                    if (task->on_result) {
+                        task->on_result(result);
+                    }
+                    task->promise.set_value(std::move(result));
+                } catch (...) {
+                    // A truncated result or a throwing callback, the caller sees it through the future
+                    task->promise.set_exception(std::current_exception());
+                }
+                break;
+            }
+            case IPC_ERROR: {
+                if (resolveCall(message, true)) {
+                    break;
+                }
+                std::unique_ptr<ClientTask> task = take(message.id);
+                if (!task) {
+                    break;
+                }
+                drain(*task);
+                releaseChannel(task->channel);
+                try {
+                    if (task->on_error) {
+                        task->on_error(message.payload);
+                    }
+                } catch (...) {
+                }
+                task->promise.set_exception(std::make_exception_ptr(std::runtime_error(message.payload)));
+                break;
+            }
+            case IPC_REPLY:
+                resolveCall(message, false);
+                break;
+            default:
+                break;
+        }
+    }
+
+    bool resolveCall(const IpcMessage &message, bool error) {
+        std::promise<std::string> promise; {
+            std::lock_guard lock(tasksMutex);
+            const auto it = calls.find(message.id);
+            if (it == calls.end()) {
+                return false;
+            }
+            promise = std::move(it->second);
+            calls.erase(it);
+        }
+        if (error) {
+            promise.set_exception(std::make_exception_ptr(std::runtime_error(message.payload)));
+        } else {
+            promise.set_value(message.payload);
+        }
+        return true;
+    }
+
+    // Receiving thread. Only this thread removes tasks, the pointers stay valid while it uses them.
+    void drainAll() {
+        std::vector<ClientTask *> streaming; {
+            std::lock_guard lock(tasksMutex);
+            streaming.reserve(tasks.size());
+            for (auto &[id, task]: tasks) {
+                if (task->on_token || task->on_token_id || task->on_probs) {
+                    streaming.push_back(task.get());
+                }
+            }
+        }
+        for (ClientTask *task: streaming) {
+            drain(*task);
+        }
+    }
+
+    void drain(ClientTask &task) {
+        IpcChannel &channel = *ipcChannel(mapping, task.channel);
+        channel.notified.store(false);
+        // Pairs with the engine's exchange of the flag, data written after this point signals the eventfd again
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        task.records.clear();
+        ipcRingRead(channel, ipcRing(mapping, channels, ringBytes, task.channel), ringBytes, task.records);
+        deliver(task, task.records);
+    }
+
+    void deliver(ClientTask &task, std::string_view records) {
+        while (records.size() >= sizeof(IpcRecordHeader)) {
+            IpcRecordHeader header;
+            std::memcpy(&header, records.data(), sizeof(header));
+            records.remove_prefix(sizeof(header));
+            if (header.size > records.size()) {
+                return;
+            }
+            const std::string_view data = records.substr(0, header.size);
+            records.remove_prefix(header.size);
+
+            if (header.kind == IPC_RECORD_TEXT && task.on_token) {
+                task.on_token(std::string(data));
+            } else if (header.kind == IPC_RECORD_TOKEN_ID && task.on_token_id && data.size() == sizeof(int32_t)) {
+                int32_t token;
+                std::memcpy(&token, data.data(), sizeof(token));
+                task.on_token_id(token);
+            } else if (header.kind == IPC_RECORD_PROBS && task.on_probs && data.size() >= sizeof(TokenLogprob)) {
+                const size_t count = data.size() / sizeof(TokenLogprob);
+                std::memcpy(&task.probs.chosen, data.data(), sizeof(TokenLogprob));
+                task.probs.top.resize(count - 1);
+                std::memcpy(task.probs.top.data(), data.data() + sizeof(TokenLogprob),
+                            (count - 1) * sizeof(TokenLogprob));
+                task.on_probs(task.probs);
+            }
+        }
+    }
+
+    void forwardCancelFlags() {
+        std::lock_guard lock(tasksMutex);
+        if (cancelFlags == 0) {
+            return;
+        }
+        for (auto &[id, task]: tasks) {
+            if (task->cancelled && task->cancelled->load(std::memory_order_relaxed)) {
+                ipcChannel(mapping, task->channel)->cancelled.store(true, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void fail(const std::runtime_error &error) {
+        std::unordered_map<uint64_t, std::unique_ptr<ClientTask> > failed;
+        std::unordered_map<uint64_t, std::promise<std::string> > failedCalls; {
+            std::lock_guard lock(tasksMutex);
+            failed.swap(tasks);
+            failedCalls.swap(calls);
+            cancelFlags = 0;
+        }
+        for (auto &[id, task]: failed) {
+            try {
+                if (task->on_error) {
+                    task->on_error(error.what());
+                }
+            } catch (...) {
+            }
+            task->promise.set_exception(std::make_exception_ptr(error));
+        }
+        for (auto &[id, promise]: failedCalls) {
+            promise.set_exception(std::make_exception_ptr(error));
+        }
+    }
+
+    void release() {
+        if (mapping) {
+            munmap(mapping, mappingSize);
+            mapping = nullptr;
+        }
+        for (int *descriptor: {&fd, &eventFd, &stopFd}) {
+            if (*descriptor >= 0) {
+                ::close(*descriptor);
+                *descriptor = -1;
+            }
+        }
+    }
+
+    int fd = -1;
+    // Signaled by the engine when a ring has data, see IpcChannel::notified
+    int eventFd = -1;
+    // Stops the receiving thread
+    int stopFd = -1;
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+    uint32_t channels = 0;
+    uint32_t ringBytes = 0;
+
+    mutable std::mutex sendMutex;
+    mutable std::atomic<uint64_t> nextId{1};
+
+    std::mutex channelsMutex;
+    std::condition_variable channelsCv;
+    std::vector<uint32_t> freeChannels;
+
+    mutable std::mutex tasksMutex;
+    std::unordered_map<uint64_t, std::unique_ptr<ClientTask> > tasks;
+    mutable std::unordered_map<uint64_t, std::promise<std::string> > calls;
+    // Tasks whose caller passed a cancel flag, the receiving thread polls them
+    size_t cancelFlags = 0;
+
+    std::thread receiver;
+};
+
+SynexisClient::SynexisClient(const std::string &socketPath, int channels, int ringBytes) {
+    impl = new SynexisClientImpl(socketPath, channels, ringBytes);
+}
+
+SynexisClient::~SynexisClient() {
+    delete impl;
+}
+
+std::future<CompletionResult> SynexisClient::addTask(const std::string &prompt, const TaskParams &sampling_params) {
+    TaskParams params = sampling_params;
+    params.prompt = prompt;
+    params.promptOwner.reset();
+    return impl->addTask(std::move(params));
+}
+
+std::future<CompletionResult> SynexisClient::addTask(TaskParams params) {
+    return impl->addTask(std::move(params));
+}
+
+std::future<CompletionResult> SynexisClient::addTask(std::vector<int32_t> tokens, TaskParams params) {
+    params.tokens = std::move(tokens);
+    return impl->addTask(std::move(params));
+}
+
+std::vector<std::future<CompletionResult>> SynexisClient::addTasks(std::vector<TaskParams> params) {
+    std::vector<std::future<CompletionResult>> futures;
+    futures.reserve(params.size());
+    for (auto &task: params) {
+        futures.push_back(impl->addTask(std::move(task)));
+    }
+    return futures;
+}
+
+MetricsSnapshot SynexisClient::metrics() const {
+    const std::string reply = impl->call(IPC_METRICS, std::string());
+    WireReader reader(reply);
+    return ipcReadMetrics(reader);
+}
+
+std::string SynexisClient::modelPath() const {
+    return impl->modelPath;
+}
+
+std::string SynexisClient::getTemplate() const {
+    return impl->chatTemplate;
+}
+
+bool SynexisClient::hasNativeChatTemplate() const {
+    return impl->nativeChatTemplate;
+}
+
+std::string SynexisClient::applyChatTemplate(const std::vector<ChatMessage> &messages,
+                                             bool addGenerationPrompt) const {
+    WireWriter writer;
+    writer.put<uint64_t>(messages.size());
+    for (const auto &message: messages) {
+        writer.putString(message.role);
+        writer.putString(message.content);
+    }
+    writer.put<uint8_t>(addGenerationPrompt);
+    const std::string reply = impl->call(IPC_APPLY_TEMPLATE, writer.out);
+    WireReader reader(reply);
+    return reader.getString();
+}
+
+std::string SynexisClient::mediaMarker() {
+    return Synexis::mediaMarker();
+}
+
+std::string SynexisClient::getToken(std::string str) const {
+    if (str == "BOS") {
+        return impl->bosToken;
+    }
+    if (str == "EOS") {
+        return impl->eosToken;
+    }
+    throw std::invalid_argument("unknown token " + str);
+}
+
+bool SynexisClient::connected() const {
+    return impl->connected;
+}
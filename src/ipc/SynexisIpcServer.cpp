@@ -0,0 +1,519 @@
+#include <synexis/SynexisIpcServer.h>
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <synexis/Synexis.h>
+
+#include "IpcProtocol.h"
+
+#define IPC_LISTEN_ID 0
+#define IPC_WAKE_ID 1
+#define IPC_EPOLL_BATCH 64
+// Messages a client left unread past that are not queued anymore, the client is disconnected instead
+#define IPC_OUTBOX_MAX_BYTES (64 * 1024 * 1024)
+
+namespace {
+    // One connected client process. Engine threads hold it through their tasks, so the ring mapping and the eventfd
+    // stay valid until the last task is done even when the client is gone.
+    struct IpcPeer {
+        IpcPeer(int fd, uint64_t id, int epollFd): fd(fd), id(id), epollFd(epollFd) {
+        }
+
+        ~IpcPeer() {
+            if (eventFd >= 0) {
+                ::close(eventFd);
+            }
+            if (mapping) {
+                munmap(mapping, mappingSize);
+            }
+        }
+
+        // Any thread, never blocks: the engine worker sends from its callbacks and must not wait for a slow client.
+        // What the socket cannot take now is queued and sent by the loop thread once it is writable. A failed send
+        // or a client too far behind shuts the socket down, the loop then sees the hangup and closes it.
+        bool send(IpcMessageType type, uint64_t taskId, std::string payload) {
+            std::lock_guard lock(sendMutex);
+            if (closed || broken) {
+                return false;
+            }
+            if (outbox.empty()) {
+                if (ipcSend(fd, type, taskId, payload)) {
+                    return true;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    disconnect();
+                    return false;
+                }
+                watchWritable(true);
+            }
+            outboxBytes += payload.size();
+            if (outboxBytes > IPC_OUTBOX_MAX_BYTES) {
+                disconnect();
+                return false;
+            }
+            outbox.push_back({type, taskId, std::move(payload)});
+            return true;
+        }
+
+        // Loop thread, once the socket is writable again
+        void flush() {
+            std::lock_guard lock(sendMutex);
+            if (closed || broken) {
+                return;
+            }
+            while (!outbox.empty()) {
+                const Pending &pending = outbox.front();
+                if (!ipcSend(fd, pending.type, pending.taskId, pending.payload)) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        disconnect();
+                    }
+                    return;
+                }
+                outboxBytes -= pending.payload.size();
+                outbox.pop_front();
+            }
+            watchWritable(false);
+        }
+
+        // Engine thread, after writing to the channel's ring
+        void notify(uint32_t channel) {
+            // Pairs with the client clearing the flag before it reads the ring
+            if (!ipcChannel(mapping, channel)->notified.exchange(true)) {
+                const uint64_t one = 1;
+                [[maybe_unused]] const ssize_t written = ::write(eventFd, &one, sizeof(one));
+            }
+        }
+
+        // Loop thread
+        void close(int epollFd) {
+            std::lock_guard lock(sendMutex);
+            if (closed) {
+                return;
+            }
+            closed = true;
+            outbox.clear();
+            // Nobody reads the streams anymore
+            for (uint32_t i = 0; mapping && i < channels; ++i) {
+                ipcChannel(mapping, i)->cancelled.store(true);
+            }
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            ::close(fd);
+        }
+
+        const int fd;
+        const uint64_t id;
+        const int epollFd;
+        // Set once by the handshake on the loop thread, before any task refers to them
+        int eventFd = -1;
+        void *mapping = nullptr;
+        size_t mappingSize = 0;
+        uint32_t channels = 0;
+        uint32_t ringBytes = 0;
+
+        std::mutex sendMutex;
+        bool closed = false;
+
+    private:
+        struct Pending {
+            IpcMessageType type;
+            uint64_t taskId;
+            std::string payload;
+        };
+
+        // With sendMutex held
+        void disconnect() {
+            broken = true;
+            outbox.clear();
+            shutdown(fd, SHUT_RDWR);
+        }
+
+        void watchWritable(bool writable) {
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLRDHUP | (writable ? EPOLLOUT : 0);
+            event.data.u64 = id;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+        }
+
+        // Guarded by sendMutex, in the order the client expects them
+        std::deque<Pending> outbox;
+        size_t outboxBytes = 0;
+        bool broken = false;
+    };
+
+    // Engine side of one submitted task
+    struct IpcTask {
+        std::shared_ptr<IpcPeer> peer;
+        uint64_t id;
+        uint32_t channel;
+        // Once a record went over the socket the following ones do too, so the client reads them in order
+        bool overflowed = false;
+        std::string doneText;
+
+        // Engine worker thread
+        void write(IpcRecordKind kind, const void *data, uint32_t size) {
+            if (!overflowed) {
+                char *ring = ipcRing(peer->mapping, peer->channels, peer->ringBytes, channel);
+                if (ipcRingWrite(*ipcChannel(peer->mapping, channel), ring, peer->ringBytes, kind, data, size)) {
+                    peer->notify(channel);
+                    return;
+                }
+                overflowed = true;
+            }
+            std::string record;
+            record.reserve(sizeof(IpcRecordHeader) + size);
+            const IpcRecordHeader header = {kind, size};
+            record.append(reinterpret_cast<const char *>(&header), sizeof(header));
+            record.append(static_cast<const char *>(data), size);
+            peer->send(IPC_STREAM_OVERFLOW, id, std::move(record));
+        }
+    };
+
+    bool isPowerOfTwo(uint32_t value) {
+        return value != 0 && (value & (value - 1)) == 0;
+    }
+}
+
+class SynexisIpcServerImpl {
+public:
+    SynexisIpcServerImpl(Synexis &engine, std::string socketPath): engine(engine), socketPath(std::move(socketPath)) {
+    }
+
+    ~SynexisIpcServerImpl() {
+        stop();
+    }
+
+    void run() {
+        if (running) {
+            return;
+        }
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("invalid socket path " + socketPath);
+        }
+        std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+        listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) {
+            throw std::runtime_error(std::string("socket failed: ") + std::strerror(errno));
+        }
+        ::unlink(socketPath.c_str());
+        if (bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            listen(listenFd, SOMAXCONN) != 0) {
+            const std::string error = std::strerror(errno);
+            closeFds();
+            throw std::runtime_error("cannot listen on " + socketPath + ": " + error);
+        }
+
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) {
+            closeFds();
+            throw std::runtime_error("cannot set up the IPC event loop");
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = IPC_LISTEN_ID;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+        event.data.u64 = IPC_WAKE_ID;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+
+        running = true;
+        loopThread = std::thread(&SynexisIpcServerImpl::loop, this);
+    }
+
+    void stop() {
+        if (!running.exchange(false)) {
+            return;
+        }
+        const uint64_t one = 1;
+        [[maybe_unused]] const ssize_t written = ::write(wakeFd, &one, sizeof(one));
+        if (loopThread.joinable()) {
+            loopThread.join();
+        }
+        for (auto &[id, peer]: peers) {
+            peer->close(epollFd);
+        }
+        peers.clear();
+        closeFds();
+        ::unlink(socketPath.c_str());
+    }
+
+private:
+    void closeFds() {
+        for (int *fd: {&listenFd, &epollFd, &wakeFd}) {
+            if (*fd >= 0) {
+                ::close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+
+    void loop() {
+        epoll_event events[IPC_EPOLL_BATCH];
+        while (running) {
+            const int n = epoll_wait(epollFd, events, IPC_EPOLL_BATCH, -1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "IPC epoll_wait failed: " << std::strerror(errno) << std::endl;
+                return;
+            }
+            for (int i = 0; i < n; ++i) {
+                const uint64_t id = events[i].data.u64;
+                if (id == IPC_LISTEN_ID) {
+                    accept();
+                } else if (id != IPC_WAKE_ID) {
+                    const auto it = peers.find(id);
+                    if (it != peers.end()) {
+                        const std::shared_ptr<IpcPeer> peer = it->second;
+                        if (events[i].events & EPOLLOUT) {
+                            peer->flush();
+                        }
+                        if ((events[i].events & ~EPOLLOUT) && !receive(peer)) {
+                            peer->close(epollFd);
+                            peers.erase(id);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void accept() {
+        while (true) {
+            // Non-blocking, IpcPeer::send queues what the socket cannot take
+            const int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+
+            const uint64_t id = nextPeerId++;
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLRDHUP;
+            event.data.u64 = id;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                ::close(fd);
+                continue;
+            }
+            peers.emplace(id, std::make_shared<IpcPeer>(fd, id, epollFd));
+        }
+    }
+
+    // Handles every pending message, false when the client is gone or broke the protocol
+    bool receive(const std::shared_ptr<IpcPeer> &peer) {
+        while (true) {
+            IpcMessage message;
+            if (!ipcReceive(peer->fd, message, false)) {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            bool ok;
+            try {
+                ok = handle(peer, message);
+            } catch (const std::exception &e) {
+                std::cerr << "IPC client " << peer->id << ": " << e.what() << std::endl;
+                ok = false;
+            }
+            ipcCloseFds(message.fds);
+            if (!ok) {
+                return false;
+            }
+        }
+    }
+
+    bool handle(const std::shared_ptr<IpcPeer> &peer, IpcMessage &message) {
+        if (message.type == IPC_HELLO) {
+            return handshake(*peer, message);
+        }
+        if (!peer->mapping) {
+            return false;
+        }
+        switch (message.type) {
+            case IPC_SUBMIT:
+                submit(peer, message);
+                return true;
+            case IPC_METRICS: {
+                WireWriter writer;
+                ipcWriteMetrics(writer, engine.metrics());
+                peer->send(IPC_REPLY, message.id, std::move(writer.out));
+                return true;
+            }
+            case IPC_APPLY_TEMPLATE: {
+                WireReader reader(message.payload);
+                std::vector<ChatMessage> messages;
+                const uint64_t count = reader.get<uint64_t>();
+                for (uint64_t i = 0; i < count; ++i) {
+                    ChatMessage chat;
+                    chat.role = reader.getString();
+                    chat.content = reader.getString();
+                    messages.push_back(std::move(chat));
+                }
+                const bool addGenerationPrompt = reader.get<uint8_t>() != 0;
+                try {
+                    WireWriter writer;
+                    writer.putString(engine.applyChatTemplate(messages, addGenerationPrompt));
+                    peer->send(IPC_REPLY, message.id, std::move(writer.out));
+                } catch (const std::exception &e) {
+                    peer->send(IPC_ERROR, message.id, e.what());
+                }
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    bool handshake(IpcPeer &peer, IpcMessage &message) {
+        IpcHello hello{};
+        if (peer.mapping || message.fds.size() != 2 || message.payload.size() != sizeof(hello)) {
+            return false;
+        }
+        std::memcpy(&hello, message.payload.data(), sizeof(hello));
+        if (hello.magic != IPC_MAGIC || hello.version != IPC_VERSION || hello.channels == 0 ||
+            hello.channels > 64 * 1024 || !isPowerOfTwo(hello.ringBytes) || hello.ringBytes < 256 ||
+            hello.ringBytes > 16 * 1024 * 1024) {
+            return false;
+        }
+        const size_t size = ipcMappingSize(hello.channels, hello.ringBytes);
+        struct stat info{};
+        if (!ipcSealedSize(message.fds[0]) || fstat(message.fds[0], &info) != 0 ||
+            static_cast<size_t>(info.st_size) < size) {
+            return false;
+        }
+        void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, message.fds[0], 0);
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+        peer.mapping = mapping;
+        peer.mappingSize = size;
+        peer.channels = hello.channels;
+        peer.ringBytes = hello.ringBytes;
+        // Kept, the mapping does not need its descriptor anymore
+        peer.eventFd = message.fds[1];
+        message.fds.pop_back();
+
+        WireWriter writer;
+        writer.putString(engine.modelPath());
+        writer.putString(engine.getTemplate());
+        writer.put<uint8_t>(engine.hasNativeChatTemplate());
+        writer.putString(engine.getToken("BOS"));
+        writer.putString(engine.getToken("EOS"));
+        return peer.send(IPC_WELCOME, 0, std::move(writer.out));
+    }
+
+    void submit(const std::shared_ptr<IpcPeer> &peer, IpcMessage &message) {
+        WireReader reader(message.payload);
+        const uint32_t channel = reader.get<uint32_t>();
+        if (channel >= peer->channels) {
+            throw std::runtime_error("channel out of range");
+        }
+        TaskParams params;
+        const uint32_t flags = ipcReadTask(reader, params);
+
+        for (int fd: message.fds) {
+            struct stat info{};
+            if (!ipcSealedSize(fd) || fstat(fd, &info) != 0 || info.st_size <= 0) {
+                throw std::runtime_error("unreadable media");
+            }
+            const size_t size = info.st_size;
+            void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                throw std::runtime_error("cannot map media");
+            }
+            std::shared_ptr<void> owner(data, [size](void *pointer) { munmap(pointer, size); });
+            params.addMedia(static_cast<const uint8_t *>(data), size, std::move(owner));
+        }
+
+        // The client reset the channel before submitting. The flag lives in the shared mapping, the client sets it.
+        params.cancelled = std::shared_ptr<std::atomic<bool> >(peer, &ipcChannel(peer->mapping, channel)->cancelled);
+
+        auto task = std::make_shared<IpcTask>();
+        task->peer = peer;
+        task->id = message.id;
+        task->channel = channel;
+        if (flags & IPC_TASK_ON_TOKEN) {
+            params.on_token = [task](const std::string &piece) {
+                task->write(IPC_RECORD_TEXT, piece.data(), static_cast<uint32_t>(piece.size()));
+            };
+        }
+        if (flags & IPC_TASK_ON_TOKEN_ID) {
+            params.on_token_id = [task](int32_t token) {
+                task->write(IPC_RECORD_TOKEN_ID, &token, sizeof(token));
+            };
+        }
+        if (flags & IPC_TASK_ON_PROBS) {
+            params.on_probs = [task](const TokenProbs &probs) {
+                std::vector<TokenLogprob> row;
+                row.reserve(probs.top.size() + 1);
+                row.push_back(probs.chosen);
+                row.insert(row.end(), probs.top.begin(), probs.top.end());
+                task->write(IPC_RECORD_PROBS, row.data(), static_cast<uint32_t>(row.size() * sizeof(TokenLogprob)));
+            };
+        }
+        params.on_done = [task](const std::string &text) {
+            task->doneText = text;
+        };
+        params.on_result = [task](const CompletionResult &result) {
+            WireWriter writer;
+            ipcWriteResult(writer, result);
+            writer.putString(task->doneText);
+            task->peer->send(IPC_RESULT, task->id, std::move(writer.out));
+        };
+        params.on_error = [task](const std::string &error) {
+            task->peer->send(IPC_ERROR, task->id, error);
+        };
+
+        try {
+            engine.addTask(std::move(params));
+        } catch (const std::exception &e) {
+            peer->send(IPC_ERROR, message.id, e.what());
+        }
+    }
+
+    Synexis &engine;
+    const std::string socketPath;
+    int listenFd = -1;
+    int epollFd = -1;
+    int wakeFd = -1;
+    std::atomic<bool> running{false};
+    std::thread loopThread;
+
+    // Loop thread only. Ids 0 and 1 are the listening socket and wakeFd in the epoll set.
+    uint64_t nextPeerId = 2;
+    std::unordered_map<uint64_t, std::shared_ptr<IpcPeer> > peers;
+};
+
+SynexisIpcServer::SynexisIpcServer(Synexis &engine, std::string socketPath) {
+    impl = new SynexisIpcServerImpl(engine, std::move(socketPath));
+}
+
+SynexisIpcServer::~SynexisIpcServer() {
+    delete impl;
+}
+
+void SynexisIpcServer::run() {
+    impl->run();
+}
+
+void SynexisIpcServer::stop() {
+    impl->stop();
+}
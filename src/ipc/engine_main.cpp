@@ -0,0 +1,94 @@
+// Loads a model once and serves it to SynexisClient instances in other processes.
+//
+//   synexis-engine -m model.gguf --socket /tmp/synexis.sock --slots 16
+//
+// Worker processes then connect with SynexisClient("/tmp/synexis.sock"), or SynexisLLM.connect() from Python.
+
+#include <csignal>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+#include <synexis/Synexis.h>
+#include <synexis/SynexisIpcServer.h>
+
+static void printUsage(const char *program) {
+    const SynexisArguments defaults("");
+    std::printf(
+        "usage: %s -m MODEL --socket PATH [options]\n"
+        "\n"
+        "  -m, --model PATH          GGUF model\n"
+        "  --mmproj PATH             multimodal projector\n"
+        "  --socket PATH             Unix socket the clients connect to\n"
+        "  --slots N                 concurrent sequences shared by every client (%d)\n"
+        "  --ctx N                   context size shared by the slots (%d)\n"
+        "  --batch N                 logical batch size (%d)\n"
+        "  --threads N               CPU threads (%d)\n"
+        "  --gpu-layers N            layers offloaded to the GPU (%d)\n"
+        "  --media-encoders N        images or audio clips encoded in parallel (%d)\n",
+        program, defaults.n_slots, defaults.n_ctx, defaults.n_batch, defaults.numberOfThreads,
+        defaults.numberOfGpuLayers, defaults.mediaEncoders);
+}
+
+int main(int argc, char **argv) {
+    SynexisArguments args("");
+    std::string socketPath;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    throw std::invalid_argument("missing value for " + arg);
+                }
+                return argv[++i];
+            };
+            if (arg == "-h" || arg == "--help") {
+                printUsage(argv[0]);
+                return 0;
+            } else if (arg == "-m" || arg == "--model") args.modelPath = value();
+            else if (arg == "--mmproj") args.modelProjectorPath = value();
+            else if (arg == "--socket") socketPath = value();
+            else if (arg == "--slots") args.n_slots = std::stoi(value());
+            else if (arg == "--ctx") args.n_ctx = std::stoi(value());
+            else if (arg == "--batch") args.n_batch = std::stoi(value());
+            else if (arg == "--threads") args.numberOfThreads = std::stoi(value());
+            else if (arg == "--gpu-layers") args.numberOfGpuLayers = std::stoi(value());
+            else if (arg == "--media-encoders") args.mediaEncoders = std::stoi(value());
+            else {
+                throw std::invalid_argument("unknown argument " + arg);
+            }
+        }
+        if (args.modelPath.empty() || socketPath.empty()) {
+            throw std::invalid_argument("a model (-m) and a socket path (--socket) are required");
+        }
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // Delivered to sigwait() below instead of a handler, every thread started from here inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    try {
+        Synexis engine(args);
+        engine.run();
+        SynexisIpcServer server(engine, socketPath);
+        server.run();
+        std::fprintf(stderr, "Serving %s on %s\n", args.modelPath.c_str(), socketPath.c_str());
+
+        int signal;
+        sigwait(&signals, &signal);
+
+        server.stop();
+        engine.stop();
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+
+// Wakes an event loop up when tasks it waits on make progress, without a thread per task.
+// The engine thread queues the id of the task and signals a file descriptor the event loop watches; the loop then
+// drains every ready id at once. The descriptor is signaled once per drain, however many tasks became ready.
+// Not available on Windows, where fileno() returns -1.
+class AsyncDispatcher {
+public:
+    AsyncDispatcher() {
+#if defined(__linux__)
+        read_fd = write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (read_fd < 0) {
+            throw std::runtime_error("Failed to create the eventfd");
+        }
+#elif !defined(_WIN32)
+        int fds[2];
+        if (pipe(fds) != 0) {
+            throw std::runtime_error("Failed to create the pipe");
+        }
+        for (int fd: fds) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        read_fd = fds[0];
+        write_fd = fds[1];
+#endif
+    }
+
+    AsyncDispatcher(const AsyncDispatcher &) = delete;
+
+    AsyncDispatcher &operator=(const AsyncDispatcher &) = delete;
+
+    ~AsyncDispatcher() {
+#ifndef _WIN32
+        if (read_fd >= 0) {
+            close(read_fd);
+        }
+        if (write_fd >= 0 && write_fd != read_fd) {
+            close(write_fd);
+        }
+#endif
+    }
+
+    int fileno() const {
+        return read_fd;
+    }
+
+    // Any thread. Queues `id` and signals the descriptor if nothing was pending.
+    void notify(uint64_t id) {
+        bool was_empty; {
+            std::lock_guard lock(mutex);
+            was_empty = ready.empty();
+            ready.push_back(id);
+        }
+        // A signal raced by a drain only causes an empty wakeup, never a lost one
+        if (was_empty) {
+            signal();
+        }
+    }
+
+    // Event loop thread. Clears the descriptor and returns every id queued since the last call.
+    std::vector<uint64_t> drain() {
+        clear();
+        std::vector<uint64_t> ids; {
+            std::lock_guard lock(mutex);
+            ids.swap(ready);
+        }
+        return ids;
+    }
+
+private:
+    void signal() const {
+#if defined(__linux__)
+        const uint64_t one = 1;
+        [[maybe_unused]] auto n = write(write_fd, &one, sizeof(one));
+#elif !defined(_WIN32)
+        const char byte = 0;
+        [[maybe_unused]] auto n = write(write_fd, &byte, 1);
+#endif
+    }
+
+    void clear() const {
+#if defined(__linux__)
+        uint64_t value;
+        [[maybe_unused]] auto n = read(read_fd, &value, sizeof(value));
+#elif !defined(_WIN32)
+        char buffer[64];
+        while (read(read_fd, buffer, sizeof(buffer)) > 0) {
+        }
+#endif
+    }
+
+    int read_fd = -1;
+    int write_fd = -1;
+    std::mutex mutex;
+    std::vector<uint64_t> ready;
+};
+
+// Outcome of a non-streaming task awaited from an event loop
+class AsyncResult {
+public:
+    void set_value(const std::string &value) {
+        text = value;
+        done.store(true, std::memory_order_release);
+    }
+
+    void set_error(const std::string &message) {
+        error = message;
+        failed = true;
+        done.store(true, std::memory_order_release);
+    }
+
+    bool ready() const {
+        return done.load(std::memory_order_acquire);
+    }
+
+    // Event loop thread, after the dispatcher reported the task
+    const std::string &get() const {
+        if (!ready()) {
+            throw std::runtime_error("The task is not finished");
+        }
+        if (failed) {
+            throw std::runtime_error(error);
+        }
+        return text;
+    }
+
+private:
+    std::string text;
+    std::string error;
+    bool failed = false;
+    std::atomic<bool> done{false};
+};
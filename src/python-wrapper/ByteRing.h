@@ -0,0 +1,60 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <string>
+
+// Single-producer/single-consumer byte queue over a fixed power-of-two buffer.
+// The producer publishes whole writes, so the consumer never sees half of a pushed piece.
+class ByteRing {
+public:
+    explicit ByteRing(size_t capacity) {
+        size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        buffer = std::make_unique<char[]>(size);
+    }
+
+    // Producer side. Writes all the bytes or nothing when there is not enough room.
+    bool write(const char *data, size_t n) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        const size_t t = tail.load(std::memory_order_acquire);
+        if (size - (h - t) < n) {
+            return false;
+        }
+        const size_t offset = h & (size - 1);
+        const size_t first = std::min(n, size - offset);
+        std::memcpy(buffer.get() + offset, data, first);
+        std::memcpy(buffer.get(), data + first, n - first);
+        head.store(h + n, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Appends every readable byte to `out` and returns how many were read.
+    size_t read(std::string &out) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        const size_t h = head.load(std::memory_order_acquire);
+        const size_t n = h - t;
+        if (n == 0) {
+            return 0;
+        }
+        const size_t offset = t & (size - 1);
+        const size_t first = std::min(n, size - offset);
+        out.append(buffer.get() + offset, first);
+        out.append(buffer.get(), n - first);
+        tail.store(h, std::memory_order_release);
+        return n;
+    }
+
+    size_t readable() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+private:
+    std::unique_ptr<char[]> buffer;
+    size_t size;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
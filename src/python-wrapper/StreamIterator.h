@@ -1,100 +1,266 @@
 #pragma once
 #include <pybind11/pybind11.h>
+#include <synexis/TaskParams.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include "ByteRing.h"
+#include "numpy_helper.h"
 namespace py = pybind11;
 
+#define STREAM_RING_SIZE (64 * 1024)
+#define STREAM_FLUSH_BYTES 256
+#define STREAM_FLUSH_INTERVAL_US 2000
+
 // This class will be exposed to Python as an iterator for streaming results.
+// The engine thread pushes pieces into a lock-free ring; next() returns everything available at once,
+// after giving the producer a short window to coalesce more bytes.
 class StreamIterator {
 public:
-    StreamIterator() = default;
+    explicit StreamIterator(size_t flush_bytes = STREAM_FLUSH_BYTES,
+                            int64_t flush_interval_us = STREAM_FLUSH_INTERVAL_US): ring(STREAM_RING_SIZE),
+        flush_bytes(flush_bytes),
+        flush_interval(flush_interval_us) {
+    }
 
     ~StreamIterator() = default;
 
-    bool is_valid_utf8(const std::string& str) {
-        int c, i, ix, n;
-        for (ix = 0, n = str.length(); ix < n; ix++) {
-            c = (unsigned char) str[ix];
-            if (c <= 0x7F) continue;
-            else if ((c & 0xE0) == 0xC0) i = 1;
-            else if ((c & 0xF0) == 0xE0) i = 2;
-            else if ((c & 0xF8) == 0xF0) i = 3;
-            else return false;
-
-            if (ix + i >= n) return false;
-            while (i--) {
-                if ((++ix >= n) || ((str[ix] & 0xC0) != 0x80)) return false;
-            }
-        }
-        return true;
+    // Every generated token adds one row of `n_probs + 1` log-probabilities, the chosen token first
+    void enable_probs(int n_probs) {
+        probs_stride = n_probs + 1;
     }
 
-    std::string next() {
-        std::unique_lock<std::mutex> lock(q_mutex);
+    // Items become NumPy int32 arrays of token ids instead of text, see push_token()
+    void enable_token_ids() {
+        token_ids = true;
+    }
+
+    // Replaces the condition variable wakeups: `fn` runs on the engine thread when data arrives or the stream ends,
+    // once until the next poll()
+    void set_notify(std::function<void()> fn) {
+        notify = std::move(fn);
+    }
 
-        {
+    py::object next() {
+        std::string chunk;
+        std::vector<int32_t> tokens;
+        std::vector<float> values;
+        bool has_chunk; {
             py::gil_scoped_release release;
-            cv.wait(lock, [this] { return !queue.empty() || finished || error_occurred; });
+            has_chunk = collect(chunk, tokens, values);
         }
 
-        if (error_occurred) {
+        if (error_occurred.load()) {
             throw std::runtime_error("Stream error occurred");
         }
-
-        if (queue.empty() && finished) {
+        if (!has_chunk) {
             throw py::stop_iteration();
         }
+        return make_item(chunk, std::move(tokens), std::move(values));
+    }
 
-        utf8_buffer += std::move(queue.front());
-        queue.pop();
-
-        while (!is_valid_utf8(utf8_buffer)) {
-            if (queue.empty()) {
-                if (finished) {
-                    throw py::stop_iteration();
-                }
+    // Non-blocking next(): returns None when nothing was generated since the last call
+    py::object poll() {
+        notified.store(false);
+        // Pairs with the producer's fence, so data published after this point triggers a new notification
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const bool was_closed = closed();
+        std::string chunk;
+        std::vector<int32_t> tokens;
+        std::vector<float> values;
+        drain(chunk, tokens, values);
 
-                // Wait for more data
-                cv.wait(lock, [this] { return !queue.empty() || finished || error_occurred; });
-                if (error_occurred) throw std::runtime_error("Stream error occurred");
-                if (queue.empty()) continue;
+        if (error_occurred.load()) {
+            throw std::runtime_error("Stream error occurred");
+        }
+        if (chunk.empty() && tokens.empty()) {
+            if (was_closed) {
+                throw py::stop_iteration();
             }
+            return py::none();
+        }
+        return make_item(chunk, std::move(tokens), std::move(values));
+    }
+
+    // Engine thread only. The core only hands over complete code points.
+    void push(const std::string &piece) {
+        if (finished.load(std::memory_order_acquire)) return; // Don't push after finishing
+        write(piece);
+        wake(false);
+    }
 
-            utf8_buffer += std::move(queue.front());
-            queue.pop();
+    // Engine thread only, in token id mode
+    void push_token(int32_t token) {
+        if (finished.load(std::memory_order_acquire)) return;
+        write(std::string_view(reinterpret_cast<const char *>(&token), sizeof(token)));
+        wake(false);
+    }
+
+    // Engine thread only. The row is reported with the chunk that is being collected, its text may come later.
+    void push_probs(const TokenProbs &probs) {
+        std::lock_guard lock(probs_mutex);
+        prob_tokens.push_back(probs.chosen.token);
+        prob_values.push_back(probs.chosen.logprob);
+        for (const auto &[token, logprob]: probs.top) {
+            prob_tokens.push_back(token);
+            prob_values.push_back(logprob);
         }
+    }
 
-        std::string complete_token = std::move(utf8_buffer);
-        utf8_buffer.clear();
-        return complete_token;
+    void end() {
+        finished.store(true, std::memory_order_release);
+        wake(true);
     }
 
+    void set_error() {
+        error_occurred.store(true, std::memory_order_release);
+        wake(true);
+    }
 
-    void push(const std::string &token) { {
-            std::lock_guard lock(q_mutex);
-            if (finished) return; // Don't push after finishing
-            queue.push(token);
+private:
+    py::object make_item(const std::string &chunk, std::vector<int32_t> &&tokens, std::vector<float> &&values) const {
+        py::object text;
+        if (token_ids) {
+            // The ring holds whole ids, written as raw int32 values
+            std::vector<int32_t> ids(chunk.size() / sizeof(int32_t));
+            std::memcpy(ids.data(), chunk.data(), ids.size() * sizeof(int32_t));
+            const auto n_ids = static_cast<py::ssize_t>(ids.size());
+            text = vector_to_numpy(std::move(ids), {n_ids});
+        } else {
+            text = py::reinterpret_steal<py::str>(PyUnicode_DecodeUTF8(chunk.data(), chunk.size(), "replace"));
+        }
+        if (probs_stride == 0) {
+            return text;
         }
-        cv.notify_one();
+        std::vector<py::ssize_t> shape = {
+            static_cast<py::ssize_t>(tokens.size() / probs_stride), static_cast<py::ssize_t>(probs_stride)
+        };
+        return py::make_tuple(text, py::make_tuple(vector_to_numpy(std::move(tokens), shape),
+                                                   vector_to_numpy(std::move(values), shape)));
     }
 
-    void end() { {
-            std::lock_guard lock(q_mutex);
-            finished = true;
+    enum ConsumerState {
+        CONSUMER_RUNNING,
+        CONSUMER_WAITING_DATA,
+        CONSUMER_WAITING_FLUSH,
+    };
+
+    void write(std::string_view piece) {
+        // Once something went to the overflow buffer, keep using it until the consumer drained it, to keep the order
+        if (overflowing.load(std::memory_order_acquire) || !ring.write(piece.data(), piece.size())) {
+            std::lock_guard lock(overflow_mutex);
+            overflow += piece;
+            overflowing.store(true, std::memory_order_release);
         }
-        cv.notify_one();
     }
 
-    void set_error() { {
-            std::lock_guard lock(q_mutex);
-            error_occurred = true;
+    // Only takes the wait mutex when the consumer sleeps and has a reason to wake up
+    void wake(bool force) {
+        // Pairs with the consumer publishing its state before checking for data, so one of them sees the other
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (notify) {
+            if (!notified.exchange(true)) {
+                notify();
+            }
+            return;
+        }
+        const int state = consumer_state.load();
+        if (state == CONSUMER_RUNNING) {
+            return;
+        }
+        if (force || state == CONSUMER_WAITING_DATA || overflowing.load() || ring.readable() >= flush_bytes) {
+            std::lock_guard lock(wait_mutex);
+            cv.notify_one();
         }
-        cv.notify_one();
     }
 
-private:
-    std::string utf8_buffer;
-    std::queue<std::string> queue;
-    std::mutex q_mutex;
+    bool has_data() const {
+        return ring.readable() > 0 || overflowing.load(std::memory_order_acquire);
+    }
+
+    bool closed() const {
+        return finished.load(std::memory_order_acquire) || error_occurred.load(std::memory_order_acquire);
+    }
+
+    void drain(std::string &chunk, std::vector<int32_t> &tokens, std::vector<float> &values) {
+        std::unique_lock<std::mutex> probs_lock(probs_mutex, std::defer_lock);
+        if (probs_stride != 0) {
+            probs_lock.lock();
+        }
+        ring.read(chunk);
+        if (overflowing.load(std::memory_order_acquire)) {
+            std::lock_guard lock(overflow_mutex);
+            chunk += overflow;
+            overflow.clear();
+            overflowing.store(false, std::memory_order_release);
+        }
+        if (probs_stride != 0) {
+            tokens.insert(tokens.end(), prob_tokens.begin(), prob_tokens.end());
+            values.insert(values.end(), prob_values.begin(), prob_values.end());
+            prob_tokens.clear();
+            prob_values.clear();
+        }
+    }
+
+    // Waits for data and returns everything available. False once the stream is over.
+    bool collect(std::string &chunk, std::vector<int32_t> &tokens, std::vector<float> &values) {
+        while (true) {
+            if (!has_data()) {
+                if (closed()) {
+                    // The last pieces are written before the stream is closed
+                    if (has_data()) continue;
+                    // Rows of tokens that produced no text are still reported
+                    if (probs_stride != 0) {
+                        drain(chunk, tokens, values);
+                    }
+                    return !chunk.empty() || !tokens.empty();
+                }
+                consumer_state.store(CONSUMER_WAITING_DATA); {
+                    std::unique_lock<std::mutex> lock(wait_mutex);
+                    cv.wait(lock, [this] { return has_data() || closed(); });
+                }
+                consumer_state.store(CONSUMER_RUNNING);
+                continue;
+            }
+
+            // Give the producer a short window to coalesce more bytes into this chunk
+            if (!closed() && ring.readable() < flush_bytes && !overflowing.load()) {
+                consumer_state.store(CONSUMER_WAITING_FLUSH); {
+                    std::unique_lock<std::mutex> lock(wait_mutex);
+                    cv.wait_for(lock, flush_interval, [this] {
+                        return ring.readable() >= flush_bytes || overflowing.load() || closed();
+                    });
+                }
+                consumer_state.store(CONSUMER_RUNNING);
+            }
+
+            drain(chunk, tokens, values);
+            return true;
+        }
+    }
+
+    ByteRing ring;
+    const size_t flush_bytes;
+    const std::chrono::microseconds flush_interval;
+
+    std::mutex overflow_mutex;
+    std::string overflow;
+    std::atomic<bool> overflowing{false};
+
+    std::atomic<int> consumer_state{CONSUMER_RUNNING};
+    std::function<void()> notify;
+    std::atomic<bool> notified{false};
+    std::mutex wait_mutex;
     std::condition_variable cv;
-    bool finished = false;
-    bool error_occurred = false;
+
+    size_t probs_stride = 0;
+    bool token_ids = false;
+    std::mutex probs_mutex;
+    std::vector<int32_t> prob_tokens;
+    std::vector<float> prob_values;
+
+    std::atomic<bool> finished{false};
+    std::atomic<bool> error_occurred{false};
 };
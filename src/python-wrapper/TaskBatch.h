@@ -0,0 +1,101 @@
+#pragma once
+#include <pybind11/pybind11.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+namespace py = pybind11;
+
+// Handle over the tasks queued by one submit_many() call.
+// The engine thread records every outcome as it happens, so results can be collected in submission order with
+// wait_all() or in completion order with as_completed().
+class TaskBatch {
+public:
+    explicit TaskBatch(size_t size): results(size), errors(size), finished(size, false) {
+    }
+
+    // Engine thread
+    void set_value(size_t index, const std::string &text) {
+        complete(index, text, std::nullopt);
+    }
+
+    // Engine thread
+    void set_error(size_t index, const std::string &message) {
+        complete(index, std::string(), message);
+    }
+
+    size_t size() const {
+        return results.size();
+    }
+
+    size_t done() {
+        std::lock_guard lock(mutex);
+        return n_done;
+    }
+
+    // Waits for every task and returns the texts in submission order. Raises the first error.
+    std::vector<std::string> wait_all() {
+        {
+            py::gil_scoped_release release;
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [this] { return n_done == results.size(); });
+        }
+        for (size_t i = 0; i < errors.size(); ++i) {
+            if (errors[i]) {
+                throw std::runtime_error("Task " + std::to_string(i) + " failed: " + *errors[i]);
+            }
+        }
+        return results;
+    }
+
+    // Returns (index, text) for the next task to finish, in completion order. Failed tasks raise when reached.
+    py::tuple next_completed() {
+        size_t index; {
+            py::gil_scoped_release release;
+            std::unique_lock lock(mutex);
+            if (n_yielded == results.size()) {
+                index = results.size();
+            } else {
+                cv.wait(lock, [this] { return !completed.empty(); });
+                index = completed.front();
+                completed.pop_front();
+                n_yielded++;
+            }
+        }
+        if (index == results.size()) {
+            throw py::stop_iteration();
+        }
+        if (errors[index]) {
+            throw std::runtime_error("Task " + std::to_string(index) + " failed: " + *errors[index]);
+        }
+        return py::make_tuple(index, py::str(results[index]));
+    }
+
+private:
+    void complete(size_t index, const std::string &text, std::optional<std::string> error) {
+        {
+            std::lock_guard lock(mutex);
+            // Only the first outcome of a task counts
+            if (finished[index]) {
+                return;
+            }
+            finished[index] = true;
+            results[index] = text;
+            errors[index] = std::move(error);
+            completed.push_back(index);
+            n_done++;
+        }
+        cv.notify_all();
+    }
+
+    std::vector<std::string> results;
+    std::vector<std::optional<std::string>> errors;
+    std::vector<bool> finished;
+    std::deque<size_t> completed;
+    size_t n_done = 0;
+    size_t n_yielded = 0;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
@@ -0,0 +1,14 @@
+#pragma once
+#include <vector>
+#include <pybind11/numpy.h>
+namespace py = pybind11;
+
+// Hands the vector's storage over to a NumPy array without copying it.
+template<typename T>
+py::array_t<T> vector_to_numpy(std::vector<T> &&vec, std::vector<py::ssize_t> shape) {
+    auto *owned = new std::vector<T>(std::move(vec));
+    py::capsule owner(owned, [](void *ptr) {
+        delete static_cast<std::vector<T> *>(ptr);
+    });
+    return py::array_t<T>(shape, owned->data(), owner);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <memory>
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+// Runs `release(arg)` with the GIL held from any thread. An engine thread never waits for the GIL: the call is
+// queued for the interpreter, which runs it at its next check.
+inline void release_with_gil(int (*release)(void *), void *arg) {
+    if (!Py_IsInitialized()) {
+        return;
+    }
+    if (PyGILState_Check()) {
+        release(arg);
+        return;
+    }
+    if (Py_AddPendingCall(release, arg) != 0) {
+        // The pending calls queue is full
+        py::gil_scoped_acquire acquire;
+        release(arg);
+    }
+}
+
+// Keeps a Python object alive as long as the returned owner, which may be dropped without the GIL
+inline std::shared_ptr<const void> pin_object(py::handle object) {
+    object.inc_ref();
+    return std::shared_ptr<const void>(object.ptr(), [](const void *ptr) {
+        release_with_gil([](void *arg) {
+            Py_DECREF(static_cast<PyObject *>(arg));
+            return 0;
+        }, const_cast<void *>(ptr));
+    });
+}
+
+// Exports the bytes of any object supporting the buffer protocol (bytes, bytearray, memoryview, NumPy arrays...)
+// without copying them. The exporter stays locked as long as the returned owner lives.
+inline std::shared_ptr<const void> pin_buffer(py::handle object, const uint8_t *&data, size_t &size) {
+    auto *view = new Py_buffer();
+    if (PyObject_GetBuffer(object.ptr(), view, PyBUF_C_CONTIGUOUS) != 0) {
+        delete view;
+        throw py::error_already_set();
+    }
+    data = static_cast<const uint8_t *>(view->buf);
+    size = static_cast<size_t>(view->len);
+    return std::shared_ptr<const void>(view, [](const void *ptr) {
+        release_with_gil([](void *arg) {
+            auto *buffer = static_cast<Py_buffer *>(arg);
+            PyBuffer_Release(buffer);
+            delete buffer;
+            return 0;
+        }, const_cast<void *>(ptr));
+    });
+}
+
+// Borrows the UTF-8 representation of a str, which CPython caches in the object itself
+inline std::shared_ptr<const void> pin_str(const py::str &text, std::string_view &view) {
+    Py_ssize_t size = 0;
+    const char *data = PyUnicode_AsUTF8AndSize(text.ptr(), &size);
+    if (data == nullptr) {
+        throw py::error_already_set();
+    }
+    view = std::string_view(data, static_cast<size_t>(size));
+    return pin_object(text);
+}
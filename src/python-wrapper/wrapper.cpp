@@ -7,45 +7,177 @@
 #include <memory>
 
 #include <synexis/Synexis.h>
+#include <synexis/SynexisRouter.h>
+#ifdef SYNEXIS_IPC
+#include <synexis/SynexisClient.h>
+#include <synexis/SynexisIpcServer.h>
+#endif
 #include <synexis/TaskParams.h>
 #include <synexis/sampler/StructParams.h>
+#include "AsyncDispatcher.h"
 #include "StreamIterator.h"
+#include "TaskBatch.h"
+#include "pin_helper.h"
 #include <pybind11/numpy.h>
 
 namespace py = pybind11;
 
-std::shared_ptr<StreamIterator> stream_task(Synexis &self, TaskParams &params) {
-    auto iterator = std::make_shared<StreamIterator>();
+// The helpers take the engine as a template parameter: a Synexis or a SynexisRouter in this process, or a
+// SynexisClient to another one
+template<typename Engine>
+void start_stream(Engine &self, TaskParams &&params, bool logprobs, const std::shared_ptr<StreamIterator> &iterator,
+                  bool token_ids = false) {
     params.stream = true;
-    params.on_token = [iterator](const std::string &token) {
-        iterator->push(token);
-    };
+    params.emitText = !token_ids;
+    params.on_token = nullptr;
+    params.on_token_id = nullptr;
+    if (token_ids) {
+        iterator->enable_token_ids();
+        params.on_token_id = [iterator](int32_t token) {
+            iterator->push_token(token);
+        };
+    } else {
+        params.on_token = [iterator](const std::string &token) {
+            iterator->push(token);
+        };
+    }
+    params.on_probs = nullptr;
+    if (logprobs) {
+        iterator->enable_probs(std::max(params.samplerParams.n_probs, 0));
+        params.on_probs = [iterator](const TokenProbs &probs) {
+            iterator->push_probs(probs);
+        };
+    }
 
     params.on_done = [iterator](const std::string &text) {
         iterator->end();
     };
-    params.on_error = [](const std::string &error) {
-        py::gil_scoped_acquire acquire;
-        throw py::value_error(error);
-    };
 
     try {
         py::gil_scoped_release release;
-        std::future<std::string> future = self.addTask(params.prompt, params);
+        auto future = self.addTask(std::move(params));
     } catch (const std::exception &e) {
         iterator->set_error();
         std::cerr << "Error while adding the task: " << e.what() << std::endl;
     }
+}
+
+template<typename Engine>
+std::shared_ptr<StreamIterator> stream_task(Engine &self, TaskParams params, bool logprobs, size_t flush_bytes,
+                                            double flush_interval_ms) {
+    auto iterator = std::make_shared<StreamIterator>(flush_bytes, static_cast<int64_t>(flush_interval_ms * 1000));
+    // Runs on an engine thread: an exception there would terminate the process
+    params.on_error = [iterator](const std::string &error) {
+        iterator->set_error();
+    };
+    start_stream(self, std::move(params), logprobs, iterator);
+    return iterator;
+}
 
+template<typename Engine>
+std::shared_ptr<StreamIterator> stream_tokens(Engine &self, TaskParams params, bool logprobs, size_t flush_tokens,
+                                              double flush_interval_ms) {
+    auto iterator = std::make_shared<StreamIterator>(flush_tokens * sizeof(int32_t),
+                                                     static_cast<int64_t>(flush_interval_ms * 1000));
+    params.on_error = [iterator](const std::string &error) {
+        iterator->set_error();
+    };
+    start_stream(self, std::move(params), logprobs, iterator, true);
     return iterator;
 }
 
-std::string get_template(Synexis &self) {
+// The iterator is read with poll() once the dispatcher reports `id`
+template<typename Engine>
+std::shared_ptr<StreamIterator> stream_task_async(Engine &self, TaskParams params, bool logprobs,
+                                                  std::shared_ptr<AsyncDispatcher> dispatcher, uint64_t id) {
+    auto iterator = std::make_shared<StreamIterator>();
+    iterator->set_notify([dispatcher, id] {
+        dispatcher->notify(id);
+    });
+    params.on_error = [iterator](const std::string &error) {
+        iterator->set_error();
+    };
+    start_stream(self, std::move(params), logprobs, iterator);
+    return iterator;
+}
+
+template<typename Engine>
+std::shared_ptr<AsyncResult> complete_async(Engine &self, TaskParams params,
+                                            std::shared_ptr<AsyncDispatcher> dispatcher, uint64_t id) {
+    auto result = std::make_shared<AsyncResult>();
+    params.stream = false;
+    params.on_token = nullptr;
+    params.on_probs = nullptr;
+    params.on_done = [result, dispatcher, id](const std::string &text) {
+        result->set_value(text);
+        dispatcher->notify(id);
+    };
+    params.on_error = [result, dispatcher, id](const std::string &error) {
+        result->set_error(error);
+        dispatcher->notify(id);
+    };
+    py::gil_scoped_release release;
+    auto future = self.addTask(std::move(params));
+    return result;
+}
+
+template<typename Engine>
+std::shared_ptr<TaskBatch> submit_many(Engine &self, std::vector<TaskParams> tasks) {
+    auto batch = std::make_shared<TaskBatch>(tasks.size());
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        auto &params = tasks[i];
+        params.stream = false;
+        params.on_token = nullptr;
+        params.on_probs = nullptr;
+        params.on_done = [batch, i](const std::string &text) {
+            batch->set_value(i, text);
+        };
+        params.on_error = [batch, i](const std::string &error) {
+            batch->set_error(i, error);
+        };
+    }
+    py::gil_scoped_release release;
+    self.addTasks(std::move(tasks));
+    return batch;
+}
+
+template<typename Engine>
+std::string get_template(Engine &self) {
     return self.getTemplate();
 }
 
+template<typename Engine>
+CompletionResult complete_task(Engine &self, TaskParams params) {
+    params.stream = false;
+    params.on_token = nullptr;
+    params.on_probs = nullptr;
+    py::gil_scoped_release release;
+    auto future = self.addTask(std::move(params));
+    return future.get();
+}
+
+template<typename Engine>
+std::string apply_chat_template(const Engine &self, const py::iterable &messages, bool add_generation_prompt) {
+    std::vector<ChatMessage> chat;
+    for (const auto &message: messages) {
+        auto pair = message.cast<std::pair<std::string, std::string> >();
+        chat.push_back({std::move(pair.first), std::move(pair.second)});
+    }
+    py::gil_scoped_release release;
+    return self.applyChatTemplate(chat, add_generation_prompt);
+}
+
+template<typename Engine>
+py::dict get_tokens(const Engine &self) {
+    py::dict d;
+    d["bos_token"] = self.getToken("BOS");
+    d["eos_token"] = self.getToken("EOS");
+    return d;
+}
+
 PYBIND11_MODULE(synexis_python, m) {
     m.doc() = "Python bindings for the Synexis C++ library";
+    m.attr("MEDIA_MARKER") = Synexis::mediaMarker();
     py::class_<SynexisArguments>(m, "SynexisArguments")
             .def(py::init<std::string>(), py::arg("model_path"))
             .def_readwrite("model_path", &SynexisArguments::modelPath)
@@ -53,16 +185,41 @@ PYBIND11_MODULE(synexis_python, m) {
             .def_readwrite("number_of_gpu_layers", &SynexisArguments::numberOfGpuLayers)
             .def_readwrite("number_of_threads", &SynexisArguments::numberOfThreads)
             .def_readwrite("use_mmap", &SynexisArguments::use_mmap)
+            .def_readwrite("cpus", &SynexisArguments::cpus)
             .def_readwrite("n_ctx", &SynexisArguments::n_ctx)
             .def_readwrite("n_batch", &SynexisArguments::n_batch)
             .def_readwrite("n_keep", &SynexisArguments::n_keep)
             .def_readwrite("n_discard", &SynexisArguments::n_discard)
             .def_readwrite("embedding", &SynexisArguments::embedding)
-            .def_readwrite("n_slots", &SynexisArguments::n_slots);
+            .def_readwrite("n_slots", &SynexisArguments::n_slots)
+            .def_readwrite("media_encoders", &SynexisArguments::mediaEncoders)
+            .def_readwrite("trace_capacity", &SynexisArguments::traceCapacity)
+            .def_readwrite("trace_path", &SynexisArguments::tracePath);
 
     py::class_<StreamIterator, std::shared_ptr<StreamIterator> >(m, "StreamIterator")
             .def("__iter__", [](std::shared_ptr<StreamIterator> it) -> std::shared_ptr<StreamIterator> { return it; })
-            .def("__next__", &StreamIterator::next); {
+            .def("__next__", &StreamIterator::next)
+            .def("poll", &StreamIterator::poll,
+                 "Non-blocking __next__ for streams started with stream_async: returns None when nothing is ready.");
+
+    py::class_<AsyncDispatcher, std::shared_ptr<AsyncDispatcher> >(m, "AsyncDispatcher")
+            .def(py::init<>())
+            .def("fileno", &AsyncDispatcher::fileno,
+                 "Descriptor that becomes readable when a task made progress, -1 when not supported.")
+            .def("drain", &AsyncDispatcher::drain, "Returns the ids of every task that made progress since the last call.");
+
+    py::class_<TaskBatch, std::shared_ptr<TaskBatch> >(m, "TaskBatch")
+            .def("__len__", &TaskBatch::size)
+            .def("done", &TaskBatch::done, "Number of tasks that finished so far.")
+            .def("wait_all", &TaskBatch::wait_all, "Waits for every task and returns the texts in submission order.")
+            .def("as_completed", [](std::shared_ptr<TaskBatch> batch) { return batch; },
+                 "Iterates over (index, text) pairs in completion order.")
+            .def("__iter__", [](std::shared_ptr<TaskBatch> batch) { return batch; })
+            .def("__next__", &TaskBatch::next_completed);
+
+    py::class_<AsyncResult, std::shared_ptr<AsyncResult> >(m, "AsyncResult")
+            .def("ready", &AsyncResult::ready)
+            .def("get", &AsyncResult::get, "Returns the generated text, or raises if the task failed."); {
         SamplingParams defaults{};
 
         py::class_<SamplingParams>(m, "SamplingParams")
@@ -75,22 +232,113 @@ PYBIND11_MODULE(synexis_python, m) {
                 .def_readwrite("temp", &SamplingParams::temp)
                 .def_readwrite("top_k", &SamplingParams::top_k)
                 .def_readwrite("top_p", &SamplingParams::top_p)
-                .def_readwrite("min_p", &SamplingParams::min_p);
+                .def_readwrite("min_p", &SamplingParams::min_p)
+                .def_readwrite("n_probs", &SamplingParams::n_probs)
+                .def_readwrite("logit_bias", &SamplingParams::logit_bias)
+                .def_readwrite("banned_tokens", &SamplingParams::banned_tokens)
+                .def_readwrite("timing_per_token", &SamplingParams::timing_per_token);
     }
+    // The prompt and media are borrowed from the Python objects, which stay pinned until the engine is done with them
     py::class_<TaskParams>(m, "TaskParams")
             .def(py::init<>())
-            .def(py::init<std::string, SamplingParams, int, std::vector<std::string> >(),
+            .def(py::init([](const py::str &prompt, SamplingParams sampling_params, int maximum_tokens,
+                             std::vector<std::string> stop_tokens) {
+                     TaskParams params({}, std::move(sampling_params), maximum_tokens, std::move(stop_tokens));
+                     std::string_view view;
+                     auto owner = pin_str(prompt, view);
+                     params.setPrompt(view, std::move(owner));
+                     return params;
+                 }),
                  py::arg("prompt"),
                  py::arg("sampling_params") = SamplingParams(), py::arg("maximum_tokens") = -1,
                  py::arg("stop_tokens") = std::vector<std::string>())
-            .def_readwrite("prompt", &TaskParams::prompt)
+            .def_property("prompt", [](const TaskParams &self) {
+                              const std::string_view view = self.promptView();
+                              return py::str(view.data(), view.size());
+                          }, [](TaskParams &self, const py::str &prompt) {
+                              std::string_view view;
+                              auto owner = pin_str(prompt, view);
+                              self.setPrompt(view, std::move(owner));
+                          })
+            .def_property("messages", [](const TaskParams &self) {
+                              std::vector<std::pair<std::string, std::string> > messages;
+                              for (const auto &message: self.messages) {
+                                  messages.emplace_back(message.role, message.content);
+                              }
+                              return messages;
+                          }, [](TaskParams &self, const py::iterable &messages) {
+                              self.messages.clear();
+                              for (const auto &message: messages) {
+                                  auto pair = message.cast<std::pair<std::string, std::string> >();
+                                  self.messages.push_back({std::move(pair.first), std::move(pair.second)});
+                              }
+                          }, "(role, content) pairs rendered and tokenized by the engine instead of the prompt.")
+            .def_property("tokens", [](const TaskParams &self) {
+                              std::vector<int32_t> tokens = self.tokens;
+                              const auto n_tokens = static_cast<py::ssize_t>(tokens.size());
+                              return vector_to_numpy(std::move(tokens), {n_tokens});
+                          }, [](TaskParams &self, const py::array_t<int32_t, py::array::c_style | py::array::forcecast> &tokens) {
+                              self.tokens.assign(tokens.data(), tokens.data() + tokens.size());
+                          }, "Pre-tokenized prompt (any int sequence or NumPy array), used instead of prompt and messages.")
+            .def_readwrite("add_generation_prompt", &TaskParams::addGenerationPrompt)
             .def_readwrite("sampling_params", &TaskParams::samplerParams)
             .def_readwrite("maximum_tokens", &TaskParams::maximumTokens)
             .def_readwrite("stop_tokens", &TaskParams::stopTokens)
-            .def("add_media", [](TaskParams &self, const py::bytes &media) {
-                std::string_view view = media;
-                self.addMedia(view);
-            });
+            .def("add_media", [](TaskParams &self, const py::buffer &media) {
+                const uint8_t *data = nullptr;
+                size_t size = 0;
+                auto owner = pin_buffer(media, data, size);
+                self.addMedia(data, size, std::move(owner));
+            }, py::arg("media"), "Adds media from any contiguous buffer (bytes, bytearray, memoryview...) without copying it.")
+            .def("add_media_file", &TaskParams::addMediaFile, py::arg("path"),
+                 "Adds a media file, which is memory-mapped instead of being read.");
+
+    py::class_<ScoreResult>(m, "ScoreResult")
+            .def_readonly("logprob", &ScoreResult::logprob)
+            .def_readonly("tokens", &ScoreResult::tokens)
+            .def_readonly("token_logprobs", &ScoreResult::token_logprobs)
+            .def_readonly("greedy", &ScoreResult::greedy);
+
+    py::class_<CompletionResult>(m, "CompletionResult")
+            .def_readonly("text", &CompletionResult::text)
+            .def_readonly("prompt_tokens", &CompletionResult::promptTokens)
+            .def_readonly("prompt_tokens_computed", &CompletionResult::promptTokensComputed)
+            .def_readonly("prompt_tokens_cached", &CompletionResult::promptTokensCached)
+            .def_readonly("completion_tokens", &CompletionResult::completionTokens)
+            .def_property_readonly("finish_reason", &CompletionResult::finishReasonName)
+            .def_readonly("queue_time", &CompletionResult::queueTime)
+            .def_readonly("prefill_time", &CompletionResult::prefillTime)
+            .def_readonly("decode_time", &CompletionResult::decodeTime)
+            .def_readonly("token_times", &CompletionResult::tokenTimes);
+
+    py::class_<HistogramSnapshot>(m, "HistogramSnapshot")
+            .def_readonly("bounds", &HistogramSnapshot::bounds)
+            .def_readonly("counts", &HistogramSnapshot::counts)
+            .def_readonly("count", &HistogramSnapshot::count)
+            .def_readonly("sum", &HistogramSnapshot::sum)
+            .def("quantile", &HistogramSnapshot::quantile, py::arg("q"),
+                 "Estimates the q-quantile from the buckets.");
+
+    py::class_<MetricsSnapshot>(m, "MetricsSnapshot")
+            .def_readonly("requests_admitted", &MetricsSnapshot::requestsAdmitted)
+            .def_readonly("requests_completed", &MetricsSnapshot::requestsCompleted)
+            .def_readonly("requests_failed", &MetricsSnapshot::requestsFailed)
+            .def_readonly("requests_cancelled", &MetricsSnapshot::requestsCancelled)
+            .def_readonly("prompt_tokens", &MetricsSnapshot::promptTokens)
+            .def_readonly("generated_tokens", &MetricsSnapshot::generatedTokens)
+            .def_readonly("decode_steps", &MetricsSnapshot::decodeSteps)
+            .def_readonly("decode_retries", &MetricsSnapshot::decodeRetries)
+            .def_readonly("context_shifts", &MetricsSnapshot::contextShifts)
+            .def_readonly("queue_depth", &MetricsSnapshot::queueDepth)
+            .def_readonly("time_to_first_token", &MetricsSnapshot::timeToFirstToken)
+            .def_readonly("inter_token_latency", &MetricsSnapshot::interTokenLatency)
+            .def_readonly("queue_wait", &MetricsSnapshot::queueWait)
+            .def_readonly("prefill_tokens", &MetricsSnapshot::prefillTokens)
+            .def_readonly("decode_tokens", &MetricsSnapshot::decodeTokens)
+            .def_readonly("batch_fill", &MetricsSnapshot::batchFill)
+            .def_readonly("slot_kv_cells", &MetricsSnapshot::slotKvCells)
+            .def("to_prometheus", &MetricsSnapshot::toPrometheus,
+                 "Renders the snapshot in the Prometheus text exposition format.");
 
     py::class_<Synexis>(m, "Synexis")
             .def(py::init([](SynexisArguments &args) {
@@ -103,17 +351,50 @@ PYBIND11_MODULE(synexis_python, m) {
                  "Starts the backend processing threads.")
 
             .def("stop", &Synexis::stop, "Stops the backend processing threads.")
-            .def("complete", [](Synexis &self, TaskParams params) {
-                params.stream = false;
-                params.on_token = nullptr;
-                py::gil_scoped_release release;
-                std::future<std::string> future = self.addTask(params.prompt, params);
-                return future.get();
-            }, py::arg("params"), "Adds a task for synchronous (non-streaming) generation.")
+            .def("metrics", &Synexis::metrics, py::call_guard<py::gil_scoped_release>(),
+                 "Returns a MetricsSnapshot of the engine counters and latency histograms.")
+            .def("trace_json", &Synexis::traceJson, py::call_guard<py::gil_scoped_release>(),
+                 "Returns the recorded scheduler spans as Chrome trace-event JSON.")
+            .def("dump_trace", &Synexis::dumpTrace, py::arg("path"), py::call_guard<py::gil_scoped_release>(),
+                 "Writes the recorded scheduler spans to path, open it in chrome://tracing or Perfetto.")
+            .def("complete", &complete_task<Synexis>, py::arg("params"),
+                 "Runs a non-streaming task and returns its CompletionResult: the text, token counts, finish reason "
+                 "and timings.")
+
+            .def("submit_many", &submit_many<Synexis>, py::arg("tasks"),
+                 "Queues every task with one call and returns a TaskBatch to collect the results.")
 
-            .def("complete_stream", &stream_task, py::arg("params"),
-                 "Adds a task for streaming generation and returns an iterator.")
-            .def("get_template", &get_template, "Get the model template or fallback to the default one")
+            .def("score", [](Synexis &self, const std::string &prompt, const std::vector<std::string> &continuations) {
+                     py::gil_scoped_release release;
+                     auto future = self.score(prompt, continuations);
+                     return future.get();
+                 }, py::arg("prompt"), py::arg("continuations"),
+                 "Returns the log-likelihood of every continuation after the prompt.")
+            .def("complete_stream", &stream_task<Synexis>, py::arg("params"), py::arg("logprobs") = false,
+                 py::arg("flush_bytes") = STREAM_FLUSH_BYTES, py::arg("flush_interval_ms") = STREAM_FLUSH_INTERVAL_US / 1000.0,
+                 "Adds a task for streaming generation and returns an iterator. Every item holds all the text generated "
+                 "since the previous one: a chunk is returned once flush_bytes are buffered, flush_interval_ms after "
+                 "its first byte, or at the end of the stream. With logprobs, every item is "
+                 "(text, (tokens, logprobs)) where both arrays have one row per token holding the chosen token "
+                 "followed by the sampling_params.n_probs most likely alternatives.")
+            .def("complete_async", &complete_async<Synexis>, py::arg("params"), py::arg("dispatcher"), py::arg("id"),
+                 "Adds a task for non-streaming generation without waiting for it. The dispatcher reports id once the "
+                 "returned AsyncResult is ready.")
+            .def("stream_async", &stream_task_async<Synexis>, py::arg("params"), py::arg("dispatcher"), py::arg("id"),
+                 py::arg("logprobs") = false,
+                 "Adds a task for streaming generation. The dispatcher reports id whenever the returned iterator has "
+                 "something for poll().")
+            .def("complete_stream_tokens", &stream_tokens<Synexis>, py::arg("params"), py::arg("logprobs") = false,
+                 py::arg("flush_tokens") = STREAM_FLUSH_BYTES / sizeof(int32_t),
+                 py::arg("flush_interval_ms") = STREAM_FLUSH_INTERVAL_US / 1000.0,
+                 "Like complete_stream, but every item is a NumPy int32 array of the generated token ids. "
+                 "Tokens are not detokenized unless stop_tokens need it.")
+            .def("get_template", &get_template<Synexis>, "Get the model template or fallback to the default one")
+            .def("has_native_chat_template", &Synexis::hasNativeChatTemplate,
+                 "Whether apply_chat_template can render the model's template without Jinja.")
+            .def("apply_chat_template", &apply_chat_template<Synexis>, py::arg("messages"),
+                 py::arg("add_generation_prompt") = true,
+                 "Renders (role, content) pairs with the model's chat template, with the GIL released.")
             .def("get_embedding", [](Synexis &self, std::string &prompt) {
                 auto res = self.getEmbedding(prompt);
                 auto &vec = res[0]; // std::vector<float>
@@ -122,10 +403,86 @@ PYBIND11_MODULE(synexis_python, m) {
                     vec.data() // pointer to data
                 );
             })
-            .def("get_tokens", [](Synexis &self) {
-                py::dict d;
-                d["bos_token"] = self.getToken("BOS");
-                d["eos_token"] = self.getToken("EOS");
-                return d;
-            });
+            .def("get_tokens", &get_tokens<Synexis>);
+
+    py::class_<SynexisRouter>(m, "SynexisRouter")
+            .def(py::init([](SynexisArguments &args, int replicas, bool local_weights) {
+                py::gil_scoped_release release;
+                return std::make_unique<SynexisRouter>(args, replicas, local_weights);
+            }), py::arg("args"), py::arg("replicas") = 0, py::arg("local_weights") = false,
+                 "Loads replicas of the engine pinned to the NUMA nodes, one per node when replicas is 0. With "
+                 "local_weights every replica reads its own copy of the weights into memory of its node.")
+            .def("run", &SynexisRouter::run, py::call_guard<py::gil_scoped_release>())
+            .def("stop", &SynexisRouter::stop)
+            .def("replicas", &SynexisRouter::replicas)
+            .def("replica_cpus", &SynexisRouter::replicaCpus, py::arg("replica"))
+            .def("metrics", &SynexisRouter::metrics, py::call_guard<py::gil_scoped_release>(),
+                 "Returns the MetricsSnapshot of every replica added up.")
+            .def("replica_metrics", &SynexisRouter::replicaMetrics, py::arg("replica"),
+                 py::call_guard<py::gil_scoped_release>())
+            .def("complete", &complete_task<SynexisRouter>, py::arg("params"))
+            .def("submit_many", &submit_many<SynexisRouter>, py::arg("tasks"))
+            .def("score", [](SynexisRouter &self, const std::string &prompt,
+                             const std::vector<std::string> &continuations) {
+                py::gil_scoped_release release;
+                auto future = self.score(prompt, continuations);
+                return future.get();
+            }, py::arg("prompt"), py::arg("continuations"))
+            .def("complete_stream", &stream_task<SynexisRouter>, py::arg("params"), py::arg("logprobs") = false,
+                 py::arg("flush_bytes") = STREAM_FLUSH_BYTES,
+                 py::arg("flush_interval_ms") = STREAM_FLUSH_INTERVAL_US / 1000.0)
+            .def("complete_async", &complete_async<SynexisRouter>, py::arg("params"), py::arg("dispatcher"),
+                 py::arg("id"))
+            .def("stream_async", &stream_task_async<SynexisRouter>, py::arg("params"), py::arg("dispatcher"),
+                 py::arg("id"), py::arg("logprobs") = false)
+            .def("complete_stream_tokens", &stream_tokens<SynexisRouter>, py::arg("params"),
+                 py::arg("logprobs") = false, py::arg("flush_tokens") = STREAM_FLUSH_BYTES / sizeof(int32_t),
+                 py::arg("flush_interval_ms") = STREAM_FLUSH_INTERVAL_US / 1000.0)
+            .def("get_template", &get_template<SynexisRouter>)
+            .def("has_native_chat_template", &SynexisRouter::hasNativeChatTemplate)
+            .def("apply_chat_template", &apply_chat_template<SynexisRouter>, py::arg("messages"),
+                 py::arg("add_generation_prompt") = true)
+            .def("get_embedding", [](SynexisRouter &self, std::string &prompt) {
+                auto res = self.getEmbedding(prompt);
+                auto &vec = res[0];
+                return py::array_t(vec.size(), vec.data());
+            })
+            .def("get_tokens", &get_tokens<SynexisRouter>);
+
+#ifdef SYNEXIS_IPC
+    py::class_<SynexisIpcServer>(m, "SynexisIpcServer")
+            .def(py::init<Synexis &, std::string>(), py::arg("engine"), py::arg("socket_path"),
+                 py::keep_alive<1, 2>())
+            .def("run", &SynexisIpcServer::run, py::call_guard<py::gil_scoped_release>(),
+                 "Starts accepting SynexisClient connections on the socket.")
+            .def("stop", &SynexisIpcServer::stop, py::call_guard<py::gil_scoped_release>(),
+                 "Disconnects every client, cancelling their tasks, and removes the socket file.");
+
+    // Same task methods as Synexis, served by the engine process behind the socket
+    py::class_<SynexisClient>(m, "SynexisClient")
+            .def(py::init([](const std::string &socket_path, int channels, int ring_bytes) {
+                py::gil_scoped_release release;
+                return std::make_unique<SynexisClient>(socket_path, channels, ring_bytes);
+            }), py::arg("socket_path"), py::arg("channels") = 1024, py::arg("ring_bytes") = 16 * 1024)
+            .def("connected", &SynexisClient::connected)
+            .def("model_path", &SynexisClient::modelPath)
+            .def("metrics", &SynexisClient::metrics, py::call_guard<py::gil_scoped_release>())
+            .def("complete", &complete_task<SynexisClient>, py::arg("params"))
+            .def("submit_many", &submit_many<SynexisClient>, py::arg("tasks"))
+            .def("complete_stream", &stream_task<SynexisClient>, py::arg("params"), py::arg("logprobs") = false,
+                 py::arg("flush_bytes") = STREAM_FLUSH_BYTES,
+                 py::arg("flush_interval_ms") = STREAM_FLUSH_INTERVAL_US / 1000.0)
+            .def("complete_async", &complete_async<SynexisClient>, py::arg("params"), py::arg("dispatcher"),
+                 py::arg("id"))
+            .def("stream_async", &stream_task_async<SynexisClient>, py::arg("params"), py::arg("dispatcher"),
+                 py::arg("id"), py::arg("logprobs") = false)
+            .def("complete_stream_tokens", &stream_tokens<SynexisClient>, py::arg("params"),
+                 py::arg("logprobs") = false, py::arg("flush_tokens") = STREAM_FLUSH_BYTES / sizeof(int32_t),
+                 py::arg("flush_interval_ms") = STREAM_FLUSH_INTERVAL_US / 1000.0)
+            .def("get_template", &get_template<SynexisClient>)
+            .def("has_native_chat_template", &SynexisClient::hasNativeChatTemplate)
+            .def("apply_chat_template", &apply_chat_template<SynexisClient>, py::arg("messages"),
+                 py::arg("add_generation_prompt") = true)
+            .def("get_tokens", &get_tokens<SynexisClient>);
+#endif
 }
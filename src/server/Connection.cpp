@@ -0,0 +1,230 @@
+#include "Connection.h"
+
+#include <cerrno>
+#include <cstdio>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+Connection::Connection(int fd, int epollFd, uint64_t id): id(id),
+                                                         cancelled(std::make_shared<std::atomic<bool> >(false)),
+                                                         fd(fd), epollFd(epollFd) {
+}
+
+Connection::~Connection() {
+    close();
+}
+
+const char *httpStatusText(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+void appendJsonString(std::string &out, std::string_view text) {
+    static const char *hex = "0123456789abcdef";
+    out += '"';
+    size_t run = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        const unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        // Copies the characters that need no escaping in one go
+        out.append(text.data() + run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 15];
+        }
+    }
+    out.append(text.data() + run, text.size() - run);
+    out += '"';
+}
+
+void Connection::watchWritable(bool writable) {
+    // Once closed the descriptor may already belong to another connection
+    if (closed || writableWatched == writable) {
+        return;
+    }
+    writableWatched = writable;
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLRDHUP | (writable ? EPOLLOUT : 0);
+    event.data.u64 = id;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void Connection::write(std::string_view data) {
+    if (closed) {
+        return;
+    }
+    if (output.empty()) {
+        while (!data.empty()) {
+            const ssize_t n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                data.remove_prefix(static_cast<size_t>(n));
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                // The peer is gone, the loop closes the socket when epoll reports it
+                cancelled->store(true);
+                return;
+            }
+        }
+    }
+    if (!data.empty()) {
+        output.append(data);
+        watchWritable(true);
+    }
+}
+
+void Connection::respond(int status, std::string_view contentType, std::string_view body, bool keepAlive) {
+    char head[256];
+    const int n = std::snprintf(head, sizeof(head),
+                                "HTTP/1.1 %d %s\r\nContent-Type: %.*s\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n",
+                                status, httpStatusText(status), static_cast<int>(contentType.size()),
+                                contentType.data(), body.size(), keepAlive ? "keep-alive" : "close");
+    std::lock_guard lock(mutex);
+    // One send for small responses
+    if (body.size() < 16 * 1024) {
+        std::string response(head, n);
+        response.append(body);
+        write(response);
+    } else {
+        write(std::string_view(head, n));
+        write(body);
+    }
+    responding = false;
+    keepAliveAfter = keepAlive;
+    watchWritable(true);
+}
+
+void Connection::startEventStream() {
+    std::lock_guard lock(mutex);
+    write("HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n");
+}
+
+void Connection::sendEvent(std::string_view data) {
+    // Chunk size, then "data: <data>\n\n" in the same chunk
+    char size[20];
+    const int n = std::snprintf(size, sizeof(size), "%zx\r\n", data.size() + 8);
+    std::string chunk;
+    chunk.reserve(n + data.size() + 10);
+    chunk.append(size, n);
+    chunk += "data: ";
+    chunk.append(data);
+    chunk += "\n\n\r\n";
+    std::lock_guard lock(mutex);
+    write(chunk);
+}
+
+void Connection::endEventStream(bool keepAlive) {
+    std::lock_guard lock(mutex);
+    write("0\r\n\r\n");
+    responding = false;
+    keepAliveAfter = keepAlive;
+    watchWritable(true);
+}
+
+void Connection::finish(bool keepAlive) {
+    std::lock_guard lock(mutex);
+    responding = false;
+    keepAliveAfter = keepAlive;
+    // Wakes the loop, which sees the socket writable and moves on to the next request
+    watchWritable(true);
+}
+
+bool Connection::readInput() {
+    char buffer[16 * 1024];
+    while (true) {
+        const ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            // A request is at most its headers and body, anything beyond is a client that does not read responses
+            if (input.size() + n > HTTP_MAX_HEADER_BYTES + HTTP_MAX_BODY_BYTES) {
+                return false;
+            }
+            input.append(buffer, n);
+        } else if (n == 0) {
+            return false;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+}
+
+bool Connection::flush() {
+    std::lock_guard lock(mutex);
+    if (closed) {
+        return false;
+    }
+    size_t written = 0;
+    while (written < output.size()) {
+        const ssize_t n = ::send(fd, output.data() + written, output.size() - written, MSG_NOSIGNAL);
+        if (n > 0) {
+            written += static_cast<size_t>(n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            return false;
+        }
+    }
+    output.erase(0, written);
+    if (output.empty()) {
+        watchWritable(false);
+    }
+    return true;
+}
+
+void Connection::begin() {
+    std::lock_guard lock(mutex);
+    responding = true;
+}
+
+bool Connection::idle() {
+    std::lock_guard lock(mutex);
+    return !responding && output.empty();
+}
+
+bool Connection::keepAlive() {
+    std::lock_guard lock(mutex);
+    return keepAliveAfter;
+}
+
+void Connection::close() {
+    std::lock_guard lock(mutex);
+    if (closed) {
+        return;
+    }
+    closed = true;
+    cancelled->store(true);
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+}
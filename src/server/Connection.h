@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "HttpRequest.h"
+
+// One client socket, registered in the server's epoll set under `id`.
+//
+// The event loop thread reads, parses and closes. Responses are written by whichever thread produces them: the loop
+// for errors, the engine worker for generated tokens, the embedding thread for embeddings. A write goes straight to
+// the non-blocking socket under the connection's mutex, only what the kernel does not take is queued and flushed by
+// the loop on EPOLLOUT. Once closed every write is dropped, so producers may keep a reference past the disconnect.
+class Connection {
+public:
+    Connection(int fd, int epollFd, uint64_t id);
+
+    ~Connection();
+
+    Connection(const Connection &) = delete;
+
+    Connection &operator=(const Connection &) = delete;
+
+    // Complete response with a Content-Length, then finish()
+    void respond(int status, std::string_view contentType, std::string_view body, bool keepAlive);
+
+    // Status line and headers of a server-sent event stream, sent with chunked encoding so the connection can be
+    // kept alive afterwards
+    void startEventStream();
+
+    // One "data: ..." event, `data` must not contain a blank line
+    void sendEvent(std::string_view data);
+
+    // Writes the last chunk, then finish()
+    void endEventStream(bool keepAlive);
+
+    // Marks the response as complete. The loop then reads the next request or closes the connection.
+    void finish(bool keepAlive);
+
+    // Loop thread only
+
+    // Marks a response as pending before the request is handed to a handler
+    void begin();
+
+    // Appends everything readable to `input`, returns false when the peer closed or the socket failed
+    bool readInput();
+
+    // Writes queued output, returns false when the socket failed
+    bool flush();
+
+    // True once the response is complete and all of it was written
+    bool idle();
+
+    bool keepAlive();
+
+    void close();
+
+    const uint64_t id;
+    std::string input;
+    HttpParser parser;
+    // Set when the client goes away, handed to the engine as the task's cancel flag
+    std::shared_ptr<std::atomic<bool> > cancelled;
+
+private:
+    // Caller holds `mutex`
+    void write(std::string_view data);
+
+    void watchWritable(bool writable);
+
+    const int fd;
+    const int epollFd;
+    std::mutex mutex;
+    std::string output;
+    bool closed = false;
+    bool responding = false;
+    bool keepAliveAfter = true;
+    bool writableWatched = false;
+};
+
+// Reason phrase of the status codes the server sends
+const char *httpStatusText(int status);
+
+// Appends `text` as a quoted JSON string
+void appendJsonString(std::string &out, std::string_view text);
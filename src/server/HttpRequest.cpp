@@ -0,0 +1,154 @@
+#include "HttpRequest.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace {
+    std::string_view trim(std::string_view text) {
+        while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+            text.remove_prefix(1);
+        }
+        while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) {
+            text.remove_suffix(1);
+        }
+        return text;
+    }
+
+    std::string lowercase(std::string_view text) {
+        std::string out(text);
+        std::transform(out.begin(), out.end(), out.begin(), [](unsigned char c) { return std::tolower(c); });
+        return out;
+    }
+
+    // Comma-separated header values such as "keep-alive, Upgrade"
+    bool hasToken(std::string_view value, std::string_view token) {
+        while (!value.empty()) {
+            const size_t comma = value.find(',');
+            if (lowercase(trim(value.substr(0, comma))) == token) {
+                return true;
+            }
+            if (comma == std::string_view::npos) {
+                break;
+            }
+            value.remove_prefix(comma + 1);
+        }
+        return false;
+    }
+}
+
+const std::string *HttpRequest::header(std::string_view name) const {
+    for (const auto &[key, value]: headers) {
+        if (key == name) {
+            return &value;
+        }
+    }
+    return nullptr;
+}
+
+std::string_view HttpRequest::path() const {
+    std::string_view view(target);
+    return view.substr(0, view.find('?'));
+}
+
+HttpParseStatus HttpParser::fail(int errorStatus, std::string errorMessage) {
+    status = errorStatus;
+    message = std::move(errorMessage);
+    return HTTP_PARSE_ERROR;
+}
+
+HttpParseStatus HttpParser::parse(std::string &buffer, HttpRequest &request) {
+    if (state == STATE_HEADERS) {
+        // The terminator may straddle the previous read
+        const size_t from = scanned >= 3 ? scanned - 3 : 0;
+        const size_t end = buffer.find("\r\n\r\n", from);
+        if (end == std::string::npos) {
+            scanned = buffer.size();
+            if (buffer.size() > HTTP_MAX_HEADER_BYTES) {
+                return fail(431, "request headers too large");
+            }
+            return HTTP_PARSE_INCOMPLETE;
+        }
+        if (end > HTTP_MAX_HEADER_BYTES) {
+            return fail(431, "request headers too large");
+        }
+        pending = HttpRequest();
+        if (!parseHead(std::string_view(buffer.data(), end), pending)) {
+            return HTTP_PARSE_ERROR;
+        }
+        headerBytes = end + 4;
+        state = STATE_BODY;
+    }
+
+    if (buffer.size() - headerBytes < contentLength) {
+        return HTTP_PARSE_INCOMPLETE;
+    }
+    pending.body.assign(buffer, headerBytes, contentLength);
+    request = std::move(pending);
+    pending = HttpRequest();
+    buffer.erase(0, headerBytes + contentLength);
+    state = STATE_HEADERS;
+    scanned = 0;
+    headerBytes = 0;
+    contentLength = 0;
+    return HTTP_PARSE_DONE;
+}
+
+bool HttpParser::parseHead(std::string_view head, HttpRequest &request) {
+    size_t lineEnd = head.find("\r\n");
+    const std::string_view requestLine = head.substr(0, lineEnd);
+    const size_t firstSpace = requestLine.find(' ');
+    const size_t lastSpace = requestLine.rfind(' ');
+    if (firstSpace == std::string_view::npos || lastSpace == firstSpace) {
+        fail(400, "malformed request line");
+        return false;
+    }
+    request.method = std::string(requestLine.substr(0, firstSpace));
+    request.target = std::string(trim(requestLine.substr(firstSpace + 1, lastSpace - firstSpace - 1)));
+    request.version = std::string(requestLine.substr(lastSpace + 1));
+    if (request.version.rfind("HTTP/1.", 0) != 0 || request.target.empty()) {
+        fail(400, "malformed request line");
+        return false;
+    }
+
+    contentLength = 0;
+    bool keepAlive = request.version != "HTTP/1.0";
+    while (lineEnd != std::string_view::npos) {
+        const size_t start = lineEnd + 2;
+        lineEnd = head.find("\r\n", start);
+        const std::string_view line = head.substr(start, lineEnd == std::string_view::npos
+                                                             ? std::string_view::npos
+                                                             : lineEnd - start);
+        const size_t colon = line.find(':');
+        if (colon == std::string_view::npos || colon == 0) {
+            fail(400, "malformed header");
+            return false;
+        }
+        std::string name = lowercase(line.substr(0, colon));
+        const std::string_view value = trim(line.substr(colon + 1));
+
+        if (name == "content-length") {
+            if (value.empty() || value.size() > 12 ||
+                !std::all_of(value.begin(), value.end(), [](unsigned char c) { return std::isdigit(c); })) {
+                fail(400, "invalid Content-Length");
+                return false;
+            }
+            contentLength = std::stoull(std::string(value));
+            if (contentLength > HTTP_MAX_BODY_BYTES) {
+                fail(413, "request body too large");
+                return false;
+            }
+        } else if (name == "transfer-encoding") {
+            fail(501, "chunked request bodies are not supported, send a Content-Length");
+            return false;
+        } else if (name == "connection") {
+            if (hasToken(value, "close")) {
+                keepAlive = false;
+            } else if (hasToken(value, "keep-alive")) {
+                keepAlive = true;
+            }
+        }
+        request.headers.emplace_back(std::move(name), std::string(value));
+    }
+    request.keepAlive = keepAlive;
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#define HTTP_MAX_HEADER_BYTES (64 * 1024)
+#define HTTP_MAX_BODY_BYTES (64 * 1024 * 1024)
+
+struct HttpRequest {
+    std::string method;
+    // Path and query as sent
+    std::string target;
+    std::string version;
+    // Names are lowercased
+    std::vector<std::pair<std::string, std::string> > headers;
+    std::string body;
+    bool keepAlive = true;
+
+    // Value of the header, nullptr when it is missing. `name` must be lowercase.
+    const std::string *header(std::string_view name) const;
+
+    // Target without the query string
+    std::string_view path() const;
+};
+
+enum HttpParseStatus {
+    HTTP_PARSE_INCOMPLETE,
+    HTTP_PARSE_DONE,
+    HTTP_PARSE_ERROR,
+};
+
+// Incremental HTTP/1.1 request parser. Call parse() after every read with the connection's input buffer: it
+// remembers how far it searched for the end of the headers, so a slowly arriving request is scanned once, and
+// removes a request from the front of the buffer when it is complete. Pipelined requests stay in the buffer.
+class HttpParser {
+public:
+    HttpParseStatus parse(std::string &buffer, HttpRequest &request);
+
+    // After HTTP_PARSE_ERROR: the status to answer with and why
+    int errorStatus() const { return status; }
+
+    const std::string &errorMessage() const { return message; }
+
+private:
+    enum State {
+        STATE_HEADERS,
+        STATE_BODY,
+    };
+
+    bool parseHead(std::string_view head, HttpRequest &request);
+
+    HttpParseStatus fail(int errorStatus, std::string errorMessage);
+
+    State state = STATE_HEADERS;
+    // Bytes of the buffer already searched for the end of the headers
+    size_t scanned = 0;
+    size_t headerBytes = 0;
+    size_t contentLength = 0;
+    // Head of the request whose body is still arriving
+    HttpRequest pending;
+    int status = 0;
+    std::string message;
+};
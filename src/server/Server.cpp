@@ -0,0 +1,551 @@
+#include "Server.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::ordered_json;
+
+#define LISTEN_ID 0
+#define WAKE_ID 1
+#define EPOLL_BATCH 64
+
+namespace {
+    void sendError(Connection &connection, int status, const std::string &message, bool keepAlive) {
+        const json body = {
+            {
+                "error", {
+                    {"message", message},
+                    {"type", status >= 500 ? "server_error" : "invalid_request_error"},
+                    {"code", status},
+                }
+            },
+        };
+        connection.respond(status, "application/json", body.dump(), keepAlive);
+    }
+
+    // Leaves `out` untouched when the field is missing or null
+    template<typename T>
+    void readField(const json &body, const char *key, T &out) {
+        const auto it = body.find(key);
+        if (it != body.end() && !it->is_null()) {
+            out = it->get<T>();
+        }
+    }
+
+    std::string messageContent(const json &message) {
+        const auto it = message.find("content");
+        if (it == message.end() || it->is_null()) {
+            return std::string();
+        }
+        if (it->is_string()) {
+            return it->get<std::string>();
+        }
+        if (!it->is_array()) {
+            throw std::invalid_argument("message content must be a string or an array of parts");
+        }
+        std::string content;
+        for (const auto &part: *it) {
+            if (part.value("type", std::string()) != "text") {
+                throw std::invalid_argument("only text content parts are supported");
+            }
+            content += part.at("text").get<std::string>();
+        }
+        return content;
+    }
+
+    void readSampling(const json &body, TaskParams &params) {
+        int n = 1;
+        readField(body, "n", n);
+        if (n != 1) {
+            throw std::invalid_argument("only n = 1 is supported");
+        }
+        const auto logprobs = body.find("logprobs");
+        if (logprobs != body.end() && ((logprobs->is_boolean() && logprobs->get<bool>()) ||
+                                       (logprobs->is_number() && logprobs->get<int>() > 0))) {
+            throw std::invalid_argument("logprobs are not supported");
+        }
+
+        SamplingParams &sampling = params.samplerParams;
+        readField(body, "temperature", sampling.temp);
+        readField(body, "top_p", sampling.top_p);
+        readField(body, "top_k", sampling.top_k);
+        readField(body, "min_p", sampling.min_p);
+        readField(body, "typical_p", sampling.typ_p);
+        readField(body, "seed", sampling.seed);
+        readField(body, "repeat_penalty", sampling.penalty_repeat);
+        readField(body, "repeat_last_n", sampling.penalty_last_n);
+        readField(body, "presence_penalty", sampling.penalty_present);
+        readField(body, "frequency_penalty", sampling.penalty_freq);
+
+        readField(body, "max_tokens", params.maximumTokens);
+        readField(body, "max_completion_tokens", params.maximumTokens);
+
+        const auto stop = body.find("stop");
+        if (stop != body.end() && stop->is_string()) {
+            params.stopTokens = {stop->get<std::string>()};
+        } else if (stop != body.end() && !stop->is_null()) {
+            params.stopTokens = stop->get<std::vector<std::string> >();
+        }
+
+        const auto logitBias = body.find("logit_bias");
+        if (logitBias != body.end() && !logitBias->is_null()) {
+            for (const auto &[token, bias]: logitBias->items()) {
+                sampling.logit_bias[std::stoi(token)] = bias.get<float>();
+            }
+        }
+    }
+
+    json usageJson(const CompletionResult &result) {
+        return {
+            {"prompt_tokens", result.promptTokens},
+            {"completion_tokens", result.completionTokens},
+            {"total_tokens", result.promptTokens + result.completionTokens},
+            {"prompt_tokens_details", {{"cached_tokens", result.promptTokensCached}}},
+        };
+    }
+
+    json timingsJson(const CompletionResult &result) {
+        return {
+            {"queue_time", result.queueTime},
+            {"prefill_time", result.prefillTime},
+            {"decode_time", result.decodeTime},
+        };
+    }
+}
+
+Server::Server(Synexis &engine, ServerOptions options): engine(engine), options(std::move(options)) {
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd < 0) {
+        throw std::runtime_error(std::string("eventfd failed: ") + std::strerror(errno));
+    }
+}
+
+Server::~Server() {
+    {
+        std::lock_guard lock(embeddingMutex);
+        embeddingStopped = true;
+    }
+    embeddingCv.notify_all();
+    if (embeddingThread.joinable()) {
+        embeddingThread.join();
+    }
+    for (auto &[id, connection]: connections) {
+        connection->close();
+    }
+    connections.clear();
+    if (listenFd >= 0) {
+        ::close(listenFd);
+    }
+    if (epollFd >= 0) {
+        ::close(epollFd);
+    }
+    ::close(wakeFd);
+}
+
+void Server::stop() {
+    running = false;
+    const uint64_t one = 1;
+    // Only fails when the counter would overflow, the loop is woken up either way
+    [[maybe_unused]] const ssize_t written = ::write(wakeFd, &one, sizeof(one));
+}
+
+void Server::run() {
+    std::string host = options.host == "localhost" ? "127.0.0.1" : options.host;
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(options.port));
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+        throw std::runtime_error("invalid IPv4 address " + options.host);
+    }
+
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        throw std::runtime_error(std::string("socket failed: ") + std::strerror(errno));
+    }
+    const int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listenFd, SOMAXCONN) != 0) {
+        throw std::runtime_error("cannot listen on " + options.host + ":" + std::to_string(options.port) + ": " +
+                                 std::strerror(errno));
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        throw std::runtime_error(std::string("epoll_create1 failed: ") + std::strerror(errno));
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = LISTEN_ID;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.data.u64 = WAKE_ID;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+
+    if (options.embedding) {
+        embeddingThread = std::thread(&Server::embeddingLoop, this);
+    }
+
+    running = true;
+    std::cerr << "Listening on http://" << options.host << ":" << options.port << std::endl;
+    epoll_event events[EPOLL_BATCH];
+    while (running) {
+        const int n = epoll_wait(epollFd, events, EPOLL_BATCH, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("epoll_wait failed: ") + std::strerror(errno));
+        }
+        for (int i = 0; i < n; ++i) {
+            const uint64_t id = events[i].data.u64;
+            if (id == LISTEN_ID) {
+                accept();
+            } else if (id == WAKE_ID) {
+                uint64_t count;
+                [[maybe_unused]] const ssize_t read = ::read(wakeFd, &count, sizeof(count));
+            } else {
+                // Closed earlier in this batch
+                const auto it = connections.find(id);
+                if (it != connections.end()) {
+                    const std::shared_ptr<Connection> connection = it->second;
+                    onEvent(connection, events[i].events);
+                }
+            }
+        }
+    }
+
+    // Cancels the tasks of the open connections
+    for (auto &[id, connection]: connections) {
+        connection->close();
+    }
+    connections.clear();
+}
+
+void Server::accept() {
+    while (true) {
+        const int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "accept failed: " << std::strerror(errno) << std::endl;
+            }
+            return;
+        }
+        // Token events are small writes that must not wait for more data
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        const uint64_t id = nextConnectionId++;
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = id;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            ::close(fd);
+            continue;
+        }
+        connections.emplace(id, std::make_shared<Connection>(fd, epollFd, id));
+    }
+}
+
+void Server::closeConnection(const std::shared_ptr<Connection> &connection) {
+    connection->close();
+    connections.erase(connection->id);
+}
+
+void Server::onEvent(const std::shared_ptr<Connection> &connection, uint32_t events) {
+    if (events & EPOLLERR) {
+        closeConnection(connection);
+        return;
+    }
+    // A closed peer shows up as EOF, after whatever it sent before
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && !connection->readInput()) {
+        closeConnection(connection);
+        return;
+    }
+    if ((events & EPOLLOUT) && !connection->flush()) {
+        closeConnection(connection);
+        return;
+    }
+    if (connection->idle()) {
+        if (!connection->keepAlive()) {
+            closeConnection(connection);
+            return;
+        }
+        serveNext(connection);
+    }
+}
+
+void Server::serveNext(const std::shared_ptr<Connection> &connection) {
+    HttpRequest request;
+    const HttpParseStatus status = connection->parser.parse(connection->input, request);
+    if (status == HTTP_PARSE_INCOMPLETE) {
+        return;
+    }
+    connection->begin();
+    if (status == HTTP_PARSE_ERROR) {
+        // The rest of the stream cannot be framed anymore
+        sendError(*connection, connection->parser.errorStatus(), connection->parser.errorMessage(), false);
+        return;
+    }
+    dispatch(connection, request);
+}
+
+void Server::dispatch(const std::shared_ptr<Connection> &connection, const HttpRequest &request) {
+    const std::string_view path = request.path();
+    const bool post = request.method == "POST";
+    const bool get = request.method == "GET";
+    try {
+        if (path == "/v1/chat/completions" || path == "/v1/completions") {
+            if (!post) {
+                sendError(*connection, 405, "use POST", request.keepAlive);
+                return;
+            }
+            handleCompletion(connection, request, path == "/v1/chat/completions");
+        } else if (path == "/v1/embeddings") {
+            if (!post) {
+                sendError(*connection, 405, "use POST", request.keepAlive);
+                return;
+            }
+            handleEmbeddings(connection, request);
+        } else if (path == "/v1/models" && get) {
+            const json body = {
+                {"object", "list"},
+                {"data", json::array({{{"id", options.modelName}, {"object", "model"}, {"owned_by", "synexis"}}})},
+            };
+            connection->respond(200, "application/json", body.dump(), request.keepAlive);
+        } else if (path == "/health" && get) {
+            connection->respond(200, "application/json", "{\"status\":\"ok\"}", request.keepAlive);
+        } else if (path == "/metrics" && get) {
+            connection->respond(200, "text/plain; version=0.0.4", engine.metrics().toPrometheus(),
+                                request.keepAlive);
+        } else {
+            sendError(*connection, 404, "no route for " + request.method + " " + std::string(path),
+                      request.keepAlive);
+        }
+    } catch (const json::exception &e) {
+        sendError(*connection, 400, std::string("invalid request body: ") + e.what(), request.keepAlive);
+    } catch (const std::invalid_argument &e) {
+        sendError(*connection, 400, e.what(), request.keepAlive);
+    } catch (const std::exception &e) {
+        sendError(*connection, 500, e.what(), request.keepAlive);
+    }
+}
+
+void Server::handleCompletion(const std::shared_ptr<Connection> &connection, const HttpRequest &request,
+                              bool chat) {
+    if (options.embedding) {
+        throw std::invalid_argument("the server was started with --embedding, it only serves /v1/embeddings");
+    }
+    const json body = json::parse(request.body);
+    if (!body.is_object()) {
+        throw std::invalid_argument("the body must be a JSON object");
+    }
+
+    TaskParams params;
+    if (chat) {
+        if (!engine.hasNativeChatTemplate()) {
+            throw std::invalid_argument("the model's chat template is not supported, use /v1/completions");
+        }
+        const json &messages = body.at("messages");
+        if (!messages.is_array() || messages.empty()) {
+            throw std::invalid_argument("messages must be a non-empty array");
+        }
+        for (const auto &message: messages) {
+            params.messages.push_back({message.at("role").get<std::string>(), messageContent(message)});
+        }
+    } else {
+        const json &prompt = body.at("prompt");
+        if (prompt.is_string()) {
+            params.prompt = prompt.get<std::string>();
+        } else if (prompt.is_array() && !prompt.empty() && prompt[0].is_number_integer()) {
+            params.tokens = prompt.get<std::vector<int32_t> >();
+        } else if (prompt.is_array() && prompt.size() == 1 && prompt[0].is_string()) {
+            params.prompt = prompt[0].get<std::string>();
+        } else {
+            throw std::invalid_argument("prompt must be a string or an array of token ids, one prompt per request");
+        }
+    }
+    readSampling(body, params);
+
+    bool stream = false;
+    readField(body, "stream", stream);
+    bool includeUsage = false;
+    const auto streamOptions = body.find("stream_options");
+    if (streamOptions != body.end() && streamOptions->is_object()) {
+        readField(*streamOptions, "include_usage", includeUsage);
+    }
+
+    const std::string id = (chat ? "chatcmpl-" : "cmpl-") + std::to_string(++nextCompletionId);
+    const int64_t created = std::time(nullptr);
+    const std::string object = chat ? (stream ? "chat.completion.chunk" : "chat.completion") : "text_completion";
+    const bool keepAlive = request.keepAlive;
+    const std::string modelName = options.modelName;
+    params.cancelled = connection->cancelled;
+
+    if (stream) {
+        // Every event of the stream starts and ends the same way, only the piece changes
+        std::string head = "{\"id\":\"" + id + "\",\"object\":\"" + object + "\",\"created\":" +
+                           std::to_string(created) + ",\"model\":";
+        appendJsonString(head, modelName);
+        head += ",\"choices\":[{\"index\":0,";
+        const std::string prefix = head + (chat ? "\"delta\":{\"content\":" : "\"text\":");
+        const std::string suffix = chat
+                                       ? "},\"finish_reason\":null}]}"
+                                       : ",\"logprobs\":null,\"finish_reason\":null}]}";
+
+        params.stream = true;
+        params.on_token = [connection, prefix, suffix](const std::string &piece) {
+            std::string event;
+            event.reserve(prefix.size() + piece.size() + suffix.size() + 8);
+            event += prefix;
+            appendJsonString(event, piece);
+            event += suffix;
+            connection->sendEvent(event);
+        };
+        params.on_result = [connection, id, object, created, modelName, chat, includeUsage, keepAlive](
+            const CompletionResult &result) {
+            json choice = {{"index", 0}};
+            if (chat) {
+                choice["delta"] = json::object();
+            } else {
+                choice["text"] = "";
+                choice["logprobs"] = nullptr;
+            }
+            choice["finish_reason"] = result.finishReasonName();
+            json last = {
+                {"id", id}, {"object", object}, {"created", created}, {"model", modelName},
+                {"choices", json::array({choice})},
+            };
+            connection->sendEvent(last.dump());
+            if (includeUsage) {
+                last["choices"] = json::array();
+                last["usage"] = usageJson(result);
+                connection->sendEvent(last.dump());
+            }
+            connection->sendEvent("[DONE]");
+            connection->endEventStream(keepAlive);
+        };
+        params.on_error = [connection, keepAlive](const std::string &message) {
+            const json error = {{"error", {{"message", message}, {"type", "server_error"}}}};
+            connection->sendEvent(error.dump());
+            connection->sendEvent("[DONE]");
+            connection->endEventStream(keepAlive);
+        };
+
+        connection->startEventStream();
+        if (chat) {
+            connection->sendEvent(head +
+                                  "\"delta\":{\"role\":\"assistant\",\"content\":\"\"},\"finish_reason\":null}]}");
+        }
+    } else {
+        params.on_result = [connection, id, object, created, modelName, chat, keepAlive](
+            const CompletionResult &result) {
+            json choice = {{"index", 0}};
+            if (chat) {
+                choice["message"] = {{"role", "assistant"}, {"content", result.text}};
+            } else {
+                choice["text"] = result.text;
+                choice["logprobs"] = nullptr;
+            }
+            choice["finish_reason"] = result.finishReasonName();
+            const json response = {
+                {"id", id}, {"object", object}, {"created", created}, {"model", modelName},
+                {"choices", json::array({choice})},
+                {"usage", usageJson(result)},
+                {"timings", timingsJson(result)},
+            };
+            // Generated text is not guaranteed to be valid UTF-8, replace what is not
+            connection->respond(200, "application/json", response.dump(-1, ' ', false, json::error_handler_t::replace),
+                                keepAlive);
+        };
+        params.on_error = [connection, keepAlive](const std::string &message) {
+            sendError(*connection, 500, message, keepAlive);
+        };
+    }
+
+    // Answered from the callbacks, the future is not needed
+    engine.addTask(std::move(params));
+}
+
+void Server::handleEmbeddings(const std::shared_ptr<Connection> &connection, const HttpRequest &request) {
+    if (!options.embedding) {
+        throw std::invalid_argument("start the server with --embedding to serve embeddings");
+    }
+    const json body = json::parse(request.body);
+    const json &input = body.at("input");
+    std::vector<std::string> inputs;
+    if (input.is_string()) {
+        inputs.push_back(input.get<std::string>());
+    } else if (input.is_array() && !input.empty() && input[0].is_string()) {
+        inputs = input.get<std::vector<std::string> >();
+    } else {
+        throw std::invalid_argument("input must be a string or an array of strings");
+    }
+
+    const bool keepAlive = request.keepAlive;
+    std::lock_guard lock(embeddingMutex);
+    embeddingJobs.emplace_back([this, connection, inputs = std::move(inputs), keepAlive] {
+        json data = json::array();
+        try {
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                const std::vector<std::vector<float> > rows = engine.getEmbedding(inputs[i]);
+                if (rows.empty()) {
+                    throw std::runtime_error("no embedding for input " + std::to_string(i));
+                }
+                // One row with pooling, one per token without: those are averaged
+                std::vector<float> embedding = rows[0];
+                for (size_t r = 1; r < rows.size(); ++r) {
+                    for (size_t j = 0; j < embedding.size(); ++j) {
+                        embedding[j] += rows[r][j];
+                    }
+                }
+                if (rows.size() > 1) {
+                    for (float &value: embedding) {
+                        value /= static_cast<float>(rows.size());
+                    }
+                }
+                data.push_back({{"object", "embedding"}, {"index", i}, {"embedding", std::move(embedding)}});
+            }
+        } catch (const std::exception &e) {
+            sendError(*connection, 500, e.what(), keepAlive);
+            return;
+        }
+        const json response = {
+            {"object", "list"},
+            {"data", std::move(data)},
+            {"model", options.modelName},
+        };
+        connection->respond(200, "application/json", response.dump(), keepAlive);
+    });
+    embeddingCv.notify_one();
+}
+
+void Server::embeddingLoop() {
+    while (true) {
+        std::function<void()> job; {
+            std::unique_lock lock(embeddingMutex);
+            embeddingCv.wait(lock, [this] { return embeddingStopped || !embeddingJobs.empty(); });
+            if (embeddingStopped) {
+                return;
+            }
+            job = std::move(embeddingJobs.front());
+            embeddingJobs.pop_front();
+        }
+        job();
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <synexis/Synexis.h>
+
+#include "Connection.h"
+
+struct ServerOptions {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    // Reported as "model" in the responses
+    std::string modelName;
+    // The engine was created with SynexisArguments::embedding: /v1/embeddings is served, generation is not
+    bool embedding = false;
+};
+
+// OpenAI-compatible HTTP/1.1 server over one epoll loop.
+//
+// The loop thread accepts, reads and parses requests incrementally, and hands completions to the engine. The answer
+// is written from the engine's callbacks on its worker thread: every streamed piece becomes one server-sent event
+// written to the socket right away, and the final chunk or the whole non-streaming response comes from on_result.
+// A client that disconnects cancels its task. Embeddings run on a separate thread, one request at a time.
+class Server {
+public:
+    Server(Synexis &engine, ServerOptions options);
+
+    ~Server();
+
+    Server(const Server &) = delete;
+
+    Server &operator=(const Server &) = delete;
+
+    // Binds and serves until stop(). Throws std::runtime_error when the socket cannot be set up.
+    void run();
+
+    // Async-signal-safe
+    void stop();
+
+private:
+    void accept();
+
+    void onEvent(const std::shared_ptr<Connection> &connection, uint32_t events);
+
+    // Parses and dispatches the next buffered request once the previous response is complete
+    void serveNext(const std::shared_ptr<Connection> &connection);
+
+    void dispatch(const std::shared_ptr<Connection> &connection, const HttpRequest &request);
+
+    void handleCompletion(const std::shared_ptr<Connection> &connection, const HttpRequest &request, bool chat);
+
+    void handleEmbeddings(const std::shared_ptr<Connection> &connection, const HttpRequest &request);
+
+    void closeConnection(const std::shared_ptr<Connection> &connection);
+
+    void embeddingLoop();
+
+    Synexis &engine;
+    ServerOptions options;
+
+    int listenFd = -1;
+    int epollFd = -1;
+    // Written by stop() to wake the loop
+    int wakeFd = -1;
+    std::atomic<bool> running{false};
+
+    // Loop thread only. Ids 0 and 1 are the listening socket and wakeFd in the epoll set.
+    uint64_t nextConnectionId = 2;
+    std::unordered_map<uint64_t, std::shared_ptr<Connection> > connections;
+
+    std::atomic<uint64_t> nextCompletionId{0};
+
+    std::thread embeddingThread;
+    std::mutex embeddingMutex;
+    std::condition_variable embeddingCv;
+    std::deque<std::function<void()> > embeddingJobs;
+    bool embeddingStopped = false;
+};
@@ -0,0 +1,105 @@
+// OpenAI-compatible HTTP server in front of one engine.
+//
+//   synexis-server -m model.gguf --port 8080 --slots 8
+//   curl -N localhost:8080/v1/chat/completions -d '{"messages":[{"role":"user","content":"Hi"}],"stream":true}'
+
+#include <csignal>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+#include <synexis/Synexis.h>
+
+#include "Server.h"
+
+static Server *activeServer = nullptr;
+
+static void onSignal(int) {
+    if (activeServer) {
+        activeServer->stop();
+    }
+}
+
+static void printUsage(const char *program) {
+    const SynexisArguments defaults("");
+    const ServerOptions serverDefaults;
+    std::printf(
+        "usage: %s -m MODEL [options]\n"
+        "\n"
+        "  -m, --model PATH          GGUF model\n"
+        "  --mmproj PATH             multimodal projector\n"
+        "  --host ADDR               IPv4 address to listen on (%s)\n"
+        "  --port N                  port to listen on (%d)\n"
+        "  --alias NAME              model name reported to clients (file name of the model)\n"
+        "  --slots N                 concurrent sequences (%d)\n"
+        "  --ctx N                   context size shared by the slots (%d)\n"
+        "  --batch N                 logical batch size (%d)\n"
+        "  --threads N               CPU threads (%d)\n"
+        "  --gpu-layers N            layers offloaded to the GPU (%d)\n"
+        "  --embedding               serve /v1/embeddings instead of completions\n",
+        program, serverDefaults.host.c_str(), serverDefaults.port, defaults.n_slots, defaults.n_ctx,
+        defaults.n_batch, defaults.numberOfThreads, defaults.numberOfGpuLayers);
+}
+
+int main(int argc, char **argv) {
+    SynexisArguments args("");
+    ServerOptions options;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    throw std::invalid_argument("missing value for " + arg);
+                }
+                return argv[++i];
+            };
+            if (arg == "-h" || arg == "--help") {
+                printUsage(argv[0]);
+                return 0;
+            } else if (arg == "-m" || arg == "--model") args.modelPath = value();
+            else if (arg == "--mmproj") args.modelProjectorPath = value();
+            else if (arg == "--host") options.host = value();
+            else if (arg == "--port") options.port = std::stoi(value());
+            else if (arg == "--alias") options.modelName = value();
+            else if (arg == "--slots") args.n_slots = std::stoi(value());
+            else if (arg == "--ctx") args.n_ctx = std::stoi(value());
+            else if (arg == "--batch") args.n_batch = std::stoi(value());
+            else if (arg == "--threads") args.numberOfThreads = std::stoi(value());
+            else if (arg == "--gpu-layers") args.numberOfGpuLayers = std::stoi(value());
+            else if (arg == "--embedding") args.embedding = true;
+            else {
+                throw std::invalid_argument("unknown argument " + arg);
+            }
+        }
+        if (args.modelPath.empty()) {
+            throw std::invalid_argument("a model is required (-m)");
+        }
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        printUsage(argv[0]);
+        return 1;
+    }
+    options.embedding = args.embedding;
+    if (options.modelName.empty()) {
+        const size_t slash = args.modelPath.find_last_of('/');
+        options.modelName = slash == std::string::npos ? args.modelPath : args.modelPath.substr(slash + 1);
+    }
+
+    try {
+        Synexis engine(args);
+        engine.run();
+
+        Server server(engine, options);
+        activeServer = &server;
+        std::signal(SIGINT, onSignal);
+        std::signal(SIGTERM, onSignal);
+        server.run();
+        activeServer = nullptr;
+
+        engine.stop();
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
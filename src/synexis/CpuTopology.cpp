@@ -0,0 +1,116 @@
+#include "CpuTopology.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+std::vector<int> parseCpuList(const std::string &list) {
+    std::vector<int> cpus;
+    size_t position = 0;
+    try {
+        while (position < list.size()) {
+            size_t end = list.find(',', position);
+            if (end == std::string::npos) {
+                end = list.size();
+            }
+            const std::string range = list.substr(position, end - position);
+            position = end + 1;
+            if (range.empty() || range == "\n") {
+                continue;
+            }
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            if (first < 0 || last < first) {
+                return {};
+            }
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+    } catch (const std::logic_error &) {
+        return {};
+    }
+    return cpus;
+}
+
+#ifdef __linux__
+static std::vector<int> allowedCpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+std::vector<std::vector<int>> numaNodeCpus() {
+    const std::vector<int> allowed = allowedCpus();
+    std::vector<std::pair<int, std::vector<int>>> nodes;
+    if (DIR *directory = opendir("/sys/devices/system/node")) {
+        while (dirent *entry = readdir(directory)) {
+            const std::string name = entry->d_name;
+            if (name.size() <= 4 || name.compare(0, 4, "node") != 0 ||
+                name.find_first_not_of("0123456789", 4) != std::string::npos) {
+                continue;
+            }
+            std::ifstream file("/sys/devices/system/node/" + name + "/cpulist");
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> cpus;
+            for (int cpu: parseCpuList(list)) {
+                // Offline CPUs and the ones outside a taskset or cgroup cpuset are not in the allowed set
+                if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+                    cpus.push_back(cpu);
+                }
+            }
+            if (!cpus.empty()) {
+                nodes.emplace_back(std::stoi(name.substr(4)), std::move(cpus));
+            }
+        }
+        closedir(directory);
+    }
+    std::sort(nodes.begin(), nodes.end());
+    std::vector<std::vector<int>> result;
+    for (auto &node: nodes) {
+        result.push_back(std::move(node.second));
+    }
+    if (result.empty()) {
+        result.push_back(allowed);
+    }
+    return result;
+}
+
+bool pinCurrentThread(const std::vector<int> &cpus) {
+    if (cpus.empty()) {
+        return true;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+#else
+std::vector<std::vector<int>> numaNodeCpus() {
+    return {{}};
+}
+
+bool pinCurrentThread(const std::vector<int> &cpus) {
+    return cpus.empty();
+}
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// CPUs of every NUMA node this process may run on, in node order, nodes without such a CPU left out. A single entry
+// holding every allowed CPU when sysfs has no topology, a single empty one (no pinning) on other platforms. Never
+// empty.
+std::vector<std::vector<int>> numaNodeCpus();
+
+// "0-3,8,10-11" as found in sysfs, empty when malformed
+std::vector<int> parseCpuList(const std::string &list);
+
+// Restricts the calling thread to `cpus`, the threads it starts afterwards inherit the mask. Nothing to do for an
+// empty list, false when the platform does not support it or the call failed.
+bool pinCurrentThread(const std::vector<int> &cpus);
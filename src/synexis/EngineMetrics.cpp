@@ -0,0 +1,156 @@
+#include "EngineMetrics.h"
+
+#include <algorithm>
+#include <sstream>
+
+Histogram Histogram::exponential(uint64_t first, uint64_t factor, size_t n, double scale) {
+    Histogram histogram(scale);
+    histogram.n_bounds = std::min<size_t>(n, METRICS_MAX_BUCKETS);
+    uint64_t bound = first;
+    for (size_t i = 0; i < histogram.n_bounds; ++i) {
+        histogram.bounds[i] = bound;
+        bound *= factor;
+    }
+    return histogram;
+}
+
+Histogram Histogram::linear(uint64_t step, size_t n, double scale) {
+    Histogram histogram(scale);
+    histogram.n_bounds = std::min<size_t>(n, METRICS_MAX_BUCKETS);
+    for (size_t i = 0; i < histogram.n_bounds; ++i) {
+        histogram.bounds[i] = step * (i + 1);
+    }
+    return histogram;
+}
+
+Histogram::Histogram(const Histogram &other): bounds(other.bounds), n_bounds(other.n_bounds), scale(other.scale) {
+    for (size_t i = 0; i <= n_bounds; ++i) {
+        counts[i].store(other.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    sum.store(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+    HistogramSnapshot snapshot;
+    snapshot.bounds.reserve(n_bounds);
+    for (size_t i = 0; i < n_bounds; ++i) {
+        snapshot.bounds.push_back(bounds[i] * scale);
+    }
+    snapshot.counts.reserve(n_bounds + 1);
+    for (size_t i = 0; i <= n_bounds; ++i) {
+        const uint64_t count = counts[i].load(std::memory_order_relaxed);
+        snapshot.counts.push_back(count);
+        snapshot.count += count;
+    }
+    snapshot.sum = sum.load(std::memory_order_relaxed) * scale;
+    return snapshot;
+}
+
+EngineMetrics::EngineMetrics(int n_slots): n_slots(n_slots),
+                                           slotKvCells(std::make_unique<std::atomic<int32_t>[]>(n_slots)) {
+    for (int i = 0; i < n_slots; ++i) {
+        slotKvCells[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+MetricsSnapshot EngineMetrics::snapshot() const {
+    MetricsSnapshot snapshot;
+    snapshot.requestsAdmitted = requestsAdmitted.load(std::memory_order_relaxed);
+    snapshot.requestsCompleted = requestsCompleted.load(std::memory_order_relaxed);
+    snapshot.requestsFailed = requestsFailed.load(std::memory_order_relaxed);
+    snapshot.requestsCancelled = requestsCancelled.load(std::memory_order_relaxed);
+    snapshot.promptTokens = promptTokens.load(std::memory_order_relaxed);
+    snapshot.generatedTokens = generatedTokens.load(std::memory_order_relaxed);
+    snapshot.decodeSteps = decodeSteps.load(std::memory_order_relaxed);
+    snapshot.decodeRetries = decodeRetries.load(std::memory_order_relaxed);
+    snapshot.contextShifts = contextShifts.load(std::memory_order_relaxed);
+    snapshot.queueDepth = queueDepth.load(std::memory_order_relaxed);
+    snapshot.timeToFirstToken = timeToFirstToken.snapshot();
+    snapshot.interTokenLatency = interTokenLatency.snapshot();
+    snapshot.queueWait = queueWait.snapshot();
+    snapshot.prefillTokens = prefillTokens.snapshot();
+    snapshot.decodeTokens = decodeTokens.snapshot();
+    snapshot.batchFill = batchFill.snapshot();
+    snapshot.slotKvCells.reserve(n_slots);
+    for (int i = 0; i < n_slots; ++i) {
+        snapshot.slotKvCells.push_back(slotKvCells[i].load(std::memory_order_relaxed));
+    }
+    return snapshot;
+}
+
+// Linear interpolation inside the bucket holding the quantile, the overflow bucket reports its lower bound
+double HistogramSnapshot::quantile(double q) const {
+    if (count == 0) {
+        return 0.0;
+    }
+    const double rank = q * count;
+    double seen = 0.0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (counts[i] == 0 || seen + counts[i] < rank) {
+            seen += counts[i];
+            continue;
+        }
+        const double lower = i == 0 ? 0.0 : bounds[i - 1];
+        if (i == bounds.size()) {
+            return lower;
+        }
+        return lower + (bounds[i] - lower) * (rank - seen) / counts[i];
+    }
+    return bounds.empty() ? 0.0 : bounds.back();
+}
+
+namespace {
+    void writeCounter(std::ostringstream &out, const char *name, const char *help, uint64_t value) {
+        out << "# HELP synexis_" << name << ' ' << help << '\n'
+                << "# TYPE synexis_" << name << " counter\n"
+                << "synexis_" << name << ' ' << value << '\n';
+    }
+
+    void writeHistogram(std::ostringstream &out, const char *name, const char *help,
+                        const HistogramSnapshot &histogram) {
+        out << "# HELP synexis_" << name << ' ' << help << '\n'
+                << "# TYPE synexis_" << name << " histogram\n";
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < histogram.bounds.size(); ++i) {
+            cumulative += histogram.counts[i];
+            out << "synexis_" << name << "_bucket{le=\"" << histogram.bounds[i] << "\"} " << cumulative << '\n';
+        }
+        out << "synexis_" << name << "_bucket{le=\"+Inf\"} " << histogram.count << '\n'
+                << "synexis_" << name << "_sum " << histogram.sum << '\n'
+                << "synexis_" << name << "_count " << histogram.count << '\n';
+    }
+}
+
+std::string MetricsSnapshot::toPrometheus() const {
+    std::ostringstream out;
+    writeCounter(out, "requests_admitted_total", "Requests assigned to a slot.", requestsAdmitted);
+    writeCounter(out, "requests_completed_total", "Requests that finished generating.", requestsCompleted);
+    writeCounter(out, "requests_failed_total", "Requests dropped by an error.", requestsFailed);
+    writeCounter(out, "requests_cancelled_total", "Requests stopped by their cancel flag.", requestsCancelled);
+    writeCounter(out, "prompt_tokens_total", "Prompt tokens decoded.", promptTokens);
+    writeCounter(out, "generated_tokens_total", "Tokens sampled.", generatedTokens);
+    writeCounter(out, "decode_steps_total", "Batches decoded.", decodeSteps);
+    writeCounter(out, "decode_retries_total", "Batches decoded again with a smaller size after a failure.",
+                 decodeRetries);
+    writeCounter(out, "context_shifts_total", "Slots that discarded half their context to keep generating.",
+                 contextShifts);
+    out << "# HELP synexis_queue_depth Requests waiting for a slot.\n"
+            << "# TYPE synexis_queue_depth gauge\n"
+            << "synexis_queue_depth " << queueDepth << '\n';
+
+    writeHistogram(out, "time_to_first_token_seconds", "Time from enqueueing to the first generated token.",
+                   timeToFirstToken);
+    writeHistogram(out, "inter_token_latency_seconds", "Time between two generated tokens of a request.",
+                   interTokenLatency);
+    writeHistogram(out, "queue_wait_seconds", "Time from enqueueing to getting a slot.", queueWait);
+    writeHistogram(out, "prefill_tokens_per_step", "Prompt tokens in one decoded batch.", prefillTokens);
+    writeHistogram(out, "decode_tokens_per_step", "Generated tokens in one decoded batch.", decodeTokens);
+    writeHistogram(out, "batch_fill_ratio", "Tokens in one decoded batch over the batch size.", batchFill);
+
+    out << "# HELP synexis_slot_kv_cells KV cells held by the sequence of a slot.\n"
+            << "# TYPE synexis_slot_kv_cells gauge\n";
+    for (size_t i = 0; i < slotKvCells.size(); ++i) {
+        out << "synexis_slot_kv_cells{slot=\"" << i << "\"} " << slotKvCells[i] << '\n';
+    }
+    return out.str();
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include "synexis/Metrics.h"
+
+#define METRICS_MAX_BUCKETS 24
+
+// Fixed-bucket histogram updated with relaxed atomics, observing a value is a short scan and two increments.
+// Values are integers in the metric's raw unit (microseconds, tokens, per-mille), `scale` converts them for
+// snapshots.
+class Histogram {
+public:
+    // Buckets bounded by first, first * factor, ... `n` bounds in total
+    static Histogram exponential(uint64_t first, uint64_t factor, size_t n, double scale = 1.0);
+
+    // Buckets bounded by step, 2 * step, ... `n` bounds in total
+    static Histogram linear(uint64_t step, size_t n, double scale = 1.0);
+
+    Histogram(const Histogram &other);
+
+    void observe(uint64_t value) {
+        size_t i = 0;
+        while (i < n_bounds && value > bounds[i]) {
+            ++i;
+        }
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    HistogramSnapshot snapshot() const;
+
+private:
+    explicit Histogram(double scale): scale(scale) {
+    }
+
+    std::array<uint64_t, METRICS_MAX_BUCKETS> bounds{};
+    size_t n_bounds = 0;
+    double scale;
+    std::array<std::atomic<uint64_t>, METRICS_MAX_BUCKETS + 1> counts{};
+    std::atomic<uint64_t> sum{0};
+};
+
+// Counters and histograms of one engine. Written from the admission and worker threads without locks, read
+// whenever a snapshot is taken; a snapshot is not atomic as a whole, each value is.
+struct EngineMetrics {
+    using Clock = std::chrono::steady_clock;
+
+    explicit EngineMetrics(int n_slots);
+
+    static uint64_t microseconds(Clock::duration duration) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    }
+
+    static void add(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    MetricsSnapshot snapshot() const;
+
+    std::atomic<uint64_t> requestsAdmitted{0};
+    std::atomic<uint64_t> requestsCompleted{0};
+    std::atomic<uint64_t> requestsFailed{0};
+    std::atomic<uint64_t> requestsCancelled{0};
+    std::atomic<uint64_t> promptTokens{0};
+    std::atomic<uint64_t> generatedTokens{0};
+    std::atomic<uint64_t> decodeSteps{0};
+    std::atomic<uint64_t> decodeRetries{0};
+    std::atomic<uint64_t> contextShifts{0};
+    std::atomic<uint64_t> queueDepth{0};
+
+    // 100us to ~105s
+    Histogram timeToFirstToken = Histogram::exponential(100, 2, 21, 1e-6);
+    Histogram interTokenLatency = Histogram::exponential(100, 2, 21, 1e-6);
+    Histogram queueWait = Histogram::exponential(100, 2, 21, 1e-6);
+    // 1 to 8192 tokens
+    Histogram prefillTokens = Histogram::exponential(1, 2, 14);
+    Histogram decodeTokens = Histogram::exponential(1, 2, 14);
+    // Per-mille of n_batch, in tenths
+    Histogram batchFill = Histogram::linear(100, 10, 1e-3);
+
+    int n_slots;
+    std::unique_ptr<std::atomic<int32_t>[]> slotKvCells;
+};
@@ -0,0 +1,87 @@
+#include "MappedFile.h"
+
+#include <memory>
+#include <stdexcept>
+
+#include "synexis/TaskParams.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string &path) {
+#ifdef _WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        file = nullptr;
+        throw std::runtime_error("Failed to open media file: " + path);
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        throw std::runtime_error("Media file is empty or unreadable: " + path);
+    }
+    length = static_cast<size_t>(file_size.QuadPart);
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) {
+        CloseHandle(file);
+        throw std::runtime_error("Failed to map media file: " + path);
+    }
+    address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (address == nullptr) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        throw std::runtime_error("Failed to map media file: " + path);
+    }
+#else
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open media file: " + path);
+    }
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Media file is empty or unreadable: " + path);
+    }
+    length = static_cast<size_t>(st.st_size);
+    address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file referenced
+    close(fd);
+    if (address == MAP_FAILED) {
+        address = nullptr;
+        throw std::runtime_error("Failed to map media file: " + path);
+    }
+    // The decoder reads the file front to back once
+    madvise(address, length, MADV_SEQUENTIAL);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (address != nullptr) {
+        UnmapViewOfFile(address);
+    }
+    if (mapping != nullptr) {
+        CloseHandle(mapping);
+    }
+    if (file != nullptr) {
+        CloseHandle(file);
+    }
+#else
+    if (address != nullptr) {
+        munmap(address, length);
+    }
+#endif
+}
+
+void TaskParams::addMediaFile(const std::string &path) {
+    auto file = std::make_shared<MappedFile>(path);
+    media.push_back({file->data(), file->size(), file});
+}
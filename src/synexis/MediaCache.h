@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define MEDIA_DECODED_CACHE_BYTES (256ull * 1024 * 1024)
+#define MEDIA_ENCODED_CACHE_BYTES (512ull * 1024 * 1024)
+
+// Least recently used values bounded by the sum of their sizes in bytes. Not synchronized, the owner of each cache
+// guards it.
+template<typename T>
+class MediaLru {
+public:
+    explicit MediaLru(size_t maxBytes): maxBytes(maxBytes) {
+    }
+
+    std::shared_ptr<const T> find(const std::string &key) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->value;
+    }
+
+    void insert(const std::string &key, std::shared_ptr<const T> value, size_t bytes) {
+        if (bytes > maxBytes || index.count(key) != 0) {
+            return;
+        }
+        entries.push_front({key, std::move(value), bytes});
+        index.emplace(key, entries.begin());
+        totalBytes += bytes;
+        while (totalBytes > maxBytes) {
+            const Entry &oldest = entries.back();
+            totalBytes -= oldest.bytes;
+            index.erase(oldest.key);
+            entries.pop_back();
+        }
+    }
+
+    void erase(const std::string &key) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return;
+        }
+        totalBytes -= it->second->bytes;
+        entries.erase(it->second);
+        index.erase(it);
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const T> value;
+        size_t bytes;
+    };
+
+    size_t maxBytes;
+    size_t totalBytes = 0;
+    std::list<Entry> entries;
+    std::unordered_map<std::string, typename std::list<Entry>::iterator> index;
+};
+
+// mtmd gives every chunk split out of one bitmap (audio longer than one encoder window, the slices of an image) the
+// id of the bitmap, the chunk's ordinal within its media and its size tell them apart
+inline std::string encodedMediaKey(const char *id, size_t ordinal, size_t n_tokens) {
+    return std::string(id) + '#' + std::to_string(ordinal) + ':' + std::to_string(n_tokens);
+}
+
+// Decoded pixels (RGB) or audio samples (float), enough to rebuild an mtmd bitmap without decoding the file again
+struct DecodedMedia {
+    uint32_t nx = 0;
+    uint32_t ny = 0;
+    bool audio = false;
+    std::vector<unsigned char> data;
+};
+
+// Output of the vision or audio encoder for one media chunk, `n_tokens * n_embd` floats.
+// Filled by the media encoder thread, `embd` and `failed` may only be read once `ready` is set.
+struct EncodedMedia {
+    std::vector<float> embd;
+    bool failed = false;
+    std::atomic<bool> ready{false};
+};
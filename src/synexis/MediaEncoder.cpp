@@ -0,0 +1,117 @@
+#include "MediaEncoder.h"
+
+#include "CpuTopology.h"
+#include "ggml.h"
+#include "../vendor/llama.cpp/ggml/src/ggml-impl.h"
+
+MediaEncoder::MediaEncoder(mtmd_context *mctx, const llama_model *model, Tracer &tracer,
+                           std::vector<mtmd::context_ptr> extraContexts,
+                           std::vector<int> cpus): mainContext(mctx), extraContexts(std::move(extraContexts)),
+                                                   n_embd(llama_model_n_embd(model)), tracer(tracer),
+                                                   cpus(std::move(cpus)) {
+}
+
+MediaEncoder::~MediaEncoder() {
+    stop();
+}
+
+void MediaEncoder::start() {
+    std::lock_guard lock(mutex);
+    if (running) {
+        return;
+    }
+    running = true;
+    threads.emplace_back(&MediaEncoder::loop, this, mainContext);
+    for (auto &context: extraContexts) {
+        threads.emplace_back(&MediaEncoder::loop, this, context.get());
+    }
+}
+
+void MediaEncoder::stop() {
+    {
+        std::lock_guard lock(mutex);
+        running = false;
+    }
+    jobsCv.notify_all();
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    threads.clear();
+}
+
+std::shared_ptr<const EncodedMedia> MediaEncoder::submit(const mtmd_input_chunk *chunk, size_t ordinal) {
+    const char *id = mtmd_input_chunk_get_id(chunk);
+    const size_t n_tokens = mtmd_input_chunk_get_n_tokens(chunk);
+    const size_t bytes = n_tokens * n_embd * sizeof(float);
+    const std::string key = id != nullptr ? encodedMediaKey(id, ordinal, n_tokens) : "";
+
+    auto media = std::make_shared<EncodedMedia>();
+    {
+        std::lock_guard lock(mutex);
+        if (!key.empty()) {
+            // Entries are inserted before they are encoded, a hit may still be pending
+            if (auto cached = cache.find(key)) {
+                return cached;
+            }
+            cache.insert(key, media, bytes);
+        }
+        jobs.push_back({mtmd::input_chunk_ptr(mtmd_input_chunk_copy(chunk)), key, media});
+    }
+    jobsCv.notify_one();
+    return media;
+}
+
+void MediaEncoder::waitForProgress(std::chrono::milliseconds timeout) {
+    std::unique_lock lock(progressMutex);
+    const uint64_t seen = completed;
+    progressCv.wait_for(lock, timeout, [&] { return completed != seen; });
+}
+
+void MediaEncoder::loop(mtmd_context *mctx) {
+    tracer.nameThread("media encoder");
+    pinCurrentThread(cpus);
+    while (true) {
+        Job job; {
+            std::unique_lock lock(mutex);
+            jobsCv.wait(lock, [this] { return !jobs.empty() || !running; });
+            if (!running) {
+                break;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        encode(job, mctx);
+    }
+
+    // Nobody will encode what is left, fail it so no slot waits forever
+    std::lock_guard lock(mutex);
+    for (auto &job: jobs) {
+        job.media->failed = true;
+        job.media->ready.store(true, std::memory_order_release);
+    }
+    jobs.clear();
+}
+
+void MediaEncoder::encode(Job &job, mtmd_context *mctx) {
+    TraceScope scope(tracer, "encode_media");
+    scope.arg(0, "tokens", mtmd_input_chunk_get_n_tokens(job.chunk.get()));
+    const int32_t result = mtmd_encode_chunk(mctx, job.chunk.get());
+    if (result != 0) {
+        GGML_LOG_ERROR("mtmd_encode_chunk failed with status %d\n", result);
+        job.media->failed = true;
+        if (!job.key.empty()) {
+            // A later request retries instead of getting the failure
+            std::lock_guard lock(mutex);
+            cache.erase(job.key);
+        }
+    } else {
+        const float *embd = mtmd_get_output_embd(mctx);
+        job.media->embd.assign(embd, embd + mtmd_input_chunk_get_n_tokens(job.chunk.get()) * n_embd);
+    }
+    job.media->ready.store(true, std::memory_order_release);
+    {
+        std::lock_guard lock(progressMutex);
+        ++completed;
+    }
+    progressCv.notify_all();
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llama.h"
+#include "mtmd.h"
+#include "MediaCache.h"
+#include "Tracer.h"
+
+// Runs the vision and audio encoders on their own threads, so a large image no longer stalls the decode loop.
+// The admission thread submits every media chunk of a request as soon as it is tokenized and gets a handle back;
+// the worker thread only decodes the embeddings of a chunk once its handle is ready and keeps generating for the
+// other slots in the meantime. Encoder outputs stay in an LRU keyed by the chunk id, so a file seen before, or one
+// that is still being encoded for another request, is never encoded twice. mtmd encodes one chunk per call, so
+// chunks queued by several requests are spread over one thread per projector context instead of being batched.
+class MediaEncoder {
+public:
+    // `mctx` stays owned by the caller, `extraContexts` are more instances of the same projector. The encoder threads
+    // run on `cpus`, anywhere when empty.
+    MediaEncoder(mtmd_context *mctx, const llama_model *model, Tracer &tracer,
+                 std::vector<mtmd::context_ptr> extraContexts = {}, std::vector<int> cpus = {});
+
+    MediaEncoder(const MediaEncoder &) = delete;
+
+    MediaEncoder &operator=(const MediaEncoder &) = delete;
+
+    ~MediaEncoder();
+
+    void start();
+
+    void stop();
+
+    // Queues the chunk unless its output is cached or already being encoded, never blocks on the encoder. `ordinal`
+    // counts the chunks of the same media before this one.
+    std::shared_ptr<const EncodedMedia> submit(const mtmd_input_chunk *chunk, size_t ordinal);
+
+    // Worker thread: sleeps until some media finished encoding or `timeout` passed
+    void waitForProgress(std::chrono::milliseconds timeout);
+
+private:
+    struct Job {
+        mtmd::input_chunk_ptr chunk;
+        // Cache entry, empty when the chunk has no id
+        std::string key;
+        std::shared_ptr<EncodedMedia> media;
+    };
+
+    void loop(mtmd_context *mctx);
+
+    void encode(Job &job, mtmd_context *mctx);
+
+    mtmd_context *mainContext;
+    std::vector<mtmd::context_ptr> extraContexts;
+    int32_t n_embd;
+    Tracer &tracer;
+    std::vector<int> cpus;
+
+    std::mutex mutex;
+    std::condition_variable jobsCv;
+    std::deque<Job> jobs;
+    MediaLru<EncodedMedia> cache{MEDIA_ENCODED_CACHE_BYTES};
+
+    std::mutex progressMutex;
+    std::condition_variable progressCv;
+    uint64_t completed = 0;
+
+    std::vector<std::thread> threads;
+    bool running = false;
+};
@@ -1,13 +1,26 @@
 #pragma once
 
+#include <chrono>
 #include <string>
 #include <future>
+#include "synexis/CompletionResult.h"
+#include "synexis/ScoreResult.h"
 #include "synexis/TaskParams.h"
 #include "synexis/sampler/StructParams.h"
 
 struct Request {
     int id;
-    std::string prompt;
     TaskParams params;
-    std::promise<std::string> promise;
+    std::promise<CompletionResult> promise;
+    std::chrono::steady_clock::time_point enqueued = std::chrono::steady_clock::now();
+
+    bool cancelled() const {
+        return params.cancelled && params.cancelled->load(std::memory_order_relaxed);
+    }
+};
+
+struct ScoreRequest {
+    std::string prompt;
+    std::vector<std::string> continuations;
+    std::promise<std::vector<ScoreResult>> promise;
 };
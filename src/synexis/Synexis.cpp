@@ -8,14 +8,31 @@ Synexis::Synexis(SynexisArguments args) {
 }
 
 
-std::future<std::string> Synexis::addTask(const std::string &prompt, const TaskParams &params) {
+std::future<CompletionResult> Synexis::addTask(const std::string &prompt, const TaskParams &params) {
     return impl->addTask(prompt, params);
 }
 
+std::future<CompletionResult> Synexis::addTask(TaskParams params) {
+    return impl->addTask(std::move(params));
+}
+
+std::future<CompletionResult> Synexis::addTask(std::vector<int32_t> tokens, TaskParams params) {
+    return impl->addTask(std::move(tokens), std::move(params));
+}
+
+std::vector<std::future<CompletionResult>> Synexis::addTasks(std::vector<TaskParams> params) {
+    return impl->addTasks(std::move(params));
+}
+
 std::string Synexis::get_result(int task_id) {
     return "";
 }
 
+std::future<std::vector<ScoreResult>> Synexis::score(const std::string &prompt,
+                                                     const std::vector<std::string> &continuations) {
+    return impl->score(prompt, continuations);
+}
+
 void Synexis::run() const {
     impl->run();
 }
@@ -24,10 +41,38 @@ void Synexis::stop() const {
     impl->stop();
 }
 
+MetricsSnapshot Synexis::metrics() const {
+    return impl->metricsSnapshot();
+}
+
+std::string Synexis::traceJson() const {
+    return impl->getTracer().json();
+}
+
+bool Synexis::dumpTrace(const std::string &path) const {
+    return impl->getTracer().dump(path);
+}
+
+std::string Synexis::modelPath() const {
+    return impl->arguments().modelPath;
+}
+
 std::string Synexis::getTemplate() const {
     return impl->getTemplate();
 }
 
+bool Synexis::hasNativeChatTemplate() const {
+    return impl->hasNativeChatTemplate();
+}
+
+std::string Synexis::applyChatTemplate(const std::vector<ChatMessage> &messages, bool addGenerationPrompt) const {
+    return impl->applyChatTemplate(messages, addGenerationPrompt);
+}
+
+std::string Synexis::mediaMarker() {
+    return mtmd_default_marker();
+}
+
 std::string Synexis::getToken(std::string str) const {
     return impl->getToken(str);
 }
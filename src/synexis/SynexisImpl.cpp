@@ -5,6 +5,9 @@
 #include <stdexcept>
 
 #include "batch_helper.h"
+#include "CpuTopology.h"
+#include "ggml-backend.h"
+#include "sampler/Logprobs.h"
 #include "SynexisSlot.h"
 #include "synexis/TaskParams.h"
 #include "TaskTokens.h"
@@ -13,7 +16,10 @@
 #include "../vendor/llama.cpp/src/llama-model.h"
 #include "synexis/SynexisArguments.h"
 
-#define TOKEN_PIECE_MAX_SIZE 64
+// LLAMA_MAX_SEQ of the vendored llama.cpp, scoring uses the sequence ids after the slots
+#define MAX_SEQUENCES 64
+// Number of message boundaries, counted from the end of the chat, looked up in the tokenization cache
+#define TOKENIZATION_CACHE_CANDIDATES 4
 #define CHATML_TEMPLATE_SRC \
 "{%- for message in messages -%}\n" \
 "  {{- '<|im_start|>' + message.role + '\n' + message.content + '<|im_end|>\n' -}}\n" \
@@ -22,7 +28,8 @@
 "  {{- '<|im_start|>assistant\n' -}}\n" \
 "{%- endif -%}"
 
-SynexisImpl::SynexisImpl(const SynexisArguments &args): params(args) {
+SynexisImpl::SynexisImpl(const SynexisArguments &args): metrics(args.n_slots), tracer(args.traceCapacity),
+                                                        params(args) {
     ggml_backend_load_all();
     llama_log_set([](ggml_log_level level, const char *text, void * /*user_data*/) {
         if (level != GGML_LOG_LEVEL_DEBUG) {
@@ -43,17 +50,25 @@ SynexisImpl::SynexisImpl(const SynexisArguments &args): params(args) {
     contextParams.n_batch = params.n_batch;
     contextParams.n_ubatch = 512;
     contextParams.n_threads_batch = params.numberOfThreads;
+    if (!params.cpus.empty()) {
+        // Both share the pool attached below, sized for the batch threads
+        contextParams.n_threads = std::min<int>(contextParams.n_threads, params.numberOfThreads);
+    }
     contextParams.embeddings = args.embedding;
     ctx = llama_init_from_model(model, contextParams);
 
     if (ctx == nullptr) {
         throw std::runtime_error("Failed to create context");
     }
+    if (!params.cpus.empty()) {
+        attachThreadpool();
+    }
 
     slots.reserve(args.n_slots);
     for (int i = 0; i < args.n_slots; ++i) {
         auto slot = std::make_unique<SynexisSlot>();
         slot->id = i;
+        slot->metrics = &metrics;
         slots.push_back(std::move(slot));
     }
     if (!args.modelProjectorPath.empty()) {
@@ -62,11 +77,58 @@ SynexisImpl::SynexisImpl(const SynexisArguments &args): params(args) {
         mparams.n_threads = params.numberOfThreads;
         mparams.verbosity = GGML_LOG_LEVEL_ERROR;
         mtmd_context = mtmd_init_from_file(args.modelProjectorPath.c_str(), model, mparams);
+        if (mtmd_context != nullptr) {
+            // Every extra encoder loads its own copy of the projector weights
+            std::vector<mtmd::context_ptr> extraContexts;
+            for (int i = 1; i < args.mediaEncoders; ++i) {
+                mtmd::context_ptr extra(mtmd_init_from_file(args.modelProjectorPath.c_str(), model, mparams));
+                if (!extra) {
+                    throw std::runtime_error("Failed to load the projector for a media encoder");
+                }
+                extraContexts.push_back(std::move(extra));
+            }
+            mediaEncoder = std::make_unique<MediaEncoder>(mtmd_context, model, tracer, std::move(extraContexts),
+                                                          params.cpus);
+        }
     }
 
+    // Matching the template once here keeps the per-request rendering to the renderer itself
+    const char *modelTemplate = llama_model_chat_template(model, nullptr);
+    chatTemplate = modelTemplate ? llm_chat_detect_template(modelTemplate) : LLM_CHAT_TEMPLATE_CHATML;
+
     batch = llama_batch_init(params.n_batch, 0, 1);
 }
 
+// Without a pool attached, the CPU backend starts its compute threads for every graph and they inherit the mask of
+// the worker thread. A pool keeps them alive between steps, each one restricted to params.cpus.
+void SynexisImpl::attachThreadpool() {
+    ggml_backend_dev_t cpu = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (cpu == nullptr) {
+        return;
+    }
+    // Looked up through the registry, the CPU backend may be a module loaded by ggml_backend_load_all()
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(cpu);
+    auto threadpoolNew = reinterpret_cast<ggml_threadpool *(*)(ggml_threadpool_params *)>(
+        ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new"));
+    threadpoolFree = reinterpret_cast<void (*)(ggml_threadpool *)>(
+        ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free"));
+    if (threadpoolNew == nullptr || threadpoolFree == nullptr) {
+        GGML_LOG_WARN("The CPU backend has no thread pool, its threads are not pinned\n");
+        return;
+    }
+    ggml_threadpool_params poolParams = ggml_threadpool_params_default(params.numberOfThreads);
+    for (int cpu_id: params.cpus) {
+        if (cpu_id >= 0 && cpu_id < GGML_MAX_N_THREADS) {
+            poolParams.cpumask[cpu_id] = true;
+        }
+    }
+    threadpool = threadpoolNew(&poolParams);
+    if (threadpool == nullptr) {
+        throw std::runtime_error("Failed to create the thread pool");
+    }
+    llama_attach_threadpool(ctx, threadpool, threadpool);
+}
+
 void common_embd_normalize(const float *inp, float *out, int n, int embd_norm) {
     double sum = 0.0;
 
@@ -145,38 +207,103 @@ std::vector<std::vector<float> > SynexisImpl::getEmbedding(const std::string &pr
     return embeddings_res;
 }
 
-std::future<std::string> SynexisImpl::addTask(const std::string &prompt, const TaskParams &params) {
+std::future<CompletionResult> SynexisImpl::addTask(const std::string &prompt, const TaskParams &params) {
+    TaskParams task = params;
+    task.prompt = prompt;
+    task.promptOwner.reset();
+    return addTask(std::move(task));
+}
+
+std::future<CompletionResult> SynexisImpl::addTask(TaskParams &&params) {
     auto request = std::make_unique<Request>();
-    request->prompt = prompt;
-    request->params = params;
+    request->params = std::move(params);
+    std::future<CompletionResult> future = request->promise.get_future(); {
+        std::lock_guard lock(tokenization_queue_mutex);
+        if (!stopped) {
+            tokenization_queue.push_back(std::move(request));
+        }
+    }
+    if (request) {
+        failRequest(*request, "The engine is stopped");
+        return future;
+    }
+    EngineMetrics::add(metrics.queueDepth);
+    tokenization_queue_cv.notify_one();
+    return future;
+}
 
-    // Create a promise/future pair
-    std::future<std::string> future = request->promise.get_future();
+std::future<CompletionResult> SynexisImpl::addTask(std::vector<llama_token> &&tokens, TaskParams &&params) {
+    params.tokens = std::move(tokens);
+    return addTask(std::move(params));
+}
 
-    // Find a free slot
-    SynexisSlot *slot = nullptr;
-    //Forcing one slot to be selected at atime
-    std::unique_lock lock(slotLock);
-    GGML_LOG_INFO("Waiting for a free slot\n");
-    while (slot == nullptr) {
-        slot = findEmptySlot();
-        if (slot == nullptr) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+std::vector<std::future<CompletionResult>> SynexisImpl::addTasks(std::vector<TaskParams> &&params) {
+    std::vector<std::unique_ptr<Request>> requests;
+    std::vector<std::future<CompletionResult>> futures;
+    requests.reserve(params.size());
+    futures.reserve(params.size());
+    for (auto &task: params) {
+        auto request = std::make_unique<Request>();
+        request->params = std::move(task);
+        futures.push_back(request->promise.get_future());
+        requests.push_back(std::move(request));
+    } {
+        std::lock_guard lock(tokenization_queue_mutex);
+        if (!stopped) {
+            for (auto &request: requests) {
+                tokenization_queue.push_back(std::move(request));
+            }
+            requests.clear();
+        }
+    }
+    if (!requests.empty()) {
+        for (auto &request: requests) {
+            failRequest(*request, "The engine is stopped");
         }
+        return futures;
     }
-    GGML_LOG_INFO("Found a free slot\n");
-    // Tokenization
-    if (mtmd_context != nullptr) {
+    EngineMetrics::add(metrics.queueDepth, futures.size());
+    tokenization_queue_cv.notify_one();
+    return futures;
+}
+
+void SynexisImpl::admit(std::unique_ptr<Request> &request, SynexisSlot *slot) {
+    // Tokenized straight from the caller's buffer
+    std::string_view prompt = request->params.promptView();
+    std::string rendered;
+    const bool hasMedia = mtmd_context != nullptr && !request->params.media.empty();
+    if (request->params.tokens.empty() && !request->params.messages.empty()) {
+        if (hasMedia) {
+            rendered = applyChatTemplate(request->params.messages, request->params.addGenerationPrompt);
+            prompt = rendered;
+        } else {
+            slot->tokens = TaskTokens(tokenizeChat(request->params.messages, request->params.addGenerationPrompt));
+        }
+    }
+
+    if (!request->params.tokens.empty()) {
+        const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+        for (const llama_token token: request->params.tokens) {
+            if (token < 0 || token >= n_vocab) {
+                throw std::runtime_error("Invalid token id in the prompt: " + std::to_string(token));
+            }
+        }
+        slot->tokens = TaskTokens(std::move(request->params.tokens));
+    } else if (!request->params.messages.empty() && !hasMedia) {
+        // Already tokenized from the chat
+    } else if (mtmd_context != nullptr) {
+        //In case we have mtmd context we would have to parse media files
         mtmd::bitmaps bitmaps;
-        for (auto &[data, size]: request->params.media) {
-            mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_buf(mtmd_context, data, size));
-            std::string hash = fnv_hash(bmp.data(), bmp.n_bytes());
-            bmp.set_id(hash.c_str());
+        for (auto &[data, size, owner]: request->params.media) {
+            // Hashed before decoding: identical files share the id, which also keys their encoder output
+            const std::string id = std::to_string(hash_bytes(data, size));
+            mtmd::bitmap bmp(loadBitmap(id, data, size));
+            bmp.set_id(id.c_str());
             bitmaps.entries.push_back(std::move(bmp));
         }
 
         mtmd_input_text inp_txt = {
-            request->prompt.c_str(),
+            prompt.data(),
             /* add_special */ true,
             /* parse_special */ true,
         };
@@ -196,66 +323,334 @@ std::future<std::string> SynexisImpl::addTask(const std::string &prompt, const T
         }
 
         slot->tokens = TaskTokens(chunks);
+        // Encoding starts now, while the request still waits for the worker to reach its prompt
+        slot->tokens.encodeMedia(*mediaEncoder);
     } else {
-        size_t n_tokens = request->prompt.length();
-        auto vocab = llama_model_get_vocab(model);
-        std::vector<llama_token> tokenized(n_tokens);
-        n_tokens = llama_tokenize(
-            vocab,
-            request->prompt.data(),
-            request->prompt.length(),
-            tokenized.data(),
-            tokenized.size(),
-            false,
-            true
-        );
-        tokenized.resize(n_tokens);
-        slot->tokens = TaskTokens(std::move(tokenized));
+        slot->tokens = TaskTokens(tokenize(prompt, false));
     }
 
     // Setup the sampler and slot
     delete slot->sampler;
     slot->sampler = new SynexisSampler(model, request->params.samplerParams);
+    slot->probs.top.reserve(std::max(request->params.samplerParams.n_probs, 0));
+    metrics.queueWait.observe(EngineMetrics::microseconds(EngineMetrics::Clock::now() - request->enqueued));
+    EngineMetrics::add(metrics.requestsAdmitted);
     slot->request = std::move(request);
+    // Publishes the slot to the worker thread, everything above must be set first
     slot->state = SLOT_STATE_STARTED;
+}
 
-    return future;
+mtmd_bitmap *SynexisImpl::loadBitmap(const std::string &id, const uint8_t *data, size_t size) {
+    if (auto cached = decodedMedia.find(id)) {
+        if (cached->audio) {
+            return mtmd_bitmap_init_from_audio(cached->data.size() / sizeof(float),
+                                               reinterpret_cast<const float *>(cached->data.data()));
+        }
+        return mtmd_bitmap_init(cached->nx, cached->ny, cached->data.data());
+    }
+    mtmd_bitmap *bitmap = mtmd_helper_bitmap_init_from_buf(mtmd_context, data, size);
+    if (bitmap == nullptr) {
+        throw std::runtime_error("Failed to decode media");
+    }
+    auto decoded = std::make_shared<DecodedMedia>();
+    decoded->nx = mtmd_bitmap_get_nx(bitmap);
+    decoded->ny = mtmd_bitmap_get_ny(bitmap);
+    decoded->audio = mtmd_bitmap_is_audio(bitmap);
+    const unsigned char *pixels = mtmd_bitmap_get_data(bitmap);
+    decoded->data.assign(pixels, pixels + mtmd_bitmap_get_n_bytes(bitmap));
+    const size_t bytes = decoded->data.size();
+    decodedMedia.insert(id, std::move(decoded), bytes);
+    return bitmap;
 }
 
 std::string SynexisImpl::tokenToPiece(llama_token token, bool special) const {
+    std::string piece;
+    token_to_piece(llama_model_get_vocab(model), token, special, piece);
+    return piece;
+}
+
+
+std::vector<llama_token> SynexisImpl::tokenize(std::string_view text, bool add_special) const {
+    auto vocab = llama_model_get_vocab(model);
+    std::vector<llama_token> tokens(text.length() + 2);
+    int32_t n_tokens = llama_tokenize(vocab, text.data(), text.length(), tokens.data(), tokens.size(),
+                                      add_special, true);
+    if (n_tokens < 0) {
+        tokens.resize(-n_tokens);
+        n_tokens = llama_tokenize(vocab, text.data(), text.length(), tokens.data(), tokens.size(),
+                                  add_special, true);
+    }
+    tokens.resize(n_tokens);
+    return tokens;
+}
+
+// Tokenizes a chat reusing the tokens of the longest conversation prefix seen before, so a new turn only costs
+// its own text. Prefixes are cut where a message ends. Tokenizing two pieces separately gives the same tokens as
+// tokenizing them together only when one side of the cut is a special token, since the tokenizer splits the text
+// on special tokens first, so every cut is checked and merged back when it is not one.
+std::vector<llama_token> SynexisImpl::tokenizeChat(const std::vector<ChatMessage> &messages, bool addGenerationPrompt) {
+    const std::string full = applyChatTemplate(messages, addGenerationPrompt);
+    const size_t n = messages.size();
+    // Offset in `full` where the first `k` messages end, npos when the template renders them differently alone
+    std::vector<size_t> boundaries(n + 1, 0);
+    auto boundary = [&](size_t k) {
+        if (boundaries[k] == 0 && k > 0) {
+            const std::string prefix = applyChatTemplate(
+                std::vector<ChatMessage>(messages.begin(), messages.begin() + k), false);
+            boundaries[k] = full.compare(0, prefix.size(), prefix) == 0 ? prefix.size() : std::string::npos;
+        }
+        return boundaries[k];
+    };
     const llama_vocab *vocab = llama_model_get_vocab(model);
+    auto isSpecial = [vocab](llama_token token) {
+        return (llama_vocab_get_attr(vocab, token) & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_USER_DEFINED)) != 0;
+    };
+
+    std::vector<llama_token> tokens;
+    size_t start = 0;
+    const size_t firstCandidate = n >= TOKENIZATION_CACHE_CANDIDATES ? n + 1 - TOKENIZATION_CACHE_CANDIDATES : 1;
+    for (size_t k = n + 1; k-- > firstCandidate;) {
+        const size_t offset = boundary(k);
+        if (offset == std::string::npos || offset == 0) {
+            continue;
+        }
+        if (auto cached = tokenizationCache.find(std::string_view(full).substr(0, offset))) {
+            tokens = *cached;
+            start = offset;
+            break;
+        }
+    }
 
-    // Try with a reasonably small buffer on the stack first
-    char buf[TOKEN_PIECE_MAX_SIZE]; // fast path for most tokens
-    const int32_t n_chars = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, special);
+    // Cut after the first message, usually a shared system prompt, and after the whole conversation, which the
+    // next turn starts with
+    std::vector<size_t> cuts;
+    for (size_t k: {size_t(1), n}) {
+        const size_t offset = boundary(k);
+        if (offset != std::string::npos && offset > start && (cuts.empty() || cuts.back() < offset)) {
+            cuts.push_back(offset);
+        }
+    }
+    const size_t cached = cuts.size();
+    if (cuts.empty() || cuts.back() < full.size()) {
+        cuts.push_back(full.size());
+    }
 
-    if (n_chars >= 0) {
-        return std::string(buf, n_chars);
+    for (size_t i = 0; i < cuts.size(); ++i) {
+        const size_t end = cuts[i];
+        std::vector<llama_token> segment = tokenize(std::string_view(full).substr(start, end - start), false);
+        if (!tokens.empty() && !segment.empty() && !isSpecial(tokens.back()) && !isSpecial(segment.front())) {
+            tokens = tokenize(std::string_view(full).substr(0, end), false);
+        } else {
+            tokens.insert(tokens.end(), segment.begin(), segment.end());
+        }
+        if (i < cached) {
+            tokenizationCache.insert(std::string_view(full).substr(0, end), tokens);
+        }
+        start = end;
     }
+    return tokens;
+}
 
-    const size_t required = -n_chars;
-    std::string piece(required, '\0');
-    const int check = llama_token_to_piece(vocab, token, piece.data(), required, 0, special);
-    GGML_ASSERT(check ==required);
-    return piece;
+std::future<std::vector<ScoreResult>> SynexisImpl::score(const std::string &prompt,
+                                                         const std::vector<std::string> &continuations) {
+    auto request = std::make_unique<ScoreRequest>();
+    request->prompt = prompt;
+    request->continuations = continuations;
+    auto future = request->promise.get_future();
+    {
+        std::lock_guard lock(score_queue_mutex);
+        if (!stopped) {
+            score_queue.push_back(std::move(request));
+        }
+    }
+    if (request) {
+        request->promise.set_exception(std::make_exception_ptr(std::runtime_error("The engine is stopped")));
+    }
+    return future;
 }
 
+void SynexisImpl::processScoreQueue() {
+    while (true) {
+        std::unique_ptr<ScoreRequest> request;
+        {
+            std::lock_guard lock(score_queue_mutex);
+            if (score_queue.empty()) {
+                return;
+            }
+            request = std::move(score_queue.front());
+            score_queue.pop_front();
+        }
+        try {
+            request->promise.set_value(processScore(*request));
+        } catch (...) {
+            request->promise.set_exception(std::current_exception());
+        }
+    }
+}
+
+std::vector<ScoreResult> SynexisImpl::processScore(const ScoreRequest &request) {
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    const int32_t n_batch = llama_n_batch(ctx);
+    llama_memory_t memory = llama_get_memory(ctx);
+
+    // The prompt lives in the first sequence after the slots, every continuation gets a copy of it
+    const llama_seq_id prompt_seq = params.n_slots;
+    const int n_parallel = MAX_SEQUENCES - params.n_slots - 1;
+    if (n_parallel <= 0) {
+        throw std::runtime_error("No free sequence left for scoring");
+    }
+
+    std::vector<llama_token> prompt = tokenize(request.prompt, true);
+    if (prompt.empty()) {
+        prompt.push_back(llama_vocab_bos(vocab));
+    }
+    const int32_t n_prompt = prompt.size();
+
+    std::vector<ScoreResult> results(request.continuations.size());
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto tokens = tokenize(request.continuations[i], false);
+        results[i].tokens.assign(tokens.begin(), tokens.end());
+        results[i].token_logprobs.reserve(tokens.size());
+    }
+
+    // (batch index, continuation, token) of every output row of the current batch
+    struct PendingRow {
+        int32_t i_batch;
+        size_t continuation;
+        size_t token;
+    };
+    std::vector<PendingRow> pending;
+
+    auto decode = [&]() {
+        if (batch.n_tokens == 0) {
+            return;
+        }
+        if (llama_decode(ctx, batch) != 0) {
+            throw std::runtime_error("Failed to decode scoring batch");
+        }
+        for (const auto &row: pending) {
+            const float *logits = llama_get_logits_ith(ctx, row.i_batch);
+            auto &result = results[row.continuation];
+            const llama_token target = result.tokens[row.token];
+
+            const float max_logit = logits_max(logits, n_vocab);
+            const float logprob = logits[target] - logits_logsumexp(logits, n_vocab, max_logit);
+            result.token_logprobs.push_back(logprob);
+            result.logprob += logprob;
+            result.greedy = result.greedy && logits[target] >= max_logit;
+        }
+        pending.clear();
+        clear_batch(batch);
+    };
+
+    auto release = [&](llama_seq_id first, llama_seq_id last) {
+        for (llama_seq_id seq = first; seq <= last; ++seq) {
+            llama_memory_seq_rm(memory, seq, -1, -1);
+        }
+    };
+
+    clear_batch(batch);
+    release(prompt_seq, prompt_seq + n_parallel);
+    try {
+        // Everything but the last prompt token is shared, the last one produces the logits of each first token
+        for (int32_t i = 0; i < n_prompt - 1; ++i) {
+            batch_add(batch, prompt[i], i, {prompt_seq}, false);
+            if (batch.n_tokens == n_batch) {
+                decode();
+            }
+        }
+        decode();
+
+        for (size_t first = 0; first < results.size(); first += n_parallel) {
+            const size_t last = std::min(results.size(), first + n_parallel);
+            for (size_t c = first; c < last; ++c) {
+                const llama_seq_id seq = prompt_seq + 1 + (c - first);
+                const auto &tokens = results[c].tokens;
+                llama_memory_seq_cp(memory, prompt_seq, seq, -1, -1);
+
+                // The logits at each position score the next continuation token, the last one is never decoded
+                for (size_t t = 0; t < tokens.size(); ++t) {
+                    const llama_token token = t == 0 ? prompt[n_prompt - 1] : tokens[t - 1];
+                    pending.push_back({batch.n_tokens, c, t});
+                    batch_add(batch, token, n_prompt - 1 + t, {seq}, true);
+                    if (batch.n_tokens == n_batch) {
+                        decode();
+                    }
+                }
+            }
+            decode();
+            release(prompt_seq + 1, prompt_seq + n_parallel);
+        }
+    } catch (...) {
+        clear_batch(batch);
+        release(prompt_seq, prompt_seq + n_parallel);
+        throw;
+    }
+    release(prompt_seq, prompt_seq);
+    return results;
+}
 
 void SynexisImpl::run() {
     running = true;
-    //tokenization_thread = std::thread(&SynexisImpl::tokenizationLoop, this);
+    loopsRunning = 2;
+    if (mediaEncoder) {
+        mediaEncoder->start();
+    }
+    tokenization_thread = std::thread(&SynexisImpl::tokenizationLoop, this);
     workerThread = std::thread(&SynexisImpl::updateLoop, this);
     auto c = workerThread.get_id();
     std::cout << "C++ thread ID: " << c << std::endl;
 }
 
 void SynexisImpl::stop() {
+    std::deque<std::unique_ptr<Request>> queued;
+    std::deque<std::unique_ptr<ScoreRequest>> queuedScores;
     running = false;
+    stopped = true; {
+        // The admission thread checks `running` under this mutex before waiting
+        std::lock_guard lock(tokenization_queue_mutex);
+        queued.swap(tokenization_queue);
+    } {
+        std::lock_guard lock(score_queue_mutex);
+        queuedScores.swap(score_queue);
+    }
     tokenization_queue_cv.notify_all();
+
+    // Nothing would ever take them out of the queue again, their callers would wait forever
+    metrics.queueDepth.fetch_sub(queued.size(), std::memory_order_relaxed);
+    for (auto &request: queued) {
+        failRequest(*request, "The engine is stopped");
+    }
+    for (auto &request: queuedScores) {
+        request->promise.set_exception(std::make_exception_ptr(std::runtime_error("The engine is stopped")));
+    }
+}
+
+void SynexisImpl::failRequest(Request &request, const char *error) {
+    EngineMetrics::add(metrics.requestsFailed);
+    if (request.params.on_error) {
+        request.params.on_error(error);
+    }
+    request.promise.set_exception(std::make_exception_ptr(std::runtime_error(error)));
 }
 
+void SynexisImpl::loopExited() {
+    // The admission thread fills idle slots and the worker empties them, once both are gone no slot changes
+    if (loopsRunning.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    for (auto &slot: slots) {
+        if (!slot->idle()) {
+            slot->reset(true, "The engine is stopped");
+        }
+    }
+}
+
+// Admission queue: hands the queued requests to free slots in order, tokenizing them off the worker thread
 void SynexisImpl::tokenizationLoop() {
-    mtmd_default_marker();
+    tracer.nameThread("admission");
+    pinCurrentThread(params.cpus);
     while (running) {
         std::unique_ptr<Request> request; {
             std::unique_lock lock(tokenization_queue_mutex);
@@ -265,64 +660,57 @@ void SynexisImpl::tokenizationLoop() {
             tokenization_queue.pop_front();
         }
         SynexisSlot *slot = nullptr;
-        GGML_LOG_INFO("Waiting for a free slot\n");
-        while (running && slot == nullptr) {
+        while (running && slot == nullptr && !request->cancelled()) {
             slot = findEmptySlot();
             if (slot == nullptr) {
                 std::this_thread::sleep_for(std::chrono::milliseconds(10));
             }
         }
-        GGML_LOG_INFO("Found a free slot\n");
-        if (!running) break;
-
-        //In case we have mtmd context we would have to parse media files
-        if (mtmd_context != nullptr) {
-            mtmd::bitmaps bitmaps;
-            for (auto &[data, size]: request->params.media) {
-                mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_buf(mtmd_context, data, size));
-                // calculate bitmap hash (for KV caching)
-                std::string hash = fnv_hash(bmp.data(), bmp.n_bytes());
-                bmp.set_id(hash.c_str());
-                bitmaps.entries.push_back(std::move(bmp));
+        if (!running) {
+            metrics.queueDepth.fetch_sub(1, std::memory_order_relaxed);
+            failRequest(*request, "The engine is stopped");
+            break;
+        }
+        metrics.queueDepth.fetch_sub(1, std::memory_order_relaxed);
+
+        if (request->cancelled()) {
+            // Never reached a slot: nothing was generated
+            EngineMetrics::add(metrics.requestsCancelled);
+            CompletionResult result;
+            result.finishReason = FINISH_REASON_CANCELLED;
+            result.queueTime = std::chrono::duration<double>(EngineMetrics::Clock::now() - request->enqueued).count();
+            if (request->params.on_done) {
+                request->params.on_done(std::string());
             }
-            mtmd_input_text inp_txt = {
-                request->prompt.c_str(),
-                /* add_special */ true,
-                /* parse_special */ true,
-            };
-            mtmd::input_chunks chunks(mtmd_input_chunks_init());
-            auto bitmaps_c_ptr = bitmaps.c_ptr();
-            int32_t tokenized = mtmd_tokenize(mtmd_context,
-                                              chunks.ptr.get(),
-                                              &inp_txt,
-                                              bitmaps_c_ptr.data(),
-                                              bitmaps_c_ptr.size());
-            if (tokenized != 0) {
-                throw std::runtime_error("Failed to tokenize prompt");
+            if (request->params.on_result) {
+                request->params.on_result(result);
             }
-            slot->tokens = TaskTokens(chunks);
-        } else {
-            size_t n_tokens = request->prompt.length();
-            auto vocab = llama_model_get_vocab(model);
-            std::vector<llama_token> tokenized(n_tokens);
-            n_tokens = llama_tokenize(vocab, request->prompt.data(), request->prompt.length(), tokenized.data(),
-                                      tokenized.size(), false,
-                                      true);
-            tokenized.resize(n_tokens);
-
-            slot->tokens = TaskTokens(std::move(tokenized));
+            request->promise.set_value(std::move(result));
+            continue;
         }
 
-
-        delete slot->sampler;
-        slot->sampler = new SynexisSampler(model, request->params.samplerParams);
-        slot->request = std::move(request);
-        slot->state = SLOT_STATE_STARTED;
+        try {
+            TRACE_SCOPE(tracer, "admit");
+            admit(request, slot);
+        } catch (const std::exception &e) {
+            EngineMetrics::add(metrics.requestsFailed);
+            // The request is only moved into the slot once admission succeeded
+            if (request->params.on_error) {
+                request->params.on_error(e.what());
+            }
+            request->promise.set_exception(std::current_exception());
+        }
     }
+    loopExited();
 }
 
 void SynexisImpl::updateLoop() {
+    tracer.nameThread("worker");
+    pinCurrentThread(params.cpus);
     while (running) {
+        // Scoring requests run between two generation steps and finish in one go
+        processScoreQueue();
+
         bool all_idle = true;
         for (auto &slot: slots) {
             if (!slot->idle()) {
@@ -335,11 +723,19 @@ void SynexisImpl::updateLoop() {
             continue;
         }
 
+        // Cancelled requests give their slot back before the next batch is built
+        for (auto &slot: slots) {
+            if (!slot->idle() && slot->request->cancelled()) {
+                slot->result.finishReason = FINISH_REASON_CANCELLED;
+                slot->release();
+            }
+        }
+
 
         std::vector<SynexisSlot *> compatible_slots;
         SynexisSlot *slot_batched = nullptr;
         for (auto &slot: slots) {
-            if (slot->idle()) continue;
+            if (slot->idle() || slot->waitingForMedia()) continue;
 
             if (!slot_batched) {
                 slot_batched = slot.get();
@@ -348,6 +744,19 @@ void SynexisImpl::updateLoop() {
                 compatible_slots.push_back(slot.get());
             }
         }
+        if (compatible_slots.empty()) {
+            // Either every slot was just cancelled, or every busy slot waits for the media encoder
+            const bool waitingForMedia = std::any_of(slots.begin(), slots.end(), [](const auto &slot) {
+                return !slot->idle() && slot->waitingForMedia();
+            });
+            if (mediaEncoder && waitingForMedia) {
+                TRACE_SCOPE(tracer, "wait_media");
+                mediaEncoder->waitForProgress(std::chrono::milliseconds(1));
+            }
+            continue;
+        }
+        TraceScope step(tracer, "step");
+        step.arg(0, "slots", compatible_slots.size());
         for (const auto &slot: compatible_slots) {
             if (slot->n_past + 1 >= params.n_ctx) {
                 if (mtmd_context) {
@@ -363,6 +772,7 @@ void SynexisImpl::updateLoop() {
                 slot->cacheTokens.shiftTokens(n_keep, n_discard);
                 slot->n_past -= n_discard;
                 slot->truncated = true;
+                EngineMetrics::add(metrics.contextShifts);
             }
         }
 
@@ -376,8 +786,11 @@ void SynexisImpl::updateLoop() {
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
 
+        int32_t n_decode_tokens = 0;
+        int32_t n_prefill_tokens = 0;
         for (auto slot: compatible_slots) {
             if (slot->state == SLOT_STATE_GENERATING) {
+                ++n_decode_tokens;
                 slot->i_batch = batch.n_tokens;
                 batch_add(batch, slot->sampled, slot->n_past++, {slot->id}, true);
                 slot->cacheTokens.add(slot->sampled);
@@ -387,6 +800,7 @@ void SynexisImpl::updateLoop() {
         for (auto slot: compatible_slots) {
             if (slot->state == SLOT_STATE_PROCESSING_PROMPT || slot->state == SLOT_STATE_STARTED) {
                 if (slot->state == SLOT_STATE_STARTED) {
+                    slot->promptStart = EngineMetrics::Clock::now();
                     slot->n_past = 0;
                     slot->state = SLOT_STATE_PROCESSING_PROMPT;
 
@@ -417,8 +831,14 @@ void SynexisImpl::updateLoop() {
                 slot->cacheTokens.keepFirst(slot->n_past);
 
                 if (slot->n_past < slot->promptSize() && slot->tokens.getTokens()[slot->n_past] == LLAMA_TOKEN_NULL) {
+                    if (!slot->tokens.mediaReady(slot->n_past)) {
+                        continue;
+                    }
                     int32_t new_n_past;
-                    int32_t res = slot->tokens.process_chunk(ctx, mtmd_context, slot->n_past, slot->id, new_n_past);
+                    int32_t res; {
+                        TRACE_SCOPE(tracer, "decode_media");
+                        res = slot->tokens.process_chunk(ctx, mtmd_context, slot->n_past, slot->id, new_n_past);
+                    }
                     int32_t n_pos = new_n_past - slot->n_past;
 
                     if (res != 0) {
@@ -431,6 +851,7 @@ void SynexisImpl::updateLoop() {
 
                     slot->n_past += n_pos;
                     slot->n_prompt_tokens_processed += n_pos;
+                    EngineMetrics::add(metrics.promptTokens, n_pos);
                 }
 
                 while (slot->n_past < slot->promptSize() && batch.n_tokens < n_batch) {
@@ -444,6 +865,7 @@ void SynexisImpl::updateLoop() {
 
                     slot->n_prompt_tokens_processed++;
                     slot->n_past++;
+                    ++n_prefill_tokens;
                 }
 
                 if (slot->n_past == slot->promptSize()) {
@@ -472,6 +894,22 @@ void SynexisImpl::updateLoop() {
             continue;
         }
 
+        step.arg(1, "prefill_tokens", n_prefill_tokens);
+        step.arg(2, "decode_tokens", n_decode_tokens);
+        EngineMetrics::add(metrics.decodeSteps);
+        EngineMetrics::add(metrics.promptTokens, n_prefill_tokens);
+        // Slots are batched by state, a step is usually all prefill or all decode: a zero would skew the quantiles
+        if (n_prefill_tokens > 0) {
+            metrics.prefillTokens.observe(n_prefill_tokens);
+        }
+        if (n_decode_tokens > 0) {
+            metrics.decodeTokens.observe(n_decode_tokens);
+        }
+        metrics.batchFill.observe(batch.n_tokens * 1000 / n_batch);
+        for (auto slot: compatible_slots) {
+            metrics.slotKvCells[slot->id].store(slot->n_past, std::memory_order_relaxed);
+        }
+
         int32_t i_next = 0;
         for (int32_t i = 0; i < batch.n_tokens; i = i_next) {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
@@ -485,18 +923,28 @@ void SynexisImpl::updateLoop() {
                 batch.seq_id + i,
                 batch.logits + i,
             };
-            const int ret = llama_decode(ctx, batch_view);
+            int ret; {
+                TraceScope decode(tracer, "llama_decode");
+                decode.arg(0, "tokens", n_tokens);
+                ret = llama_decode(ctx, batch_view);
+            }
             if (ret != 0) {
                 std::cerr << "Retrying Batch" << std::endl;
+                EngineMetrics::add(metrics.decodeRetries);
+                // Idle slots belong to the admission thread, it may be filling one right now
                 if (n_batch == 1 && ret == 1) {
                     for (auto &slot: slots) {
-                        slot->reset();
+                        if (!slot->idle()) {
+                            slot->reset();
+                        }
                     }
                     break;
                 }
                 if (ret == -1 || ret < -1) {
                     for (auto &slot: slots) {
-                        slot->reset();
+                        if (!slot->idle()) {
+                            slot->reset();
+                        }
                     }
                     break;
                 }
@@ -511,6 +959,7 @@ void SynexisImpl::updateLoop() {
             i_next = i + n_tokens;
             n_batch = llama_n_batch(ctx);
 
+            TRACE_SCOPE(tracer, "sample");
             for (auto &slot: slots) {
                 if (slot->i_batch < i || slot->i_batch >= i + n_tokens) {
                     continue;
@@ -526,15 +975,48 @@ void SynexisImpl::updateLoop() {
                 llama_token id = slot->sampler->sample(ctx, tok_idx);
 
                 slot->i_batch = -1;
+                if (id == LLAMA_TOKEN_NULL) {
+                    // Nothing can be accepted by the grammar any more, the request fails instead of aborting in it
+                    slot->reset(true, "The grammar allows no further token");
+                    continue;
+                }
                 slot->sampler->accept(id, true);
                 slot->n_decoded += 1;
 
+                const auto now = EngineMetrics::Clock::now();
+                EngineMetrics::add(metrics.generatedTokens);
+                if (slot->n_decoded == 1) {
+                    slot->firstTokenTime = now;
+                    metrics.timeToFirstToken.observe(EngineMetrics::microseconds(now - slot->request->enqueued));
+                } else {
+                    metrics.interTokenLatency.observe(EngineMetrics::microseconds(now - slot->lastTokenTime));
+                }
+                slot->lastTokenTime = now;
+                if (slot->request->params.samplerParams.timing_per_token) {
+                    slot->result.tokenTimes.push_back(
+                        std::chrono::duration<double>(now - slot->request->enqueued).count());
+                }
+
                 auto vocab = llama_model_get_vocab(model);
-                std::string token_str = tokenToPiece(id, false);
+                const TaskParams &taskParams = slot->request->params;
+                // Token id streams only detokenize to look for stop strings
+                const bool needsText = !taskParams.stream || taskParams.emitText || !taskParams.stopTokens.empty();
+                std::string token_str = needsText ? tokenToPiece(id, false) : std::string();
 
                 if (slot->request->params.stream) {
-                    if (slot->request->params.on_token) {
-                        slot->request->params.on_token(token_str);
+                    if (slot->request->params.on_probs) {
+                        slot->sampler->probs(ctx, tok_idx, id, slot->probs);
+                        slot->request->params.on_probs(slot->probs);
+                    }
+                    if (slot->request->params.on_token_id) {
+                        slot->request->params.on_token_id(id);
+                    }
+                    if (slot->request->params.emitText && slot->request->params.on_token) {
+                        slot->streamText.clear();
+                        slot->utf8.feed(token_str, slot->streamText);
+                        if (!slot->streamText.empty()) {
+                            slot->request->params.on_token(slot->streamText);
+                        }
                     }
                 } else {
                     slot->generatedText += token_str;
@@ -549,9 +1031,14 @@ void SynexisImpl::updateLoop() {
             }
         }
     }
+    loopExited();
 }
 
 
+MetricsSnapshot SynexisImpl::metricsSnapshot() const {
+    return metrics.snapshot();
+}
+
 SynexisSlot *SynexisImpl::findEmptySlot() {
     for (auto &slot: slots) {
         if (slot->state == SLOT_STATE_IDLE) {
@@ -573,18 +1060,55 @@ std::string SynexisImpl::getTemplate() {
     return templateSource;
 }
 
+bool SynexisImpl::hasNativeChatTemplate() const {
+    return chatTemplate != LLM_CHAT_TEMPLATE_UNKNOWN;
+}
+
+std::string SynexisImpl::applyChatTemplate(const std::vector<ChatMessage> &messages, bool addGenerationPrompt) const {
+    if (chatTemplate == LLM_CHAT_TEMPLATE_UNKNOWN) {
+        throw std::runtime_error("The chat template of the model is not supported natively");
+    }
+    std::vector<llama_chat_message> chat(messages.size());
+    std::vector<const llama_chat_message *> chatPointers(messages.size());
+    for (size_t i = 0; i < messages.size(); ++i) {
+        chat[i] = {messages[i].role.c_str(), messages[i].content.c_str()};
+        chatPointers[i] = &chat[i];
+    }
+    std::string prompt;
+    if (llm_chat_apply_template(chatTemplate, chatPointers, prompt, addGenerationPrompt) < 0) {
+        throw std::runtime_error("Failed to apply the chat template");
+    }
+
+    // Prompts are tokenized without special tokens, like the Jinja templates the BOS has to be part of the text
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    if (llama_vocab_get_add_bos(vocab)) {
+        const std::string bos = tokenToPiece(llama_vocab_bos(vocab), true);
+        if (prompt.compare(0, bos.size(), bos) != 0) {
+            prompt.insert(0, bos);
+        }
+    }
+    return prompt;
+}
 
 SynexisImpl::~SynexisImpl() {
     if (running) {
         stop();
     }
-    // if (tokenization_thread.joinable()) {
-    //     tokenization_thread.join();
-    // }
+    if (tokenization_thread.joinable()) {
+        tokenization_thread.join();
+    }
     if (workerThread.joinable()) {
         workerThread.join();
     }
+    // Before the slots and mtmd context it encodes for go away
+    mediaEncoder.reset();
+    if (!params.tracePath.empty() && !tracer.dump(params.tracePath)) {
+        std::cerr << "Failed to write the trace to " << params.tracePath << std::endl;
+    }
     llama_free(ctx);
+    if (threadpool != nullptr) {
+        threadpoolFree(threadpool);
+    }
     llama_model_free(model);
     mtmd_free(mtmd_context);
     llama_backend_free();
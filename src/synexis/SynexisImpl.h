@@ -8,12 +8,20 @@
 #include <llama-cpp.h>
 #include <mutex>
 
+#include "EngineMetrics.h"
+#include "MediaCache.h"
+#include "MediaEncoder.h"
 #include "SynexisSlot.h"
+#include "TokenizationCache.h"
+#include "Tracer.h"
 #include "synexis/TaskParams.h"
 #include "Request.h"
 #include <future>
 
+#include "synexis/ChatMessage.h"
+#include "synexis/Metrics.h"
 #include "synexis/SynexisArguments.h"
+#include "../vendor/llama.cpp/src/llama-chat.h"
 
 class SynexisImpl {
 public:
@@ -25,39 +33,99 @@ public:
 
     std::vector<std::vector<float>> getEmbedding(const std::string &prompt);
 
-    std::future<std::string> addTask(const std::string &prompt, const TaskParams &params);
+    std::future<CompletionResult> addTask(const std::string &prompt, const TaskParams &params);
+
+    std::future<CompletionResult> addTask(TaskParams &&params);
+
+    std::future<CompletionResult> addTask(std::vector<llama_token> &&tokens, TaskParams &&params);
+
+    std::vector<std::future<CompletionResult>> addTasks(std::vector<TaskParams> &&params);
+
+    std::future<std::vector<ScoreResult>> score(const std::string &prompt, const std::vector<std::string> &continuations);
 
     void run();
 
     std::string getTemplate();
 
+    bool hasNativeChatTemplate() const;
+
+    std::string applyChatTemplate(const std::vector<ChatMessage> &messages, bool addGenerationPrompt) const;
+
     SynexisImpl(const std::string &model_path, const llama_context_params &params, int n_slots);
 
     void stop();
 
+    MetricsSnapshot metricsSnapshot() const;
+
+    const Tracer &getTracer() const {
+        return tracer;
+    }
+
+    const SynexisArguments &arguments() const {
+        return params;
+    }
+
 private:
     void updateLoop();
     void tokenizationLoop();
 
     SynexisSlot *findEmptySlot();
 
+    void admit(std::unique_ptr<Request> &request, SynexisSlot *slot);
+
+    mtmd_bitmap *loadBitmap(const std::string &id, const uint8_t *data, size_t size);
+
+    void processScoreQueue();
+
+    // Ends a request that never reached a slot: on_error and the future get `error`
+    void failRequest(Request &request, const char *error);
+
+    // Called by both loops when they exit, the last one fails the requests still in a slot
+    void loopExited();
+
+    std::vector<ScoreResult> processScore(const ScoreRequest &request);
+
+    std::vector<llama_token> tokenize(std::string_view text, bool add_special) const;
+
+    std::vector<llama_token> tokenizeChat(const std::vector<ChatMessage> &messages, bool addGenerationPrompt);
+
 
     std::string tokenToPiece(int32_t token, bool special) const;
 
+    void attachThreadpool();
+
     llama_model *model;
     llama_context *ctx;
+    // CPU compute threads pinned to params.cpus, null when not pinned
+    ggml_threadpool *threadpool = nullptr;
+    void (*threadpoolFree)(ggml_threadpool *) = nullptr;
     mtmd_context *mtmd_context = nullptr;
+    // Built-in llama.cpp renderer matching the model's template, UNKNOWN when it has to be rendered as Jinja
+    llm_chat_template chatTemplate = LLM_CHAT_TEMPLATE_UNKNOWN;
+    TokenizationCache tokenizationCache;
+    // Admission thread: decoded media, skips decoding files seen before
+    MediaLru<DecodedMedia> decodedMedia{MEDIA_DECODED_CACHE_BYTES};
+    // Encodes the media of admitted requests while the worker keeps decoding, null without a projector
+    std::unique_ptr<MediaEncoder> mediaEncoder;
+    EngineMetrics metrics;
+    Tracer tracer;
     std::vector<std::unique_ptr<SynexisSlot> > slots;
     std::mutex slotLock;
     std::condition_variable cv;
     std::thread workerThread;
     std::atomic<bool> running{false};
+    // Set by stop() before it empties the queues, tasks added afterwards fail right away
+    std::atomic<bool> stopped{false};
+    std::atomic<int> loopsRunning{0};
     llama_batch batch;
     
     std::deque<std::unique_ptr<Request>> tokenization_queue;
     std::mutex tokenization_queue_mutex;
     std::condition_variable tokenization_queue_cv;
     std::thread tokenization_thread;
+
+    std::deque<std::unique_ptr<ScoreRequest>> score_queue;
+    std::mutex score_queue_mutex;
     SynexisArguments params;
 };
 
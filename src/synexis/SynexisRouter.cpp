@@ -0,0 +1,341 @@
+#include <synexis/SynexisRouter.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include <synexis/Synexis.h>
+#include "CpuTopology.h"
+#include "utils.h"
+
+// Bytes of a plain prompt, and tokens of a pre-tokenized one, identifying its prefix
+#define ROUTER_PREFIX_BYTES 512
+#define ROUTER_PREFIX_TOKENS 128
+// Prefixes remembered, the oldest one is forgotten first
+#define ROUTER_AFFINITY_ENTRIES 4096
+
+struct Replica {
+    std::vector<int> cpus;
+    std::atomic<int> inFlight{0};
+    // Last, its threads stop before the rest goes away
+    std::unique_ptr<Synexis> engine;
+};
+
+class SynexisRouterImpl {
+public:
+    SynexisRouterImpl(const SynexisArguments &args, int count, bool localWeights);
+
+    // Picks the replica for the task and counts it until its on_result or on_error, returns its index
+    size_t route(TaskParams &params);
+
+    Replica &leastLoaded();
+
+    std::vector<std::unique_ptr<Replica>> replicas;
+    int slotsPerReplica;
+
+private:
+    Replica *affinityReplica(uint64_t key);
+
+    std::mutex affinityMutex;
+    std::unordered_map<uint64_t, Replica *> affinity;
+    std::deque<uint64_t> affinityOrder;
+    std::atomic<size_t> nextReplica{0};
+};
+
+// 0 when the task has nothing worth keeping together
+static uint64_t prefixKey(const TaskParams &params) {
+    if (!params.tokens.empty()) {
+        const size_t count = std::min<size_t>(params.tokens.size(), ROUTER_PREFIX_TOKENS);
+        return hash_bytes(params.tokens.data(), count * sizeof(int32_t));
+    }
+    if (!params.messages.empty()) {
+        // The system prompt and the first user message tell one conversation from another, later turns extend it
+        uint64_t key = 0;
+        for (size_t i = 0; i < std::min<size_t>(params.messages.size(), 2); ++i) {
+            const ChatMessage &message = params.messages[i];
+            key = hash_bytes(message.role.data(), message.role.size(), key);
+            key = hash_bytes(message.content.data(), message.content.size(), key);
+        }
+        return key;
+    }
+    const std::string_view prompt = params.promptView();
+    if (prompt.empty()) {
+        return 0;
+    }
+    return hash_bytes(prompt.data(), std::min<size_t>(prompt.size(), ROUTER_PREFIX_BYTES));
+}
+
+SynexisRouterImpl::SynexisRouterImpl(const SynexisArguments &args, int count,
+                                     bool localWeights): slotsPerReplica(args.n_slots) {
+    const std::vector<std::vector<int>> nodes = numaNodeCpus();
+    if (count <= 0) {
+        count = static_cast<int>(nodes.size());
+    }
+    // Replicas sharing a node split its CPUs in contiguous ranges
+    std::vector<int> perNode(nodes.size(), 0);
+    for (int i = 0; i < count; ++i) {
+        perNode[i % nodes.size()]++;
+    }
+    std::vector<int> seenOnNode(nodes.size(), 0);
+    for (int i = 0; i < count; ++i) {
+        auto replica = std::make_unique<Replica>();
+        const size_t node = i % nodes.size();
+        const std::vector<int> &cpus = nodes[node];
+        const size_t share = cpus.size() / perNode[node];
+        if (share > 0) {
+            const size_t first = seenOnNode[node] * share;
+            const size_t last = seenOnNode[node] + 1 == perNode[node] ? cpus.size() : first + share;
+            replica->cpus.assign(cpus.begin() + first, cpus.begin() + last);
+        }
+        seenOnNode[node]++;
+        replicas.push_back(std::move(replica));
+    }
+
+    // Every replica is created from a thread on its own CPUs, the memory it touches first (KV cache, compute
+    // buffers, its copy of the weights) is allocated on its node
+    std::vector<std::exception_ptr> errors(replicas.size());
+    std::vector<std::thread> loaders;
+    for (size_t i = 0; i < replicas.size(); ++i) {
+        loaders.emplace_back([&, i] {
+            Replica &replica = *replicas[i];
+            try {
+                pinCurrentThread(replica.cpus);
+                SynexisArguments replicaArgs = args;
+                replicaArgs.cpus = replica.cpus;
+                if (!replica.cpus.empty()) {
+                    replicaArgs.numberOfThreads = std::min<int>(args.numberOfThreads,
+                                                                static_cast<int>(replica.cpus.size()));
+                }
+                if (localWeights) {
+                    replicaArgs.use_mmap = false;
+                }
+                replica.engine = std::make_unique<Synexis>(replicaArgs);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto &loader: loaders) {
+        loader.join();
+    }
+    for (auto &error: errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+Replica &SynexisRouterImpl::leastLoaded() {
+    // Starts the scan at a rotating replica, ties do not all land on the first one
+    const size_t start = nextReplica.fetch_add(1, std::memory_order_relaxed);
+    Replica *best = nullptr;
+    for (size_t i = 0; i < replicas.size(); ++i) {
+        Replica *replica = replicas[(start + i) % replicas.size()].get();
+        if (best == nullptr || replica->inFlight.load(std::memory_order_relaxed) <
+                               best->inFlight.load(std::memory_order_relaxed)) {
+            best = replica;
+        }
+    }
+    return *best;
+}
+
+Replica *SynexisRouterImpl::affinityReplica(uint64_t key) {
+    auto it = affinity.find(key);
+    return it == affinity.end() ? nullptr : it->second;
+}
+
+size_t SynexisRouterImpl::route(TaskParams &params) {
+    Replica *replica = nullptr;
+    const uint64_t key = replicas.size() > 1 ? prefixKey(params) : 0;
+    if (key != 0) {
+        std::lock_guard lock(affinityMutex);
+        replica = affinityReplica(key);
+        // A replica without a free slot would queue the task, another one starts it now even without the prefix
+        if (replica != nullptr && replica->inFlight.load(std::memory_order_relaxed) >= slotsPerReplica) {
+            Replica &least = leastLoaded();
+            if (least.inFlight.load(std::memory_order_relaxed) < replica->inFlight.load(std::memory_order_relaxed)) {
+                replica = &least;
+                affinity[key] = replica;
+            }
+        }
+        if (replica == nullptr) {
+            replica = &leastLoaded();
+            affinity.emplace(key, replica);
+            affinityOrder.push_back(key);
+            if (affinityOrder.size() > ROUTER_AFFINITY_ENTRIES) {
+                affinity.erase(affinityOrder.front());
+                affinityOrder.pop_front();
+            }
+        }
+    } else {
+        replica = &leastLoaded();
+    }
+
+    replica->inFlight.fetch_add(1, std::memory_order_relaxed);
+    // Exactly one of them is called per task
+    auto onResult = std::move(params.on_result);
+    params.on_result = [replica, onResult = std::move(onResult)](const CompletionResult &result) {
+        replica->inFlight.fetch_sub(1, std::memory_order_relaxed);
+        if (onResult) {
+            onResult(result);
+        }
+    };
+    auto onError = std::move(params.on_error);
+    params.on_error = [replica, onError = std::move(onError)](const std::string &error) {
+        replica->inFlight.fetch_sub(1, std::memory_order_relaxed);
+        if (onError) {
+            onError(error);
+        }
+    };
+    return std::find_if(replicas.begin(), replicas.end(), [replica](const auto &candidate) {
+        return candidate.get() == replica;
+    }) - replicas.begin();
+}
+
+static void addHistogram(HistogramSnapshot &total, const HistogramSnapshot &histogram) {
+    if (total.counts.empty()) {
+        total = histogram;
+        return;
+    }
+    // Every replica uses the same bounds
+    for (size_t i = 0; i < total.counts.size() && i < histogram.counts.size(); ++i) {
+        total.counts[i] += histogram.counts[i];
+    }
+    total.count += histogram.count;
+    total.sum += histogram.sum;
+}
+
+SynexisRouter::SynexisRouter(SynexisArguments args, int replicas, bool localWeights) {
+    impl = new SynexisRouterImpl(args, replicas, localWeights);
+}
+
+SynexisRouter::~SynexisRouter() {
+    delete impl;
+}
+
+std::future<CompletionResult> SynexisRouter::addTask(const std::string &prompt, const TaskParams &sampling_params) {
+    TaskParams task = sampling_params;
+    task.prompt = prompt;
+    task.promptOwner.reset();
+    return addTask(std::move(task));
+}
+
+std::future<CompletionResult> SynexisRouter::addTask(TaskParams params) {
+    const size_t replica = impl->route(params);
+    return impl->replicas[replica]->engine->addTask(std::move(params));
+}
+
+std::future<CompletionResult> SynexisRouter::addTask(std::vector<int32_t> tokens, TaskParams params) {
+    params.tokens = std::move(tokens);
+    return addTask(std::move(params));
+}
+
+std::vector<std::future<CompletionResult>> SynexisRouter::addTasks(std::vector<TaskParams> params) {
+    // Queued per replica in one go each, the futures are put back in submission order
+    std::vector<std::vector<TaskParams>> batches(impl->replicas.size());
+    std::vector<std::vector<size_t>> positions(impl->replicas.size());
+    for (size_t i = 0; i < params.size(); ++i) {
+        const size_t replica = impl->route(params[i]);
+        batches[replica].push_back(std::move(params[i]));
+        positions[replica].push_back(i);
+    }
+    std::vector<std::future<CompletionResult>> futures(params.size());
+    for (size_t r = 0; r < batches.size(); ++r) {
+        if (batches[r].empty()) {
+            continue;
+        }
+        auto replicaFutures = impl->replicas[r]->engine->addTasks(std::move(batches[r]));
+        for (size_t i = 0; i < replicaFutures.size(); ++i) {
+            futures[positions[r][i]] = std::move(replicaFutures[i]);
+        }
+    }
+    return futures;
+}
+
+std::future<std::vector<ScoreResult>> SynexisRouter::score(const std::string &prompt,
+                                                           const std::vector<std::string> &continuations) {
+    return impl->leastLoaded().engine->score(prompt, continuations);
+}
+
+void SynexisRouter::run() const {
+    for (auto &replica: impl->replicas) {
+        replica->engine->run();
+    }
+}
+
+void SynexisRouter::stop() const {
+    for (auto &replica: impl->replicas) {
+        replica->engine->stop();
+    }
+}
+
+MetricsSnapshot SynexisRouter::metrics() const {
+    MetricsSnapshot total;
+    for (auto &replica: impl->replicas) {
+        const MetricsSnapshot snapshot = replica->engine->metrics();
+        total.requestsAdmitted += snapshot.requestsAdmitted;
+        total.requestsCompleted += snapshot.requestsCompleted;
+        total.requestsFailed += snapshot.requestsFailed;
+        total.requestsCancelled += snapshot.requestsCancelled;
+        total.promptTokens += snapshot.promptTokens;
+        total.generatedTokens += snapshot.generatedTokens;
+        total.decodeSteps += snapshot.decodeSteps;
+        total.decodeRetries += snapshot.decodeRetries;
+        total.contextShifts += snapshot.contextShifts;
+        total.queueDepth += snapshot.queueDepth;
+        addHistogram(total.timeToFirstToken, snapshot.timeToFirstToken);
+        addHistogram(total.interTokenLatency, snapshot.interTokenLatency);
+        addHistogram(total.queueWait, snapshot.queueWait);
+        addHistogram(total.prefillTokens, snapshot.prefillTokens);
+        addHistogram(total.decodeTokens, snapshot.decodeTokens);
+        addHistogram(total.batchFill, snapshot.batchFill);
+        total.slotKvCells.insert(total.slotKvCells.end(), snapshot.slotKvCells.begin(), snapshot.slotKvCells.end());
+    }
+    return total;
+}
+
+MetricsSnapshot SynexisRouter::replicaMetrics(size_t replica) const {
+    return impl->replicas.at(replica)->engine->metrics();
+}
+
+size_t SynexisRouter::replicas() const {
+    return impl->replicas.size();
+}
+
+std::vector<int> SynexisRouter::replicaCpus(size_t replica) const {
+    return impl->replicas.at(replica)->cpus;
+}
+
+std::string SynexisRouter::modelPath() const {
+    return impl->replicas.front()->engine->modelPath();
+}
+
+std::string SynexisRouter::getTemplate() const {
+    return impl->replicas.front()->engine->getTemplate();
+}
+
+bool SynexisRouter::hasNativeChatTemplate() const {
+    return impl->replicas.front()->engine->hasNativeChatTemplate();
+}
+
+std::string SynexisRouter::applyChatTemplate(const std::vector<ChatMessage> &messages,
+                                             bool addGenerationPrompt) const {
+    return impl->replicas.front()->engine->applyChatTemplate(messages, addGenerationPrompt);
+}
+
+std::string SynexisRouter::mediaMarker() {
+    return Synexis::mediaMarker();
+}
+
+std::string SynexisRouter::getToken(std::string str) const {
+    return impl->replicas.front()->engine->getToken(std::move(str));
+}
+
+std::vector<std::vector<float>> SynexisRouter::getEmbedding(const std::string &str) {
+    return impl->leastLoaded().engine->getEmbedding(str);
+}
@@ -1,6 +1,10 @@
 #include "SynexisSlot.h"
 
+#include <algorithm>
 #include <stdexcept>
+#include <unordered_map>
+
+#include "../vendor/llama.cpp/ggml/src/ggml-impl.h"
 
 
 void TaskTokens::add(llama_token token) {
@@ -11,7 +15,6 @@ void TaskTokens::insert(std::vector<llama_token> &tokens) {
     this->tokens.insert(this->tokens.end(), tokens.begin(), tokens.end());
 }
 
-#include <iostream>  // for std::cout
 #include <cstring>   // for std::memmove
 
 void TaskTokens::shiftTokens(int n_keep, int n_discard) {
@@ -62,26 +65,58 @@ const mtmd::input_chunk_ptr &TaskTokens::find_chunk(llama_pos pos) const {
     throw std::runtime_error("Chunk not found");
 }
 
+void TaskTokens::encodeMedia(MediaEncoder &encoder) {
+    // In prompt order, the slot needs the first chunk first
+    std::vector<size_t> positions;
+    positions.reserve(mediaPosition.size());
+    for (const auto &[pos, chunk]: mediaPosition) {
+        positions.push_back(pos);
+    }
+    std::sort(positions.begin(), positions.end());
+    // Chunks split out of one media item share its id, they are told apart by their order in the prompt
+    std::unordered_map<std::string, size_t> ordinals;
+    for (size_t pos: positions) {
+        const mtmd_input_chunk *chunk = mediaPosition.at(pos).get();
+        const char *id = mtmd_input_chunk_get_id(chunk);
+        const size_t ordinal = id != nullptr ? ordinals[id]++ : 0;
+        mediaEncoded[pos] = encoder.submit(chunk, ordinal);
+    }
+}
+
+bool TaskTokens::mediaReady(size_t pos) const {
+    auto it = mediaEncoded.find(pos);
+    return it == mediaEncoded.end() || it->second->ready.load(std::memory_order_acquire);
+}
+
 int32_t TaskTokens::process_chunk(llama_context *ctx, mtmd_context *mctx, llama_pos n_past, int32_t seq_id,
                                   llama_pos &n_pos_out) {
     auto &chunk = find_chunk(n_past);
     const char *name = mtmd_input_chunk_get_type(chunk.get()) == MTMD_INPUT_CHUNK_TYPE_IMAGE
                            ? "image"
                            : "audio";
-    std::cout << "Processing Image" << std::endl;
     int32_t n_batch = llama_n_batch(ctx);
-    int64_t t0 = ggml_time_ms();
     llama_pos new_n_past = n_past;
-    int32_t result = mtmd_helper_eval_chunk_single(mctx, ctx,
-                                                   chunk.get(),
-                                                   n_past,
-                                                   seq_id,
-                                                   n_batch,
-                                                   true, // logits last
-                                                   &new_n_past);
-    std::printf("%s processed in %" PRId64 " ms\n", name, ggml_time_ms() - t0);
+
+    auto it = mediaEncoded.find(n_past);
+    int32_t result;
+    if (it == mediaEncoded.end()) {
+        // Not submitted to the encoder thread, encode it here
+        result = mtmd_helper_eval_chunk_single(mctx, ctx, chunk.get(), n_past, seq_id, n_batch, false, &new_n_past);
+    } else if (it->second->failed) {
+        GGML_LOG_ERROR("%s could not be encoded\n", name);
+        result = -1;
+    } else {
+        // Only reads the embeddings, the helper takes them as a mutable pointer
+        result = mtmd_helper_decode_image_chunk(mctx, ctx,
+                                                chunk.get(),
+                                                const_cast<float *>(it->second->embd.data()),
+                                                n_past,
+                                                seq_id,
+                                                n_batch,
+                                                &new_n_past);
+    }
     if (result != 0) {
-        std::printf("mtmd_helper_eval failed with status %d\n", result);
+        GGML_LOG_ERROR("processing the %s chunk failed with status %d\n", name, result);
         n_pos_out = n_past;
         return result;
     }
@@ -115,6 +150,7 @@ void TaskTokens::keepFirst(size_t n) {
         for (auto it = mediaPosition.begin(); it != mediaPosition.end();) {
             llama_pos pos = it->first;
             if (pos >= (llama_pos) n) {
+                mediaEncoded.erase(pos);
                 it = mediaPosition.erase(it);
             } else {
                 ++it;
@@ -128,15 +164,18 @@ void TaskTokens::keepFirst(size_t n) {
 bool SynexisSlot::processToken(const llama_vocab *vocab, int32_t id,std::string &token_str) {
     sampled = id;
     if (llama_vocab_is_eog(vocab, id)) {
+        result.finishReason = FINISH_REASON_STOP;
         return false;
     }
 
     if (request->params.maximumTokens!=-1 && n_decoded >= request->params.maximumTokens) {
+        result.finishReason = FINISH_REASON_LENGTH;
         return false;
     }
 
     for (const auto &stop_word: request->params.stopTokens) {
         if (token_str.find(stop_word) != std::string::npos) {
+            result.finishReason = FINISH_REASON_STOP;
             return false;
         }
     }
@@ -1,14 +1,17 @@
 #pragma once
 
+#include <atomic>
 #include <iostream>
 #include <unordered_map>
 #include <memory>
 
+#include "EngineMetrics.h"
 #include "mtmd-helper.h"
 #include "mtmd.h"
 #include "sampler/Sampler.h"
 #include "TaskTokens.h"
 #include "Request.h"
+#include "utils.h"
 
 enum SlotState {
     SLOT_STATE_IDLE,
@@ -24,10 +27,15 @@ struct SynexisSlot {
 
     llama_context *ctx = nullptr;
 
-    SlotState state = SLOT_STATE_IDLE;
+    // Set by the admission thread when a request is assigned, everything else runs on the worker thread
+    std::atomic<SlotState> state{SLOT_STATE_IDLE};
     size_t index = 0;
     int n_past;
     std::string generatedText;
+    // Streaming only: splits the generated pieces on code point boundaries before they reach on_token
+    Utf8Stream utf8;
+    std::string streamText;
+    TokenProbs probs;
     SynexisSampler *sampler;
     TaskTokens tokens, cacheTokens;
     bool truncated = false;
@@ -36,6 +44,12 @@ struct SynexisSlot {
     llama_token sampled;
     int32_t n_prompt_tokens_processed;
     int n_decoded;
+    // Filled while the request runs, moved into the future by release()
+    CompletionResult result;
+    std::chrono::steady_clock::time_point promptStart;
+    std::chrono::steady_clock::time_point firstTokenTime;
+    std::chrono::steady_clock::time_point lastTokenTime;
+    EngineMetrics *metrics = nullptr;
 
     bool reuse = false;
 
@@ -45,42 +59,78 @@ struct SynexisSlot {
 
     SynexisSlot &operator=(SynexisSlot &&) = default;
 
-    void reset(bool error = true) {
-        std::cout << "I had to reset" << std::endl;
-        if (error && request && request->params.on_error) {
-            request->params.on_error("Force reset from the model");
-            try {
-                throw std::runtime_error("Failed to generate from model");
-            } catch (...) {
-                request->promise.set_exception(std::current_exception());
+    void reset(bool error = true, const char *reason = "Force reset from the model") {
+        if (metrics) {
+            if (error && request) {
+                EngineMetrics::add(metrics->requestsFailed);
             }
+            metrics->slotKvCells[id].store(0, std::memory_order_relaxed);
+        }
+        if (error && request) {
+            if (request->params.on_error) {
+                request->params.on_error(reason);
+            }
+            // Without it the caller would only see a broken promise
+            const std::runtime_error failure("Failed to generate from model");
+            request->promise.set_exception(std::make_exception_ptr(failure));
         }
         n_past = 0;
         n_prompt_tokens_processed = 0;
         n_decoded = 0;
-        state = SLOT_STATE_IDLE;
         request.reset();
 
         generatedText.clear();
-        sampler->reset();
+        result = CompletionResult();
+        utf8.reset();
+        if (sampler) {
+            sampler->reset();
+        }
         reuse = true;
+        // Last, the admission thread may take the slot as soon as it is idle
+        state = SLOT_STATE_IDLE;
     }
 
     bool idle() const {
         return state == SLOT_STATE_IDLE;
     }
 
+    // A prompt stops at a media chunk until the encoder thread finished it, the other slots keep decoding meanwhile
+    bool waitingForMedia() {
+        const SlotState current = state.load();
+        if (current != SLOT_STATE_STARTED && current != SLOT_STATE_PROCESSING_PROMPT) {
+            return false;
+        }
+        const size_t pos = current == SLOT_STATE_STARTED ? 0 : n_past;
+        return pos < promptSize() && tokens.getTokens()[pos] == LLAMA_TOKEN_NULL && !tokens.mediaReady(pos);
+    }
+
     bool canBeBatchedWith(SynexisSlot *other) const {
-        return state == other->state;
+        return state.load() == other->state.load();
     }
 
     void release() {
         if (request) {
             reuse = true;
-            request->promise.set_value(generatedText);
+            if (metrics) {
+                EngineMetrics::add(result.finishReason == FINISH_REASON_CANCELLED
+                                       ? metrics->requestsCancelled
+                                       : metrics->requestsCompleted);
+            }
+            if (request->params.stream && request->params.on_token) {
+                // A generation cut in the middle of a code point still hands its last bytes over
+                std::string rest = utf8.flush();
+                if (!rest.empty()) {
+                    request->params.on_token(rest);
+                }
+            }
             if (request->params.on_done) {
                 request->params.on_done(generatedText);
             }
+            finishResult();
+            if (request->params.on_result) {
+                request->params.on_result(result);
+            }
+            request->promise.set_value(std::move(result));
         }
         reset(false);
     }
@@ -88,6 +138,23 @@ struct SynexisSlot {
 
     bool processToken(const llama_vocab *vocab, int32_t id, std::string &token_str);
 
+    // Counts and durations of the request, the text is moved in
+    void finishResult() {
+        using Seconds = std::chrono::duration<double>;
+        const auto now = std::chrono::steady_clock::now();
+        // A cancelled request may end before the worker reached its prompt or before its first token
+        const auto started = state == SLOT_STATE_STARTED ? now : promptStart;
+        const auto firstToken = n_decoded > 0 ? firstTokenTime : now;
+        result.text = std::move(generatedText);
+        result.promptTokens = static_cast<int32_t>(promptSize());
+        result.promptTokensComputed = n_prompt_tokens_processed;
+        result.promptTokensCached = result.promptTokens - n_prompt_tokens_processed;
+        result.completionTokens = n_decoded;
+        result.queueTime = Seconds(started - request->enqueued).count();
+        result.prefillTime = Seconds(firstToken - started).count();
+        result.decodeTime = Seconds(now - firstToken).count();
+    }
+
     size_t promptSize() {
         return tokens.size();
     }
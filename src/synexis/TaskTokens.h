@@ -4,6 +4,8 @@
 #include <vector>
 #include "llama.h"
 #include "mtmd.h"
+#include "MediaCache.h"
+#include "MediaEncoder.h"
 
 
 class TaskTokens {
@@ -50,6 +52,12 @@ public:
 
     const mtmd::input_chunk_ptr &find_chunk(llama_pos pos) const;
 
+    // Hands every media chunk to the encoder, process_chunk() then only decodes their embeddings
+    void encodeMedia(MediaEncoder &encoder);
+
+    // False while the chunk starting at `pos` is still being encoded
+    bool mediaReady(size_t pos) const;
+
     int32_t process_chunk(
         llama_context *ctx,
         mtmd_context *mctx,
@@ -61,4 +69,5 @@ private:
     bool hasMtmd = false;
     std::vector<llama_token> tokens;
     std::unordered_map<size_t, mtmd::input_chunk_ptr> mediaPosition;
+    std::unordered_map<size_t, std::shared_ptr<const EncodedMedia> > mediaEncoded;
 };
@@ -0,0 +1,43 @@
+#include "TokenizationCache.h"
+
+#include "utils.h"
+
+TokenizationCache::Key TokenizationCache::keyOf(std::string_view text) {
+    return Key{hash_bytes(text.data(), text.size()), text.size()};
+}
+
+TokenizationCache::Tokens TokenizationCache::find(std::string_view text) {
+    auto it = index.find(keyOf(text));
+    if (it == index.end() || it->second->text != text) {
+        return nullptr;
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->tokens;
+}
+
+void TokenizationCache::insert(std::string_view text, std::vector<llama_token> tokens) {
+    if (tokens.size() > maxTokens) {
+        return;
+    }
+    const Key key = keyOf(text);
+    if (auto it = index.find(key); it != index.end()) {
+        if (it->second->text == text) {
+            entries.splice(entries.begin(), entries, it->second);
+            return;
+        }
+        // Colliding text, the newer one takes the slot
+        erase(it);
+    }
+    totalTokens += tokens.size();
+    entries.push_front({key, std::string(text), std::make_shared<const std::vector<llama_token> >(std::move(tokens))});
+    index.emplace(key, entries.begin());
+    while (totalTokens > maxTokens) {
+        erase(index.find(entries.back().key));
+    }
+}
+
+void TokenizationCache::erase(std::unordered_map<Key, std::list<Entry>::iterator, KeyHash>::iterator it) {
+    totalTokens -= it->second->tokens->size();
+    entries.erase(it->second);
+    index.erase(it);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+
+#define TOKENIZATION_CACHE_MAX_TOKENS (1 << 20)
+
+// Tokens of previously rendered chat prefixes, looked up by the hash and length of their text. Every entry keeps its
+// text, a hit is only returned when it matches: a hash collision must not hand over another conversation's tokens.
+// Least recently used entries are dropped once the cache holds more than `maxTokens` tokens.
+// Only used from the admission thread, so it is not synchronized.
+class TokenizationCache {
+public:
+    using Tokens = std::shared_ptr<const std::vector<llama_token> >;
+
+    explicit TokenizationCache(size_t maxTokens = TOKENIZATION_CACHE_MAX_TOKENS): maxTokens(maxTokens) {
+    }
+
+    // Returns the tokens of `text` or nullptr, and marks the entry as recently used
+    Tokens find(std::string_view text);
+
+    void insert(std::string_view text, std::vector<llama_token> tokens);
+
+    size_t size() const { return totalTokens; }
+
+private:
+    struct Key {
+        uint64_t hash;
+        size_t length;
+
+        bool operator==(const Key &other) const { return hash == other.hash && length == other.length; }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const { return static_cast<size_t>(key.hash); }
+    };
+
+    struct Entry {
+        Key key;
+        std::string text;
+        Tokens tokens;
+    };
+
+    void erase(std::unordered_map<Key, std::list<Entry>::iterator, KeyHash>::iterator it);
+
+    static Key keyOf(std::string_view text);
+
+    size_t maxTokens;
+    size_t totalTokens = 0;
+    std::list<Entry> entries;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+};
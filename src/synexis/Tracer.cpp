@@ -0,0 +1,126 @@
+#include "Tracer.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+namespace {
+    std::atomic<uint64_t> nextTracerId{1};
+
+    struct ThreadCache {
+        uint64_t tracerId = 0;
+        void *buffer = nullptr;
+    };
+
+    thread_local ThreadCache threadCache;
+
+    void writeString(std::ostringstream &out, const char *text) {
+        out << '"';
+        for (const char *c = text; *c; ++c) {
+            if (*c == '"' || *c == '\\') {
+                out << '\\';
+            }
+            out << *c;
+        }
+        out << '"';
+    }
+}
+
+Tracer::Tracer(size_t capacity): capacity(capacity), id(nextTracerId.fetch_add(1)), origin(Clock::now()) {
+}
+
+Tracer::ThreadBuffer *Tracer::threadBuffer() {
+    if (threadCache.tracerId == id) {
+        return static_cast<ThreadBuffer *>(threadCache.buffer);
+    }
+    std::lock_guard lock(mutex);
+    buffers.push_back(std::make_unique<ThreadBuffer>(capacity, static_cast<int>(buffers.size()) + 1));
+    threadCache = {id, buffers.back().get()};
+    return buffers.back().get();
+}
+
+void Tracer::nameThread(const char *name) {
+    if (!enabled()) {
+        return;
+    }
+    ThreadBuffer *buffer = threadBuffer();
+    std::lock_guard lock(mutex);
+    buffer->name = name;
+}
+
+void Tracer::record(const TraceEvent &event) {
+    ThreadBuffer *buffer = threadBuffer();
+    const uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    buffer->events[head % capacity] = event;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+std::string Tracer::json() const {
+    std::ostringstream out;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    auto separator = [&] {
+        if (!first) {
+            out << ',';
+        }
+        first = false;
+    };
+
+    std::lock_guard lock(mutex);
+    for (const auto &buffer: buffers) {
+        if (buffer->name) {
+            separator();
+            out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid << ",\"args\":{\"name\":";
+            writeString(out, buffer->name);
+            out << "}}";
+        }
+
+        const uint64_t end = buffer->head.load(std::memory_order_acquire);
+        const uint64_t begin = end > capacity ? end - capacity : 0;
+        std::vector<TraceEvent> events;
+        events.reserve(end - begin);
+        for (uint64_t i = begin; i < end; ++i) {
+            events.push_back(buffer->events[i % capacity]);
+        }
+        // The owner kept writing while copying: the oldest copies may have been overwritten halfway, drop them.
+        // The slot of event `after` may be being written right now.
+        const uint64_t after = buffer->head.load(std::memory_order_acquire) + 1;
+        const uint64_t stable = after > capacity ? after - capacity : 0;
+        const size_t skip = static_cast<size_t>(std::min<uint64_t>(stable > begin ? stable - begin : 0, events.size()));
+
+        for (size_t i = skip; i < events.size(); ++i) {
+            const TraceEvent &event = events[i];
+            separator();
+            out << "{\"name\":";
+            writeString(out, event.name);
+            out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid << ",\"ts\":" << event.start
+                    << ",\"dur\":" << event.duration;
+            if (event.argNames[0]) {
+                out << ",\"args\":{";
+                for (int a = 0; a < TRACE_MAX_ARGS && event.argNames[a]; ++a) {
+                    if (a > 0) {
+                        out << ',';
+                    }
+                    writeString(out, event.argNames[a]);
+                    out << ':' << event.args[a];
+                }
+                out << '}';
+            }
+            out << '}';
+        }
+    }
+    out << "]}";
+    return out.str();
+}
+
+bool Tracer::dump(const std::string &path) const {
+    if (!enabled()) {
+        return false;
+    }
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    file << json();
+    return static_cast<bool>(file);
+}
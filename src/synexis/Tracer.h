@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define TRACE_MAX_ARGS 3
+
+// One complete span. Names and argument names must be string literals, recording never allocates.
+struct TraceEvent {
+    const char *name;
+    int64_t start;
+    int64_t duration;
+    const char *argNames[TRACE_MAX_ARGS];
+    int64_t args[TRACE_MAX_ARGS];
+};
+
+// Opt-in recorder of scheduler spans, exported in the Chrome trace-event format (chrome://tracing, Perfetto).
+// Every thread writes into its own preallocated ring, so recording is a clock read and a few stores; the oldest
+// events are overwritten once a ring is full. When the capacity is 0 every call returns after one branch.
+class Tracer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // `capacity` events are kept per thread, 0 disables tracing
+    explicit Tracer(size_t capacity);
+
+    bool enabled() const {
+        return capacity != 0;
+    }
+
+    // Microseconds since the tracer was created
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - origin).count();
+    }
+
+    // Labels the calling thread in the exported trace
+    void nameThread(const char *name);
+
+    void record(const TraceEvent &event);
+
+    // Every recorded event as Chrome trace JSON, can be called while the threads keep recording
+    std::string json() const;
+
+    // Writes json() to `path`, returns false when tracing is off or the file could not be written
+    bool dump(const std::string &path) const;
+
+private:
+    struct ThreadBuffer {
+        explicit ThreadBuffer(size_t capacity, int tid): events(capacity), tid(tid) {
+        }
+
+        std::vector<TraceEvent> events;
+        // Total events written, the slot of the next one is `head % events.size()`
+        std::atomic<uint64_t> head{0};
+        int tid;
+        const char *name = nullptr;
+    };
+
+    ThreadBuffer *threadBuffer();
+
+    size_t capacity;
+    // Tells the buffers of this tracer apart from another one's in the thread-local cache
+    uint64_t id;
+    Clock::time_point origin;
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadBuffer> > buffers;
+};
+
+// Records the span from its construction to its destruction
+class TraceScope {
+public:
+    TraceScope(Tracer &tracer, const char *name): tracer(tracer) {
+        if (tracer.enabled()) {
+            event.name = name;
+            event.start = tracer.now();
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    // Attaches up to TRACE_MAX_ARGS integer arguments to the span
+    void arg(int index, const char *name, int64_t value) {
+        event.argNames[index] = name;
+        event.args[index] = value;
+    }
+
+    ~TraceScope() {
+        if (tracer.enabled()) {
+            event.duration = tracer.now() - event.start;
+            tracer.record(event);
+        }
+    }
+
+private:
+    Tracer &tracer;
+    TraceEvent event{};
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(tracer, name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)((tracer), (name))
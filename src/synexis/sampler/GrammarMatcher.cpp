@@ -0,0 +1,173 @@
+#include "GrammarMatcher.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+
+#include "../../vendor/llama.cpp/src/llama-grammar.h"
+
+#define GRAMMAR_MASK_CACHE_SIZE 1024
+
+static inline uint64_t hash_combine(uint64_t seed, uint64_t value) {
+    value += 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return seed ^ value ^ (value >> 31);
+}
+
+GrammarMaskCache::GrammarMaskCache(const llama_vocab *vocab, size_t capacity): vocab_(vocab), capacity_(capacity) {
+}
+
+std::shared_ptr<GrammarMaskCache> GrammarMaskCache::get(const llama_vocab *vocab, const std::string &grammar) {
+    static std::mutex registryLock;
+    static std::unordered_map<std::string, std::weak_ptr<GrammarMaskCache> > registry;
+
+    std::string key = std::to_string(reinterpret_cast<uintptr_t>(vocab)) + ":" + grammar;
+    std::lock_guard lock(registryLock);
+    auto &entry = registry[key];
+    auto cache = entry.lock();
+    if (!cache) {
+        cache = std::make_shared<GrammarMaskCache>(vocab, GRAMMAR_MASK_CACHE_SIZE);
+        entry = cache;
+
+        // Drop registry entries whose caches are no longer used by any request, per-request grammars come and go
+        for (auto it = registry.begin(); it != registry.end();) {
+            if (it->second.expired()) {
+                it = registry.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return cache;
+}
+
+size_t GrammarMaskCache::StateHash::operator()(const State &state) const {
+    uint64_t hash = 0;
+    for (uint64_t value: state) {
+        hash = hash_combine(hash, value);
+    }
+    return static_cast<size_t>(hash);
+}
+
+std::shared_ptr<const TokenMask> GrammarMaskCache::find(const State &state) {
+    std::lock_guard lock(mutex_);
+    auto it = entries_.find(state);
+    if (it == entries_.end()) {
+        return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->second;
+}
+
+std::shared_ptr<const TokenMask> GrammarMaskCache::insert(const State &state, std::shared_ptr<const TokenMask> mask) {
+    std::lock_guard lock(mutex_);
+    auto it = entries_.find(state);
+    if (it != entries_.end()) {
+        // Another request computed the same state in the meantime
+        return it->second->second;
+    }
+    lru_.emplace_front(state, std::move(mask));
+    entries_[state] = lru_.begin();
+    if (lru_.size() > capacity_) {
+        entries_.erase(lru_.back().first);
+        lru_.pop_back();
+    }
+    return lru_.front().second;
+}
+
+
+GrammarMatcher::GrammarMatcher(const llama_vocab *vocab, const std::string &grammar, bool lazy,
+                               const std::vector<const char *> &trigger_patterns,
+                               const std::vector<llama_token> &trigger_tokens): vocab_(vocab) {
+    grammar_ = llama_grammar_init_impl(vocab, grammar.c_str(), "root", lazy,
+                                       const_cast<const char **>(trigger_patterns.data()), trigger_patterns.size(),
+                                       trigger_tokens.data(), trigger_tokens.size());
+    if (!grammar_) {
+        return;
+    }
+
+    cache_ = GrammarMaskCache::get(vocab, grammar);
+
+    rule_index_.reserve(grammar_->rules.size());
+    for (uint32_t i = 0; i < grammar_->rules.size(); ++i) {
+        rule_index_.emplace_back(grammar_->rules[i].data(), i);
+    }
+    std::sort(rule_index_.begin(), rule_index_.end(), [](const auto &a, const auto &b) {
+        return std::less<const llama_grammar_element *>()(a.first, b.first);
+    });
+}
+
+GrammarMatcher::~GrammarMatcher() {
+    if (grammar_) {
+        llama_grammar_free_impl(grammar_);
+    }
+}
+
+std::pair<uint32_t, uint32_t> GrammarMatcher::elementOffset(const llama_grammar_element *element) const {
+    auto it = std::upper_bound(rule_index_.begin(), rule_index_.end(), element,
+                               [](const llama_grammar_element *value, const auto &rule) {
+                                   return std::less<const llama_grammar_element *>()(value, rule.first);
+                               });
+    if (it == rule_index_.begin()) {
+        throw std::runtime_error("Grammar element does not belong to any rule");
+    }
+    --it;
+    return {it->second, static_cast<uint32_t>(element - it->first)};
+}
+
+GrammarMaskCache::State GrammarMatcher::state() const {
+    GrammarMaskCache::State state;
+    state.push_back(grammar_->partial_utf8.value);
+    state.push_back(static_cast<uint64_t>(grammar_->partial_utf8.n_remain));
+    for (const auto &stack: grammar_->stacks) {
+        state.push_back(stack.size());
+        for (const auto *element: stack) {
+            auto [rule, offset] = elementOffset(element);
+            state.push_back((static_cast<uint64_t>(rule) << 32) | offset);
+        }
+    }
+    return state;
+}
+
+const TokenMask *GrammarMatcher::mask() {
+    if (grammar_->awaiting_trigger) {
+        return nullptr;
+    }
+    if (current_) {
+        return current_.get();
+    }
+
+    const GrammarMaskCache::State key = state();
+    current_ = cache_->find(key);
+    if (current_) {
+        return current_.get();
+    }
+
+    // First time we see this state: run the grammar over the whole vocabulary once
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab_);
+    std::vector<llama_token_data> candidates(n_vocab);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        candidates[id] = {id, 0.0f, 0.0f};
+    }
+    llama_token_data_array array = {candidates.data(), candidates.size(), -1, false};
+    llama_grammar_apply_impl(*grammar_, &array);
+
+    auto mask = std::make_shared<TokenMask>();
+    mask->bits.assign((n_vocab + 63) / 64, 0);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        if (candidates[id].logit != -INFINITY) {
+            mask->bits[id >> 6] |= 1ULL << (id & 63);
+            mask->n_allowed++;
+        }
+    }
+
+    current_ = cache_->insert(key, std::move(mask));
+    return current_.get();
+}
+
+void GrammarMatcher::accept(llama_token token) {
+    llama_grammar_accept_impl(*grammar_, token);
+    current_.reset();
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "llama.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+struct llama_grammar;
+struct llama_grammar_element;
+
+/**
+ * Bitmask over the vocabulary: bit `i` is set when token `i` is allowed.
+ */
+struct TokenMask {
+    std::vector<uint64_t> bits;
+    int32_t n_allowed = 0;
+
+    bool allowed(llama_token token) const {
+        return (bits[token >> 6] >> (token & 63)) & 1;
+    }
+
+    // Index of the lowest set bit of a non-zero mask word
+    static int lowestBit(uint64_t word) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, word);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctzll(word);
+#endif
+    }
+};
+
+/**
+ * Caches the allowed-token mask of every grammar state seen so far.
+ *
+ * A grammar state is identified by its parse stacks and partial UTF-8 state, both expressed
+ * relative to the grammar rules, so the key does not depend on the generated text or on the
+ * grammar instance. One cache is shared by every request that uses the same grammar source.
+ * States are compared in full, not by their hash: a collision must not hand out another state's mask.
+ */
+class GrammarMaskCache {
+public:
+    // Partial UTF-8 state, then the size and the (rule, offset) elements of every parse stack
+    using State = std::vector<uint64_t>;
+
+    GrammarMaskCache(const llama_vocab *vocab, size_t capacity);
+
+    static std::shared_ptr<GrammarMaskCache> get(const llama_vocab *vocab, const std::string &grammar);
+
+    std::shared_ptr<const TokenMask> find(const State &state);
+
+    std::shared_ptr<const TokenMask> insert(const State &state, std::shared_ptr<const TokenMask> mask);
+
+private:
+    struct StateHash {
+        size_t operator()(const State &state) const;
+    };
+
+    using Entry = std::pair<State, std::shared_ptr<const TokenMask> >;
+
+    const llama_vocab *vocab_;
+    size_t capacity_;
+
+    std::mutex mutex_;
+    std::list<Entry> lru_;
+    std::unordered_map<State, std::list<Entry>::iterator, StateHash> entries_;
+};
+
+/**
+ * Owns the grammar state of a single request and hands out the token mask for the current state.
+ */
+class GrammarMatcher {
+public:
+    GrammarMatcher(const llama_vocab *vocab, const std::string &grammar, bool lazy,
+                   const std::vector<const char *> &trigger_patterns,
+                   const std::vector<llama_token> &trigger_tokens);
+
+    GrammarMatcher(const GrammarMatcher &) = delete;
+
+    GrammarMatcher &operator=(const GrammarMatcher &) = delete;
+
+    ~GrammarMatcher();
+
+    /**
+     * Returns the mask of the current grammar state, or nullptr while a lazy grammar is still
+     * waiting for its trigger and every token is allowed.
+     */
+    const TokenMask *mask();
+
+    void accept(llama_token token);
+
+    bool valid() const { return grammar_ != nullptr; }
+
+private:
+    GrammarMaskCache::State state() const;
+
+    std::pair<uint32_t, uint32_t> elementOffset(const llama_grammar_element *element) const;
+
+    const llama_vocab *vocab_;
+    llama_grammar *grammar_ = nullptr;
+    std::shared_ptr<GrammarMaskCache> cache_;
+    std::shared_ptr<const TokenMask> current_;
+
+    // Start address and index of every grammar rule, sorted by address
+    std::vector<std::pair<const llama_grammar_element *, uint32_t> > rule_index_;
+};
@@ -0,0 +1,63 @@
+#include "LogitBias.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+std::shared_ptr<const LogitBiasTable> LogitBiasTable::get(const std::map<int32_t, float> &logit_bias,
+                                                          const std::vector<int32_t> &banned_tokens,
+                                                          int32_t n_vocab) {
+    if (logit_bias.empty() && banned_tokens.empty()) {
+        return nullptr;
+    }
+
+    // Banned tokens win over any bias given for the same token
+    std::map<int32_t, float> merged = logit_bias;
+    for (int32_t token: banned_tokens) {
+        merged[token] = -INFINITY;
+    }
+
+    std::string key(merged.size() * (sizeof(int32_t) + sizeof(float)), '\0');
+    char *out = key.data();
+    for (const auto &[token, bias]: merged) {
+        if (token < 0 || token >= n_vocab) {
+            throw std::runtime_error("Invalid token id in logit bias: " + std::to_string(token));
+        }
+        std::memcpy(out, &token, sizeof(token));
+        std::memcpy(out + sizeof(token), &bias, sizeof(bias));
+        out += sizeof(token) + sizeof(bias);
+    }
+
+    static std::mutex registryLock;
+    static std::unordered_map<std::string, std::weak_ptr<const LogitBiasTable> > registry;
+
+    std::lock_guard lock(registryLock);
+    auto &entry = registry[key];
+    auto table = entry.lock();
+    if (table) {
+        return table;
+    }
+
+    auto created = std::make_shared<LogitBiasTable>();
+    created->tokens.reserve(merged.size());
+    created->bias.reserve(merged.size());
+    for (const auto &[token, bias]: merged) {
+        created->tokens.push_back(token);
+        created->bias.push_back(bias);
+    }
+    entry = created;
+
+    // Drop registry entries whose tables are no longer used by any request
+    for (auto it = registry.begin(); it != registry.end();) {
+        if (it->second.expired()) {
+            it = registry.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return created;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "llama.h"
+
+/**
+ * Sparse logit update built from a request's logit bias map and banned-token list.
+ *
+ * Tables are interned: requests passing the same map and list share one instance.
+ */
+struct LogitBiasTable {
+    std::vector<llama_token> tokens;
+    // -INFINITY for banned tokens
+    std::vector<float> bias;
+
+    // On candidates built by SynexisSampler::fillCandidates: the whole vocabulary indexed by token id, or the
+    // tokens a grammar allows in increasing order. The logits row of the context stays as it is.
+    void apply(llama_token_data *candidates, size_t n_candidates, int32_t n_vocab) const {
+        const size_t n = tokens.size();
+        if (n_candidates == static_cast<size_t>(n_vocab)) {
+            for (size_t i = 0; i < n; ++i) {
+                candidates[tokens[i]].logit += bias[i];
+            }
+            return;
+        }
+        // Both are sorted by token id
+        size_t c = 0;
+        for (size_t i = 0; i < n && c < n_candidates; ++i) {
+            while (c < n_candidates && candidates[c].id < tokens[i]) {
+                ++c;
+            }
+            if (c < n_candidates && candidates[c].id == tokens[i]) {
+                candidates[c].logit += bias[i];
+            }
+        }
+    }
+
+    static std::shared_ptr<const LogitBiasTable> get(const std::map<int32_t, float> &logit_bias,
+                                                     const std::vector<int32_t> &banned_tokens,
+                                                     int32_t n_vocab);
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "synexis/TaskParams.h"
+
+/**
+ * Log of the softmax normalizer of a logits row, log(sum(exp(logits))).
+ */
+inline float logits_logsumexp(const float *logits, int32_t n, float max_logit) {
+    if (max_logit == -INFINITY) {
+        return -INFINITY;
+    }
+    float sum = 0.0f;
+    for (int32_t i = 0; i < n; ++i) {
+        sum += std::exp(logits[i] - max_logit);
+    }
+    return max_logit + std::log(sum);
+}
+
+inline float logits_max(const float *logits, int32_t n) {
+    float max_logit = -INFINITY;
+    for (int32_t i = 0; i < n; ++i) {
+        max_logit = std::max(max_logit, logits[i]);
+    }
+    return max_logit;
+}
+
+/**
+ * Writes the `k` highest logits of the row into `out`, sorted in descending order.
+ *
+ * Keeps a small sorted window and only touches it for logits that beat its smallest entry,
+ * so a row is scanned once without sorting the vocabulary. Returns the maximum logit.
+ */
+inline float logits_top_k(const float *logits, int32_t n, int32_t k, TokenLogprob *out) {
+    float max_logit = -INFINITY;
+    int32_t filled = 0;
+    for (int32_t i = 0; i < n; ++i) {
+        const float logit = logits[i];
+        max_logit = std::max(max_logit, logit);
+        if (filled == k && (k == 0 || logit <= out[k - 1].logprob)) {
+            continue;
+        }
+        int32_t pos = filled < k ? filled++ : k - 1;
+        while (pos > 0 && out[pos - 1].logprob < logit) {
+            out[pos] = out[pos - 1];
+            --pos;
+        }
+        out[pos] = {i, logit};
+    }
+    for (int32_t i = filled; i < k; ++i) {
+        out[i] = {-1, -INFINITY};
+    }
+    return max_logit;
+}
@@ -1,103 +1,179 @@
 #pragma once
 
-#include <deque>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
 
 template<typename T>
 /**
  * A circular buffer implementation that allows for fixed-size storage of elements.
  *
- * This class supports operations to enqueue and dequeue elements while maintaining a
- * fixed maximum capacity. When the buffer reaches its capacity, older elements can
- * be overwritten based on the operation logic.
+ * The storage is allocated once, with a power-of-two capacity, and never grows: pushing an
+ * element never allocates. Every element is written twice, at its slot and at the same slot in
+ * a mirror half, so the most recent elements are always available as one contiguous range
+ * that can be scanned without wrapping around.
  */
 class RingBuffer {
+    static_assert(std::is_trivially_copyable<T>::value, "RingBuffer only holds trivially copyable elements");
+
+public:
     /**
-     * Stores elements in a sequential container with dynamic sizing.
+     * Contiguous, read-only view over a range of the buffer, oldest element first.
      *
-     * This member variable acts as the underlying container for the ring buffer.
-     * It retains the elements in the order they were pushed, ensuring
-     * that newer elements are always added to the back, while older
-     * elements can be removed from the front when the maximum size of
-     * the ring buffer is exceeded.
+     * The view stays valid until the next push.
+     */
+    struct View {
+        const T *data_ = nullptr;
+        size_t size_ = 0;
+
+        const T *data() const { return data_; }
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        const T &operator[](size_t index) const { return data_[index]; }
+        const T *begin() const { return data_; }
+        const T *end() const { return data_ + size_; }
+    };
+
+    /**
+     * Position of the buffer at some point in time, see snapshot() and restore().
      */
+    struct Snapshot {
+        size_t head;
+        size_t count;
+    };
+
 private:
-    std::deque<T> buffer;
+    /**
+     * Backing storage of `2 * capacity` elements. Slot `i` and slot `i + capacity` always hold
+     * the same element.
+     */
+    std::vector<T> buffer;
     /**
      * Specifies the maximum number of elements that the RingBuffer can hold.
      * If the number of elements exceeds this value, the oldest element in
-     * the buffer will be removed to make space for the new element being added.
+     * the buffer will be dropped to make space for the new element being added.
      */
     size_t max_size;
+    /**
+     * Power-of-two number of slots, at least `max_size`.
+     */
+    size_t capacity;
+    /**
+     * Slot that receives the next element.
+     */
+    size_t head = 0;
+    /**
+     * Number of elements currently stored.
+     */
+    size_t count = 0;
+
+    static size_t roundUpPowerOfTwo(size_t size) {
+        size_t result = 1;
+        while (result < size) {
+            result <<= 1;
+        }
+        return result;
+    }
 
     /**
      * Constructs a RingBuffer object with the specified maximum size.
-     * Initializes the buffer with the given maximum capacity.
+     * Allocates all the storage the buffer will ever use.
      *
      * @param size The maximum size of the ring buffer.
      */
 public:
-    explicit RingBuffer(const size_t size) : max_size(size) {
+    explicit RingBuffer(const size_t size) : max_size(size), capacity(roundUpPowerOfTwo(size)) {
+        buffer.resize(2 * capacity);
     }
 
     /**
-     * Adds an element to the end of the container, resizing it if necessary.
-     *
-     * This method appends the specified element to the back of the container.
+     * Adds an element to the end of the buffer, dropping the oldest one when it is full.
      *
-     * @param value The element to be added to the container.
+     * @param item The element to be added to the buffer.
      */
     void push_back(const T &item) {
-        buffer.push_back(item);
-        if (buffer.size() > max_size) {
-            buffer.pop_front();
+        buffer[head] = item;
+        buffer[head + capacity] = item;
+        head = (head + 1) & (capacity - 1);
+        if (count < max_size) {
+            count++;
         }
     }
 
     /**
      * @brief Clears all elements from the buffer.
      *
-     * This method removes all items currently stored in the buffer, leaving it empty.
-     * After calling this method, the size of the buffer will be zero.
+     * The storage is kept, only the element count is reset.
      */
-    void clear() { buffer.clear(); }
+    void clear() {
+        head = 0;
+        count = 0;
+    }
+
     /**
-     *
+     * Number of elements currently stored.
      */
-    size_t size() const { return buffer.size(); }
+    size_t size() const { return count; }
+
     /**
-     *
+     * True when no element is stored.
      */
-    bool empty() const { return buffer.empty(); }
+    bool empty() const { return count == 0; }
 
     /**
-     * Overloads the operator to define a specific behavior when it is invoked.
+     * Returns the element at the given index, 0 being the oldest element. O(1).
      *
-     * The operator is used to carry out a customized operation based on its implementation.
+     * @param index Position of the element, must be lower than size().
+     */
+    const T &operator[](size_t index) const { return buffer[(head + capacity - count + index) & (capacity - 1)]; }
+
+    /**
+     * Returns the most recently pushed element. The buffer must not be empty.
+     */
+    const T &back() const { return buffer[head + capacity - 1]; }
+
+    /**
+     * Returns a contiguous view of the last `n` elements, or of every element when fewer are stored.
      *
-     * @param lhs The left-hand side operand of the operation.
-     * @param rhs The right-hand side operand of the operation.
-     * @return The result of the operation based on the implementation.
+     * @param n Number of elements to include.
      */
-    const T &operator[](size_t index) const { return buffer[index]; }
+    View last(size_t n) const {
+        if (n > count) {
+            n = count;
+        }
+        return View{buffer.data() + head + capacity - n, n};
+    }
+
     /**
-     * Overloads an operator to provide custom functionality.
+     * Returns a contiguous view of every stored element, oldest first.
+     */
+    View view() const { return last(count); }
+
+    /**
+     * Captures the current position of the buffer. The snapshot is trivially copyable.
+     */
+    Snapshot snapshot() const { return Snapshot{head, count}; }
+
+    /**
+     * Drops every element pushed after the snapshot was taken.
      *
-     * This method allows for the redefinition of the behavior of a specific operator for objects of
-     * the class it resides in, enabling custom logic as required.
+     * Only valid while those pushes did not overwrite the elements held at snapshot time, i.e. when
+     * no more than `capacity - snapshot.count` elements were pushed since.
      *
-     * @param other The operand or object to be used in the operation with the current instance.
-     *              The type and significance of this parameter depend on the operator being overloaded.
-     * @return The result of the operation. The return type and value depend on the custom implementation
-     *         of the overloaded operator.
+     * @param snapshot Position returned by snapshot().
      */
-    T &operator[](size_t index) { return buffer[index]; }
+    void restore(const Snapshot &snapshot) {
+        head = snapshot.head;
+        count = snapshot.count;
+    }
 
     /**
-     *
+     * Iterators over every stored element, oldest first.
      */
-    auto begin() const { return buffer.begin(); }
+    const T *begin() const { return view().begin(); }
+
     /**
-     *
+     * End iterator matching begin().
      */
-    auto end() const { return buffer.end(); }
+    const T *end() const { return view().end(); }
 };
@@ -3,6 +3,7 @@
 #include <sstream>
 #include <stdexcept>
 #include "Sampler.h"
+#include "Logprobs.h"
 
 #include <llama-cpp.h>
 
@@ -12,6 +13,8 @@ SynexisSampler::SynexisSampler(llama_model *model, const SamplingParams &params)
       , model_(model)
       , vocab_(llama_model_get_vocab(model))
       , token_history_(std::max(32, params.n_prev)) {
+    logit_bias_ = LogitBiasTable::get(params_.logit_bias, params_.banned_tokens, llama_vocab_n_tokens(vocab_));
+
     if (!initialize_grammar_sampler() || !initialize_chain_sampler()) {
         throw std::runtime_error("Failed to initialize samplers");
     }
@@ -23,13 +26,13 @@ SynexisSampler::SynexisSampler(SynexisSampler &&other) noexcept
     : params_(std::move(other.params_))
       , model_(other.model_)
       , vocab_(other.vocab_)
-      , grammar_sampler_(std::move(other.grammar_sampler_))
+      , grammar_(std::move(other.grammar_))
+      , logit_bias_(std::move(other.logit_bias_))
       , chain_sampler_(std::move(other.chain_sampler_))
       , token_history_(std::move(other.token_history_))
       , current_candidates_(std::move(other.current_candidates_))
       , current_candidates_array_(std::move(other.current_candidates_array_))
       , initialized_(other.initialized_) {
-    other.grammar_sampler_ = nullptr;
     other.chain_sampler_ = nullptr;
     other.initialized_ = false;
 }
@@ -41,59 +44,37 @@ SynexisSampler &SynexisSampler::operator=(SynexisSampler &&other) noexcept {
         params_ = std::move(other.params_);
         model_ = other.model_;
         vocab_ = other.vocab_;
-        grammar_sampler_ = other.grammar_sampler_;
+        grammar_ = std::move(other.grammar_);
+        logit_bias_ = std::move(other.logit_bias_);
         chain_sampler_ = other.chain_sampler_;
         token_history_ = std::move(other.token_history_);
         current_candidates_ = std::move(other.current_candidates_);
         current_candidates_array_ = std::move(other.current_candidates_array_);
         initialized_ = other.initialized_;
 
-        other.grammar_sampler_ = nullptr;
         other.chain_sampler_ = nullptr;
         other.initialized_ = false;
     }
     return *this;
 }
 
-llama_token SynexisSampler::sample(llama_context *ctx, int idx, bool grammar_first) {
+llama_token SynexisSampler::sample(llama_context *ctx, int idx) {
     if (!initialized_ || !ctx) {
         throw std::runtime_error("Sampler not initialized or context is null");
     }
 
-    setLogits(ctx, idx);
-
-    if (grammar_first) {
-        llama_sampler_apply(grammar_sampler_, current_candidates_array_.get());
-    }
-
-    llama_sampler_apply(chain_sampler_, current_candidates_array_.get());
-
-    assert(current_candidates_array_->selected != -1 && "no selected token during sampling");
-
-    const llama_token id = current_candidates_array_->data[current_candidates_array_->selected].id;
-
-    if (grammar_first) {
-        return id;
-    }
-
-    // Check if the sampled token fits the grammar
-    llama_token_data single_token_data = {id, 1.0f, 0.0f};
-    llama_token_data_array single_token_data_array = {&single_token_data, 1, -1, false};
-
-    llama_sampler_apply(grammar_sampler_, &single_token_data_array);
-
-    const bool is_valid = single_token_data_array.data[0].logit != -INFINITY;
-    if (is_valid) {
-        return id;
+    // The grammar is applied up front through its cached token mask, so the sampled token is always valid
+    const TokenMask *mask = grammar_ ? grammar_->mask() : nullptr;
+    if (mask && mask->n_allowed == 0) {
+        // The grammar has no valid continuation, not even an end of generation token the grammar could accept
+        return LLAMA_TOKEN_NULL;
     }
 
-    // Resampling: apply grammar first, then sampling chain
-    setLogits(ctx, idx);
+    setLogits(ctx, idx, mask);
 
-    llama_sampler_apply(grammar_sampler_, current_candidates_array_.get());
     llama_sampler_apply(chain_sampler_, current_candidates_array_.get());
 
-    assert(current_candidates_array_->selected != -1 && "no selected token during re-sampling");
+    assert(current_candidates_array_->selected != -1 && "no selected token during sampling");
 
     return current_candidates_array_->data[current_candidates_array_->selected].id;
 }
@@ -103,29 +84,49 @@ void SynexisSampler::accept(llama_token token, bool accept_grammar) {
         throw std::runtime_error("Sampler not initialized");
     }
 
-    if (accept_grammar) {
-        llama_sampler_accept(grammar_sampler_, token);
+    if (accept_grammar && grammar_) {
+        grammar_->accept(token);
     }
 
     llama_sampler_accept(chain_sampler_, token);
     token_history_.push_back(token);
 }
 
+void SynexisSampler::probs(llama_context *ctx, int idx, llama_token token, TokenProbs &out) const {
+    const float *logits = idx == -1 ? llama_get_logits(ctx) : llama_get_logits_ith(ctx, idx);
+    if (!logits) {
+        throw std::runtime_error("Failed to get logits from context");
+    }
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab_);
+    const int32_t n_top = std::min(std::max(params_.n_probs, 0), n_vocab);
+
+    out.top.resize(n_top);
+    const float max_logit = logits_top_k(logits, n_vocab, n_top, out.top.data());
+    const float log_norm = logits_logsumexp(logits, n_vocab, max_logit);
+
+    for (auto &entry: out.top) {
+        entry.logprob -= log_norm;
+    }
+    out.chosen = {token, logits[token] - log_norm};
+}
+
 void SynexisSampler::set_grammar(const std::string &grammar_str, bool lazy) {
     params_.grammar = grammar_str;
     params_.grammar_lazy = lazy;
 
     if (initialized_) {
         // Reinitialize grammar sampler
-        if (grammar_sampler_) {
-            llama_sampler_free(grammar_sampler_);
-        }
         initialize_grammar_sampler();
     }
 }
 
 
 bool SynexisSampler::initialize_grammar_sampler() {
+    grammar_.reset();
+    if (params_.grammar.empty()) {
+        return true;
+    }
+
     std::vector<std::string> trigger_patterns;
     std::vector<std::string> patterns_anywhere;
     std::vector<llama_token> trigger_tokens;
@@ -164,114 +165,125 @@ bool SynexisSampler::initialize_grammar_sampler() {
         trigger_patterns_c.push_back(regex.c_str());
     }
 
-    auto ptr = params_.grammar_lazy
-                   ? llama_sampler_init_grammar_lazy_patterns(vocab_, params_.grammar.c_str(), "root",
-                                                              trigger_patterns_c.data(), trigger_patterns_c.size(),
-                                                              trigger_tokens.data(), trigger_tokens.size())
-                   : llama_sampler_init_grammar(vocab_, params_.grammar.c_str(), "root");
+    if (!params_.grammar_lazy) {
+        trigger_patterns_c.clear();
+        trigger_tokens.clear();
+    }
 
-    grammar_sampler_ = ptr;
+    grammar_ = std::make_unique<GrammarMatcher>(vocab_, params_.grammar, params_.grammar_lazy,
+                                                trigger_patterns_c, trigger_tokens);
 
-    return true;
+    return grammar_->valid();
 }
 
 bool SynexisSampler::initialize_chain_sampler() {
+    // Logit bias and banned tokens are not part of the chain, setLogits applies them to the candidates
+    chain_sampler_ = buildChain(params_, vocab_, llama_model_n_ctx_train(model_));
+    return chain_sampler_ != nullptr;
+}
+
+llama_sampler *SynexisSampler::buildChain(const SamplingParams &params, const llama_vocab *vocab,
+                                          int32_t n_ctx_train) {
     llama_sampler_chain_params lparams = llama_sampler_chain_default_params();
-    lparams.no_perf = params_.no_perf;
+    lparams.no_perf = params.no_perf;
 
-    chain_sampler_ = llama_sampler_chain_init(lparams);
-    if (!chain_sampler_) {
-        return false;
+    llama_sampler *chain = llama_sampler_chain_init(lparams);
+    if (!chain) {
+        return nullptr;
     }
-    //TODO
-    // // Add logit bias sampler
-    // llama_sampler_chain_add(chain_sampler_,
-    //                         llama_sampler_init_logit_bias(
-    //                             llama_vocab_n_tokens(vocab_),
-    //                             params_.logit_bias.size(),
-    //                             params_.logit_bias.data()));
-
-    if (params_.mirostat == 0) {
+    auto requireVocab = [&](const char *sampler) {
+        if (!vocab) {
+            llama_sampler_free(chain);
+            throw std::runtime_error(std::string("The ") + sampler + " sampler needs a vocabulary");
+        }
+    };
+
+    if (params.mirostat == 0) {
         // Add samplers in the specified order
-        for (const auto &sampler_type: params_.samplers) {
+        for (const auto &sampler_type: params.samplers) {
             switch (sampler_type) {
                 case SAMPLER_TYPE_DRY: {
+                    requireVocab("DRY");
                     std::vector<const char *> c_breakers;
-                    c_breakers.reserve(params_.dry_sequence_breakers.size());
-                    for (const auto &str: params_.dry_sequence_breakers) {
+                    c_breakers.reserve(params.dry_sequence_breakers.size());
+                    for (const auto &str: params.dry_sequence_breakers) {
                         c_breakers.push_back(str.c_str());
                     }
 
-                    llama_sampler_chain_add(chain_sampler_,
-                                            llama_sampler_init_dry(vocab_, llama_model_n_ctx_train(model_),
-                                                                   params_.dry_multiplier, params_.dry_base,
-                                                                   params_.dry_allowed_length,
-                                                                   params_.dry_penalty_last_n,
+                    llama_sampler_chain_add(chain,
+                                            llama_sampler_init_dry(vocab, n_ctx_train,
+                                                                   params.dry_multiplier, params.dry_base,
+                                                                   params.dry_allowed_length,
+                                                                   params.dry_penalty_last_n,
                                                                    c_breakers.data(), c_breakers.size()));
                     break;
                 }
                 case SAMPLER_TYPE_TOP_K:
-                    llama_sampler_chain_add(chain_sampler_, llama_sampler_init_top_k(params_.top_k));
+                    llama_sampler_chain_add(chain, llama_sampler_init_top_k(params.top_k));
                     break;
                 case SAMPLER_TYPE_TOP_P:
-                    llama_sampler_chain_add(chain_sampler_,
-                                            llama_sampler_init_top_p(params_.top_p, params_.min_keep));
+                    llama_sampler_chain_add(chain,
+                                            llama_sampler_init_top_p(params.top_p, params.min_keep));
                     break;
                 case SAMPLER_TYPE_TOP_N_SIGMA:
-                    llama_sampler_chain_add(chain_sampler_, llama_sampler_init_top_n_sigma(params_.top_n_sigma));
+                    llama_sampler_chain_add(chain, llama_sampler_init_top_n_sigma(params.top_n_sigma));
                     break;
                 case SAMPLER_TYPE_MIN_P:
-                    llama_sampler_chain_add(chain_sampler_,
-                                            llama_sampler_init_min_p(params_.min_p, params_.min_keep));
+                    llama_sampler_chain_add(chain,
+                                            llama_sampler_init_min_p(params.min_p, params.min_keep));
                     break;
                 case SAMPLER_TYPE_XTC:
-                    llama_sampler_chain_add(chain_sampler_,
-                                            llama_sampler_init_xtc(params_.xtc_probability, params_.xtc_threshold,
-                                                                   params_.min_keep, params_.seed));
+                    llama_sampler_chain_add(chain,
+                                            llama_sampler_init_xtc(params.xtc_probability, params.xtc_threshold,
+                                                                   params.min_keep, params.seed));
                     break;
                 case SAMPLER_TYPE_TYPICAL_P:
-                    llama_sampler_chain_add(chain_sampler_,
-                                            llama_sampler_init_typical(params_.typ_p, params_.min_keep));
+                    llama_sampler_chain_add(chain,
+                                            llama_sampler_init_typical(params.typ_p, params.min_keep));
                     break;
                 case SAMPLER_TYPE_TEMPERATURE:
-                    llama_sampler_chain_add(chain_sampler_,
-                                            llama_sampler_init_temp_ext(params_.temp, params_.dynatemp_range,
-                                                                        params_.dynatemp_exponent));
+                    llama_sampler_chain_add(chain,
+                                            llama_sampler_init_temp_ext(params.temp, params.dynatemp_range,
+                                                                        params.dynatemp_exponent));
                     break;
                 case SAMPLER_TYPE_INFILL:
-                    llama_sampler_chain_add(chain_sampler_, llama_sampler_init_infill(vocab_));
+                    requireVocab("infill");
+                    llama_sampler_chain_add(chain, llama_sampler_init_infill(vocab));
                     break;
                 case SAMPLER_TYPE_PENALTIES:
-                    llama_sampler_chain_add(chain_sampler_,
+                    llama_sampler_chain_add(chain,
                                             llama_sampler_init_penalties(
-                                                params_.penalty_last_n, params_.penalty_repeat, params_.penalty_freq,
-                                                params_.penalty_present));
+                                                params.penalty_last_n, params.penalty_repeat, params.penalty_freq,
+                                                params.penalty_present));
                     break;
                 default:
+                    llama_sampler_free(chain);
                     throw std::runtime_error("Unknown sampler type");
             }
         }
-        llama_sampler_chain_add(chain_sampler_, llama_sampler_init_dist(params_.seed));
-    } else if (params_.mirostat == 1) {
-        llama_sampler_chain_add(chain_sampler_, llama_sampler_init_temp(params_.temp));
-        llama_sampler_chain_add(chain_sampler_,
-                                llama_sampler_init_mirostat(llama_vocab_n_tokens(vocab_), params_.seed,
-                                                            params_.mirostat_tau, params_.mirostat_eta, 100));
-    } else if (params_.mirostat == 2) {
-        llama_sampler_chain_add(chain_sampler_, llama_sampler_init_temp(params_.temp));
-        llama_sampler_chain_add(chain_sampler_,
-                                llama_sampler_init_mirostat_v2(params_.seed, params_.mirostat_tau,
-                                                               params_.mirostat_eta));
+        llama_sampler_chain_add(chain, llama_sampler_init_dist(params.seed));
+    } else if (params.mirostat == 1) {
+        requireVocab("mirostat");
+        llama_sampler_chain_add(chain, llama_sampler_init_temp(params.temp));
+        llama_sampler_chain_add(chain,
+                                llama_sampler_init_mirostat(llama_vocab_n_tokens(vocab), params.seed,
+                                                            params.mirostat_tau, params.mirostat_eta, 100));
+    } else if (params.mirostat == 2) {
+        llama_sampler_chain_add(chain, llama_sampler_init_temp(params.temp));
+        llama_sampler_chain_add(chain,
+                                llama_sampler_init_mirostat_v2(params.seed, params.mirostat_tau,
+                                                               params.mirostat_eta));
     } else {
+        llama_sampler_free(chain);
         throw std::runtime_error("Unknown mirostat version");
     }
 
-    return true;
+    return chain;
 }
 
 
-void SynexisSampler::setLogits(llama_context *ctx, int idx) {
-    const float *logits = nullptr;
+void SynexisSampler::setLogits(llama_context *ctx, int idx, const TokenMask *mask) {
+    float *logits = nullptr;
     if (idx == -1) {
         logits = llama_get_logits(ctx);
     } else {
@@ -288,20 +300,17 @@ void SynexisSampler::setLogits(llama_context *ctx, int idx) {
         throw std::runtime_error("Invalid vocabulary size");
     }
 
-
-    current_candidates_.resize(n_vocab);
-
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        current_candidates_[token_id] = {
-            token_id,
-            logits[token_id],
-            0.0f
-        };
+    const size_t n_candidates = fillCandidates(logits, n_vocab, mask, current_candidates_);
+    // On the candidates rather than the row: probs() reads the row again for the logprobs of the unbiased model
+    if (logit_bias_) {
+        logit_bias_->apply(current_candidates_.data(), n_candidates, n_vocab);
     }
 
-    current_candidates_array_ = std::make_unique<llama_token_data_array>();
+    if (!current_candidates_array_) {
+        current_candidates_array_ = std::make_unique<llama_token_data_array>();
+    }
     current_candidates_array_->data = current_candidates_.data();
-    current_candidates_array_->size = current_candidates_.size();
+    current_candidates_array_->size = n_candidates;
     current_candidates_array_->selected = -1;
     current_candidates_array_->sorted = false;
     // Initialize the token data array structure
@@ -313,6 +322,35 @@ void SynexisSampler::setLogits(llama_context *ctx, int idx) {
     // };
 }
 
+size_t SynexisSampler::fillCandidates(const float *logits, int32_t n_vocab, const TokenMask *mask,
+                                      std::vector<llama_token_data> &out) {
+    out.resize(n_vocab);
+
+    size_t n_candidates = 0;
+    if (mask && mask->n_allowed < n_vocab) {
+        // Only the tokens allowed by the grammar become candidates, walking the mask a word at a time
+        const size_t n_words = mask->bits.size();
+        for (size_t word = 0; word < n_words; ++word) {
+            uint64_t bits = mask->bits[word];
+            while (bits) {
+                const llama_token token_id = static_cast<llama_token>(word * 64 + TokenMask::lowestBit(bits));
+                out[n_candidates++] = {token_id, logits[token_id], 0.0f};
+                bits &= bits - 1;
+            }
+        }
+    } else {
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            out[token_id] = {
+                token_id,
+                logits[token_id],
+                0.0f
+            };
+        }
+        n_candidates = n_vocab;
+    }
+    return n_candidates;
+}
+
 std::string SynexisSampler::escapeRegex(const std::string &str) {
     static const std::regex special_chars("[.^$|()*+?\\[\\]{}\\\\]");
     return std::regex_replace(str, special_chars, "\\$&");
@@ -332,11 +370,10 @@ std::string SynexisSampler::joinStrings(const std::vector<std::string> &strings,
 
 void SynexisSampler::reset() {
     llama_sampler_reset(chain_sampler_);
-    llama_sampler_reset(grammar_sampler_);
+    initialize_grammar_sampler();
 }
 
 SynexisSampler::~SynexisSampler() {
     token_history_.clear();
     llama_sampler_free(chain_sampler_);
-    llama_sampler_free(grammar_sampler_);
 }
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <memory>
+
 #include "../../include/synexis/sampler/Enums.h"
+#include "GrammarMatcher.h"
+#include "LogitBias.h"
 #include "RingBuffer.h"
 #include "../../include/synexis/sampler/StructParams.h"
 
@@ -11,6 +15,7 @@ struct llama_context;
 struct llama_model;
 struct llama_token_data;
 struct llama_token_data_array;
+struct TokenProbs;
 
 class SynexisSampler {
 public:
@@ -27,16 +32,31 @@ public:
 
     SynexisSampler &operator=(SynexisSampler &&other) noexcept;
 
-    // Main sampling interface
-    int32_t sample(llama_context *ctx, int idx = -1, bool grammar_first = false);
+    // Main sampling interface, LLAMA_TOKEN_NULL when the grammar allows no token at all
+    int32_t sample(llama_context *ctx, int idx = -1);
 
     void accept(int32_t token, bool accept_grammar = true);
 
+    // Log-probability of `token` and the top `params.n_probs` alternatives, read from the same logits row as sample()
+    void probs(llama_context *ctx, int idx, int32_t token, TokenProbs &out) const;
+
     // Configuration methods
     void set_grammar(const std::string &grammar_str, bool lazy = false);
 
     void reset();
 
+    // Recently accepted tokens (prompt and generated), oldest first. last(n) gives a contiguous view for scans.
+    const RingBuffer<int32_t> &history() const { return token_history_; }
+
+    // Writes the candidates of a logits row into `out`, only the tokens allowed by `mask` when it is given.
+    // Returns the number of candidates.
+    static size_t fillCandidates(const float *logits, int32_t n_vocab, const TokenMask *mask,
+                                 std::vector<llama_token_data> &out);
+
+    // The sampler chain for `params`, owned by the caller. `vocab` may be null as long as neither DRY, infill nor
+    // mirostat 1 are asked for.
+    static llama_sampler *buildChain(const SamplingParams &params, const llama_vocab *vocab, int32_t n_ctx_train);
+
 
     ~SynexisSampler();
 
@@ -47,7 +67,7 @@ private:
     bool initialize_chain_sampler();
 
 
-    void setLogits(llama_context *ctx, int idx);
+    void setLogits(llama_context *ctx, int idx, const TokenMask *mask = nullptr);
 
     std::string escapeRegex(const std::string &str);
 
@@ -58,7 +78,8 @@ private:
     const llama_model *model_;
     const llama_vocab *vocab_;
 
-    llama_sampler *grammar_sampler_;
+    std::unique_ptr<GrammarMatcher> grammar_;
+    std::shared_ptr<const LogitBiasTable> logit_bias_;
     llama_sampler *chain_sampler_;
 
     RingBuffer<int32_t> token_history_;
@@ -1,14 +1,147 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
 #include <string>
-// Computes FNV-1a hash of the data
-static std::string fnv_hash(const uint8_t *data, size_t len) {
-    const uint64_t fnv_prime = 0x100000001b3ULL;
-    uint64_t hash = 0xcbf29ce484222325ULL;
 
-    for (size_t i = 0; i < len; ++i) {
-        hash ^= data[i];
-        hash *= fnv_prime;
+#include "llama.h"
+
+// Tokens whose piece fits are converted through a stack buffer, longer ones take a second call
+#define TOKEN_PIECE_MAX_SIZE 64
+
+// 64-bit hash in the spirit of xxHash64: four independent lanes consume 32 bytes per step, which keeps long
+// prompts and media buffers at memory speed
+static uint64_t hash_bytes(const void *data, size_t len, uint64_t seed = 0) {
+    constexpr uint64_t p1 = 0x9E3779B185EBCA87ULL;
+    constexpr uint64_t p2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr uint64_t p3 = 0x165667B19E3779F9ULL;
+    constexpr uint64_t p4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr uint64_t p5 = 0x27D4EB2F165667C5ULL;
+    const auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    const auto read64 = [](const uint8_t *p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    };
+    const auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * p2, 31) * p1; };
+    const auto merge = [&](uint64_t acc, uint64_t lane) { return (acc ^ round(0, lane)) * p1 + p4; };
+
+    const auto *p = static_cast<const uint8_t *>(data);
+    const uint8_t *const end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + p1 + p2, v2 = seed + p2, v3 = seed, v4 = seed - p1;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + p5;
+    }
+    h += len;
+    for (; end - p >= 8; p += 8) {
+        h = rotl(h ^ round(0, read64(p)), 27) * p1 + p4;
+    }
+    if (end - p >= 4) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        h = rotl(h ^ (v * p1), 23) * p2 + p3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h = rotl(h ^ (*p * p5), 11) * p1;
+    }
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Number of bytes of the UTF-8 sequence started by `lead`, 1 for ASCII and stray bytes
+static size_t utf8_sequence_length(unsigned char lead) {
+    if ((lead & 0xE0) == 0xC0) return 2;
+    if ((lead & 0xF0) == 0xE0) return 3;
+    if ((lead & 0xF8) == 0xF0) return 4;
+    return 1;
+}
+
+// Cuts a stream of token pieces on code point boundaries. A piece that ends inside a multi-byte sequence
+// has its trailing bytes held back until the next piece completes them, so only the bytes that are new to
+// the stream are ever looked at.
+struct Utf8Stream {
+    // Bytes of the last sequence that is not complete yet, and how many are still expected
+    std::string partial;
+    size_t missing = 0;
+
+    // Appends to `out` everything of `piece` that forms complete code points, together with the held back bytes
+    void feed(const std::string &piece, std::string &out) {
+        const size_t n = piece.size();
+        size_t i = 0;
+        while (missing > 0 && i < n && (static_cast<unsigned char>(piece[i]) & 0xC0) == 0x80) {
+            partial += piece[i++];
+            --missing;
+        }
+        if (missing > 0) {
+            if (i == n) {
+                return;
+            }
+            // Interrupted sequence, pass the invalid bytes through and let the reader replace them
+            missing = 0;
+        }
+        out += partial;
+        partial.clear();
+
+        // Only the last three bytes can start a sequence that is cut off
+        size_t end = n;
+        for (size_t back = 1; back <= 3 && back <= n - i; ++back) {
+            const auto c = static_cast<unsigned char>(piece[n - back]);
+            if ((c & 0xC0) == 0x80) {
+                continue;
+            }
+            const size_t len = utf8_sequence_length(c);
+            if (back < len) {
+                end = n - back;
+                missing = len - back;
+            }
+            break;
+        }
+        out.append(piece, i, end - i);
+        partial.assign(piece, end, std::string::npos);
+    }
+
+    // Returns the bytes of an unfinished sequence, if any, and forgets them
+    std::string flush() {
+        std::string rest = std::move(partial);
+        partial.clear();
+        missing = 0;
+        return rest;
     }
-    return std::to_string(hash);
+
+    void reset() {
+        partial.clear();
+        missing = 0;
+    }
+};
+
+// Writes the text of `token` into `piece`, reusing its storage, and returns its size
+static size_t token_to_piece(const llama_vocab *vocab, llama_token token, bool special, std::string &piece) {
+    char buf[TOKEN_PIECE_MAX_SIZE];
+    const int32_t n_chars = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, special);
+    if (n_chars >= 0) {
+        piece.assign(buf, n_chars);
+        return piece.size();
+    }
+
+    const int32_t required = -n_chars;
+    piece.resize(required);
+    const int32_t check = llama_token_to_piece(vocab, token, piece.data(), required, 0, special);
+    GGML_ASSERT(check == required);
+    return piece.size();
 }
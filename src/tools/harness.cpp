@@ -0,0 +1,560 @@
+// Scheduler harness on a tiny random-weight model. Every scenario starts its own engine, drives it through the
+// public API and checks that each future resolves the way the scheduler promises: concurrent submission, cancellation,
+// chunked prefill, context shifts, decode failures from an exhausted KV cache, and run-to-run determinism.
+//
+//   synexis-harness                              writes a tiny model to the temp directory and runs every scenario
+//   synexis-harness --scenario cancel --repeat 20
+//   synexis-harness -m tiny.gguf --trace-dir traces
+//
+// The workload of a scenario only depends on --seed and the repetition, so a failure reproduces with the same
+// arguments. -m must point to a file written by synexis-tiny-model, the scenarios rely on its token ids.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <synexis/Synexis.h>
+
+#include "tiny_model.h"
+
+using Clock = std::chrono::steady_clock;
+
+// A future still pending after that long counts as a hang
+#define RESULT_TIMEOUT_S 60
+#define TRACE_CAPACITY (1 << 16)
+
+struct HarnessOptions {
+    std::string model;
+    bool keepModel = false;
+    TinyModelOptions tiny;
+    std::string scenario;
+    int repeat = 1;
+    int threads = 2;
+    uint32_t seed = 42;
+    std::string traceDir;
+};
+
+struct Outcome {
+    bool resolved = false;
+    bool failed = false;
+    std::string error;
+    CompletionResult result;
+};
+
+static Outcome await(std::future<CompletionResult> &future) {
+    Outcome outcome;
+    if (future.wait_for(std::chrono::seconds(RESULT_TIMEOUT_S)) != std::future_status::ready) {
+        return outcome;
+    }
+    outcome.resolved = true;
+    try {
+        outcome.result = future.get();
+    } catch (const std::exception &e) {
+        outcome.failed = true;
+        outcome.error = e.what();
+    }
+    return outcome;
+}
+
+// State of one scenario run: the seeded generator, the engines it starts and what went wrong
+class Run {
+public:
+    Run(const HarnessOptions &options, std::string modelPath, std::string name, uint32_t seed)
+        : options(options), modelPath(std::move(modelPath)), name(std::move(name)), seed(seed), rng(seed) {
+    }
+
+    std::unique_ptr<Synexis> engine(int slots, int ctx, int batch) {
+        SynexisArguments args(modelPath);
+        args.n_slots = slots;
+        args.n_ctx = ctx;
+        args.n_batch = batch;
+        args.numberOfThreads = options.threads;
+        args.numberOfGpuLayers = 0;
+        if (!options.traceDir.empty()) {
+            args.traceCapacity = TRACE_CAPACITY;
+            args.tracePath = options.traceDir + "/" + name + "-" + std::to_string(engines) + ".json";
+        }
+        ++engines;
+        auto engine = std::make_unique<Synexis>(args);
+        engine->run();
+        return engine;
+    }
+
+    // Lowercase words, about three tokens each with the tiny vocabulary
+    std::string prompt(int words) {
+        std::string text;
+        for (int w = 0; w < words; ++w) {
+            if (w > 0) {
+                text += ' ';
+            }
+            const int length = 2 + static_cast<int>(rng() % 7);
+            for (int i = 0; i < length; ++i) {
+                text += static_cast<char>('a' + rng() % 26);
+            }
+        }
+        return text;
+    }
+
+    uint32_t random(uint32_t bound) {
+        return rng() % bound;
+    }
+
+    void expect(bool condition, const std::string &message) {
+        if (!condition) {
+            failures.push_back(message);
+        }
+    }
+
+    // Resolved, without an error, and with consistent token counts
+    bool expectCompleted(const Outcome &outcome, const std::string &task) {
+        if (!outcome.resolved) {
+            failures.push_back(task + ": no result after " + std::to_string(RESULT_TIMEOUT_S) + " s");
+            return false;
+        }
+        if (outcome.failed) {
+            failures.push_back(task + ": " + outcome.error);
+            return false;
+        }
+        const CompletionResult &result = outcome.result;
+        expect(result.promptTokens > 0, task + ": empty prompt");
+        expect(result.promptTokensComputed + result.promptTokensCached == result.promptTokens,
+               task + ": computed and cached prompt tokens do not add up");
+        return true;
+    }
+
+    void note(const std::string &message) {
+        notes.push_back(message);
+    }
+
+    const HarnessOptions &options;
+    const std::string modelPath;
+    const std::string name;
+    const uint32_t seed;
+    std::vector<std::string> failures;
+    std::vector<std::string> notes;
+
+private:
+    std::mt19937 rng;
+    int engines = 0;
+};
+
+static SamplingParams greedy() {
+    SamplingParams params;
+    params.temp = 0.0f;
+    return params;
+}
+
+// Random weights reach the end of generation token by chance, scenarios that need a fixed length ban it
+static void banEndOfGeneration(SamplingParams &params) {
+    params.banned_tokens = {TINY_MODEL_EOS_TOKEN, TINY_MODEL_IM_END_TOKEN};
+}
+
+static void concurrentScenario(Run &run) {
+    const int n_tasks = 64;
+    const int clients = 4;
+    auto engine = run.engine(4, 4096, 256);
+
+    // Drawn up front so the workload does not depend on how the client threads interleave
+    struct Task {
+        std::string prompt;
+        int maximumTokens;
+        bool stream;
+        std::atomic<int> streamed{0};
+        std::future<CompletionResult> future;
+    };
+    std::vector<Task> tasks(n_tasks);
+    for (int i = 0; i < n_tasks; ++i) {
+        tasks[i].prompt = run.prompt(2 + static_cast<int>(run.random(120)));
+        tasks[i].maximumTokens = 1 + static_cast<int>(run.random(48));
+        tasks[i].stream = i % 2 == 1;
+    }
+
+    const MetricsSnapshot before = engine->metrics();
+    std::vector<std::thread> threads;
+    for (int c = 0; c < clients; ++c) {
+        threads.emplace_back([&, c] {
+            for (int i = c; i < n_tasks; i += clients) {
+                Task &task = tasks[i];
+                TaskParams params(task.prompt, SamplingParams(), task.maximumTokens);
+                params.samplerParams.seed = run.seed + i;
+                if (task.stream) {
+                    params.stream = true;
+                    params.emitText = false;
+                    params.on_token_id = [&task](int32_t) {
+                        task.streamed.fetch_add(1, std::memory_order_relaxed);
+                    };
+                }
+                task.future = engine->addTask(std::move(params));
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    for (int i = 0; i < n_tasks; ++i) {
+        Task &task = tasks[i];
+        const std::string label = "task " + std::to_string(i);
+        const Outcome outcome = await(task.future);
+        if (!run.expectCompleted(outcome, label)) {
+            continue;
+        }
+        const CompletionResult &result = outcome.result;
+        run.expect(result.completionTokens >= 1 && result.completionTokens <= task.maximumTokens,
+                   label + ": " + std::to_string(result.completionTokens) + " tokens for a maximum of " +
+                   std::to_string(task.maximumTokens));
+        run.expect(result.finishReason != FINISH_REASON_LENGTH || result.completionTokens == task.maximumTokens,
+                   label + ": stopped for length before the maximum");
+        if (task.stream) {
+            run.expect(task.streamed.load() == result.completionTokens,
+                       label + ": streamed " + std::to_string(task.streamed.load()) + " token ids for " +
+                       std::to_string(result.completionTokens) + " tokens");
+        }
+    }
+    const MetricsSnapshot after = engine->metrics();
+    run.expect(after.requestsCompleted - before.requestsCompleted == static_cast<uint64_t>(n_tasks),
+               "requests_completed grew by " + std::to_string(after.requestsCompleted - before.requestsCompleted));
+    run.note(std::to_string(after.decodeSteps - before.decodeSteps) + " decode steps for " +
+             std::to_string(after.generatedTokens - before.generatedTokens) + " generated tokens");
+}
+
+static void cancelScenario(Run &run) {
+    const int n_tasks = 24;
+    const int maximumTokens = 256;
+    auto engine = run.engine(2, 4096, 256);
+
+    struct Task {
+        std::shared_ptr<std::atomic<bool> > cancelled = std::make_shared<std::atomic<bool> >(false);
+        // Milliseconds after submission, negative when cancelled before it
+        int delay;
+        std::future<CompletionResult> future;
+    };
+    std::vector<Task> tasks(n_tasks);
+    for (int i = 0; i < n_tasks; ++i) {
+        tasks[i].delay = i % 3 == 0 ? -1 : static_cast<int>(run.random(40));
+    }
+
+    const MetricsSnapshot before = engine->metrics();
+    const auto start = Clock::now();
+    for (auto &task: tasks) {
+        TaskParams params(run.prompt(20), SamplingParams(), maximumTokens);
+        banEndOfGeneration(params.samplerParams);
+        params.cancelled = task.cancelled;
+        if (task.delay < 0) {
+            task.cancelled->store(true);
+        }
+        task.future = engine->addTask(std::move(params));
+    }
+    std::vector<int> order(n_tasks);
+    for (int i = 0; i < n_tasks; ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return tasks[a].delay < tasks[b].delay; });
+    for (const int i: order) {
+        if (tasks[i].delay >= 0) {
+            std::this_thread::sleep_until(start + std::chrono::milliseconds(tasks[i].delay));
+            tasks[i].cancelled->store(true);
+        }
+    }
+
+    uint64_t cancelled = 0;
+    for (int i = 0; i < n_tasks; ++i) {
+        const std::string label = "task " + std::to_string(i);
+        const Outcome outcome = await(tasks[i].future);
+        if (!run.expectCompleted(outcome, label)) {
+            continue;
+        }
+        const CompletionResult &result = outcome.result;
+        if (result.finishReason == FINISH_REASON_CANCELLED) {
+            ++cancelled;
+            run.expect(result.completionTokens < maximumTokens, label + ": cancelled after its last token");
+        } else {
+            run.expect(result.finishReason == FINISH_REASON_LENGTH && result.completionTokens == maximumTokens,
+                       label + ": ended with " + result.finishReasonName() + " after " +
+                       std::to_string(result.completionTokens) + " tokens");
+        }
+        if (tasks[i].delay < 0) {
+            run.expect(result.finishReason == FINISH_REASON_CANCELLED && result.completionTokens == 0,
+                       label + ": cancelled before submission but generated tokens");
+        }
+    }
+    const MetricsSnapshot after = engine->metrics();
+    run.expect(after.requestsCancelled - before.requestsCancelled == cancelled,
+               "requests_cancelled grew by " + std::to_string(after.requestsCancelled - before.requestsCancelled) +
+               " for " + std::to_string(cancelled) + " cancelled results");
+
+    // The slots given back by the cancelled tasks serve new ones
+    std::future<CompletionResult> followUp = engine->addTask(TaskParams(run.prompt(10), greedy(), 8));
+    const Outcome outcome = await(followUp);
+    if (run.expectCompleted(outcome, "follow-up task")) {
+        run.expect(outcome.result.completionTokens == 8 || outcome.result.finishReason == FINISH_REASON_STOP,
+                   "follow-up task: stopped early");
+    }
+    run.note(std::to_string(cancelled) + " of " + std::to_string(n_tasks) + " tasks cancelled");
+}
+
+static void prefillScenario(Run &run) {
+    const int n_batch = 64;
+    auto engine = run.engine(1, 4096, n_batch);
+    const std::string shared = run.prompt(250);
+
+    const MetricsSnapshot before = engine->metrics();
+    std::future<CompletionResult> first = engine->addTask(TaskParams(shared + " " + run.prompt(10), greedy(), 4));
+    const Outcome a = await(first);
+    const MetricsSnapshot middle = engine->metrics();
+    if (!run.expectCompleted(a, "first task")) {
+        return;
+    }
+    run.expect(a.result.promptTokens > 4 * n_batch, "the prompt fits in a few batches, pick a longer one");
+    run.expect(middle.decodeSteps - before.decodeSteps >= static_cast<uint64_t>(a.result.promptTokens / n_batch),
+               "the prompt was not split into batches of " + std::to_string(n_batch));
+
+    // Same prefix on the same slot: whatever the scheduler reuses shows up as cached tokens
+    std::future<CompletionResult> second = engine->addTask(TaskParams(shared + " " + run.prompt(10), greedy(), 4));
+    const Outcome b = await(second);
+    if (!run.expectCompleted(b, "second task")) {
+        return;
+    }
+    run.note("prompt of " + std::to_string(a.result.promptTokens) + " tokens prefilled in " +
+             std::to_string(middle.decodeSteps - before.decodeSteps) + " steps, " +
+             std::to_string(b.result.promptTokensCached) + " of " + std::to_string(b.result.promptTokens) +
+             " tokens reused by the shared-prefix task");
+}
+
+static void contextShiftScenario(Run &run) {
+    const int n_ctx = 256;
+    const int maximumTokens = 3 * n_ctx;
+    auto engine = run.engine(1, n_ctx, 32);
+
+    TaskParams params(run.prompt(8), greedy(), maximumTokens);
+    banEndOfGeneration(params.samplerParams);
+    const MetricsSnapshot before = engine->metrics();
+    std::future<CompletionResult> future = engine->addTask(std::move(params));
+    const Outcome outcome = await(future);
+    const MetricsSnapshot after = engine->metrics();
+    if (!run.expectCompleted(outcome, "long task")) {
+        return;
+    }
+    run.expect(outcome.result.completionTokens == maximumTokens,
+               "generated " + std::to_string(outcome.result.completionTokens) + " of " +
+               std::to_string(maximumTokens) + " tokens past the context");
+    run.expect(after.contextShifts > before.contextShifts, "no context shift recorded");
+    run.note(std::to_string(after.contextShifts - before.contextShifts) + " context shifts");
+}
+
+static void kvExhaustionScenario(Run &run) {
+    // Four slots share 256 cells but each wants about 230: decoding fails once the cache is full
+    const int n_tasks = 4;
+    auto engine = run.engine(n_tasks, 256, 64);
+
+    const MetricsSnapshot before = engine->metrics();
+    std::vector<std::future<CompletionResult> > futures;
+    for (int i = 0; i < n_tasks; ++i) {
+        TaskParams params(run.prompt(10), greedy(), 200);
+        banEndOfGeneration(params.samplerParams);
+        futures.push_back(engine->addTask(std::move(params)));
+    }
+    uint64_t failed = 0;
+    for (int i = 0; i < n_tasks; ++i) {
+        const Outcome outcome = await(futures[i]);
+        run.expect(outcome.resolved, "task " + std::to_string(i) + ": no result after a decode failure");
+        failed += outcome.failed;
+    }
+    const MetricsSnapshot after = engine->metrics();
+    run.expect(after.decodeRetries > before.decodeRetries, "the cache never ran out");
+    run.expect(failed > 0, "no task failed although the cache ran out");
+    run.expect(after.requestsFailed - before.requestsFailed == failed,
+               "requests_failed grew by " + std::to_string(after.requestsFailed - before.requestsFailed) + " for " +
+               std::to_string(failed) + " failed tasks");
+
+    // The reset slots serve new tasks
+    std::future<CompletionResult> followUp = engine->addTask(TaskParams(run.prompt(10), greedy(), 8));
+    run.expectCompleted(await(followUp), "follow-up task");
+    run.note(std::to_string(after.decodeRetries - before.decodeRetries) + " decode retries, " +
+             std::to_string(failed) + " tasks failed");
+}
+
+static void determinismScenario(Run &run) {
+    std::vector<std::string> prompts;
+    for (int i = 0; i < 6; ++i) {
+        prompts.push_back(run.prompt(5 + static_cast<int>(run.random(40))));
+    }
+
+    // Same tasks in the same order on two fresh engines, one at a time so the batches match too
+    auto generate = [&] {
+        auto engine = run.engine(2, 4096, 256);
+        std::vector<std::string> texts;
+        for (size_t i = 0; i < prompts.size(); ++i) {
+            SamplingParams sampling = i % 2 == 0 ? greedy() : SamplingParams();
+            sampling.seed = run.seed + static_cast<uint32_t>(i);
+            std::future<CompletionResult> future = engine->addTask(TaskParams(prompts[i], sampling, 24));
+            const Outcome outcome = await(future);
+            texts.push_back(run.expectCompleted(outcome, "task " + std::to_string(i)) ? outcome.result.text : "");
+        }
+        return texts;
+    };
+    const std::vector<std::string> first = generate();
+    const std::vector<std::string> second = generate();
+    for (size_t i = 0; i < prompts.size(); ++i) {
+        run.expect(first[i] == second[i], "task " + std::to_string(i) + " generated different text on a new engine");
+    }
+}
+
+struct ScenarioEntry {
+    const char *name;
+    const char *description;
+    void (*run)(Run &);
+};
+
+static const ScenarioEntry SCENARIOS[] = {
+    {"concurrent", "64 tasks from 4 client threads, half of them streaming token ids", concurrentScenario},
+    {"cancel", "tasks cancelled before submission, while queued and while generating", cancelScenario},
+    {"prefill", "a prompt prefilled over several batches, then one sharing its prefix", prefillScenario},
+    {"context_shift", "one task generating three times the context", contextShiftScenario},
+    {"kv_exhaustion", "more tasks than KV cells, decoding fails and the slots reset", kvExhaustionScenario},
+    {"determinism", "the same tasks on two engines generate the same text", determinismScenario},
+};
+
+static void printUsage(const char *program) {
+    std::printf(
+        "usage: %s [options]\n"
+        "\n"
+        "  -m, --model PATH          model written by synexis-tiny-model, generated in the temp directory otherwise\n"
+        "  --keep-model              keep the generated model\n"
+        "  --vocab N                 vocabulary of the generated model (4096)\n"
+        "  --layers N                layers of the generated model (2)\n"
+        "  --embd N                  embedding size of the generated model (64)\n"
+        "  --scenario NAME           only run this scenario\n"
+        "  --repeat N                run every scenario N times with different seeds (1)\n"
+        "  --threads N               engine threads (2)\n"
+        "  --seed N                  workload seed (42)\n"
+        "  --trace-dir DIR           write the scheduler trace of every engine there\n"
+        "  --list                    list the scenarios\n",
+        program);
+}
+
+static HarnessOptions parseOptions(int argc, char **argv) {
+    HarnessOptions options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            std::exit(0);
+        } else if (arg == "--list") {
+            for (const auto &scenario: SCENARIOS) {
+                std::printf("%-16s %s\n", scenario.name, scenario.description);
+            }
+            std::exit(0);
+        } else if (arg == "-m" || arg == "--model") options.model = value();
+        else if (arg == "--keep-model") options.keepModel = true;
+        else if (arg == "--vocab") options.tiny.vocabSize = std::stoi(value());
+        else if (arg == "--layers") options.tiny.layers = std::stoi(value());
+        else if (arg == "--embd") options.tiny.embedding = std::stoi(value());
+        else if (arg == "--scenario") options.scenario = value();
+        else if (arg == "--repeat") options.repeat = std::stoi(value());
+        else if (arg == "--threads") options.threads = std::stoi(value());
+        else if (arg == "--seed") options.seed = static_cast<uint32_t>(std::stoul(value()));
+        else if (arg == "--trace-dir") options.traceDir = value();
+        else {
+            throw std::invalid_argument("unknown argument " + arg);
+        }
+    }
+    if (options.repeat <= 0 || options.threads <= 0) {
+        throw std::invalid_argument("--repeat and --threads must be positive");
+    }
+    if (!options.scenario.empty()) {
+        const bool known = std::any_of(std::begin(SCENARIOS), std::end(SCENARIOS), [&](const ScenarioEntry &entry) {
+            return options.scenario == entry.name;
+        });
+        if (!known) {
+            throw std::invalid_argument("unknown scenario " + options.scenario);
+        }
+    }
+    return options;
+}
+
+int main(int argc, char **argv) {
+    HarnessOptions options;
+    try {
+        options = parseOptions(argc, argv);
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::string modelPath = options.model;
+    const bool generated = modelPath.empty();
+    if (generated) {
+        options.tiny.seed = options.seed;
+        modelPath = (std::filesystem::temp_directory_path() /
+                     ("synexis-harness-" + std::to_string(options.seed) + ".gguf")).string();
+        try {
+            writeTinyModel(options.tiny, modelPath);
+        } catch (const std::exception &e) {
+            std::fprintf(stderr, "error: %s\n", e.what());
+            return 1;
+        }
+    }
+    if (!options.traceDir.empty()) {
+        std::filesystem::create_directories(options.traceDir);
+    }
+
+    int passed = 0;
+    int failed = 0;
+    for (int repetition = 0; repetition < options.repeat; ++repetition) {
+        for (const auto &scenario: SCENARIOS) {
+            if (!options.scenario.empty() && options.scenario != scenario.name) {
+                continue;
+            }
+            const uint32_t seed = options.seed + static_cast<uint32_t>(repetition);
+            const std::string name = options.repeat > 1
+                                         ? std::string(scenario.name) + "-" + std::to_string(repetition)
+                                         : std::string(scenario.name);
+            Run run(options, modelPath, name, seed);
+            const auto start = Clock::now();
+            try {
+                scenario.run(run);
+            } catch (const std::exception &e) {
+                run.failures.push_back(std::string("exception: ") + e.what());
+            }
+            const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+            std::printf("%s %s (seed %u, %.2f s)\n", run.failures.empty() ? "PASS" : "FAIL", name.c_str(), seed,
+                        elapsed);
+            for (const auto &note: run.notes) {
+                std::printf("    %s\n", note.c_str());
+            }
+            for (const auto &failure: run.failures) {
+                std::printf("    error: %s\n", failure.c_str());
+            }
+            std::fflush(stdout);
+            run.failures.empty() ? ++passed : ++failed;
+        }
+    }
+    std::printf("%d passed, %d failed\n", passed, failed);
+
+    if (generated && !options.keepModel) {
+        std::error_code ignored;
+        std::filesystem::remove(modelPath, ignored);
+    } else if (generated) {
+        std::printf("model kept at %s\n", modelPath.c_str());
+    }
+    return failed == 0 ? 0 : 1;
+}
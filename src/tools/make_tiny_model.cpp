@@ -0,0 +1,77 @@
+// Writes a tiny random-weight GGUF for exercising the scheduler without a production model.
+//
+//   synexis-tiny-model -o tiny.gguf
+//   synexis-tiny-model -o tiny.gguf --vocab 32000 --layers 4 --embd 128 --ctx 8192 --seed 7
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+#include "tiny_model.h"
+
+static void printUsage(const char *program) {
+    const TinyModelOptions defaults;
+    std::printf(
+        "usage: %s -o PATH [options]\n"
+        "\n"
+        "  -o, --output PATH         GGUF file to write\n"
+        "  --vocab N                 vocabulary size, at least %d (%d)\n"
+        "  --layers N                transformer blocks (%d)\n"
+        "  --embd N                  embedding size (%d)\n"
+        "  --heads N                 attention heads (%d)\n"
+        "  --kv-heads N              key/value heads (%d)\n"
+        "  --ff N                    feed-forward size (%d)\n"
+        "  --ctx N                   training context length (%d)\n"
+        "  --seed N                  seed of the weights and the vocabulary (%llu)\n",
+        program, TINY_MODEL_MIN_VOCAB, defaults.vocabSize, defaults.layers, defaults.embedding, defaults.heads,
+        defaults.kvHeads, defaults.feedForward, defaults.contextLength,
+        static_cast<unsigned long long>(defaults.seed));
+}
+
+int main(int argc, char **argv) {
+    TinyModelOptions options;
+    std::string output;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    throw std::invalid_argument("missing value for " + arg);
+                }
+                return argv[++i];
+            };
+            if (arg == "-h" || arg == "--help") {
+                printUsage(argv[0]);
+                return 0;
+            } else if (arg == "-o" || arg == "--output") output = value();
+            else if (arg == "--vocab") options.vocabSize = std::stoi(value());
+            else if (arg == "--layers") options.layers = std::stoi(value());
+            else if (arg == "--embd") options.embedding = std::stoi(value());
+            else if (arg == "--heads") options.heads = std::stoi(value());
+            else if (arg == "--kv-heads") options.kvHeads = std::stoi(value());
+            else if (arg == "--ff") options.feedForward = std::stoi(value());
+            else if (arg == "--ctx") options.contextLength = std::stoi(value());
+            else if (arg == "--seed") options.seed = std::stoull(value());
+            else {
+                throw std::invalid_argument("unknown argument " + arg);
+            }
+        }
+        if (output.empty()) {
+            throw std::invalid_argument("an output path is required (-o)");
+        }
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    try {
+        writeTinyModel(options, output);
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+    std::printf("wrote %s: %d tokens, %d layers, embedding %d\n", output.c_str(), options.vocabSize, options.layers,
+                options.embedding);
+    return 0;
+}
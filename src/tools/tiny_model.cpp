@@ -0,0 +1,209 @@
+#include "tiny_model.h"
+
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <unordered_set>
+#include <vector>
+
+#include "ggml.h"
+#include "gguf.h"
+
+namespace {
+    // llama_token_type values stored in tokenizer.ggml.token_type
+    enum TokenType {
+        TOKEN_TYPE_NORMAL = 1,
+        TOKEN_TYPE_UNKNOWN = 2,
+        TOKEN_TYPE_CONTROL = 3,
+        TOKEN_TYPE_BYTE = 6,
+    };
+
+    // SentencePiece marks a preceding space with U+2581
+    const std::string SPACE_MARK = "\xE2\x96\x81";
+
+    const char *CHATML_TEMPLATE =
+            "{% for message in messages %}"
+            "{{ '<|im_start|>' + message['role'] + '\\n' + message['content'] + '<|im_end|>' + '\\n' }}"
+            "{% endfor %}"
+            "{% if add_generation_prompt %}{{ '<|im_start|>assistant\\n' }}{% endif %}";
+
+    // splitmix64: unlike the <random> distributions, its output is the same with every standard library
+    struct Random {
+        uint64_t state;
+
+        uint64_t next() {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            return z ^ (z >> 31);
+        }
+
+        // Uniform in [-1, 1)
+        float uniform() {
+            return static_cast<float>(next() >> 40) / static_cast<float>(1 << 23) - 1.0f;
+        }
+    };
+
+    struct Vocab {
+        std::vector<std::string> tokens;
+        std::vector<float> scores;
+        std::vector<int32_t> types;
+
+        void add(std::string token, float score, TokenType type) {
+            tokens.push_back(std::move(token));
+            scores.push_back(score);
+            types.push_back(type);
+        }
+    };
+
+    Vocab buildVocab(int32_t size, Random &random) {
+        Vocab vocab;
+        vocab.add("<unk>", 0.0f, TOKEN_TYPE_UNKNOWN);
+        vocab.add("<s>", 0.0f, TOKEN_TYPE_CONTROL);
+        vocab.add("</s>", 0.0f, TOKEN_TYPE_CONTROL);
+        vocab.add("<|im_start|>", 0.0f, TOKEN_TYPE_CONTROL);
+        vocab.add("<|im_end|>", 0.0f, TOKEN_TYPE_CONTROL);
+        for (int byte = 0; byte < 256; ++byte) {
+            char name[8];
+            std::snprintf(name, sizeof(name), "<0x%02X>", byte);
+            vocab.add(name, 0.0f, TOKEN_TYPE_BYTE);
+        }
+
+        // Higher scores merge first: single characters, then words by their order of creation
+        std::unordered_set<std::string> seen;
+        auto addPiece = [&](const std::string &piece) {
+            if (seen.insert(piece).second) {
+                vocab.add(piece, -static_cast<float>(vocab.tokens.size()), TOKEN_TYPE_NORMAL);
+            }
+        };
+        addPiece(SPACE_MARK);
+        for (char c = '!'; c <= '~'; ++c) {
+            addPiece(std::string(1, c));
+            addPiece(SPACE_MARK + c);
+        }
+        while (static_cast<int32_t>(vocab.tokens.size()) < size) {
+            std::string word = random.next() % 4 != 0 ? SPACE_MARK : std::string();
+            const int length = 2 + static_cast<int>(random.next() % 6);
+            for (int i = 0; i < length; ++i) {
+                word += static_cast<char>('a' + random.next() % 26);
+            }
+            addPiece(word);
+        }
+        return vocab;
+    }
+
+    // Scaled so every output of a matrix product has about unit variance
+    void fill(ggml_tensor *tensor, Random &random, float scale) {
+        float *data = static_cast<float *>(tensor->data);
+        const int64_t n = ggml_nelements(tensor);
+        for (int64_t i = 0; i < n; ++i) {
+            data[i] = random.uniform() * scale;
+        }
+    }
+
+    void fillOnes(ggml_tensor *tensor) {
+        float *data = static_cast<float *>(tensor->data);
+        const int64_t n = ggml_nelements(tensor);
+        for (int64_t i = 0; i < n; ++i) {
+            data[i] = 1.0f;
+        }
+    }
+}
+
+void writeTinyModel(const TinyModelOptions &options, const std::string &path) {
+    if (options.vocabSize < TINY_MODEL_MIN_VOCAB) {
+        throw std::runtime_error("the vocabulary needs at least " + std::to_string(TINY_MODEL_MIN_VOCAB) + " tokens");
+    }
+    if (options.layers <= 0 || options.heads <= 0 || options.kvHeads <= 0 || options.feedForward <= 0 ||
+        options.contextLength <= 0 || options.embedding % options.heads != 0 || options.heads % options.kvHeads != 0) {
+        throw std::runtime_error("invalid model shape: the embedding must divide into heads, heads into kv heads");
+    }
+    const int64_t n_embd = options.embedding;
+    const int64_t n_vocab = options.vocabSize;
+    const int64_t n_ff = options.feedForward;
+    const int64_t n_embd_kv = n_embd / options.heads * options.kvHeads;
+
+    Random random{options.seed};
+    const Vocab vocab = buildVocab(options.vocabSize, random);
+
+    const size_t n_tensors = 3 + 9 * static_cast<size_t>(options.layers);
+    const size_t n_floats = 2 * n_vocab * n_embd + n_embd +
+                            options.layers * (2 * n_embd + 2 * n_embd * n_embd + 2 * n_embd * n_embd_kv +
+                                              3 * n_embd * n_ff);
+    ggml_init_params initParams = {
+        // Each tensor's data is also padded to the ggml alignment
+        /* mem_size */ n_floats * sizeof(float) + n_tensors * (ggml_tensor_overhead() + 64),
+        /* mem_buffer */ nullptr,
+        /* no_alloc */ false,
+    };
+    ggml_context *ctx = ggml_init(initParams);
+    if (!ctx) {
+        throw std::runtime_error("failed to allocate the model tensors");
+    }
+    gguf_context *gguf = gguf_init_empty();
+
+    auto tensor = [&](const std::string &name, int64_t ne0, int64_t ne1) {
+        ggml_tensor *t = ne1 == 0
+                             ? ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0)
+                             : ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+        ggml_set_name(t, name.c_str());
+        gguf_add_tensor(gguf, t);
+        return t;
+    };
+    auto matrix = [&](const std::string &name, int64_t ne0, int64_t ne1) {
+        fill(tensor(name, ne0, ne1), random, std::sqrt(3.0f / static_cast<float>(ne0)));
+    };
+
+    gguf_set_val_str(gguf, "general.architecture", "llama");
+    gguf_set_val_str(gguf, "general.name", "synexis-tiny");
+    gguf_set_val_u32(gguf, "general.alignment", 32);
+    gguf_set_val_u32(gguf, "llama.vocab_size", options.vocabSize);
+    gguf_set_val_u32(gguf, "llama.context_length", options.contextLength);
+    gguf_set_val_u32(gguf, "llama.embedding_length", options.embedding);
+    gguf_set_val_u32(gguf, "llama.block_count", options.layers);
+    gguf_set_val_u32(gguf, "llama.feed_forward_length", options.feedForward);
+    gguf_set_val_u32(gguf, "llama.attention.head_count", options.heads);
+    gguf_set_val_u32(gguf, "llama.attention.head_count_kv", options.kvHeads);
+    gguf_set_val_u32(gguf, "llama.rope.dimension_count", options.embedding / options.heads);
+    gguf_set_val_f32(gguf, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+    gguf_set_val_f32(gguf, "llama.rope.freq_base", 10000.0f);
+
+    std::vector<const char *> tokens;
+    tokens.reserve(vocab.tokens.size());
+    for (const auto &token: vocab.tokens) {
+        tokens.push_back(token.c_str());
+    }
+    gguf_set_val_str(gguf, "tokenizer.ggml.model", "llama");
+    gguf_set_arr_str(gguf, "tokenizer.ggml.tokens", tokens.data(), tokens.size());
+    gguf_set_arr_data(gguf, "tokenizer.ggml.scores", GGUF_TYPE_FLOAT32, vocab.scores.data(), vocab.scores.size());
+    gguf_set_arr_data(gguf, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, vocab.types.data(), vocab.types.size());
+    gguf_set_val_u32(gguf, "tokenizer.ggml.unknown_token_id", 0);
+    gguf_set_val_u32(gguf, "tokenizer.ggml.bos_token_id", 1);
+    gguf_set_val_u32(gguf, "tokenizer.ggml.eos_token_id", TINY_MODEL_EOS_TOKEN);
+    gguf_set_val_bool(gguf, "tokenizer.ggml.add_bos_token", true);
+    gguf_set_val_bool(gguf, "tokenizer.ggml.add_eos_token", false);
+    gguf_set_val_str(gguf, "tokenizer.chat_template", CHATML_TEMPLATE);
+
+    fill(tensor("token_embd.weight", n_embd, n_vocab), random, 1.0f);
+    fillOnes(tensor("output_norm.weight", n_embd, 0));
+    matrix("output.weight", n_embd, n_vocab);
+    for (int32_t layer = 0; layer < options.layers; ++layer) {
+        const std::string prefix = "blk." + std::to_string(layer) + ".";
+        fillOnes(tensor(prefix + "attn_norm.weight", n_embd, 0));
+        matrix(prefix + "attn_q.weight", n_embd, n_embd);
+        matrix(prefix + "attn_k.weight", n_embd, n_embd_kv);
+        matrix(prefix + "attn_v.weight", n_embd, n_embd_kv);
+        matrix(prefix + "attn_output.weight", n_embd, n_embd);
+        fillOnes(tensor(prefix + "ffn_norm.weight", n_embd, 0));
+        matrix(prefix + "ffn_gate.weight", n_embd, n_ff);
+        matrix(prefix + "ffn_up.weight", n_embd, n_ff);
+        matrix(prefix + "ffn_down.weight", n_ff, n_embd);
+    }
+
+    const bool written = gguf_write_to_file(gguf, path.c_str(), false);
+    gguf_free(gguf);
+    ggml_free(ctx);
+    if (!written) {
+        throw std::runtime_error("failed to write " + path);
+    }
+}
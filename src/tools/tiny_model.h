@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Shape of a generated model. The defaults give a file of a few megabytes that decodes in microseconds per token.
+struct TinyModelOptions {
+    int32_t vocabSize = 4096;
+    int32_t layers = 2;
+    int32_t embedding = 64;
+    int32_t heads = 4;
+    int32_t kvHeads = 2;
+    int32_t feedForward = 128;
+    int32_t contextLength = 4096;
+    uint64_t seed = 42;
+};
+
+// Smallest vocabulary holding the special, byte and single character tokens
+#define TINY_MODEL_MIN_VOCAB 512
+
+// Ids of the end-of-generation tokens, the same in every generated vocabulary
+#define TINY_MODEL_EOS_TOKEN 2
+#define TINY_MODEL_IM_END_TOKEN 4
+
+// Writes a llama-architecture GGUF with random F32 weights, a SentencePiece vocabulary with byte fallback and a
+// ChatML template. The same options always produce the same file. Throws std::runtime_error on invalid options or
+// when the file cannot be written.
+void writeTinyModel(const TinyModelOptions &options, const std::string &path);
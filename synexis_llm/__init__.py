@@ -1,17 +1,20 @@
 __all__ = ["SynexisLLM"]
 
+import asyncio
+import itertools
 import os
 import sys
 import time
 import uuid
-from typing import Optional, List, Dict, Any, Tuple, Generator, Union
+from typing import Optional, List, Dict, Any, Tuple, Generator, Union, AsyncGenerator, Callable
 
 if sys.platform == "win32":
     dll_dir = os.path.join(os.path.dirname(__file__), "lib")
     if os.path.exists(dll_dir):
         os.add_dll_directory(dll_dir)
 try:
-    from .synexis_python import Synexis, TaskParams, SamplingParams, SynexisArguments
+    from .synexis_python import Synexis, SynexisRouter, TaskParams, SamplingParams, SynexisArguments, ScoreResult, \
+        AsyncDispatcher, MetricsSnapshot, CompletionResult, MEDIA_MARKER
 except:
     # Loading DLLs manually. For some reason sometimes it works normally but most of the time DLLs has to be loaded manually
     import ctypes
@@ -22,7 +25,14 @@ except:
                 ctypes.WinDLL(path,winmode=0)
             except Exception as e:
                 print(f"Failed loading {path}: {e}")
-    from .synexis_python import Synexis, TaskParams, SamplingParams, SynexisArguments
+    from .synexis_python import Synexis, SynexisRouter, TaskParams, SamplingParams, SynexisArguments, ScoreResult, \
+        AsyncDispatcher, MetricsSnapshot, CompletionResult, MEDIA_MARKER
+
+try:
+    # Linux builds only
+    from .synexis_python import SynexisClient, SynexisIpcServer
+except ImportError:
+    SynexisClient = SynexisIpcServer = None
 
 from jinja2 import Template
 
@@ -40,7 +50,13 @@ class SynexisLLM:
                  n_keep: int = 512,
                  use_mmap: bool = True,
                  number_of_threads: int = 10,
-                 number_gpu_layers: int = -1
+                 number_gpu_layers: int = -1,
+                 media_encoders: int = 1,
+                 trace_capacity: int = 0,
+                 trace_path: Optional[str] = None,
+                 ipc_path: Optional[str] = None,
+                 replicas: int = 1,
+                 local_weights: bool = False
                  ):
         """
         Initializes the SynexisLLM model.
@@ -54,6 +70,18 @@ class SynexisLLM:
         :param use_mmap: Whether to use memory-mapped files.
         :param number_of_threads: Number of threads for processing.
         :param number_gpu_layers: Number of layers to offload to GPU (-1 for all).
+        :param media_encoders: Number of images or audio clips encoded in parallel, each encoder loads its own
+            copy of the projector.
+        :param trace_capacity: Scheduler spans kept per engine thread for :meth:`dump_trace`, 0 disables tracing.
+        :param trace_path: Where the trace is written when the engine shuts down, requires ``trace_capacity``.
+        :param ipc_path: Also serves this engine on a Unix socket at that path, so other processes share its model,
+            slots and KV cache through :meth:`connect` instead of loading their own copy. Linux only.
+        :param replicas: Engines loaded side by side, each one with its own ``n_slots`` and context and its threads
+            pinned to the CPUs of one NUMA node. Tasks go to the replica that served the same prefix while it has a
+            free slot, otherwise to the least loaded one. 0 loads one per NUMA node. ``number_of_threads`` is per
+            replica.
+        :param local_weights: With several replicas, every replica reads its own copy of the weights into memory of
+            its node instead of sharing the mapped file.
         """
         if not os.path.exists(model_path):
             raise FileNotFoundError(f"Model file not found: {model_path}")
@@ -70,18 +98,108 @@ class SynexisLLM:
         args.use_mmap = use_mmap
         args.number_of_threads = number_of_threads
         args.number_of_gpu_layers = number_gpu_layers
+        args.media_encoders = media_encoders
+        args.trace_capacity = trace_capacity
+        if trace_path is not None:
+            args.trace_path = trace_path
 
-        self.handle = Synexis(args)
-        self.chat = Chat(self)
-        self.jinja_template = Template(self.handle.get_template())
+        if replicas == 1:
+            self.handle = Synexis(args)
+        else:
+            if ipc_path is not None:
+                raise ValueError("ipc_path serves a single engine, it cannot be combined with replicas")
+            self.handle = SynexisRouter(args, replicas, local_weights)
+        self._setup()
         self.handle.run()
+        self.ipc_server = None
+        if ipc_path is not None:
+            if SynexisIpcServer is None:
+                raise RuntimeError("ipc_path requires a Linux build")
+            self.ipc_server = SynexisIpcServer(self.handle, ipc_path)
+            self.ipc_server.run()
+
+    @classmethod
+    def connect(cls, socket_path: str, channels: int = 1024) -> 'SynexisLLM':
+        """
+        Uses the engine of another process, started with ``ipc_path`` or the ``synexis-engine`` executable, instead
+        of loading the model. Every worker process connecting to the same socket shares one model and its slots.
+
+        Completions, streams and metrics work as with a local engine; streamed text is read from memory shared with
+        the engine process. :meth:`score` and :meth:`dump_trace` are only available in the engine process.
+
+        :param socket_path: Unix socket the engine listens on.
+        :param channels: Maximum number of tasks this process has in flight, submitting more waits for one to end.
+        """
+        if SynexisClient is None:
+            raise RuntimeError("connecting to an engine requires a Linux build")
+        llm = cls.__new__(cls)
+        llm.handle = SynexisClient(socket_path, channels)
+        llm.model_path = llm.handle.model_path()
+        llm.ipc_server = None
+        llm._setup()
+        return llm
+
+    def _setup(self):
+        self.dispatcher = _AsyncDispatch()
+        self.chat = Chat(self)
+        # Templates llama.cpp renders natively skip Jinja, and the GIL, entirely
+        self.native_chat_template = self.handle.has_native_chat_template()
+        self.jinja_template = None if self.native_chat_template else Template(self.handle.get_template())
+
+    def score(self, prompt: str, continuations: List[str]) -> List[Dict[str, Any]]:
+        """
+        Scores candidate continuations of a prompt, e.g. classification labels or multiple-choice answers.
+
+        The prompt is evaluated once and shared by every continuation.
+
+        :param prompt: Text shared by all continuations.
+        :param continuations: Candidate texts that follow the prompt.
+        :return: One dict per continuation with the summed ``logprob``, the per-token ``token_logprobs``,
+            the continuation ``tokens`` and whether every token was the ``greedy`` choice.
+        """
+        results = self.handle.score(prompt, continuations)
+        return [
+            {
+                "logprob": result.logprob,
+                "token_logprobs": result.token_logprobs,
+                "tokens": result.tokens,
+                "greedy": result.greedy,
+            }
+            for result in results
+        ]
+
+    def metrics(self) -> MetricsSnapshot:
+        """
+        Returns the engine counters and latency histograms: time to first token, inter-token latency, queue wait,
+        tokens per decode step, batch fill and the KV cells of every slot. Durations are in seconds.
+        """
+        return self.handle.metrics()
+
+    def metrics_prometheus(self) -> str:
+        """
+        Returns the engine metrics in the Prometheus text exposition format, ready to serve on a /metrics endpoint.
+        """
+        return self.handle.metrics().to_prometheus()
+
+    def dump_trace(self, path: str) -> bool:
+        """
+        Writes the scheduler spans recorded so far as Chrome trace-event JSON, viewable in chrome://tracing or
+        Perfetto. Returns False when tracing is off or the file could not be written.
+        """
+        return self.handle.dump_trace(path)
 
     def _apply_chat_template(self, messages: List[Dict[str, Any]]) -> Tuple[str, List[str]]:
         """
         Applies a chat template to a list of messages to create a single prompt string
         and extracts a list of media file paths.
         """
-        prompt = self.jinja_template.render(messages=messages, **self.handle.get_tokens())
+        files = self._media_paths(messages)
+        if not self.native_chat_template:
+            return self.jinja_template.render(messages=messages, **self.handle.get_tokens()), files
+        return self.handle.apply_chat_template(self._chat_pairs(messages), True), files
+
+    @staticmethod
+    def _media_paths(messages: List[Dict[str, Any]]) -> List[str]:
         files = []
         for message in messages:
             content = message.get('content')
@@ -89,13 +207,72 @@ class SynexisLLM:
                 for content_part in content:
                     if content_part.get('type') in ('image', 'audio') and 'path' in content_part:
                         files.append(content_part['path'])
-        return prompt, files
+        return files
+
+    @staticmethod
+    def _chat_pairs(messages: List[Dict[str, Any]]) -> List[Tuple[str, str]]:
+        """
+        Flattens messages into (role, content) pairs for the native chat template, media parts become MEDIA_MARKER.
+        """
+        chat = []
+        for message in messages:
+            content = message.get('content')
+            if isinstance(content, list):
+                parts = []
+                for content_part in content:
+                    if content_part.get('type') in ('image', 'audio') and 'path' in content_part:
+                        parts.append(MEDIA_MARKER)
+                    elif content_part.get('type') == 'text':
+                        parts.append(content_part.get('text', ''))
+                content = ''.join(parts)
+            chat.append((message['role'], content or ''))
+        return chat
+
+
+class _AsyncDispatch:
+    """
+    Routes engine notifications to asyncio callbacks through a single descriptor watched by the event loop,
+    so awaiting a task never ties up a thread.
+    """
+
+    def __init__(self):
+        self.native = AsyncDispatcher()
+        self._ids = itertools.count()
+        self._callbacks: Dict[int, Callable[[], None]] = {}
+        self._loop: Optional[asyncio.AbstractEventLoop] = None
+
+    @property
+    def supported(self) -> bool:
+        return self.native.fileno() >= 0
+
+    def register(self, callback: Callable[[], None]) -> int:
+        """
+        Watches the descriptor from the running loop and returns the id to pass to the engine;
+        ``callback`` runs on the loop every time the engine reports that id.
+        """
+        loop = asyncio.get_running_loop()
+        if loop is not self._loop:
+            if self._loop is not None and not self._loop.is_closed():
+                self._loop.remove_reader(self.native.fileno())
+            loop.add_reader(self.native.fileno(), self._on_readable)
+            self._loop = loop
+        task_id = next(self._ids)
+        self._callbacks[task_id] = callback
+        return task_id
+
+    def unregister(self, task_id: int):
+        self._callbacks.pop(task_id, None)
+
+    def _on_readable(self):
+        for task_id in self.native.drain():
+            callback = self._callbacks.get(task_id)
+            if callback is not None:
+                callback()
 
 
 class Chat:
     def __init__(self, llm: 'SynexisLLM'):
         self.completions = Completions(llm)
-        self.media_cache: Dict[str, bytes] = {}
 
 
 class Completions:
@@ -111,6 +288,10 @@ class Completions:
                repeat_penalty: float = 1.1,
                max_tokens: int = 256,
                stop: Optional[List[str]] = None,
+               logit_bias: Optional[Dict[int, float]] = None,
+               banned_tokens: Optional[List[int]] = None,
+               logprobs: bool = False,
+               top_logprobs: int = 0,
                stream: bool = False) -> Union[Dict[str, Any], Generator[str, None, None]]:
         """
         Creates a chat completion response.
@@ -123,10 +304,85 @@ class Completions:
         :param repeat_penalty: Penalty for repeating tokens.
         :param max_tokens: Maximum number of tokens to generate.
         :param stop: A list of strings to stop generation at.
-        :param stream: Whether to stream the response.
+        :param logit_bias: Map of token id to a bias added to its logit.
+        :param banned_tokens: Token ids that must never be generated.
+        :param logprobs: Streaming only. Yield (text, (tokens, logprobs)) items, where both NumPy arrays hold one row
+            per generated token of the item: the chosen token followed by its ``top_logprobs`` most likely alternatives.
+        :param top_logprobs: Number of alternatives reported per token when ``logprobs`` is set.
+        :param stream: Whether to stream the response. Each streamed item holds all the text generated since the
+            previous one, which may span several tokens.
         :return: A dictionary with the completion response, or an iterator for streaming.
         """
-        prompt, file_paths = self._llm._apply_chat_template(messages)
+        task_params = self._prepare(messages, temperature, top_k, top_p, min_p, repeat_penalty, logit_bias,
+                                    banned_tokens, logprobs, top_logprobs, stream)
+        if stream:
+            return self._create_stream(task_params, logprobs)
+
+        return self._response(self._llm.handle.complete(task_params))
+
+    async def acreate(self,
+                      messages: List[Dict[str, Any]],
+                      temperature: float = 0.8,
+                      top_k: int = 40,
+                      top_p: float = 0.95,
+                      min_p: float = 0.05,
+                      repeat_penalty: float = 1.1,
+                      max_tokens: int = 256,
+                      stop: Optional[List[str]] = None,
+                      logit_bias: Optional[Dict[int, float]] = None,
+                      banned_tokens: Optional[List[int]] = None,
+                      logprobs: bool = False,
+                      top_logprobs: int = 0,
+                      stream: bool = False) -> Union[Dict[str, Any], AsyncGenerator[str, None]]:
+        """
+        Asynchronous version of :meth:`create`, taking the same arguments.
+
+        The engine signals the event loop through a file descriptor, so no thread waits on the request and
+        many thousands of completions can be in flight on one loop. With ``stream=True`` the awaited value is an
+        async iterator. Where the event loop cannot watch descriptors (Windows), the blocking calls run in the
+        loop's default executor instead.
+        """
+        task_params = self._prepare(messages, temperature, top_k, top_p, min_p, repeat_penalty, logit_bias,
+                                    banned_tokens, logprobs, top_logprobs, stream)
+        dispatch = self._llm.dispatcher
+        if stream:
+            return self._acreate_stream(task_params, logprobs)
+
+        if not dispatch.supported:
+            loop = asyncio.get_running_loop()
+            result = await loop.run_in_executor(None, self._llm.handle.complete, task_params)
+            return self._response(result)
+
+        future = asyncio.get_running_loop().create_future()
+
+        def on_ready():
+            dispatch.unregister(task_id)
+            if future.done():
+                return
+            try:
+                future.set_result(result.get())
+            except Exception as e:
+                future.set_exception(e)
+
+        task_id = dispatch.register(on_ready)
+        try:
+            result = self._llm.handle.complete_async(task_params, dispatch.native, task_id)
+        except BaseException:
+            dispatch.unregister(task_id)
+            raise
+        return self._response(await future)
+
+    def _prepare(self, messages: List[Dict[str, Any]], temperature: float, top_k: int, top_p: float, min_p: float,
+                 repeat_penalty: float, logit_bias: Optional[Dict[int, float]], banned_tokens: Optional[List[int]],
+                 logprobs: bool, top_logprobs: int, stream: bool) -> TaskParams:
+        if self._llm.native_chat_template:
+            # Rendered by the engine, which reuses the tokens of the earlier turns of the conversation
+            task_params = TaskParams()
+            task_params.messages = self._llm._chat_pairs(messages)
+            file_paths = self._llm._media_paths(messages)
+        else:
+            prompt, file_paths = self._llm._apply_chat_template(messages)
+            task_params = TaskParams(prompt)
 
         sampling_params = SamplingParams(
             temp=temperature,
@@ -135,35 +391,58 @@ class Completions:
             min_p=min_p,
             penalty_repeat=repeat_penalty,
         )
+        if logit_bias:
+            sampling_params.logit_bias = {int(token): float(bias) for token, bias in logit_bias.items()}
+        if banned_tokens:
+            sampling_params.banned_tokens = list(banned_tokens)
+        if logprobs:
+            if not stream:
+                raise ValueError("logprobs is only supported with stream=True")
+            sampling_params.n_probs = top_logprobs
 
-        task_params = TaskParams(
-            prompt
-            # TODO: Support stop tokens
-            # stop_prompts=stop if stop is not None else []
-        )
+        # TODO: Support stop tokens
+        # stop_prompts=stop if stop is not None else []
 
         for file_path in file_paths:
-            if file_path in self._llm.chat.media_cache:
-                media_bytes = self._llm.chat.media_cache[file_path]
-            else:
-                try:
-                    with open(file_path, "rb") as f:
-                        media_bytes = f.read()
-                    self._llm.chat.media_cache[file_path] = media_bytes
-                except FileNotFoundError:
-                    raise FileNotFoundError(f"Media file not found: {file_path}")
-                except IOError as e:
-                    raise IOError(f"Error reading media file {file_path}: {e}")
-
-            task_params.add_media(media_bytes)
+            if not os.path.isfile(file_path):
+                raise FileNotFoundError(f"Media file not found: {file_path}")
+            # Memory-mapped by the engine, the file is never read into Python
+            task_params.add_media_file(file_path)
 
         task_params.sampling_params = sampling_params
 
-        if stream:
-            return self._create_stream(task_params)
-
-        result_text = self._llm.handle.complete(task_params)
+        return task_params
 
+    def _response(self, result: Union[CompletionResult, str]) -> Dict[str, Any]:
+        """
+        Builds the response dict. Usage and timings are only known from a CompletionResult, the async path only
+        reports the text.
+        """
+        if isinstance(result, CompletionResult):
+            result_text = result.text
+            finish_reason = result.finish_reason
+            usage = {
+                "prompt_tokens": result.prompt_tokens,
+                "prompt_tokens_details": {"cached_tokens": result.prompt_tokens_cached},
+                "completion_tokens": result.completion_tokens,
+                "total_tokens": result.prompt_tokens + result.completion_tokens,
+            }
+            timings = {
+                "queue_time": result.queue_time,
+                "prefill_time": result.prefill_time,
+                "decode_time": result.decode_time,
+            }
+            if result.token_times:
+                timings["token_times"] = result.token_times
+        else:
+            result_text = result
+            finish_reason = "stop"
+            usage = {
+                "prompt_tokens": -1,
+                "completion_tokens": -1,
+                "total_tokens": -1,
+            }
+            timings = None
         response = {
             "id": f"chatcmpl-{uuid.uuid4()}",
             "object": "chat.completion",
@@ -174,16 +453,42 @@ class Completions:
                     "role": "assistant",
                     "content": result_text,
                 },
-                "finish_reason": "stop",
+                "finish_reason": finish_reason,
             },
-            "usage": {
-                "prompt_tokens": -1,
-                "completion_tokens": -1,
-                "total_tokens": -1,
-            }
+            "usage": usage,
         }
+        if timings is not None:
+            response["timings"] = timings
         return response
 
-    def _create_stream(self, task_params: TaskParams):
-        for token in self._llm.handle.complete_stream(task_params):
+    def _create_stream(self, task_params: TaskParams, logprobs: bool = False):
+        for token in self._llm.handle.complete_stream(task_params, logprobs):
             yield token
+
+    async def _acreate_stream(self, task_params: TaskParams, logprobs: bool = False):
+        dispatch = self._llm.dispatcher
+        if not dispatch.supported:
+            loop = asyncio.get_running_loop()
+            iterator = await loop.run_in_executor(None, self._llm.handle.complete_stream, task_params, logprobs)
+            done = object()
+            while True:
+                item = await loop.run_in_executor(None, next, iterator, done)
+                if item is done:
+                    return
+                yield item
+
+        ready = asyncio.Event()
+        task_id = dispatch.register(ready.set)
+        try:
+            iterator = self._llm.handle.stream_async(task_params, dispatch.native, task_id, logprobs)
+            while True:
+                await ready.wait()
+                ready.clear()
+                try:
+                    item = iterator.poll()
+                except StopIteration:
+                    return
+                if item is not None:
+                    yield item
+        finally:
+            dispatch.unregister(task_id)